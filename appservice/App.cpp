@@ -3,7 +3,11 @@
 #include "App.h"
 #include "MainPage.h"
 
+#include "LatencyJson.h"
+
 #include <algorithm>
+#include <sstream>
+#include <vector>
 
 using namespace winrt;
 using namespace Windows::ApplicationModel;
@@ -13,6 +17,7 @@ using namespace Windows::ApplicationModel::Background;
 using namespace Windows::Data::Json;
 using namespace Windows::Foundation;
 using namespace Windows::Foundation::Collections;
+using namespace Windows::Storage;
 using namespace Windows::UI::Xaml;
 using namespace Windows::UI::Xaml::Controls;
 using namespace Windows::UI::Xaml::Navigation;
@@ -25,6 +30,11 @@ using namespace appservice::implementation;
 /// </summary>
 App::App()
 {
+    const auto relayOptions = ReadRelayOptions();
+
+    m_toBridge = make_self<ForwardingQueue>(relayOptions, "toBridge");
+    m_toClient = make_self<ForwardingQueue>(relayOptions, "toClient");
+
     InitializeComponent();
     Suspending({ this, &App::OnSuspending });
 
@@ -47,6 +57,15 @@ App::App()
 /// <param name="e">Details about the launch request and process.</param>
 void App::OnLaunched(LaunchActivatedEventArgs const& e)
 {
+    m_startup.mark(e.PrelaunchActivated() ? L"prelaunched" : L"launched");
+
+    // Opt-in: start the bridge and open the MAPI session now, instead of waiting for the first
+    // client request to pay for it.
+    if (unbox_value_or<bool>(ApplicationData::Current().LocalSettings().Values().TryLookup(L"warmStart"), false))
+    {
+        WarmStartAsync();
+    }
+
     Frame rootFrame{ nullptr };
     auto content = Window::Current().Content();
     if (content)
@@ -135,12 +154,18 @@ ServiceConnection::ServiceConnection(
 {
 }
 
-fire_and_forget ServiceConnection::SendRequestAsync(const ValueSet& message)
+IAsyncOperation<bool> ServiceConnection::SendRequestAsync(const ValueSet& message)
 {
-    if (m_appServiceConnection)
+    const auto appServiceConnection = m_appServiceConnection;
+
+    if (!appServiceConnection)
     {
-        co_await m_appServiceConnection.SendMessageAsync(message);
+        co_return false;
     }
+
+    const auto result = co_await appServiceConnection.SendMessageAsync(message);
+
+    co_return result.Status() == AppServiceResponseStatus::Success;
 }
 
 IAsyncAction ServiceConnection::OnRequestReceived(const AppServiceConnection& /* sender */, const AppServiceRequestReceivedEventArgs& args)
@@ -154,7 +179,14 @@ IAsyncAction ServiceConnection::OnRequestReceived(const AppServiceConnection& /*
     const auto messageRequest = args.Request();
     const auto message = messageRequest.Message();
 
-    co_await m_onResponse(message);
+    if (!co_await m_onResponse(message))
+    {
+        // The sender would otherwise take it for delivered and never know to send it again.
+        ValueSet dropped;
+
+        dropped.Insert(L"dropped", box_value(true));
+        co_await messageRequest.SendResponseAsync(dropped);
+    }
 
     messageDeferral.Complete();
 }
@@ -180,6 +212,214 @@ void ServiceConnection::ShutdownService()
     m_onShutdown = nullptr;
 }
 
+ForwardingQueue::ForwardingQueue(const Options& options, std::string_view traceName)
+    : m_options { options }
+    , m_traceName { traceName }
+    , m_watermark { options.HighWatermark, options.LowWatermark }
+    , m_queueLatency { m_latency.get(L"queue") }
+    , m_sendLatency { m_latency.get(L"send") }
+{
+}
+
+void ForwardingQueue::Attach(const com_ptr<ServiceConnection>& connection)
+{
+    {
+        std::lock_guard lock { m_mutex };
+
+        m_connection = connection;
+    }
+
+    Pump();
+}
+
+void ForwardingQueue::Detach()
+{
+    std::lock_guard lock { m_mutex };
+
+    m_connection = nullptr;
+    m_stats.Dropped += m_queue.size();
+
+    for (const auto& queued : m_queue)
+    {
+        SetEvent(queued.Delivered->Done.get());
+    }
+
+    m_queue.clear();
+    UpdateWatermark();
+}
+
+IAsyncOperation<bool> ForwardingQueue::ForwardAsync(const ValueSet& message)
+{
+    const auto strong_this { get_strong() };
+    const auto delivered = std::make_shared<Delivery>();
+    QueuedMessage queued { message, delivered, LatencyHistogram::Clock::now() };
+
+    if (trace::Tracer::instance().enabled())
+    {
+        queued.TraceStart = trace::now();
+
+        if (const auto traces = message.TryLookup(L"traces").try_as<IPropertyValue>())
+        {
+            com_array<hstring> traceIds;
+
+            traces.GetStringArray(traceIds);
+            queued.TraceCount = static_cast<std::int32_t>(traceIds.size());
+
+            if (!traceIds.empty())
+            {
+                queued.Trace = to_string(traceIds.front());
+            }
+        }
+    }
+
+    // Push back on the sender: its message deferral, and so its SendMessageAsync, is held here
+    // until the backlog has drained to LowWatermark.
+    for (bool held = false;;)
+    {
+        {
+            std::lock_guard lock { m_mutex };
+
+            if (!m_watermark.throttling())
+            {
+                if (m_queue.size() >= m_options.Capacity)
+                {
+                    ++m_stats.Dropped;
+                    co_return false;
+                }
+
+                m_queue.push_back(std::move(queued));
+                m_stats.MaxQueueDepth = std::max(m_stats.MaxQueueDepth, m_queue.size());
+                UpdateWatermark();
+                break;
+            }
+
+            if (!held)
+            {
+                held = true;
+                ++m_stats.Throttled;
+            }
+        }
+
+        co_await resume_on_signal(m_drained.get());
+    }
+
+    Pump();
+
+    co_await resume_on_signal(delivered->Done.get());
+
+    co_return delivered->Succeeded;
+}
+
+ForwardingQueue::Stats ForwardingQueue::GetStats()
+{
+    std::lock_guard lock { m_mutex };
+    auto stats = m_stats;
+
+    stats.QueueDepth = m_queue.size();
+
+    return stats;
+}
+
+void ForwardingQueue::Pump()
+{
+    com_ptr<ServiceConnection> connection;
+    std::vector<QueuedMessage> messages;
+
+    {
+        std::lock_guard lock { m_mutex };
+
+        if (!m_connection)
+        {
+            return;
+        }
+
+        connection = m_connection;
+
+        while (!m_queue.empty()
+            && m_stats.InFlight < m_options.InFlightWindow)
+        {
+            m_queueLatency.recordSince(m_queue.front().Queued);
+            messages.push_back(std::move(m_queue.front()));
+            m_queue.pop_front();
+            ++m_stats.InFlight;
+        }
+
+        UpdateWatermark();
+    }
+
+    // Start the sends outside the lock, a send which completes synchronously pumps again.
+    for (auto& message : messages)
+    {
+        SendAsync(connection, std::move(message));
+    }
+}
+
+fire_and_forget ForwardingQueue::SendAsync(com_ptr<ServiceConnection> connection, QueuedMessage message)
+{
+    const auto strong_this { get_strong() };
+    const auto start = LatencyHistogram::Clock::now();
+    bool succeeded = false;
+
+    try
+    {
+        succeeded = co_await connection->SendRequestAsync(message.Message);
+    }
+    catch (const hresult_error&)
+    {
+    }
+
+    m_sendLatency.recordSince(start);
+
+    // The span covers the whole hop through the relay, waiting for a send slot included.
+    if (message.TraceStart != 0)
+    {
+        trace::Tracer::instance().record(m_traceName, message.Trace, 0, message.TraceStart, trace::now(), message.TraceCount);
+    }
+
+    {
+        std::lock_guard lock { m_mutex };
+
+        --m_stats.InFlight;
+
+        if (succeeded)
+        {
+            ++m_stats.Forwarded;
+        }
+        else
+        {
+            ++m_stats.Failed;
+        }
+    }
+
+    message.Delivered->Succeeded = succeeded;
+    SetEvent(message.Delivered->Done.get());
+    Pump();
+}
+
+const LatencyRegistry& ForwardingQueue::Latency() const
+{
+    return m_latency;
+}
+
+void ForwardingQueue::ResetLatency()
+{
+    m_latency.reset();
+}
+
+// Called with the mutex held. Nothing drains the queue without a connection, so held messages are
+// released rather than waiting for one.
+void ForwardingQueue::UpdateWatermark()
+{
+    if (m_watermark.update(m_connection ? m_queue.size() : 0))
+    {
+        ResetEvent(m_drained.get());
+    }
+    else
+    {
+        SetEvent(m_drained.get());
+    }
+}
+
 void App::OnBackgroundActivated(BackgroundActivatedEventArgs const& e)
 {
     auto taskInstance = e.TaskInstance();
@@ -209,60 +449,173 @@ void App::OnBackgroundActivated(BackgroundActivatedEventArgs const& e)
 
     if (appServiceName == L"gqlmapi.client")
     {
+        m_startup.mark(L"clientConnected");
         m_clientConnection = serviceConnection;
+        m_toClient->Attach(serviceConnection);
     }
     else if (appServiceName == L"gqlmapi.bridge")
     {
-        if (!m_bridgeQueue.empty())
-        {
-            auto messages = std::move(m_bridgeQueue);
+        // Anything the client sent while the bridge was starting is still waiting in m_toBridge.
+        m_startup.mark(L"bridgeConnected");
+        m_bridgeConnection = serviceConnection;
+        m_toBridge->Attach(serviceConnection);
+    }
+}
 
-            for (const auto& message : messages)
-            {
-                serviceConnection->SendRequestAsync(message);
-            }
-        }
+IAsyncOperation<bool> App::OnClientRequestReceived(const ValueSet& message)
+{
+    if (message.HasKey(L"relayStats"))
+    {
+        co_await SendRelayStatsAsync(unbox_value<std::int32_t>(message.Lookup(L"relayStats")),
+            unbox_value_or<bool>(message.TryLookup(L"reset"), false));
+        co_return true;
+    }
 
-        m_bridgeConnection = serviceConnection;
+    m_startup.mark(L"firstClientRequest");
+
+    // Clients which trace list their trace ids in every message.
+    if (message.HasKey(L"traces"))
+    {
+        StartTracing();
     }
+
+    const auto forwarded = m_toBridge->ForwardAsync(message);
+
+    co_await LaunchBridgeAsync();
+    co_return co_await forwarded;
 }
 
-IAsyncAction App::OnClientRequestReceived(const ValueSet& message)
+IAsyncAction App::LaunchBridgeAsync()
 {
-    if (!m_bridgeConnection)
+    if (m_bridgeConnection
+        || m_bridgeStarted.exchange(true))
     {
-        m_bridgeQueue.emplace_back(message);
+        co_return;
+    }
 
-        if (!m_bridgeStarted)
-        {
-            m_bridgeStarted = true;
-            co_await FullTrustProcessLauncher::LaunchFullTrustProcessForCurrentAppAsync();
-        }
+    m_startup.mark(L"bridgeLaunchRequested");
+    co_await FullTrustProcessLauncher::LaunchFullTrustProcessForCurrentAppAsync();
+}
 
+fire_and_forget App::WarmStartAsync()
+{
+    if (m_bridgeConnection
+        || m_bridgeStarted)
+    {
         co_return;
     }
 
-    m_bridgeConnection->SendRequestAsync(message);
+    // The bridge picks this up as soon as it connects, ahead of anything the client sends.
+    JsonObject warmStart;
+
+    warmStart.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(0));
+    warmStart.SetNamedValue(L"type", JsonValue::CreateStringValue(L"warmStart"));
+    warmStart.SetNamedValue(L"useDefaultProfile", JsonValue::CreateBooleanValue(true));
+
+    ValueSet message;
+
+    message.Insert(L"requests", PropertyValue::CreateStringArray({ warmStart.ToString() }));
+    m_toBridge->ForwardAsync(message);
+
+    co_await LaunchBridgeAsync();
+}
+
+void App::StartTracing()
+{
+    if (trace::Tracer::instance().enabled())
+    {
+        return;
+    }
+
+    std::wostringstream oss;
+
+    oss << L"relay-" << GetCurrentProcessId() << L".trace.json";
+    trace::Tracer::instance().start(std::filesystem::path { std::wstring_view { ApplicationData::Current().LocalCacheFolder().Path() } } / oss.str(), "relay");
 }
 
-IAsyncAction App::OnBridgeResponseReceived(const ValueSet& message)
+IAsyncOperation<bool> App::OnBridgeResponseReceived(const ValueSet& message)
 {
     if (!m_clientConnection)
     {
-        co_return;
+        co_return false;
     }
 
-    m_clientConnection->SendRequestAsync(message);
+    co_return co_await m_toClient->ForwardAsync(message);
 }
 
 void App::OnClientShutdown()
 {
     m_clientConnection = nullptr;
+    m_toClient->Detach();
 }
 
 void App::OnBridgeShutdown()
 {
     m_bridgeStarted = false;
     m_bridgeConnection = nullptr;
-    m_bridgeQueue.clear();
+    m_toBridge->Detach();
+}
+
+IAsyncAction App::SendRelayStatsAsync(std::int32_t requestId, bool reset)
+{
+    const auto toJson = [](const ForwardingQueue::Stats& stats) {
+        JsonObject direction;
+
+        direction.SetNamedValue(L"queueDepth", JsonValue::CreateNumberValue(static_cast<double>(stats.QueueDepth)));
+        direction.SetNamedValue(L"maxQueueDepth", JsonValue::CreateNumberValue(static_cast<double>(stats.MaxQueueDepth)));
+        direction.SetNamedValue(L"inFlight", JsonValue::CreateNumberValue(static_cast<double>(stats.InFlight)));
+        direction.SetNamedValue(L"forwarded", JsonValue::CreateNumberValue(static_cast<double>(stats.Forwarded)));
+        direction.SetNamedValue(L"dropped", JsonValue::CreateNumberValue(static_cast<double>(stats.Dropped)));
+        direction.SetNamedValue(L"throttled", JsonValue::CreateNumberValue(static_cast<double>(stats.Throttled)));
+        direction.SetNamedValue(L"failed", JsonValue::CreateNumberValue(static_cast<double>(stats.Failed)));
+
+        return direction;
+    };
+    JsonObject response;
+
+    response.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+    response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"relayStats"));
+    response.SetNamedValue(L"toBridge", toJson(m_toBridge->GetStats()));
+    response.SetNamedValue(L"toClient", toJson(m_toClient->GetStats()));
+
+    JsonObject startupStages;
+
+    for (const auto& stage : m_startup.stages())
+    {
+        startupStages.SetNamedValue(stage.first, JsonValue::CreateNumberValue(static_cast<double>(stage.second)));
+    }
+
+    response.SetNamedValue(L"startup", startupStages);
+
+    // Every duration is in microseconds.
+    JsonObject latencies;
+
+    latencies.SetNamedValue(L"toBridge", latencyToJson(m_toBridge->Latency()));
+    latencies.SetNamedValue(L"toClient", latencyToJson(m_toClient->Latency()));
+    response.SetNamedValue(L"latency", latencies);
+
+    if (reset)
+    {
+        m_toBridge->ResetLatency();
+        m_toClient->ResetLatency();
+    }
+
+    ValueSet message;
+
+    message.Insert(L"responses", PropertyValue::CreateStringArray({ response.ToString() }));
+
+    co_await m_toClient->ForwardAsync(message);
+}
+
+ForwardingQueue::Options App::ReadRelayOptions()
+{
+    const auto settings = ApplicationData::Current().LocalSettings().Values();
+    ForwardingQueue::Options options;
+
+    options.InFlightWindow = std::max(unbox_value_or<std::uint32_t>(settings.TryLookup(L"relayInFlightWindow"), options.InFlightWindow), 1u);
+    options.HighWatermark = std::max(unbox_value_or<std::uint32_t>(settings.TryLookup(L"relayHighWatermark"), static_cast<std::uint32_t>(options.HighWatermark)), 1u);
+    options.LowWatermark = std::min<std::size_t>(unbox_value_or<std::uint32_t>(settings.TryLookup(L"relayLowWatermark"), static_cast<std::uint32_t>(options.LowWatermark)), options.HighWatermark - 1);
+    options.Capacity = std::max<std::size_t>(unbox_value_or<std::uint32_t>(settings.TryLookup(L"relayQueueCapacity"), static_cast<std::uint32_t>(options.Capacity)), options.HighWatermark);
+
+    return options;
 }
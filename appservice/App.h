@@ -1,7 +1,18 @@
 ﻿#pragma once
 #include "App.xaml.g.h"
 
-#include <vector>
+#include "LatencyHistogram.h"
+#include "StartupTimeline.h"
+#include "TraceWriter.h"
+#include "Watermark.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
 
 namespace winrt::appservice::implementation
 {
@@ -14,7 +25,7 @@ namespace winrt::appservice::implementation
             const Windows::ApplicationModel::Background::BackgroundTaskDeferral& backgroundTaskDeferral,
             const ServiceRequestHandler& onResponse, const ServiceShutdownHandler& onShutdown);
 
-        fire_and_forget SendRequestAsync(const Windows::Foundation::Collections::ValueSet& message);
+        Windows::Foundation::IAsyncOperation<bool> SendRequestAsync(const Windows::Foundation::Collections::ValueSet& message);
 
         void OnAppServicesCanceled(Windows::ApplicationModel::Background::IBackgroundTaskInstance const& sender, Windows::ApplicationModel::Background::BackgroundTaskCancellationReason const& reason);
         void OnServiceClosed(Windows::ApplicationModel::AppService::AppServiceConnection const& sender, Windows::ApplicationModel::AppService::AppServiceClosedEventArgs const& reason);
@@ -29,6 +40,89 @@ namespace winrt::appservice::implementation
         ServiceShutdownHandler m_onShutdown;
     };
 
+    // Forwards messages in one direction with at most InFlightWindow sends outstanding. ForwardAsync
+    // completes once the message has reached the other end, so the sender's message deferral is held
+    // until then, and completes with false if the message was dropped or could not be sent. Once
+    // HighWatermark messages are waiting, ForwardAsync holds new messages before queuing them, and
+    // with them their senders' SendMessageAsync, until the backlog drains to LowWatermark. Each
+    // sender waits for its own message, so the backlog only builds up from messages which arrive
+    // concurrently. Past Capacity new messages are dropped.
+    struct ForwardingQueue : implements<ForwardingQueue, IInspectable>
+    {
+        struct Options
+        {
+            // Sends which are in flight together can overtake each other, more than one gives up
+            // the ordering both ends rely on.
+            std::uint32_t InFlightWindow = 1;
+            // LowWatermark must be below HighWatermark.
+            std::size_t HighWatermark = 256;
+            std::size_t LowWatermark = 64;
+            std::size_t Capacity = 1024;
+        };
+
+        struct Stats
+        {
+            std::size_t QueueDepth = 0;
+            std::size_t MaxQueueDepth = 0;
+            std::uint32_t InFlight = 0;
+            std::uint64_t Forwarded = 0;
+            std::uint64_t Dropped = 0;
+            // Messages which were held at the high watermark.
+            std::uint64_t Throttled = 0;
+            std::uint64_t Failed = 0;
+        };
+
+        // traceName names this direction's spans when tracing is on.
+        ForwardingQueue(const Options& options, std::string_view traceName);
+
+        void Attach(const com_ptr<ServiceConnection>& connection);
+        void Detach();
+
+        Windows::Foundation::IAsyncOperation<bool> ForwardAsync(const Windows::Foundation::Collections::ValueSet& message);
+        Stats GetStats();
+
+        // "queue" is how long messages wait for a send slot, "send" is how long the send takes.
+        const LatencyRegistry& Latency() const;
+        void ResetLatency();
+
+    private:
+        // Signalled once the message has been sent or dropped.
+        struct Delivery
+        {
+            handle Done { CreateEventW(nullptr, true, false, nullptr) };
+            bool Succeeded = false;
+        };
+
+        struct QueuedMessage
+        {
+            Windows::Foundation::Collections::ValueSet Message;
+            std::shared_ptr<Delivery> Delivered;
+            LatencyHistogram::Clock::time_point Queued;
+            std::int64_t TraceStart = 0;
+            // The first trace id the client listed in "traces", and how many it listed.
+            std::string Trace;
+            std::int32_t TraceCount = 0;
+        };
+
+        void Pump();
+        fire_and_forget SendAsync(com_ptr<ServiceConnection> connection, QueuedMessage message);
+        void UpdateWatermark();
+
+        const Options m_options;
+        const std::string_view m_traceName;
+
+        std::mutex m_mutex;
+        std::deque<QueuedMessage> m_queue;
+        com_ptr<ServiceConnection> m_connection;
+        Watermark m_watermark;
+        // Set whenever the queue is not throttled, held messages wait on it.
+        handle m_drained { CreateEventW(nullptr, true, true, nullptr) };
+        Stats m_stats;
+        LatencyRegistry m_latency;
+        LatencyHistogram& m_queueLatency;
+        LatencyHistogram& m_sendLatency;
+    };
+
     struct App : AppT<App>
     {
         App();
@@ -41,13 +135,21 @@ namespace winrt::appservice::implementation
         void OnBackgroundActivated(Windows::ApplicationModel::Activation::BackgroundActivatedEventArgs const&);
 
     private:
-        Windows::Foundation::IAsyncAction OnClientRequestReceived(const Windows::Foundation::Collections::ValueSet& message);
-        Windows::Foundation::IAsyncAction OnBridgeResponseReceived(const Windows::Foundation::Collections::ValueSet& message);
+        Windows::Foundation::IAsyncOperation<bool> OnClientRequestReceived(const Windows::Foundation::Collections::ValueSet& message);
+        Windows::Foundation::IAsyncOperation<bool> OnBridgeResponseReceived(const Windows::Foundation::Collections::ValueSet& message);
         void OnClientShutdown();
         void OnBridgeShutdown();
+        Windows::Foundation::IAsyncAction SendRelayStatsAsync(std::int32_t requestId, bool reset);
+        Windows::Foundation::IAsyncAction LaunchBridgeAsync();
+        fire_and_forget WarmStartAsync();
+        static void StartTracing();
+
+        static ForwardingQueue::Options ReadRelayOptions();
 
-        bool m_bridgeStarted = false;
-        std::vector<Windows::Foundation::Collections::ValueSet> m_bridgeQueue;
+        std::atomic_bool m_bridgeStarted { false };
+        StartupTimeline m_startup;
+        com_ptr<ForwardingQueue> m_toBridge;
+        com_ptr<ForwardingQueue> m_toClient;
 
         com_ptr<ServiceConnection> m_clientConnection;
         com_ptr<ServiceConnection> m_bridgeConnection;
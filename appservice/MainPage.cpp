@@ -209,7 +209,7 @@ Windows::Foundation::IAsyncAction MainPage::UnsubscribeAsync()
 
 		co_await resume_background();
 
-		co_await m_connection.Unsubscribe(previousId);
+		co_await m_connection.Cancel(previousId, nullptr);
 		co_await m_connection.DiscardQuery(previousId);
 
 		co_await resume_foreground(Dispatcher());
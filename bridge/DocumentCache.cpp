@@ -0,0 +1,203 @@
+﻿#include "pch.h"
+
+#include "DocumentCache.h"
+
+#include <algorithm>
+#include <functional>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+void DocumentCache::configure(size_t maxEntries, size_t maxBytes)
+{
+	m_maxEntries = std::max<size_t>(maxEntries, 1);
+	m_maxBytes = maxBytes;
+	evict();
+}
+
+DocumentCache::CachedDocument DocumentCache::get(std::string_view query, const service::Request& service)
+{
+	auto normalized = normalize(query);
+	const auto hash = std::hash<std::string_view> {}(normalized);
+	const auto itrIndex = m_index.find(hash);
+
+	if (itrIndex != m_index.end())
+	{
+		const auto itrEntry = itrIndex->second;
+
+		if (itrEntry->normalized == normalized)
+		{
+			++m_hits;
+			m_entries.splice(m_entries.begin(), m_entries, itrEntry);
+
+			return { hash, peg::ast { itrEntry->ast } };
+		}
+
+		// Hash collision with a different document, the newer one replaces it.
+		m_bytes -= itrEntry->bytes;
+		m_entries.erase(itrEntry);
+		m_index.erase(itrIndex);
+	}
+
+	++m_misses;
+
+	auto ast = peg::parseString(query);
+	auto validationErrors = service.validate(ast);
+
+	if (!validationErrors.empty())
+	{
+		throw service::schema_exception { std::move(validationErrors) };
+	}
+
+	Entry entry { hash, std::move(normalized), peg::ast { ast }, 0 };
+
+	entry.bytes = estimateBytes(entry, query.size());
+	m_bytes += entry.bytes;
+	m_entries.push_front(std::move(entry));
+	m_index[hash] = m_entries.begin();
+	evict();
+
+	return { hash, std::move(ast) };
+}
+
+DocumentCache::Stats DocumentCache::stats() const noexcept
+{
+	return { m_entries.size(), m_bytes, m_hits, m_misses, m_evictions };
+}
+
+void DocumentCache::evict()
+{
+	// Always keep the most recently used entry, even if it is larger than the limit by itself.
+	while (m_entries.size() > 1
+		&& (m_entries.size() > m_maxEntries || m_bytes > m_maxBytes))
+	{
+		const auto& entry = m_entries.back();
+
+		m_bytes -= entry.bytes;
+		m_index.erase(entry.hash);
+		m_entries.pop_back();
+		++m_evictions;
+	}
+}
+
+namespace {
+
+size_t countNodes(const peg::ast_node& node)
+{
+	size_t count = 1;
+
+	for (const auto& child : node.children)
+	{
+		count += countNodes(*child);
+	}
+
+	return count;
+}
+
+constexpr bool isPunctuator(char ch) noexcept
+{
+	return "!$&().:=@[]{}|\""sv.find(ch) != std::string_view::npos;
+}
+
+constexpr bool isIgnored(char ch) noexcept
+{
+	return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == ',';
+}
+
+} // namespace
+
+size_t DocumentCache::estimateBytes(const Entry& entry, size_t querySize)
+{
+	// The AST keeps the original query text alive alongside the nodes which point into it.
+	return sizeof(Entry)
+		+ entry.normalized.size()
+		+ querySize
+		+ (entry.ast.root ? countNodes(*entry.ast.root) * sizeof(peg::ast_node) : 0);
+}
+
+std::string DocumentCache::normalize(std::string_view query)
+{
+	std::string result;
+	bool pendingSpace = false;
+
+	result.reserve(query.size());
+
+	for (size_t i = 0; i < query.size();)
+	{
+		const char ch = query[i];
+
+		if (ch == '#')
+		{
+			i = query.find_first_of("\r\n"sv, i);
+
+			if (i == std::string_view::npos)
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		if (isIgnored(ch))
+		{
+			pendingSpace = !result.empty();
+			++i;
+			continue;
+		}
+
+		if (ch == '"')
+		{
+			// Copy string values verbatim, including any escaped quotes.
+			const bool blockString = (query.substr(i, 3) == R"(""")"sv);
+			size_t end = i + (blockString ? 3 : 1);
+
+			while (end < query.size())
+			{
+				if (query[end] == '\\')
+				{
+					end += (blockString && query.substr(end + 1, 3) == R"(""")"sv ? 4 : 2);
+				}
+				else if (blockString)
+				{
+					if (query.substr(end, 3) == R"(""")"sv)
+					{
+						end += 3;
+						break;
+					}
+
+					++end;
+				}
+				else if (query[end] == '"')
+				{
+					++end;
+					break;
+				}
+				else
+				{
+					++end;
+				}
+			}
+
+			end = std::min(end, query.size());
+			result.append(query.substr(i, end - i));
+			pendingSpace = false;
+			i = end;
+			continue;
+		}
+
+		// Whitespace is only significant between two names or values.
+		if (pendingSpace
+			&& !isPunctuator(result.back())
+			&& !isPunctuator(ch))
+		{
+			result.push_back(' ');
+		}
+
+		pendingSpace = false;
+		result.push_back(ch);
+		++i;
+	}
+
+	return result;
+}
@@ -0,0 +1,68 @@
+﻿#pragma once
+
+#include "graphqlservice/GraphQLParse.h"
+#include "graphqlservice/GraphQLService.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Bounded LRU cache of parsed and validated documents, keyed by a hash of the query text with
+// comments and insignificant whitespace removed. Every hit shares the cached AST nodes.
+class DocumentCache
+{
+public:
+	struct CachedDocument
+	{
+		size_t hash;
+		graphql::peg::ast ast;
+	};
+
+	struct Stats
+	{
+		size_t entries;
+		size_t bytes;
+		std::uint64_t hits;
+		std::uint64_t misses;
+		std::uint64_t evictions;
+	};
+
+	static constexpr size_t c_defaultMaxEntries = 256;
+	static constexpr size_t c_defaultMaxBytes = 16 * 1024 * 1024;
+
+	DocumentCache() = default;
+
+	void configure(size_t maxEntries, size_t maxBytes);
+	CachedDocument get(std::string_view query, const graphql::service::Request& service);
+	Stats stats() const noexcept;
+
+	static std::string normalize(std::string_view query);
+
+private:
+	struct Entry
+	{
+		size_t hash;
+		std::string normalized;
+		graphql::peg::ast ast;
+		size_t bytes;
+	};
+
+	using EntryList = std::list<Entry>;
+
+	void evict();
+
+	static size_t estimateBytes(const Entry& entry, size_t querySize);
+
+	size_t m_maxEntries = c_defaultMaxEntries;
+	size_t m_maxBytes = c_defaultMaxBytes;
+	size_t m_bytes = 0;
+	std::uint64_t m_hits = 0;
+	std::uint64_t m_misses = 0;
+	std::uint64_t m_evictions = 0;
+
+	EntryList m_entries;
+	std::unordered_map<size_t, EntryList::iterator> m_index;
+};
@@ -0,0 +1,159 @@
+﻿#include "pch.h"
+
+#include "JsonPatch.h"
+
+#include <algorithm>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+JsonPatch::JsonPatch(response::Value& operations) noexcept
+	: m_operations { operations }
+{
+}
+
+response::Value JsonPatch::diff(const response::Value& from, const response::Value& to)
+{
+	response::Value operations { response::Type::List };
+	JsonPatch patch { operations };
+	std::string path;
+
+	patch.diffValue(path, from, to);
+
+	return operations;
+}
+
+void JsonPatch::diffValue(std::string& path, const response::Value& from, const response::Value& to)
+{
+	if (from.type() != to.type())
+	{
+		add("replace"sv, path, &to);
+	}
+	else if (to.type() == response::Type::Map)
+	{
+		diffMap(path, from, to);
+	}
+	else if (to.type() == response::Type::List)
+	{
+		diffList(path, from, to);
+	}
+	else if (from != to)
+	{
+		add("replace"sv, path, &to);
+	}
+}
+
+void JsonPatch::diffMap(std::string& path, const response::Value& from, const response::Value& to)
+{
+	const auto length = path.size();
+
+	for (const auto& entry : from)
+	{
+		if (to.find(entry.first) == to.end())
+		{
+			appendToken(path, entry.first);
+			add("remove"sv, path, nullptr);
+			path.resize(length);
+		}
+	}
+
+	for (const auto& entry : to)
+	{
+		const auto itr = from.find(entry.first);
+
+		appendToken(path, entry.first);
+
+		if (itr == from.end())
+		{
+			add("add"sv, path, &entry.second);
+		}
+		else
+		{
+			diffValue(path, itr->second, entry.second);
+		}
+
+		path.resize(length);
+	}
+}
+
+void JsonPatch::diffList(std::string& path, const response::Value& from, const response::Value& to)
+{
+	const auto& fromList = from.get<response::ListType>();
+	const auto& toList = to.get<response::ListType>();
+	const auto common = std::min(fromList.size(), toList.size());
+	const auto firstOperation = m_operations.size();
+	const auto length = path.size();
+
+	for (size_t i = 0; i < common; ++i)
+	{
+		appendToken(path, std::to_string(i));
+		diffValue(path, fromList[i], toList[i]);
+		path.resize(length);
+	}
+
+	for (size_t i = common; i < toList.size(); ++i)
+	{
+		appendToken(path, std::to_string(i));
+		add("add"sv, path, &toList[i]);
+		path.resize(length);
+	}
+
+	// Remove from the end, so the indices of the remaining elements do not shift.
+	for (size_t i = fromList.size(); i > common; --i)
+	{
+		appendToken(path, std::to_string(i - 1));
+		add("remove"sv, path, nullptr);
+		path.resize(length);
+	}
+
+	// An insertion near the front shifts every element after it, replacing the whole list is
+	// smaller than patching each one.
+	if (m_operations.size() - firstOperation > toList.size())
+	{
+		auto operations = m_operations.release<response::ListType>();
+
+		operations.resize(firstOperation);
+		m_operations.set<response::ListType>(std::move(operations));
+		add("replace"sv, path, &to);
+	}
+}
+
+void JsonPatch::add(std::string_view op, const std::string& path, const response::Value* value)
+{
+	response::Value operation { response::Type::Map };
+
+	operation.reserve(value ? 3 : 2);
+	operation.emplace_back("op"s, response::Value { std::string { op } });
+	operation.emplace_back("path"s, response::Value { std::string { path } });
+
+	if (value)
+	{
+		operation.emplace_back("value"s, response::Value { *value });
+	}
+
+	m_operations.emplace_back(std::move(operation));
+}
+
+void JsonPatch::appendToken(std::string& path, std::string_view token)
+{
+	path.push_back('/');
+
+	for (const auto ch : token)
+	{
+		switch (ch)
+		{
+			case '~':
+				path.append("~0"sv);
+				break;
+
+			case '/':
+				path.append("~1"sv);
+				break;
+
+			default:
+				path.push_back(ch);
+				break;
+		}
+	}
+}
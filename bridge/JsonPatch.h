@@ -0,0 +1,28 @@
+﻿#pragma once
+
+#include "graphqlservice/GraphQLResponse.h"
+
+#include <string>
+#include <string_view>
+
+// Builds RFC 6902 JSON Patch documents which turn one subscription result into the next. Only
+// "add", "remove" and "replace" operations are produced, which is all the client has to apply.
+class JsonPatch
+{
+public:
+	static graphql::response::Value diff(const graphql::response::Value& from, const graphql::response::Value& to);
+
+	// Appends one RFC 6901 reference token, escaped, to a JSON Pointer.
+	static void appendToken(std::string& path, std::string_view token);
+
+private:
+	explicit JsonPatch(graphql::response::Value& operations) noexcept;
+
+	void diffValue(std::string& path, const graphql::response::Value& from, const graphql::response::Value& to);
+	void diffMap(std::string& path, const graphql::response::Value& from, const graphql::response::Value& to);
+	void diffList(std::string& path, const graphql::response::Value& from, const graphql::response::Value& to);
+
+	void add(std::string_view op, const std::string& path, const graphql::response::Value* value);
+
+	graphql::response::Value& m_operations;
+};
@@ -0,0 +1,438 @@
+﻿#include "PayloadWriter.h"
+
+#include "Utf.h"
+
+#include <array>
+#include <charconv>
+#include <cmath>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+utf::WideStringView PayloadWriter::writeFetched(utf::WideStringView type, int requestId, const response::Value& fetched,
+	utf::WideStringView cache)
+{
+	return writeFetched(type, &requestId, 1, fetched, cache);
+}
+
+const std::vector<std::uint8_t>& PayloadWriter::writeFetchedCbor(utf::WideStringView type, int requestId, const response::Value& fetched,
+	utf::WideStringView cache)
+{
+	return writeFetchedCbor(type, &requestId, 1, fetched, cache);
+}
+
+utf::WideStringView PayloadWriter::writeFetched(utf::WideStringView type, const std::vector<int>& requestIds, const response::Value& fetched)
+{
+	return writeFetched(type, requestIds.data(), requestIds.size(), fetched, {});
+}
+
+const std::vector<std::uint8_t>& PayloadWriter::writeFetchedCbor(utf::WideStringView type, const std::vector<int>& requestIds, const response::Value& fetched)
+{
+	return writeFetchedCbor(type, requestIds.data(), requestIds.size(), fetched, {});
+}
+
+utf::WideStringView PayloadWriter::writeFetched(utf::WideStringView type, const int* requestIds, size_t count, const response::Value& fetched,
+	utf::WideStringView cache)
+{
+	m_buffer.clear();
+
+	writeAscii("{\"type\":"sv);
+	writeString(type);
+	writeAscii(",\"fetched\":"sv);
+	writeValue(fetched);
+
+	if (!cache.empty())
+	{
+		writeAscii(",\"cache\":"sv);
+		writeString(cache);
+	}
+
+	if (count == 1)
+	{
+		writeAscii(",\"requestId\":"sv);
+		writeInt(*requestIds);
+	}
+	else
+	{
+		writeAscii(",\"requestIds\":["sv);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (i > 0)
+			{
+				m_buffer.push_back(',');
+			}
+
+			writeInt(requestIds[i]);
+		}
+
+		m_buffer.push_back(']');
+	}
+
+	m_buffer.push_back('}');
+
+	return m_buffer;
+}
+
+const std::vector<std::uint8_t>& PayloadWriter::writeFetchedCbor(utf::WideStringView type, const int* requestIds, size_t count, const response::Value& fetched,
+	utf::WideStringView cache)
+{
+	cbor::Writer writer { m_bytes };
+
+	m_bytes.clear();
+
+	writer.beginMap(cache.empty() ? 3 : 4);
+	writer.writeText("type"sv);
+	writer.writeUtf16Text(type);
+	writer.writeText("fetched"sv);
+	writeValue(writer, fetched);
+
+	if (!cache.empty())
+	{
+		writer.writeText("cache"sv);
+		writer.writeUtf16Text(cache);
+	}
+
+	if (count == 1)
+	{
+		writer.writeText("requestId"sv);
+		writer.writeInt(*requestIds);
+	}
+	else
+	{
+		writer.writeText("requestIds"sv);
+		writer.beginArray(count);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			writer.writeInt(requestIds[i]);
+		}
+	}
+
+	return m_bytes;
+}
+
+void PayloadWriter::writeValue(cbor::Writer& writer, const response::Value& value)
+{
+	switch (value.type())
+	{
+		case response::Type::Map:
+		{
+			const auto& members = value.get<response::MapType>();
+
+			writer.beginMap(members.size());
+
+			for (const auto& member : members)
+			{
+				writer.writeText(member.first);
+				writeValue(writer, member.second);
+			}
+
+			break;
+		}
+
+		case response::Type::List:
+		{
+			const auto& elements = value.get<response::ListType>();
+
+			writer.beginArray(elements.size());
+
+			for (const auto& element : elements)
+			{
+				writeValue(writer, element);
+			}
+
+			break;
+		}
+
+		case response::Type::String:
+		case response::Type::EnumValue:
+			writer.writeText(value.get<response::StringType>());
+			break;
+
+		case response::Type::Null:
+			writer.writeNull();
+			break;
+
+		case response::Type::Boolean:
+			writer.writeBool(value.get<response::BooleanType>());
+			break;
+
+		case response::Type::Int:
+			writer.writeInt(value.get<response::IntType>());
+			break;
+
+		case response::Type::Float:
+			writer.writeDouble(value.get<response::FloatType>());
+			break;
+
+		case response::Type::Scalar:
+			writeValue(writer, value.get<response::ScalarType>());
+			break;
+	}
+}
+
+void PayloadWriter::writeValue(const response::Value& value)
+{
+	switch (value.type())
+	{
+		case response::Type::Map:
+		{
+			const auto& members = value.get<response::MapType>();
+			bool first = true;
+
+			m_buffer.push_back('{');
+
+			for (const auto& member : members)
+			{
+				if (!first)
+				{
+					m_buffer.push_back(',');
+				}
+
+				first = false;
+				writeString(std::string_view { member.first });
+				m_buffer.push_back(':');
+				writeValue(member.second);
+			}
+
+			m_buffer.push_back('}');
+			break;
+		}
+
+		case response::Type::List:
+		{
+			const auto& elements = value.get<response::ListType>();
+			bool first = true;
+
+			m_buffer.push_back('[');
+
+			for (const auto& element : elements)
+			{
+				if (!first)
+				{
+					m_buffer.push_back(',');
+				}
+
+				first = false;
+				writeValue(element);
+			}
+
+			m_buffer.push_back(']');
+			break;
+		}
+
+		case response::Type::String:
+		case response::Type::EnumValue:
+			writeString(std::string_view { value.get<response::StringType>() });
+			break;
+
+		case response::Type::Null:
+			writeAscii("null"sv);
+			break;
+
+		case response::Type::Boolean:
+			writeAscii(value.get<response::BooleanType>() ? "true"sv : "false"sv);
+			break;
+
+		case response::Type::Int:
+			writeInt(value.get<response::IntType>());
+			break;
+
+		case response::Type::Float:
+			writeFloat(value.get<response::FloatType>());
+			break;
+
+		case response::Type::Scalar:
+			writeValue(value.get<response::ScalarType>());
+			break;
+	}
+}
+
+namespace {
+
+void appendAscii(utf::WideString& buffer, std::string_view value)
+{
+	const auto offset = buffer.size();
+
+	buffer.resize(offset + value.size());
+	utf::widenAscii(value.data(), value.size(), buffer.data() + offset);
+}
+
+constexpr std::string_view c_hexDigits = "0123456789abcdef"sv;
+
+// Control characters, quotes and backslashes are the only code units JSON requires us to escape.
+bool appendEscaped(utf::WideString& buffer, utf::WideChar ch)
+{
+	switch (ch)
+	{
+		case '"':
+			appendAscii(buffer, "\\\""sv);
+			return true;
+
+		case '\\':
+			appendAscii(buffer, "\\\\"sv);
+			return true;
+
+		case '\b':
+			appendAscii(buffer, "\\b"sv);
+			return true;
+
+		case '\f':
+			appendAscii(buffer, "\\f"sv);
+			return true;
+
+		case '\n':
+			appendAscii(buffer, "\\n"sv);
+			return true;
+
+		case '\r':
+			appendAscii(buffer, "\\r"sv);
+			return true;
+
+		case '\t':
+			appendAscii(buffer, "\\t"sv);
+			return true;
+
+		default:
+			if (ch < 0x20)
+			{
+				appendAscii(buffer, "\\u00"sv);
+				buffer.push_back(c_hexDigits[(ch >> 4) & 0xF]);
+				buffer.push_back(c_hexDigits[ch & 0xF]);
+				return true;
+			}
+
+			return false;
+	}
+}
+
+// The number of bytes at the start of data which are ASCII and need no escaping, so they can be
+// widened to UTF-16 as they are.
+size_t plainAsciiRun(const char* data, size_t length) noexcept
+{
+	size_t i = 0;
+
+#ifdef GQLMAPI_UTF_SSE2
+	const auto quote = _mm_set1_epi8('"');
+	const auto backslash = _mm_set1_epi8('\\');
+	const auto space = _mm_set1_epi8(0x20);
+
+	for (; i + 16 <= length; i += 16)
+	{
+		const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+		// Bytes >= 0x80 are negative, so the signed compare with space catches them with the controls.
+		const auto special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)),
+			_mm_cmplt_epi8(bytes, space));
+		const auto mask = _mm_movemask_epi8(special);
+
+		if (mask != 0)
+		{
+			for (auto bits = static_cast<unsigned int>(mask); (bits & 1) == 0; bits >>= 1)
+			{
+				++i;
+			}
+
+			return i;
+		}
+	}
+#endif
+
+	for (; i < length; ++i)
+	{
+		const auto ch = static_cast<unsigned char>(data[i]);
+
+		if (ch < 0x20 || ch >= 0x80 || ch == '"' || ch == '\\')
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+} // namespace
+
+void PayloadWriter::writeString(std::string_view value)
+{
+	const auto data = reinterpret_cast<const unsigned char*>(value.data());
+	const size_t length = value.size();
+
+	m_buffer.reserve(m_buffer.size() + length + 2);
+	m_buffer.push_back('"');
+
+	for (size_t i = 0; i < length;)
+	{
+		const auto run = plainAsciiRun(value.data() + i, length - i);
+
+		if (run > 0)
+		{
+			const auto offset = m_buffer.size();
+
+			m_buffer.resize(offset + run);
+			utf::widenAscii(value.data() + i, run, m_buffer.data() + offset);
+			i += run;
+			continue;
+		}
+
+		if (data[i] < 0x80)
+		{
+			appendEscaped(m_buffer, static_cast<utf::WideChar>(data[i]));
+			++i;
+			continue;
+		}
+
+		std::array<utf::WideChar, 2> units;
+		const auto codePoint = utf::decodeCodePoint(data, length, i);
+
+		m_buffer.append(units.data(), static_cast<size_t>(utf::encodeCodePoint(codePoint, units.data()) - units.data()));
+	}
+
+	m_buffer.push_back('"');
+}
+
+void PayloadWriter::writeString(utf::WideStringView value)
+{
+	m_buffer.reserve(m_buffer.size() + value.size() + 2);
+	m_buffer.push_back('"');
+
+	for (const auto ch : value)
+	{
+		if (!appendEscaped(m_buffer, ch))
+		{
+			m_buffer.push_back(ch);
+		}
+	}
+
+	m_buffer.push_back('"');
+}
+
+void PayloadWriter::writeInt(int value)
+{
+	std::array<char, 16> digits;
+	const auto result = std::to_chars(digits.data(), digits.data() + digits.size(), value);
+
+	writeAscii(std::string_view { digits.data(), static_cast<size_t>(result.ptr - digits.data()) });
+}
+
+void PayloadWriter::writeFloat(double value)
+{
+	if (!std::isfinite(value))
+	{
+		// JSON has no representation for NaN or infinity.
+		writeAscii("null"sv);
+		return;
+	}
+
+	std::array<char, 32> digits;
+	const auto result = std::to_chars(digits.data(), digits.data() + digits.size(), value);
+
+	writeAscii(std::string_view { digits.data(), static_cast<size_t>(result.ptr - digits.data()) });
+}
+
+void PayloadWriter::writeAscii(std::string_view value)
+{
+	appendAscii(m_buffer, value);
+}
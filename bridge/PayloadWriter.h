@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include "Cbor.h"
+#include "Utf.h"
+
+#include "graphqlservice/GraphQLResponse.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Serializes a response envelope and its fetched payload straight into a reusable UTF-16 (JSON) or
+// byte (CBOR) buffer, so a resolved response::Value only makes a single pass on its way to the wire.
+class PayloadWriter
+{
+public:
+	PayloadWriter() = default;
+
+	// A non-empty cache status is written in a "cache" member alongside the payload.
+	utf::WideStringView writeFetched(utf::WideStringView type, int requestId, const graphql::response::Value& fetched,
+		utf::WideStringView cache = {});
+	const std::vector<std::uint8_t>& writeFetchedCbor(utf::WideStringView type, int requestId, const graphql::response::Value& fetched,
+		utf::WideStringView cache = {});
+
+	// A payload shared by several subscriptions lists all of their ids in "requestIds" instead.
+	utf::WideStringView writeFetched(utf::WideStringView type, const std::vector<int>& requestIds, const graphql::response::Value& fetched);
+	const std::vector<std::uint8_t>& writeFetchedCbor(utf::WideStringView type, const std::vector<int>& requestIds, const graphql::response::Value& fetched);
+
+private:
+	utf::WideStringView writeFetched(utf::WideStringView type, const int* requestIds, size_t count, const graphql::response::Value& fetched,
+		utf::WideStringView cache);
+	const std::vector<std::uint8_t>& writeFetchedCbor(utf::WideStringView type, const int* requestIds, size_t count, const graphql::response::Value& fetched,
+		utf::WideStringView cache);
+	void writeValue(const graphql::response::Value& value);
+	static void writeValue(cbor::Writer& writer, const graphql::response::Value& value);
+	void writeString(std::string_view value);
+	void writeString(utf::WideStringView value);
+	void writeInt(int value);
+	void writeFloat(double value);
+	void writeAscii(std::string_view value);
+
+	utf::WideString m_buffer;
+	std::vector<std::uint8_t> m_bytes;
+};
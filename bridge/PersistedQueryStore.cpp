@@ -0,0 +1,199 @@
+﻿#include "pch.h"
+
+#include "PersistedQueryStore.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+using namespace winrt;
+using namespace Windows::Data::Json;
+using namespace Windows::Security::Cryptography;
+using namespace Windows::Security::Cryptography::Core;
+
+PersistedQueryStore::PersistedQueryStore(std::filesystem::path path)
+	: m_path { std::move(path) }
+{
+}
+
+void PersistedQueryStore::configure(size_t maxEntries, size_t maxBytes)
+{
+	m_maxEntries = std::max<size_t>(maxEntries, 1);
+	m_maxBytes = maxBytes;
+	evict();
+}
+
+void PersistedQueryStore::load()
+{
+	std::ifstream file { m_path, std::ios::binary };
+
+	if (!file)
+	{
+		return;
+	}
+
+	const std::string contents { std::istreambuf_iterator<char> { file }, std::istreambuf_iterator<char> {} };
+	const auto text = to_hstring(contents);
+	JsonArray queries;
+	JsonObject unordered;
+	const auto restore = [this](hstring hash, hstring query) {
+		try
+		{
+			insert(to_string(hash), to_string(query));
+		}
+		catch (const std::invalid_argument&)
+		{
+			// The document does not match its hash any more, the client will send it again.
+		}
+	};
+
+	// The store is saved most recently used first, reading it back in reverse rebuilds the same order.
+	// A damaged store only costs the client one extra round trip per query.
+	if (JsonArray::TryParse(text, queries))
+	{
+		for (auto index = queries.Size(); index > 0; --index)
+		{
+			const auto value = queries.GetAt(index - 1);
+
+			if (value.ValueType() == JsonValueType::Object)
+			{
+				const auto entry = value.GetObject();
+
+				if (entry.HasKey(L"hash")
+					&& entry.HasKey(L"query")
+					&& entry.GetNamedValue(L"hash").ValueType() == JsonValueType::String
+					&& entry.GetNamedValue(L"query").ValueType() == JsonValueType::String)
+				{
+					restore(entry.GetNamedString(L"hash"), entry.GetNamedString(L"query"));
+				}
+			}
+		}
+	}
+	else if (JsonObject::TryParse(text, unordered))
+	{
+		// Stores saved before there was an order to keep.
+		for (const auto& entry : unordered)
+		{
+			if (entry.Value().ValueType() == JsonValueType::String)
+			{
+				restore(entry.Key(), entry.Value().GetString());
+			}
+		}
+	}
+
+	m_dirty = false;
+	m_lastSave = std::chrono::steady_clock::now();
+}
+
+void PersistedQueryStore::save()
+{
+	if (!m_dirty)
+	{
+		return;
+	}
+
+	JsonArray queries;
+
+	for (const auto& entry : m_entries)
+	{
+		JsonObject query;
+
+		query.SetNamedValue(L"hash", JsonValue::CreateStringValue(to_hstring(entry.hash)));
+		query.SetNamedValue(L"query", JsonValue::CreateStringValue(to_hstring(entry.query)));
+		queries.Append(query);
+	}
+
+	std::ofstream file { m_path, std::ios::binary | std::ios::trunc };
+
+	file << to_string(queries.ToString());
+
+	m_dirty = !file;
+	m_lastSave = std::chrono::steady_clock::now();
+}
+
+void PersistedQueryStore::saveIfDue()
+{
+	if (m_dirty
+		&& std::chrono::steady_clock::now() - m_lastSave >= c_saveInterval)
+	{
+		save();
+	}
+}
+
+std::optional<std::string_view> PersistedQueryStore::find(std::string_view hash)
+{
+	const auto itr = m_index.find(hash);
+
+	if (itr == m_index.end())
+	{
+		return std::nullopt;
+	}
+
+	// Only the order changes, which is not worth a save by itself.
+	m_entries.splice(m_entries.begin(), m_entries, itr->second);
+
+	return std::make_optional<std::string_view>(itr->second->query);
+}
+
+void PersistedQueryStore::insert(std::string_view hash, std::string_view query)
+{
+	if (hash != computeHash(query))
+	{
+		std::ostringstream oss;
+
+		oss << "Persisted query hash mismatch: " << hash;
+		throw std::invalid_argument { oss.str() };
+	}
+
+	const auto itr = m_index.find(hash);
+
+	if (itr != m_index.end())
+	{
+		// The same hash is the same document.
+		m_entries.splice(m_entries.begin(), m_entries, itr->second);
+		return;
+	}
+
+	m_entries.push_front({ std::string { hash }, std::string { query } });
+	m_index[m_entries.front().hash] = m_entries.begin();
+	m_bytes += entryBytes(m_entries.front());
+	m_dirty = true;
+	evict();
+}
+
+PersistedQueryStore::Stats PersistedQueryStore::stats() const noexcept
+{
+	return { m_entries.size(), m_bytes, m_evictions };
+}
+
+void PersistedQueryStore::evict()
+{
+	// Always keep the most recently used document, even if it is larger than the limit by itself.
+	while (m_entries.size() > 1
+		&& (m_entries.size() > m_maxEntries || m_bytes > m_maxBytes))
+	{
+		const auto& entry = m_entries.back();
+
+		m_bytes -= entryBytes(entry);
+		m_index.erase(entry.hash);
+		m_entries.pop_back();
+		m_dirty = true;
+		++m_evictions;
+	}
+}
+
+size_t PersistedQueryStore::entryBytes(const Entry& entry) noexcept
+{
+	return entry.hash.size() + entry.query.size();
+}
+
+std::string PersistedQueryStore::computeHash(std::string_view query)
+{
+	const auto data = reinterpret_cast<const std::uint8_t*>(query.data());
+	const auto provider = HashAlgorithmProvider::OpenAlgorithm(HashAlgorithmNames::Sha256());
+	const auto digest = provider.HashData(CryptographicBuffer::CreateFromByteArray({ data, data + query.size() }));
+
+	return to_string(CryptographicBuffer::EncodeToHexString(digest));
+}
@@ -0,0 +1,70 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Query documents the client has registered by their SHA-256 hash. The store is saved to the
+// package's local cache folder, so it outlives the bridge process across stopService/startService.
+// It is bounded like DocumentCache, evicting the least recently used documents, and is saved in that
+// order so the limits still apply after a restart.
+class PersistedQueryStore
+{
+public:
+	struct Stats
+	{
+		size_t entries;
+		size_t bytes;
+		std::uint64_t evictions;
+	};
+
+	static constexpr size_t c_defaultMaxEntries = 1024;
+	static constexpr size_t c_defaultMaxBytes = 4 * 1024 * 1024;
+	static constexpr std::chrono::seconds c_saveInterval { 30 };
+
+	explicit PersistedQueryStore(std::filesystem::path path);
+
+	void configure(size_t maxEntries, size_t maxBytes);
+
+	void load();
+	void save();
+	// Saves new documents at most once per c_saveInterval, so they survive a bridge which never
+	// gets to shut down cleanly.
+	void saveIfDue();
+
+	std::optional<std::string_view> find(std::string_view hash);
+	void insert(std::string_view hash, std::string_view query);
+	Stats stats() const noexcept;
+
+	static std::string computeHash(std::string_view query);
+
+private:
+	struct Entry
+	{
+		std::string hash;
+		std::string query;
+	};
+
+	using EntryList = std::list<Entry>;
+
+	void evict();
+
+	static size_t entryBytes(const Entry& entry) noexcept;
+
+	const std::filesystem::path m_path;
+	size_t m_maxEntries = c_defaultMaxEntries;
+	size_t m_maxBytes = c_defaultMaxBytes;
+	size_t m_bytes = 0;
+	std::uint64_t m_evictions = 0;
+	std::chrono::steady_clock::time_point m_lastSave {};
+
+	EntryList m_entries;
+	std::unordered_map<std::string_view, EntryList::iterator> m_index;
+	bool m_dirty = false;
+};
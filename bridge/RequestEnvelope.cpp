@@ -0,0 +1,652 @@
+﻿#include "RequestEnvelope.h"
+
+#include "Utf.h"
+
+#include <charconv>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+namespace {
+
+// Deeper than any variables a client sends, shallow enough that the recursion cannot run out of stack.
+constexpr size_t c_maxDepth = 128;
+
+utf::WideString widen(std::string_view ascii)
+{
+	utf::WideString result(ascii.size(), '\0');
+
+	utf::widenAscii(ascii.data(), ascii.size(), result.data());
+
+	return result;
+}
+
+// The keys and literals the reader looks for, in the code unit type of the request text.
+const utf::WideString c_true = widen("true"sv);
+const utf::WideString c_false = widen("false"sv);
+const utf::WideString c_null = widen("null"sv);
+const utf::WideString c_unicodeEscape = widen("\\u"sv);
+const utf::WideString c_variables = widen("variables"sv);
+const utf::WideString c_requestId = widen("requestId"sv);
+const utf::WideString c_type = widen("type"sv);
+
+// Sink for the text of members which are skipped.
+struct Discard
+{
+};
+
+class Reader
+{
+public:
+	explicit Reader(utf::WideStringView json) noexcept
+		: m_json { json }
+	{
+	}
+
+	utf::WideChar peek()
+	{
+		skipWhitespace();
+
+		if (m_position == m_json.size())
+		{
+			fail();
+		}
+
+		return m_json[m_position];
+	}
+
+	bool consume(utf::WideChar ch)
+	{
+		if (peek() != ch)
+		{
+			return false;
+		}
+
+		++m_position;
+		return true;
+	}
+
+	void expect(utf::WideChar ch)
+	{
+		if (!consume(ch))
+		{
+			fail();
+		}
+	}
+
+	void expectEnd()
+	{
+		skipWhitespace();
+
+		if (m_position != m_json.size())
+		{
+			fail();
+		}
+	}
+
+	// Calls readMember for every member, positioned at its key, and readMember reads the key and value.
+	template <typename Fn>
+	void readObject(Fn&& readMember)
+	{
+		expect('{');
+
+		if (consume('}'))
+		{
+			return;
+		}
+
+		do
+		{
+			readMember();
+		} while (consume(','));
+
+		expect('}');
+	}
+
+	// Appends the unescaped string to out, which is a utf::WideString, or a std::string for UTF-8.
+	template <typename Out>
+	void readString(Out& out)
+	{
+		expect('"');
+
+		for (;;)
+		{
+			const auto start = m_position;
+
+			while (m_position < m_json.size()
+				&& m_json[m_position] != '"'
+				&& m_json[m_position] != '\\'
+				&& m_json[m_position] >= 0x20)
+			{
+				++m_position;
+			}
+
+			append(out, m_json.substr(start, m_position - start));
+
+			if (m_position == m_json.size())
+			{
+				fail();
+			}
+
+			const auto ch = m_json[m_position++];
+
+			if (ch == '"')
+			{
+				return;
+			}
+			else if (ch != '\\')
+			{
+				fail();
+			}
+
+			readEscape(out);
+		}
+	}
+
+	double readNumber()
+	{
+		skipWhitespace();
+
+		char digits[64] {};
+		size_t length = 0;
+
+		while (m_position < m_json.size()
+			&& length < std::size(digits))
+		{
+			const auto ch = m_json[m_position];
+
+			if ((ch < '0' || ch > '9')
+				&& ch != '-'
+				&& ch != '+'
+				&& ch != '.'
+				&& ch != 'e'
+				&& ch != 'E')
+			{
+				break;
+			}
+
+			digits[length++] = static_cast<char>(ch);
+			++m_position;
+		}
+
+		double value = 0.0;
+		const auto result = std::from_chars(digits, digits + length, value);
+
+		if (length == 0
+			|| result.ec != std::errc {}
+			|| result.ptr != digits + length)
+		{
+			fail();
+		}
+
+		return value;
+	}
+
+	bool readBoolean()
+	{
+		if (readLiteral(c_true))
+		{
+			return true;
+		}
+		else if (readLiteral(c_false))
+		{
+			return false;
+		}
+
+		fail();
+	}
+
+	void readNull()
+	{
+		if (!readLiteral(c_null))
+		{
+			fail();
+		}
+	}
+
+	response::Value readValue(size_t depth)
+	{
+		if (depth > c_maxDepth)
+		{
+			throw std::invalid_argument { "Request JSON is nested too deeply" };
+		}
+
+		switch (peek())
+		{
+			case '{':
+			{
+				response::Value map { response::Type::Map };
+
+				readObject([this, &map, depth]() {
+					std::string key;
+
+					readString(key);
+					expect(':');
+					map.emplace_back(std::move(key), readValue(depth + 1));
+				});
+
+				return map;
+			}
+
+			case '[':
+			{
+				response::Value list { response::Type::List };
+
+				++m_position;
+
+				if (!consume(']'))
+				{
+					do
+					{
+						list.emplace_back(readValue(depth + 1));
+					} while (consume(','));
+
+					expect(']');
+				}
+
+				return list;
+			}
+
+			case '"':
+			{
+				std::string text;
+
+				readString(text);
+
+				return response::Value { std::move(text) };
+			}
+
+			case 't':
+			case 'f':
+				return response::Value { readBoolean() };
+
+			case 'n':
+				readNull();
+				return {};
+
+			default:
+				return numberValue(readNumber());
+		}
+	}
+
+	void skipValue(size_t depth)
+	{
+		if (depth > c_maxDepth)
+		{
+			throw std::invalid_argument { "Request JSON is nested too deeply" };
+		}
+
+		switch (peek())
+		{
+			case '{':
+				readObject([this, depth]() {
+					Discard key;
+
+					readString(key);
+					expect(':');
+					skipValue(depth + 1);
+				});
+				break;
+
+			case '[':
+				++m_position;
+
+				if (!consume(']'))
+				{
+					do
+					{
+						skipValue(depth + 1);
+					} while (consume(','));
+
+					expect(']');
+				}
+				break;
+
+			case '"':
+			{
+				Discard text;
+
+				readString(text);
+				break;
+			}
+
+			case 't':
+			case 'f':
+				readBoolean();
+				break;
+
+			case 'n':
+				readNull();
+				break;
+
+			default:
+				readNumber();
+				break;
+		}
+	}
+
+private:
+	[[noreturn]] void fail() const
+	{
+		throw std::invalid_argument { "Invalid request JSON at offset "s + std::to_string(m_position) };
+	}
+
+	void skipWhitespace() noexcept
+	{
+		while (m_position < m_json.size()
+			&& (m_json[m_position] == ' '
+				|| m_json[m_position] == '\t'
+				|| m_json[m_position] == '\n'
+				|| m_json[m_position] == '\r'))
+		{
+			++m_position;
+		}
+	}
+
+	bool readLiteral(utf::WideStringView literal)
+	{
+		skipWhitespace();
+
+		if (m_json.substr(m_position, literal.size()) != literal)
+		{
+			return false;
+		}
+
+		m_position += literal.size();
+		return true;
+	}
+
+	utf::WideChar readHex4()
+	{
+		if (m_json.size() - m_position < 4)
+		{
+			fail();
+		}
+
+		unsigned int value = 0;
+
+		for (size_t i = 0; i < 4; ++i)
+		{
+			const auto ch = m_json[m_position++];
+
+			value <<= 4;
+
+			if (ch >= '0' && ch <= '9')
+			{
+				value |= ch - '0';
+			}
+			else if (ch >= 'a' && ch <= 'f')
+			{
+				value |= ch - 'a' + 10;
+			}
+			else if (ch >= 'A' && ch <= 'F')
+			{
+				value |= ch - 'A' + 10;
+			}
+			else
+			{
+				fail();
+			}
+		}
+
+		return static_cast<utf::WideChar>(value);
+	}
+
+	template <typename Out>
+	void readEscape(Out& out)
+	{
+		if (m_position == m_json.size())
+		{
+			fail();
+		}
+
+		utf::WideChar units[2] {};
+		size_t count = 1;
+
+		switch (m_json[m_position++])
+		{
+			case '"':
+				units[0] = '"';
+				break;
+
+			case '\\':
+				units[0] = '\\';
+				break;
+
+			case '/':
+				units[0] = '/';
+				break;
+
+			case 'b':
+				units[0] = '\b';
+				break;
+
+			case 'f':
+				units[0] = '\f';
+				break;
+
+			case 'n':
+				units[0] = '\n';
+				break;
+
+			case 'r':
+				units[0] = '\r';
+				break;
+
+			case 't':
+				units[0] = '\t';
+				break;
+
+			case 'u':
+			{
+				units[0] = readHex4();
+
+				// Keep an escaped surrogate pair together, so it transcodes to one code point.
+				const auto next = m_position;
+
+				if (units[0] >= 0xD800 && units[0] <= 0xDBFF
+					&& m_json.substr(next, 2) == c_unicodeEscape)
+				{
+					m_position += 2;
+					units[1] = readHex4();
+
+					if (units[1] >= 0xDC00 && units[1] <= 0xDFFF)
+					{
+						count = 2;
+					}
+					else
+					{
+						m_position = next;
+					}
+				}
+				break;
+			}
+
+			default:
+				fail();
+		}
+
+		append(out, utf::WideStringView { units, count });
+	}
+
+	static void append(utf::WideString& out, utf::WideStringView units)
+	{
+		out.append(units);
+	}
+
+	static void append(std::string& out, utf::WideStringView units)
+	{
+		utf::appendUtf8(units, out);
+	}
+
+	static void append(Discard&, utf::WideStringView) noexcept
+	{
+	}
+
+	// Windows.Data.Json keeps every number as a double and writes the integral ones without a fraction,
+	// which is what response::parseJSON used to see: whole numbers in range are Int, the rest Float.
+	static response::Value numberValue(double number)
+	{
+		if (std::trunc(number) == number
+			&& number >= std::numeric_limits<response::IntType>::min()
+			&& number <= std::numeric_limits<response::IntType>::max())
+		{
+			return response::Value { static_cast<response::IntType>(number) };
+		}
+
+		return response::Value { number };
+	}
+
+	const utf::WideStringView m_json;
+	size_t m_position = 0;
+};
+
+} // namespace
+
+RequestEnvelope::RequestEnvelope(utf::WideStringView json)
+{
+	Reader reader { json };
+
+	reader.readObject([this, &reader]() {
+		utf::WideString key;
+
+		reader.readString(key);
+		reader.expect(':');
+
+		if (key == c_variables)
+		{
+			m_variables = reader.readValue(0);
+			return;
+		}
+
+		Scalar value;
+
+		switch (reader.peek())
+		{
+			case '{':
+			case '[':
+				reader.skipValue(0);
+				return;
+
+			case '"':
+			{
+				utf::WideString text;
+
+				reader.readString(text);
+				value = std::move(text);
+				break;
+			}
+
+			case 't':
+			case 'f':
+				value = reader.readBoolean();
+				break;
+
+			case 'n':
+				reader.readNull();
+				break;
+
+			default:
+				value = reader.readNumber();
+				break;
+		}
+
+		for (auto& member : m_members)
+		{
+			if (member.first == key)
+			{
+				member.second = std::move(value);
+				return;
+			}
+		}
+
+		m_members.emplace_back(std::move(key), std::move(value));
+	});
+
+	reader.expectEnd();
+}
+
+const RequestEnvelope::Scalar* RequestEnvelope::find(utf::WideStringView key) const noexcept
+{
+	for (const auto& member : m_members)
+	{
+		if (member.first == key)
+		{
+			return &member.second;
+		}
+	}
+
+	return nullptr;
+}
+
+template <typename T>
+const T& RequestEnvelope::get(utf::WideStringView key) const
+{
+	const auto value = find(key);
+	const auto typed = (value ? std::get_if<T>(value) : nullptr);
+
+	if (!typed)
+	{
+		std::string message { value ? "Wrong type for request member: " : "Missing request member: " };
+
+		utf::appendUtf8(key, message);
+		throw std::invalid_argument { message };
+	}
+
+	return *typed;
+}
+
+int RequestEnvelope::requestId() const
+{
+	return static_cast<int>(getNumber(c_requestId));
+}
+
+utf::WideStringView RequestEnvelope::type() const
+{
+	return getString(c_type);
+}
+
+bool RequestEnvelope::hasKey(utf::WideStringView key) const noexcept
+{
+	return find(key) != nullptr;
+}
+
+double RequestEnvelope::getNumber(utf::WideStringView key) const
+{
+	return get<double>(key);
+}
+
+double RequestEnvelope::getNumber(utf::WideStringView key, double defaultValue) const
+{
+	return find(key) ? get<double>(key) : defaultValue;
+}
+
+bool RequestEnvelope::getBoolean(utf::WideStringView key, bool defaultValue) const
+{
+	return find(key) ? get<bool>(key) : defaultValue;
+}
+
+utf::WideStringView RequestEnvelope::getString(utf::WideStringView key) const
+{
+	return get<utf::WideString>(key);
+}
+
+utf::WideStringView RequestEnvelope::getString(utf::WideStringView key, utf::WideStringView defaultValue) const
+{
+	return find(key) ? utf::WideStringView { get<utf::WideString>(key) } : defaultValue;
+}
+
+response::Value RequestEnvelope::takeVariables()
+{
+	if (m_variables.type() != response::Type::Map)
+	{
+		throw std::invalid_argument { "Request variables must be an object" };
+	}
+
+	return std::exchange(m_variables, response::Value { response::Type::Map });
+}
@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include "Utf.h"
+
+#include "graphqlservice/GraphQLResponse.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Reads a request in one pass over its UTF-16 text. Scalar members are kept by name, and "variables"
+// is built as a response::Value straight from the text, rather than parsing a JsonObject, serializing
+// the variables again and handing them to response::parseJSON. Other nested objects and arrays are
+// skipped, so requests which need them (startService) still go through JsonObject.
+class RequestEnvelope
+{
+public:
+	explicit RequestEnvelope(utf::WideStringView json);
+
+	int requestId() const;
+	utf::WideStringView type() const;
+
+	bool hasKey(utf::WideStringView key) const noexcept;
+	double getNumber(utf::WideStringView key) const;
+	double getNumber(utf::WideStringView key, double defaultValue) const;
+	bool getBoolean(utf::WideStringView key, bool defaultValue) const;
+	utf::WideStringView getString(utf::WideStringView key) const;
+	utf::WideStringView getString(utf::WideStringView key, utf::WideStringView defaultValue) const;
+
+	// The variables map, or an empty map if the request had none. Moves them out on the first call.
+	// hasKey and the getters only see the other members.
+	graphql::response::Value takeVariables();
+
+private:
+	using Scalar = std::variant<std::nullptr_t, bool, double, utf::WideString>;
+
+	const Scalar* find(utf::WideStringView key) const noexcept;
+
+	template <typename T>
+	const T& get(utf::WideStringView key) const;
+
+	std::vector<std::pair<utf::WideString, Scalar>> m_members;
+	graphql::response::Value m_variables { graphql::response::Type::Map };
+};
@@ -0,0 +1,446 @@
+﻿#include "pch.h"
+
+#include "ResponseBatcher.h"
+
+#include "AppServiceTransport.h"
+#include "Cbor.h"
+#include "PayloadWriter.h"
+#include "TraceWriter.h"
+
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+using namespace graphql;
+
+using namespace winrt;
+using namespace Windows::Data::Json;
+using namespace Windows::Foundation;
+
+// wingdi.h defines GetObject as a macro, which hides IJsonValue::GetObject.
+#undef GetObject
+
+namespace {
+
+void writeJsonCbor(cbor::Writer& writer, const IJsonValue& value)
+{
+	switch (value.ValueType())
+	{
+		case JsonValueType::Null:
+			writer.writeNull();
+			break;
+
+		case JsonValueType::Boolean:
+			writer.writeBool(value.GetBoolean());
+			break;
+
+		case JsonValueType::Number:
+			writer.writeNumber(value.GetNumber());
+			break;
+
+		case JsonValueType::String:
+			writer.writeUtf16Text(std::wstring_view { value.GetString() });
+			break;
+
+		case JsonValueType::Array:
+		{
+			const auto elements = value.GetArray();
+
+			writer.beginArray(elements.Size());
+
+			for (const auto& element : elements)
+			{
+				writeJsonCbor(writer, element);
+			}
+
+			break;
+		}
+
+		case JsonValueType::Object:
+		{
+			const auto members = value.GetObject();
+
+			writer.beginMap(members.Size());
+
+			for (const auto& member : members)
+			{
+				writer.writeUtf16Text(std::wstring_view { member.Key() });
+				writeJsonCbor(writer, member.Value());
+			}
+
+			break;
+		}
+	}
+}
+
+// Each thread keeps its own buffer, so repeated payloads reuse the same allocation.
+PayloadWriter& threadPayloadWriter()
+{
+	thread_local PayloadWriter writer;
+
+	return writer;
+}
+
+} // namespace
+
+ResponseBatcher::ResponseBatcher(const std::shared_ptr<MessageTransport>& transport, const std::shared_ptr<LatencyRegistry>& latency)
+	: latency { latency }
+	, serializeLatency { latency->get(L"serialize") }
+	, queueLatency { latency->get(L"batchQueue") }
+	, sendLatency { latency->get(L"send") }
+	, flushEvent { CreateEventW(nullptr, false, false, nullptr) }
+	, idleEvent { CreateEventW(nullptr, true, true, nullptr) }
+	, transport { transport }
+{
+}
+
+void ResponseBatcher::configure(std::chrono::milliseconds window, size_t maxSize)
+{
+	std::lock_guard lock { mutex };
+
+	flushWindow = window;
+	maxBatchSize = std::max<size_t>(maxSize, 1);
+}
+
+void ResponseBatcher::useBinaryEncoding(bool binary)
+{
+	binaryEncoding = binary;
+}
+
+std::string ResponseBatcher::createSharedRing(size_t size, size_t threshold, const std::string& appContainerSid)
+{
+	std::ostringstream oss;
+
+	oss << "gqlmapi-bridge-" << GetCurrentProcessId() << '-' << GetTickCount64();
+
+	const auto name = oss.str();
+	std::lock_guard lock { mutex };
+
+	sharedRingAttached = false;
+	sharedRing.reset();
+	sharedMemory.reset();
+	sharedMemory.emplace(shm::SharedMemory::create(name, size, appContainerSid));
+	sharedRing.emplace(sharedMemory->data(), sharedMemory->size());
+	sharedThreshold = threshold;
+	sharedStats = {};
+	sharedStats.capacity = static_cast<size_t>(sharedRing->capacity());
+
+	return name;
+}
+
+void ResponseBatcher::attachSharedRing()
+{
+	std::lock_guard lock { mutex };
+
+	if (!sharedRing)
+	{
+		throw std::logic_error { "No shared memory ring to attach" };
+	}
+
+	sharedRingAttached = true;
+}
+
+void ResponseBatcher::releaseSharedRing(std::string attachError)
+{
+	std::lock_guard lock { mutex };
+
+	sharedRingAttached = false;
+	sharedRing.reset();
+	sharedMemory.reset();
+	sharedStats.attachError = std::move(attachError);
+}
+
+ResponseBatcher::SharedRingStats ResponseBatcher::sharedRingStats()
+{
+	std::lock_guard lock { mutex };
+	auto stats { sharedStats };
+
+	if (sharedRing)
+	{
+		stats.used = static_cast<size_t>(sharedRing->used());
+	}
+
+	return stats;
+}
+
+ResponseBatcher::BatchStats ResponseBatcher::batchStats()
+{
+	std::lock_guard lock { mutex };
+
+	return sendStats;
+}
+
+void ResponseBatcher::enqueue(const JsonObject& response)
+{
+	if (binaryEncoding)
+	{
+		std::vector<std::uint8_t> encoded;
+		cbor::Writer writer { encoded };
+
+		writeJsonCbor(writer, response);
+		enqueue(PendingResponse { std::move(encoded) });
+	}
+	else
+	{
+		enqueue(PendingResponse { utf::WideString { std::wstring_view { response.ToString() } } });
+	}
+}
+
+void ResponseBatcher::enqueueFetched(std::wstring_view type, int requestId, const response::Value& fetched,
+	std::function<void()> onSent, std::wstring_view cache)
+{
+	auto& writer = threadPayloadWriter();
+	const auto start = LatencyHistogram::Clock::now();
+	PendingResponse response;
+
+	if (binaryEncoding)
+	{
+		response = writer.writeFetchedCbor(type, requestId, fetched, cache);
+	}
+	else
+	{
+		response = utf::WideString { writer.writeFetched(type, requestId, fetched, cache) };
+	}
+
+	serializeLatency.recordSince(start);
+	enqueue(std::move(response), std::move(onSent));
+}
+
+void ResponseBatcher::enqueueFetched(std::wstring_view type, const std::vector<int>& requestIds, const response::Value& fetched)
+{
+	auto& writer = threadPayloadWriter();
+	const auto start = LatencyHistogram::Clock::now();
+	PendingResponse response;
+
+	if (binaryEncoding)
+	{
+		response = writer.writeFetchedCbor(type, requestIds, fetched);
+	}
+	else
+	{
+		response = utf::WideString { writer.writeFetched(type, requestIds, fetched) };
+	}
+
+	serializeLatency.recordSince(start);
+	enqueue(std::move(response));
+}
+
+void ResponseBatcher::enqueue(PendingResponse&& response, std::function<void()> onSent)
+{
+	std::unique_lock lock { mutex };
+
+	pending.push_back({ sharedRingAttached ? writeSharedRing(std::move(response)) : std::move(response), std::move(onSent), LatencyHistogram::Clock::now() });
+
+	if (!draining)
+	{
+		draining = true;
+		ResetEvent(idleEvent.get());
+		lock.unlock();
+
+		drainAsync();
+	}
+	else if (pending.size() >= maxBatchSize)
+	{
+		SetEvent(flushEvent.get());
+	}
+}
+
+// Called with the mutex held, so records go into the ring in the same order as their placeholders
+// go into the pending queue.
+ResponseBatcher::PendingResponse ResponseBatcher::writeSharedRing(PendingResponse&& response)
+{
+	const void* data = nullptr;
+	size_t size = 0;
+
+	if (const auto text = std::get_if<utf::WideString>(&response))
+	{
+		data = text->data();
+		size = text->size() * sizeof(utf::WideChar);
+	}
+	else
+	{
+		const auto& bytes = std::get<std::vector<std::uint8_t>>(response);
+
+		data = bytes.data();
+		size = bytes.size();
+	}
+
+	if (size < sharedThreshold)
+	{
+		return std::move(response);
+	}
+
+	// The record tag tells the client which encoding to decode, it matches the variant index.
+	const auto sequence = sharedRing->tryWrite(static_cast<std::uint32_t>(response.index()), data, size);
+
+	if (!sequence)
+	{
+		// The client has not caught up, this one goes through the relay instead.
+		++sharedStats.fallbacks;
+		return std::move(response);
+	}
+
+	++sharedStats.records;
+	sharedStats.bytes += size;
+
+	JsonObject placeholder;
+
+	placeholder.SetNamedValue(L"type", JsonValue::CreateStringValue(L"shared"));
+	placeholder.SetNamedValue(L"sequence", JsonValue::CreateNumberValue(static_cast<double>(*sequence)));
+
+	if (std::holds_alternative<utf::WideString>(response))
+	{
+		return PendingResponse { utf::WideString { std::wstring_view { placeholder.ToString() } } };
+	}
+
+	std::vector<std::uint8_t> encoded;
+	cbor::Writer writer { encoded };
+
+	writeJsonCbor(writer, placeholder);
+
+	return PendingResponse { std::move(encoded) };
+}
+
+IAsyncAction ResponseBatcher::flushAsync()
+{
+	const auto strong_this { get_strong() };
+
+	{
+		std::lock_guard lock { mutex };
+
+		if (!draining)
+		{
+			co_return;
+		}
+
+		SetEvent(flushEvent.get());
+	}
+
+	co_await resume_on_signal(idleEvent.get());
+}
+
+fire_and_forget ResponseBatcher::drainAsync()
+{
+	const auto strong_this { get_strong() };
+	std::chrono::milliseconds window;
+
+	{
+		std::lock_guard lock { mutex };
+
+		window = (pending.size() < maxBatchSize ? flushWindow : std::chrono::milliseconds { 0 });
+	}
+
+	// Give other responses a chance to join the batch, unless it is already full or someone is
+	// waiting on a flush.
+	if (window.count() > 0)
+	{
+		co_await resume_on_signal(flushEvent.get(), window);
+	}
+	else
+	{
+		co_await resume_background();
+	}
+
+	// There is only ever one drain loop running, so batches go out in the order they were queued
+	// and responses that arrive while a batch is in flight are picked up by the next one.
+	for (;;)
+	{
+		std::vector<PendingEntry> batch;
+
+		{
+			std::lock_guard lock { mutex };
+
+			if (pending.empty())
+			{
+				draining = false;
+				SetEvent(idleEvent.get());
+				break;
+			}
+
+			// A batch never mixes encodings, that would lose the ordering between them.
+			const auto encoding = pending.front().response.index();
+			const auto itrLimit = pending.begin() + static_cast<std::ptrdiff_t>(std::min(pending.size(), maxBatchSize));
+			const auto itrEnd = std::find_if(pending.begin(), itrLimit, [encoding](const PendingEntry& entry) noexcept {
+				return entry.response.index() != encoding;
+			});
+
+			batch.assign(std::make_move_iterator(pending.begin()), std::make_move_iterator(itrEnd));
+			pending.erase(pending.begin(), itrEnd);
+		}
+
+		// A batch which cannot be sent is dropped and counted, the loop has to keep going so that
+		// draining is reset and flushAsync is released once pending is empty.
+		bool sent = false;
+
+		try
+		{
+			for (const auto& entry : batch)
+			{
+				queueLatency.recordSince(entry.queued);
+			}
+
+			TransportMessage message;
+
+			if (std::holds_alternative<utf::WideString>(batch.front().response))
+			{
+				message.responses.reserve(batch.size());
+
+				for (auto& entry : batch)
+				{
+					message.responses.push_back(std::move(std::get<utf::WideString>(entry.response)));
+				}
+			}
+			else
+			{
+				cbor::Writer writer { message.cborResponses };
+
+				writer.beginArray(batch.size());
+
+				for (const auto& entry : batch)
+				{
+					writer.writeEncoded(std::get<std::vector<std::uint8_t>>(entry.response));
+				}
+			}
+
+			const auto sendStart = LatencyHistogram::Clock::now();
+			trace::Span sendSpan { "sendBatch" };
+
+			sendSpan.count(static_cast<std::int32_t>(batch.size()));
+
+			co_await sendMessageAsync(*transport, std::move(message));
+
+			sendLatency.recordSince(sendStart);
+			sent = true;
+		}
+		catch (const std::exception&)
+		{
+		}
+		catch (const hresult_error&)
+		{
+		}
+
+		{
+			std::lock_guard lock { mutex };
+
+			if (sent)
+			{
+				++sendStats.sent;
+			}
+			else
+			{
+				++sendStats.failed;
+				sendStats.droppedResponses += batch.size();
+			}
+		}
+
+		// Sent or not, the slot is free, so subscriptions waiting on it can move on.
+		for (const auto& entry : batch)
+		{
+			if (entry.onSent)
+			{
+				entry.onSent();
+			}
+		}
+	}
+}
@@ -0,0 +1,109 @@
+﻿#pragma once
+
+#include "graphqlservice/GraphQLResponse.h"
+
+#include "LatencyHistogram.h"
+#include "MessageTransport.h"
+#include "SharedMemory.h"
+#include "SharedRing.h"
+#include "Utf.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// Coalesces responses for every query and subscription into as few AppService messages as
+// possible, while keeping them in the order they were queued.
+struct ResponseBatcher : winrt::implements<ResponseBatcher, winrt::Windows::Foundation::IInspectable>
+{
+	// Records the serialize, batchQueue and send stages in latency.
+	ResponseBatcher(const std::shared_ptr<MessageTransport>& transport, const std::shared_ptr<LatencyRegistry>& latency);
+
+	void configure(std::chrono::milliseconds window, size_t maxSize);
+	void useBinaryEncoding(bool binary);
+
+	// Large responses can skip the AppService relay through a shared memory ring. The region is
+	// created first so its name can be sent to the client, and only used once the client attaches.
+	// appContainerSid is the client's, if it runs in an app container.
+	std::string createSharedRing(size_t size, size_t threshold, const std::string& appContainerSid);
+	void attachSharedRing();
+	// The client could not open the region, so it is released and everything goes through the relay.
+	void releaseSharedRing(std::string attachError);
+
+	struct SharedRingStats
+	{
+		size_t capacity = 0;
+		size_t used = 0;
+		size_t records = 0;
+		size_t bytes = 0;
+		size_t fallbacks = 0;
+		std::string attachError;
+	};
+
+	SharedRingStats sharedRingStats();
+
+	// Batches which were sent, and the ones which could not be, along with every response in them.
+	struct BatchStats
+	{
+		std::uint64_t sent = 0;
+		std::uint64_t failed = 0;
+		std::uint64_t droppedResponses = 0;
+	};
+
+	BatchStats batchStats();
+
+	void enqueue(const winrt::Windows::Data::Json::JsonObject& response);
+	// onSent runs once the AppService message carrying this response has been delivered, or has
+	// been dropped because it could not be sent.
+	void enqueueFetched(std::wstring_view type, int requestId, const graphql::response::Value& fetched,
+		std::function<void()> onSent = {}, std::wstring_view cache = {});
+	void enqueueFetched(std::wstring_view type, const std::vector<int>& requestIds, const graphql::response::Value& fetched);
+	winrt::Windows::Foundation::IAsyncAction flushAsync();
+
+private:
+	// JSON responses are sent in the "responses" string array, CBOR responses are sent as a
+	// single CBOR array in the "cborResponses" byte array.
+	using PendingResponse = std::variant<utf::WideString, std::vector<std::uint8_t>>;
+
+	struct PendingEntry
+	{
+		PendingResponse response;
+		std::function<void()> onSent;
+		LatencyHistogram::Clock::time_point queued;
+	};
+
+	void enqueue(PendingResponse&& response, std::function<void()> onSent = {});
+	PendingResponse writeSharedRing(PendingResponse&& response);
+	winrt::fire_and_forget drainAsync();
+
+	std::mutex mutex;
+	std::vector<PendingEntry> pending;
+	bool draining = false;
+	std::atomic_bool binaryEncoding { false };
+	std::chrono::milliseconds flushWindow { 0 };
+	size_t maxBatchSize = 64;
+
+	std::optional<shm::SharedMemory> sharedMemory;
+	std::optional<shm::RingWriter> sharedRing;
+	bool sharedRingAttached = false;
+	size_t sharedThreshold = 0;
+	SharedRingStats sharedStats;
+	BatchStats sendStats;
+
+	const std::shared_ptr<LatencyRegistry> latency;
+	LatencyHistogram& serializeLatency;
+	LatencyHistogram& queueLatency;
+	LatencyHistogram& sendLatency;
+
+	winrt::handle flushEvent;
+	winrt::handle idleEvent;
+	std::shared_ptr<MessageTransport> transport;
+};
@@ -0,0 +1,234 @@
+﻿#include "pch.h"
+
+#include "ResultCache.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace graphql;
+
+void ResultCache::configure(std::chrono::milliseconds defaultTtl, size_t maxBytes)
+{
+	std::lock_guard lock { m_mutex };
+
+	m_defaultTtl = defaultTtl;
+	m_maxBytes = maxBytes;
+	evict();
+}
+
+void ResultCache::configureOperation(const std::string& operationName, std::chrono::milliseconds ttl, const std::vector<std::string>& invalidatedBy)
+{
+	std::lock_guard lock { m_mutex };
+
+	m_operationTtls[operationName] = ttl;
+
+	for (const auto& subscriptionName : invalidatedBy)
+	{
+		auto& targets = m_subscriptionTargets[subscriptionName];
+
+		if (std::find(targets.begin(), targets.end(), operationName) == targets.end())
+		{
+			targets.push_back(operationName);
+		}
+	}
+}
+
+bool ResultCache::enabled() const
+{
+	std::lock_guard lock { m_mutex };
+
+	if (m_defaultTtl.count() > 0)
+	{
+		return true;
+	}
+
+	return std::any_of(m_operationTtls.begin(), m_operationTtls.end(), [](const auto& entry) noexcept {
+		return entry.second.count() > 0;
+	});
+}
+
+std::chrono::milliseconds ResultCache::ttl(std::string_view operationName) const
+{
+	std::lock_guard lock { m_mutex };
+	const auto itr = m_operationTtls.find(operationName);
+
+	return (itr == m_operationTtls.end() ? m_defaultTtl : itr->second);
+}
+
+std::uint64_t ResultCache::generation() const
+{
+	std::lock_guard lock { m_mutex };
+
+	return m_generation;
+}
+
+ResultCache::Result ResultCache::find(const Key& key, const peg::ast& ast)
+{
+	std::lock_guard lock { m_mutex };
+	const auto itrIndex = m_index.find(key);
+
+	if (itrIndex == m_index.end())
+	{
+		++m_misses;
+		return nullptr;
+	}
+
+	const auto itrEntry = itrIndex->second;
+
+	// The entry keeps its document alive, so a different root means the document cache parsed the
+	// query again, possibly because another document collided with its hash.
+	if (itrEntry->ast.root != ast.root
+		|| itrEntry->expires <= Clock::now())
+	{
+		if (itrEntry->ast.root == ast.root)
+		{
+			++m_expirations;
+		}
+
+		erase(itrEntry);
+		++m_misses;
+		return nullptr;
+	}
+
+	++m_hits;
+	m_entries.splice(m_entries.begin(), m_entries, itrEntry);
+
+	return itrEntry->result;
+}
+
+void ResultCache::insert(Key key, const peg::ast& ast, response::Value&& result, std::uint64_t generation)
+{
+	const auto ttl = this->ttl(std::get<1>(key));
+
+	if (ttl.count() <= 0)
+	{
+		return;
+	}
+
+	const auto bytes = sizeof(Entry) + std::get<1>(key).size() + std::get<2>(key).size() + estimateBytes(result);
+	std::lock_guard lock { m_mutex };
+
+	if (generation != m_generation)
+	{
+		return;
+	}
+
+	const auto itrIndex = m_index.find(key);
+
+	if (itrIndex != m_index.end())
+	{
+		erase(itrIndex->second);
+	}
+
+	m_entries.push_front({ std::move(key),
+		peg::ast { ast },
+		std::make_shared<const response::Value>(std::move(result)),
+		Clock::now() + ttl,
+		bytes });
+	m_index[m_entries.front().key] = m_entries.begin();
+	m_bytes += bytes;
+	evict();
+}
+
+void ResultCache::invalidate(std::string_view subscriptionName)
+{
+	std::lock_guard lock { m_mutex };
+	const auto itrTargets = m_subscriptionTargets.find(subscriptionName);
+
+	if (itrTargets == m_subscriptionTargets.end())
+	{
+		return;
+	}
+
+	const auto& targets = itrTargets->second;
+
+	++m_generation;
+
+	for (auto itrEntry = m_entries.begin(); itrEntry != m_entries.end();)
+	{
+		const auto itrNext = std::next(itrEntry);
+
+		if (std::find(targets.begin(), targets.end(), std::get<1>(itrEntry->key)) != targets.end())
+		{
+			erase(itrEntry);
+			++m_invalidations;
+		}
+
+		itrEntry = itrNext;
+	}
+}
+
+void ResultCache::clear()
+{
+	std::lock_guard lock { m_mutex };
+
+	++m_generation;
+	m_invalidations += m_entries.size();
+	m_index.clear();
+	m_entries.clear();
+	m_bytes = 0;
+}
+
+ResultCache::Stats ResultCache::stats() const
+{
+	std::lock_guard lock { m_mutex };
+
+	return { m_entries.size(), m_bytes, m_hits, m_misses, m_expirations, m_evictions, m_invalidations };
+}
+
+// Called with the mutex held.
+void ResultCache::erase(EntryList::iterator itrEntry)
+{
+	m_bytes -= itrEntry->bytes;
+	m_index.erase(itrEntry->key);
+	m_entries.erase(itrEntry);
+}
+
+// Called with the mutex held.
+void ResultCache::evict()
+{
+	while (!m_entries.empty()
+		&& m_bytes > m_maxBytes)
+	{
+		erase(std::prev(m_entries.end()));
+		++m_evictions;
+	}
+}
+
+size_t ResultCache::estimateBytes(const response::Value& value)
+{
+	size_t bytes = sizeof(response::Value);
+
+	switch (value.type())
+	{
+		case response::Type::Map:
+			for (const auto& member : value.get<response::MapType>())
+			{
+				bytes += member.first.size() + estimateBytes(member.second);
+			}
+
+			break;
+
+		case response::Type::List:
+			for (const auto& element : value.get<response::ListType>())
+			{
+				bytes += estimateBytes(element);
+			}
+
+			break;
+
+		case response::Type::String:
+		case response::Type::EnumValue:
+			bytes += value.get<response::StringType>().size();
+			break;
+
+		case response::Type::Scalar:
+			bytes += estimateBytes(value.get<response::ScalarType>());
+			break;
+
+		default:
+			break;
+	}
+
+	return bytes;
+}
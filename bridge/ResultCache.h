@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include "graphqlservice/GraphQLParse.h"
+#include "graphqlservice/GraphQLResponse.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// Opt-in cache of resolved query results, keyed by the cached document's hash, the operation name
+// and the canonical variables. Entries expire after their operation's TTL, the least recently used
+// ones are evicted past the byte limit, and events from the subscriptions an operation lists in
+// invalidatedBy drop its entries. Queries resolve on worker threads and subscription events arrive
+// on any thread, so unlike DocumentCache every method takes the lock.
+class ResultCache
+{
+public:
+	using Key = std::tuple<size_t, std::string, std::string>;
+	using Result = std::shared_ptr<const graphql::response::Value>;
+
+	struct Stats
+	{
+		size_t entries;
+		size_t bytes;
+		std::uint64_t hits;
+		std::uint64_t misses;
+		std::uint64_t expirations;
+		std::uint64_t evictions;
+		std::uint64_t invalidations;
+	};
+
+	static constexpr size_t c_defaultMaxBytes = 8 * 1024 * 1024;
+
+	ResultCache() = default;
+
+	void configure(std::chrono::milliseconds defaultTtl, size_t maxBytes);
+	void configureOperation(const std::string& operationName, std::chrono::milliseconds ttl, const std::vector<std::string>& invalidatedBy);
+	bool enabled() const;
+	std::chrono::milliseconds ttl(std::string_view operationName) const;
+
+	// Results resolved before the most recent invalidation are never inserted, so capture the
+	// generation before resolving and pass it back in with the result.
+	std::uint64_t generation() const;
+	Result find(const Key& key, const graphql::peg::ast& ast);
+	void insert(Key key, const graphql::peg::ast& ast, graphql::response::Value&& result, std::uint64_t generation);
+	void invalidate(std::string_view subscriptionName);
+	void clear();
+	Stats stats() const;
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Entry
+	{
+		Key key;
+		graphql::peg::ast ast;
+		Result result;
+		Clock::time_point expires;
+		size_t bytes;
+	};
+
+	using EntryList = std::list<Entry>;
+
+	void erase(EntryList::iterator itrEntry);
+	void evict();
+
+	static size_t estimateBytes(const graphql::response::Value& value);
+
+	mutable std::mutex m_mutex;
+	std::chrono::milliseconds m_defaultTtl { 0 };
+	size_t m_maxBytes = c_defaultMaxBytes;
+	std::map<std::string, std::chrono::milliseconds, std::less<>> m_operationTtls;
+	// Subscription operation name to the query operations its events invalidate.
+	std::map<std::string, std::vector<std::string>, std::less<>> m_subscriptionTargets;
+	size_t m_bytes = 0;
+	std::uint64_t m_generation = 0;
+	std::uint64_t m_hits = 0;
+	std::uint64_t m_misses = 0;
+	std::uint64_t m_expirations = 0;
+	std::uint64_t m_evictions = 0;
+	std::uint64_t m_invalidations = 0;
+
+	EntryList m_entries;
+	std::map<Key, EntryList::iterator> m_index;
+};
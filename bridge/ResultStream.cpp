@@ -0,0 +1,136 @@
+﻿#include "pch.h"
+
+#include "ResultStream.h"
+
+#include "JsonPatch.h"
+
+#include "graphqlservice/GraphQLService.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+void ResultStream::send(const winrt::com_ptr<ResponseBatcher>& batcher, int requestId, response::Value&& document, size_t chunkSize,
+	std::wstring_view cacheStatus)
+{
+	std::shared_ptr<ResultStream> stream { new ResultStream { batcher, requestId, cacheStatus } };
+
+	if (chunkSize > 0
+		&& document.type() == response::Type::Map)
+	{
+		auto members = document.release<response::MapType>();
+
+		for (auto& member : members)
+		{
+			if (member.first == service::strData)
+			{
+				std::string path { "/data"s };
+
+				stream->split(path, member.second, chunkSize);
+			}
+		}
+
+		document.set<response::MapType>(std::move(members));
+	}
+
+	if (stream->m_chunks.empty())
+	{
+		batcher->enqueueFetched(L"complete"sv, requestId, document, {}, cacheStatus);
+		return;
+	}
+
+	batcher->enqueueFetched(L"next"sv, requestId, document, [stream]() {
+		stream->sendNext();
+	});
+}
+
+ResultStream::ResultStream(const winrt::com_ptr<ResponseBatcher>& batcher, int requestId, std::wstring_view cacheStatus) noexcept
+	: m_batcher { batcher }
+	, m_requestId { requestId }
+	, m_cacheStatus { cacheStatus }
+{
+}
+
+// Lists inside the items kept in the first chunk are split as well, lists inside the items which are
+// held back travel whole with their item.
+void ResultStream::split(std::string& path, response::Value& value, size_t chunkSize)
+{
+	const auto length = path.size();
+
+	switch (value.type())
+	{
+		case response::Type::Map:
+		{
+			auto members = value.release<response::MapType>();
+
+			for (auto& member : members)
+			{
+				JsonPatch::appendToken(path, member.first);
+				split(path, member.second, chunkSize);
+				path.resize(length);
+			}
+
+			value.set<response::MapType>(std::move(members));
+			break;
+		}
+
+		case response::Type::List:
+		{
+			auto items = value.release<response::ListType>();
+			const auto kept = std::min(items.size(), chunkSize);
+
+			for (size_t i = 0; i < kept; ++i)
+			{
+				JsonPatch::appendToken(path, std::to_string(i));
+				split(path, items[i], chunkSize);
+				path.resize(length);
+			}
+
+			for (auto offset = kept; offset < items.size(); offset += chunkSize)
+			{
+				const auto itrFirst = items.begin() + static_cast<std::ptrdiff_t>(offset);
+				const auto itrLast = itrFirst + static_cast<std::ptrdiff_t>(std::min(chunkSize, items.size() - offset));
+				response::Value chunkItems { response::Type::List };
+				response::Value chunk { response::Type::Map };
+
+				chunkItems.reserve(static_cast<size_t>(itrLast - itrFirst));
+
+				for (auto itr = itrFirst; itr != itrLast; ++itr)
+				{
+					chunkItems.emplace_back(std::move(*itr));
+				}
+
+				chunk.reserve(2);
+				chunk.emplace_back("path"s, response::Value { std::string { path } });
+				chunk.emplace_back("items"s, std::move(chunkItems));
+				m_chunks.push_back(std::move(chunk));
+			}
+
+			items.resize(kept);
+			value.set<response::ListType>(std::move(items));
+			break;
+		}
+
+		default:
+			break;
+	}
+}
+
+void ResultStream::sendNext()
+{
+	if (m_sent == m_chunks.size())
+	{
+		m_batcher->enqueueFetched(L"complete"sv, m_requestId, response::Value {}, {}, m_cacheStatus);
+		m_chunks.clear();
+		return;
+	}
+
+	const auto& chunk = m_chunks[m_sent++];
+
+	m_batcher->enqueueFetched(L"nextItems"sv, m_requestId, chunk, [stream = shared_from_this()]() {
+		stream->sendNext();
+	});
+}
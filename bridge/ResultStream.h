@@ -0,0 +1,35 @@
+﻿#pragma once
+
+#include "graphqlservice/GraphQLResponse.h"
+
+#include "ResponseBatcher.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Sends a query or mutation result in pieces, so the client can show the start of a long list while
+// the rest is still on its way. Every list under "data" which is longer than the chunk size keeps its
+// first chunk in a "next" payload, and the remaining items follow in "nextItems" payloads with the
+// JSON Pointer of the list they extend. Each piece is queued once the previous one has been sent, so
+// the pieces travel in separate messages and responses to other requests can go out between them.
+// The "complete" payload at the end carries no result, the client has merged it by then.
+class ResultStream : public std::enable_shared_from_this<ResultStream>
+{
+public:
+	static void send(const winrt::com_ptr<ResponseBatcher>& batcher, int requestId, graphql::response::Value&& document, size_t chunkSize,
+		std::wstring_view cacheStatus);
+
+private:
+	ResultStream(const winrt::com_ptr<ResponseBatcher>& batcher, int requestId, std::wstring_view cacheStatus) noexcept;
+
+	void split(std::string& path, graphql::response::Value& value, size_t chunkSize);
+	void sendNext();
+
+	const winrt::com_ptr<ResponseBatcher> m_batcher;
+	const int m_requestId;
+	const std::wstring_view m_cacheStatus;
+	std::vector<graphql::response::Value> m_chunks;
+	size_t m_sent = 0;
+};
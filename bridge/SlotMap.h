@@ -0,0 +1,153 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Contiguous table of values addressed by a slot index plus a generation counter. Keys are
+// positive 32-bit integers which are never handed out twice: a slot whose generation counter
+// runs out is retired instead of being recycled.
+template <typename T>
+class SlotMap
+{
+public:
+	using Key = std::int32_t;
+
+	static constexpr unsigned c_indexBits = 20;
+	static constexpr std::uint32_t c_maxSlots = 1U << c_indexBits;
+	static constexpr std::uint32_t c_maxGeneration = (1U << (31 - c_indexBits)) - 1;
+
+	Key insert(T&& value)
+	{
+		std::uint32_t index;
+
+		if (m_free.empty())
+		{
+			if (m_slots.size() >= c_maxSlots)
+			{
+				throw std::runtime_error("Too many live entries");
+			}
+
+			index = static_cast<std::uint32_t>(m_slots.size());
+			m_slots.emplace_back();
+		}
+		else
+		{
+			index = m_free.back();
+			m_free.pop_back();
+		}
+
+		auto& slot = m_slots[index];
+
+		slot.value.emplace(std::move(value));
+		++m_size;
+
+		return makeKey(index, slot.generation);
+	}
+
+	T* find(Key key) noexcept
+	{
+		const auto slot = findSlot(key);
+
+		return slot ? &*slot->value : nullptr;
+	}
+
+	bool erase(Key key)
+	{
+		const auto slot = findSlot(key);
+
+		if (!slot)
+		{
+			return false;
+		}
+
+		release(static_cast<std::uint32_t>(slot - m_slots.data()));
+
+		return true;
+	}
+
+	template <typename Visitor>
+	void forEach(Visitor&& visitor)
+	{
+		for (auto& slot : m_slots)
+		{
+			if (slot.value)
+			{
+				visitor(*slot.value);
+			}
+		}
+	}
+
+	void clear()
+	{
+		for (std::uint32_t index = 0; index < m_slots.size(); ++index)
+		{
+			if (m_slots[index].value)
+			{
+				release(index);
+			}
+		}
+	}
+
+	size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	bool empty() const noexcept
+	{
+		return m_size == 0;
+	}
+
+private:
+	struct Slot
+	{
+		std::optional<T> value;
+		std::uint32_t generation = 1;
+	};
+
+	static Key makeKey(std::uint32_t index, std::uint32_t generation) noexcept
+	{
+		return static_cast<Key>((generation << c_indexBits) | index);
+	}
+
+	Slot* findSlot(Key key) noexcept
+	{
+		if (key <= 0)
+		{
+			return nullptr;
+		}
+
+		const auto bits = static_cast<std::uint32_t>(key);
+		const auto index = bits & (c_maxSlots - 1);
+
+		if (index >= m_slots.size())
+		{
+			return nullptr;
+		}
+
+		auto& slot = m_slots[index];
+
+		return (slot.value && slot.generation == (bits >> c_indexBits)) ? &slot : nullptr;
+	}
+
+	void release(std::uint32_t index)
+	{
+		auto& slot = m_slots[index];
+
+		slot.value.reset();
+		--m_size;
+
+		if (slot.generation < c_maxGeneration)
+		{
+			++slot.generation;
+			m_free.push_back(index);
+		}
+	}
+
+	std::vector<Slot> m_slots;
+	std::vector<std::uint32_t> m_free;
+	size_t m_size = 0;
+};
@@ -0,0 +1,149 @@
+﻿#include "WorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(size_t threadCount, size_t queueLimit,
+	std::function<void()> onThreadStart, std::function<void()> onThreadStop)
+	: m_queueLimit { std::max<size_t>(queueLimit, 1) }
+	, m_onThreadStart { std::move(onThreadStart) }
+	, m_onThreadStop { std::move(onThreadStop) }
+{
+	threadCount = std::max<size_t>(threadCount, 1);
+	m_threads.reserve(threadCount);
+
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		m_threads.emplace_back(&WorkerPool::run, this);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard lock { m_mutex };
+
+		m_stopping = true;
+	}
+
+	m_wakeWorker.notify_all();
+
+	// Anything already queued still runs before the workers exit.
+	for (auto& thread : m_threads)
+	{
+		thread.join();
+	}
+}
+
+bool WorkerPool::post(Task&& task, Priority priority)
+{
+	{
+		std::lock_guard lock { m_mutex };
+
+		if (m_stopping
+			|| m_queued >= m_queueLimit)
+		{
+			++m_rejected;
+			return false;
+		}
+
+		const auto index = static_cast<size_t>(priority);
+
+		m_queues[index].push_back({ std::move(task), Clock::now() });
+		++m_classStats[index].queued;
+		++m_queued;
+		m_maxQueued = std::max(m_maxQueued, m_queued);
+	}
+
+	m_wakeWorker.notify_one();
+
+	return true;
+}
+
+WorkerPool::Stats WorkerPool::stats() const
+{
+	std::lock_guard lock { m_mutex };
+
+	return { m_threads.size(), m_queued, m_maxQueued, m_running, m_completed, m_rejected, m_classStats };
+}
+
+// Only the oldest task in each class can be next, so this compares at most one task per class.
+size_t WorkerPool::nextClass() const noexcept
+{
+	size_t next = c_priorityCount;
+	Clock::time_point nextRank;
+
+	for (size_t index = 0; index < c_priorityCount; ++index)
+	{
+		if (m_queues[index].empty())
+		{
+			continue;
+		}
+
+		const auto rank = m_queues[index].front().posted + c_agingStep * static_cast<int>(index);
+
+		// Ties go to the higher class.
+		if (next == c_priorityCount
+			|| rank < nextRank)
+		{
+			next = index;
+			nextRank = rank;
+		}
+	}
+
+	return next;
+}
+
+void WorkerPool::run()
+{
+	if (m_onThreadStart)
+	{
+		m_onThreadStart();
+	}
+
+	std::unique_lock lock { m_mutex };
+
+	for (;;)
+	{
+		m_wakeWorker.wait(lock, [this]() noexcept {
+			return m_stopping || m_queued > 0;
+		});
+
+		if (m_queued == 0)
+		{
+			break;
+		}
+
+		const auto index = nextClass();
+		auto& queue = m_queues[index];
+		auto task = std::move(queue.front().task);
+
+		queue.pop_front();
+		--m_queued;
+		--m_classStats[index].queued;
+
+		if (std::any_of(m_queues.begin(), m_queues.begin() + index, [](const auto& higher) noexcept {
+				return !higher.empty();
+			}))
+		{
+			++m_classStats[index].promoted;
+		}
+
+		++m_running;
+		lock.unlock();
+
+		// Exceptions are captured in the task's future, the task reports its own errors.
+		task();
+
+		lock.lock();
+		--m_running;
+		++m_completed;
+		++m_classStats[index].completed;
+	}
+
+	lock.unlock();
+
+	if (m_onThreadStop)
+	{
+		m_onThreadStop();
+	}
+}
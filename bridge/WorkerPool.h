@@ -0,0 +1,89 @@
+﻿#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads draining a bounded queue, so slow resolvers run off the
+// dispatcher thread without spawning an unbounded number of threads. Each priority class has its own
+// FIFO queue. Workers take the task with the earliest post time, after adding c_agingStep for each
+// class below interactive, so a background task goes ahead of any interactive task posted more than
+// two steps after it and a steady stream of interactive work cannot starve the rest.
+class WorkerPool
+{
+public:
+	using Task = std::packaged_task<void()>;
+	using Clock = std::chrono::steady_clock;
+
+	enum class Priority
+	{
+		Interactive,
+		Normal,
+		Background,
+	};
+
+	static constexpr size_t c_priorityCount = 3;
+	static constexpr std::chrono::milliseconds c_agingStep { 100 };
+
+	struct ClassStats
+	{
+		size_t queued;
+		std::uint64_t completed;
+		// Taken ahead of a higher class which had work waiting, because it had aged past it.
+		std::uint64_t promoted;
+	};
+
+	struct Stats
+	{
+		size_t threads;
+		size_t queued;
+		size_t maxQueued;
+		size_t running;
+		std::uint64_t completed;
+		std::uint64_t rejected;
+		std::array<ClassStats, c_priorityCount> classes;
+	};
+
+	explicit WorkerPool(size_t threadCount, size_t queueLimit,
+		std::function<void()> onThreadStart = {}, std::function<void()> onThreadStop = {});
+	~WorkerPool();
+
+	// The queue limit covers every class together.
+	bool post(Task&& task, Priority priority = Priority::Normal);
+	Stats stats() const;
+
+private:
+	struct Entry
+	{
+		Task task;
+		Clock::time_point posted;
+	};
+
+	void run();
+	size_t nextClass() const noexcept;
+
+	const size_t m_queueLimit;
+	const std::function<void()> m_onThreadStart;
+	const std::function<void()> m_onThreadStop;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_wakeWorker;
+	std::array<std::deque<Entry>, c_priorityCount> m_queues;
+	size_t m_queued = 0;
+	bool m_stopping = false;
+	size_t m_maxQueued = 0;
+	size_t m_running = 0;
+	std::uint64_t m_completed = 0;
+	std::uint64_t m_rejected = 0;
+	std::array<ClassStats, c_priorityCount> m_classStats {};
+
+	std::vector<std::thread> m_threads;
+};
@@ -1,18 +1,42 @@
 ﻿#include "pch.h"
 
+#include "AppServiceTransport.h"
+#include "DocumentCache.h"
+#include "JsonPatch.h"
+#include "LatencyJson.h"
 #include "MAPIGraphQL.h"
+#include "PersistedQueryStore.h"
+#include "RequestEnvelope.h"
+#include "ResponseBatcher.h"
+#include "ResultCache.h"
+#include "ResultStream.h"
+#include "SlotMap.h"
+#include "StartupTimeline.h"
+#include "TimerWheel.h"
+#include "TraceWriter.h"
+#include "Utf.h"
+#include "WorkerPool.h"
 #include "graphqlservice/JSONResponse.h"
 
 #include <windows.h>
 #include <DispatcherQueue.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string_view>
+#include <tuple>
+#include <vector>
 
 using namespace graphql;
 
@@ -21,28 +45,58 @@ using namespace Windows::ApplicationModel::AppService;
 using namespace Windows::Data::Json;
 using namespace Windows::Foundation;
 using namespace Windows::Foundation::Collections;
+using namespace Windows::Storage;
 using namespace Windows::System;
 
 using namespace std::literals;
 
+// Totals across every subscription, reported in the stats response.
+struct SubscriptionStats
+{
+	std::atomic<std::uint64_t> conflated { 0 };
+	std::atomic<std::uint64_t> dropped { 0 };
+	std::atomic<std::uint64_t> shared { 0 };
+};
+
+class SubscriptionGroup;
+
 struct SubscriptionPayloadQueue : implements<SubscriptionPayloadQueue, Windows::Foundation::IInspectable>
 {
-	explicit SubscriptionPayloadQueue(const AppServiceConnection& serviceConnection, int requestId) noexcept;
+	explicit SubscriptionPayloadQueue(const com_ptr<ResponseBatcher>& batcher, int requestId) noexcept;
 	~SubscriptionPayloadQueue();
 
-	fire_and_forget sendResponse(const JsonObject& responses);
+	void sendResponse(std::wstring_view type, response::Value&& payload);
 	void Unsubscribe();
 
 	const int requestId;
-	bool registered = false;
-	std::optional<service::SubscriptionKey> key;
-	std::weak_ptr<service::Request> wpService;
+	std::shared_ptr<SubscriptionGroup> group;
 
-	AppServiceConnection serviceConnection;
+	// In delta mode every "next" payload after the first is sent as a "nextPatch" against the
+	// previous one, with a full snapshot every resyncInterval payloads.
+	bool deltaPayloads = false;
+	size_t resyncInterval = 0;
+
+	// With conflation, only one "next" payload is in flight at a time and at most maxPending newer
+	// ones wait behind it. When another one arrives the oldest waiting payload is discarded, so a
+	// slow client skips intermediate states instead of falling further behind.
+	size_t maxPending = 0;
+	std::shared_ptr<SubscriptionStats> stats;
+
+	com_ptr<ResponseBatcher> batcher;
+
+private:
+	void deliver(std::wstring_view type, response::Value&& payload);
+	void onSent();
+
+	std::mutex mutex;
+	std::optional<response::Value> lastPayload;
+	size_t patchesSinceSnapshot = 0;
+	bool inFlight = false;
+	std::deque<response::Value> pending;
 };
 
-SubscriptionPayloadQueue::SubscriptionPayloadQueue(const AppServiceConnection& serviceConnection, int requestId) noexcept
-	: serviceConnection { serviceConnection }
+SubscriptionPayloadQueue::SubscriptionPayloadQueue(const com_ptr<ResponseBatcher>& batcher, int requestId) noexcept
+	: batcher { batcher }
 	, requestId { requestId }
 {
 }
@@ -52,31 +106,220 @@ SubscriptionPayloadQueue::~SubscriptionPayloadQueue()
 	Unsubscribe();
 }
 
-fire_and_forget SubscriptionPayloadQueue::sendResponse(const JsonObject& response)
+void SubscriptionPayloadQueue::sendResponse(std::wstring_view type, response::Value&& payload)
 {
-	response.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+	if (type != L"next"sv
+		|| (!deltaPayloads && maxPending == 0))
+	{
+		batcher->enqueueFetched(type, requestId, payload);
+		return;
+	}
+
+	std::lock_guard lock { mutex };
 
-	ValueSet responseMessage;
+	if (maxPending > 0
+		&& inFlight)
+	{
+		if (pending.size() >= maxPending)
+		{
+			pending.pop_front();
+			++stats->conflated;
+		}
 
-	responseMessage.Insert(L"responses", PropertyValue::CreateStringArray({
-		response.ToString()
-		}));
+		pending.push_back(std::move(payload));
+		return;
+	}
 
-	co_await serviceConnection.SendMessageAsync(responseMessage);
+	deliver(type, std::move(payload));
 }
 
-void SubscriptionPayloadQueue::Unsubscribe()
+// Called with the mutex held.
+void SubscriptionPayloadQueue::deliver(std::wstring_view type, response::Value&& payload)
+{
+	std::function<void()> sent;
+
+	if (maxPending > 0)
+	{
+		inFlight = true;
+		sent = [weak_queue { get_weak() }]() {
+			if (const auto queue { weak_queue.get() })
+			{
+				queue->onSent();
+			}
+		};
+	}
+
+	if (!deltaPayloads)
+	{
+		batcher->enqueueFetched(type, requestId, payload, std::move(sent));
+		return;
+	}
+
+	if (lastPayload
+		&& patchesSinceSnapshot < resyncInterval)
+	{
+		++patchesSinceSnapshot;
+		batcher->enqueueFetched(L"nextPatch"sv, requestId, JsonPatch::diff(*lastPayload, payload), std::move(sent));
+	}
+	else
+	{
+		patchesSinceSnapshot = 0;
+		batcher->enqueueFetched(type, requestId, payload, std::move(sent));
+	}
+
+	lastPayload = std::move(payload);
+}
+
+void SubscriptionPayloadQueue::onSent()
 {
-	if (!registered)
+	std::lock_guard lock { mutex };
+
+	if (pending.empty())
 	{
+		inFlight = false;
 		return;
 	}
 
-	registered = false;
+	auto payload { std::move(pending.front()) };
+
+	pending.pop_front();
+	deliver(L"next"sv, std::move(payload));
+}
+
+// Subscriptions to the same cached document, operation and variables share one upstream
+// subscription. Each event is resolved once, members without delta or conflation options get it in
+// a single response addressed to all of their requestIds, and the rest get their own copy.
+class SubscriptionGroup
+{
+public:
+	SubscriptionGroup(const com_ptr<ResponseBatcher>& batcher, const std::shared_ptr<ResultCache>& resultCache, std::string operationName) noexcept;
+	~SubscriptionGroup();
+
+	void subscribe(const std::shared_ptr<service::Request>& service, service::SubscriptionKey key);
+	bool add(const com_ptr<SubscriptionPayloadQueue>& member);
+	void remove(int requestId);
+	void deliver(response::Value&& payload);
+
+private:
+	void unsubscribe(std::unique_lock<std::mutex>& lock);
+
+	std::mutex mutex;
+	std::vector<std::pair<int, weak_ref<SubscriptionPayloadQueue>>> members;
+	bool closed = false;
+	std::optional<service::SubscriptionKey> key;
+	std::weak_ptr<service::Request> wpService;
+	com_ptr<ResponseBatcher> batcher;
+	std::shared_ptr<ResultCache> resultCache;
+	const std::string operationName;
+};
+
+SubscriptionGroup::SubscriptionGroup(const com_ptr<ResponseBatcher>& batcher, const std::shared_ptr<ResultCache>& resultCache, std::string operationName) noexcept
+	: batcher { batcher }
+	, resultCache { resultCache }
+	, operationName { std::move(operationName) }
+{
+}
+
+SubscriptionGroup::~SubscriptionGroup()
+{
+	std::unique_lock lock { mutex };
+
+	unsubscribe(lock);
+}
+
+void SubscriptionGroup::subscribe(const std::shared_ptr<service::Request>& service, service::SubscriptionKey subscriptionKey)
+{
+	std::lock_guard lock { mutex };
+
+	key = std::make_optional(subscriptionKey);
+	wpService = service;
+}
+
+bool SubscriptionGroup::add(const com_ptr<SubscriptionPayloadQueue>& member)
+{
+	std::lock_guard lock { mutex };
+
+	if (closed)
+	{
+		return false;
+	}
+
+	members.emplace_back(member->requestId, member->get_weak());
+	return true;
+}
+
+void SubscriptionGroup::remove(int requestId)
+{
+	std::unique_lock lock { mutex };
+
+	members.erase(std::remove_if(members.begin(), members.end(), [requestId](const auto& member) noexcept {
+		return member.first == requestId;
+	}), members.end());
+
+	if (members.empty())
+	{
+		unsubscribe(lock);
+	}
+}
+
+void SubscriptionGroup::deliver(response::Value&& payload)
+{
+	// Drop cached results this event makes stale before anyone hears about it and queries again.
+	resultCache->invalidate(operationName);
+
+	std::vector<int> sharedIds;
+	std::vector<com_ptr<SubscriptionPayloadQueue>> individual;
+
+	{
+		std::lock_guard lock { mutex };
+
+		for (const auto& member : members)
+		{
+			auto queue { member.second.get() };
+
+			if (!queue)
+			{
+				continue;
+			}
+
+			if (queue->deltaPayloads
+				|| queue->maxPending > 0)
+			{
+				individual.push_back(std::move(queue));
+			}
+			else
+			{
+				sharedIds.push_back(member.first);
+			}
+		}
+	}
+
+	if (sharedIds.size() == 1)
+	{
+		batcher->enqueueFetched(L"next"sv, sharedIds.front(), payload);
+	}
+	else if (!sharedIds.empty())
+	{
+		batcher->enqueueFetched(L"next"sv, sharedIds, payload);
+	}
+
+	for (const auto& queue : individual)
+	{
+		queue->sendResponse(L"next"sv, response::Value { payload });
+	}
+}
+
+// Called with the mutex held, which is released before calling back into the service.
+void SubscriptionGroup::unsubscribe(std::unique_lock<std::mutex>& lock)
+{
+	closed = true;
 
 	auto deferUnsubscribe { std::move(key) };
 	auto serviceSingleton { wpService.lock() };
 
+	key.reset();
+	lock.unlock();
+
 	if (deferUnsubscribe
 		&& serviceSingleton)
 	{
@@ -84,6 +327,133 @@ void SubscriptionPayloadQueue::Unsubscribe()
 	}
 }
 
+void SubscriptionPayloadQueue::Unsubscribe()
+{
+	if (!group)
+	{
+		return;
+	}
+
+	const auto leaving { std::move(group) };
+
+	group.reset();
+
+	{
+		std::lock_guard lock { mutex };
+
+		if (stats)
+		{
+			stats->dropped += pending.size();
+		}
+
+		pending.clear();
+	}
+
+	leaving->remove(requestId);
+}
+
+// Lets a cancel request or a deadline stop a query or mutation which is still waiting for a worker,
+// or drop its result if the resolvers are already running, on a worker or inline on the dispatcher.
+// They have no way to stop part way through.
+struct FetchCancellation
+{
+	enum class State
+	{
+		Queued,
+		Resolving,
+		Finished,
+		Cancelled,
+		TimedOut,
+	};
+
+	explicit FetchCancellation(const LatencyHistogram& operationLatency) noexcept
+		: operationLatency { operationLatency }
+	{
+	}
+
+	// The worker calls these in turn, each returns false if the fetch was cancelled first.
+	bool start() noexcept
+	{
+		return advance(State::Queued, State::Resolving);
+	}
+
+	bool finish() noexcept
+	{
+		return advance(State::Resolving, State::Finished);
+	}
+
+	// These return the state the fetch was in when it was stopped, or the state it had already reached
+	// (Finished, Cancelled or TimedOut) if it was too late.
+	State cancel() noexcept
+	{
+		return stop(State::Cancelled);
+	}
+
+	State timeOut() noexcept
+	{
+		return stop(State::TimedOut);
+	}
+
+	// True once the fetch has finished or been stopped, and there is nothing left to cancel.
+	bool done() const noexcept
+	{
+		const auto current = state.load();
+
+		return current != State::Queued
+			&& current != State::Resolving;
+	}
+
+	// How long this operation usually takes to resolve, which is what cancelling it while queued saves.
+	const LatencyHistogram& operationLatency;
+
+private:
+	bool advance(State from, State to) noexcept
+	{
+		return state.compare_exchange_strong(from, to);
+	}
+
+	State stop(State reason) noexcept
+	{
+		auto current = state.load();
+
+		while ((current == State::Queued || current == State::Resolving)
+			&& !state.compare_exchange_weak(current, reason))
+		{
+		}
+
+		return current;
+	}
+
+	std::atomic<State> state { State::Queued };
+};
+
+// Requests which ran out of time, by how far they got: "expired" before the bridge read them,
+// "queued" waiting for a worker, and "resolving" while the resolvers ran.
+struct TimeoutStats
+{
+	std::atomic<std::uint64_t> expired { 0 };
+	std::atomic<std::uint64_t> queued { 0 };
+	std::atomic<std::uint64_t> resolving { 0 };
+};
+
+// Totals for the cancel requests the bridge has handled, by what each one stopped.
+struct CancellationStats
+{
+	std::uint64_t queued = 0;
+	std::uint64_t resolving = 0;
+	std::uint64_t subscriptions = 0;
+	std::uint64_t late = 0;
+};
+
+struct QueryEntry
+{
+	peg::ast ast;
+	com_ptr<SubscriptionPayloadQueue> subscription;
+	size_t documentHash;
+	// Every query or mutation for this query which is waiting for or running on a worker.
+	std::vector<std::shared_ptr<FetchCancellation>> fetches;
+};
+
 class Service : public implements<Service, Windows::Foundation::IInspectable>
 {
 public:
@@ -92,52 +462,140 @@ public:
 	fire_and_forget run();
 
 private:
-	void startService(const JsonObject& request);
+	void openService(bool useDefaultProfile);
+	void startService(int requestId, const JsonObject& request);
 	void stopService(JsonObject& response);
-	void parseQuery(const JsonObject& request, JsonObject& response);
-	void discardQuery(const JsonObject& request);
-	IAsyncAction fetchQuery(int requestId, const JsonObject& request);
-	void unsubscribe(const JsonObject& request);
-
-	IAsyncAction onRequestReceived(const AppServiceConnection& sender, const AppServiceRequestReceivedEventArgs& args);
+	void parseQuery(const RequestEnvelope& request, JsonObject& response);
+	void discardQuery(const RequestEnvelope& request);
+	IAsyncAction fetchQuery(int requestId, RequestEnvelope& request);
+	void unsubscribe(const RequestEnvelope& request);
+	void cancel(const RequestEnvelope& request, JsonObject& response);
+	void getStats(const RequestEnvelope& request, JsonObject& response);
+
+	IAsyncAction onMessageReceived(TransportMessage message, MessageTransport::Completion done);
+	IAsyncOperation<bool> processRequestsAsync(std::vector<utf::WideString> requests);
 	void onServiceClosed(const AppServiceConnection& sender, const AppServiceClosedEventArgs& reason);
 
-	IAsyncAction sendResponse(int requestId, const JsonObject& response);
-	static JsonObject convertFetchedPayload(std::wstring_view type, std::future<response::Value>&& payload);
+	// How a query or mutation result interacts with the result cache once it is resolved.
+	struct CachePlan
+	{
+		std::optional<ResultCache::Key> key;
+		std::wstring_view status;
+		std::uint64_t generation;
+		bool invalidate;
+	};
+
+	void sendResponse(int requestId, const JsonObject& response);
+	static void completeFetch(const com_ptr<ResponseBatcher>& batcher, ResultCache& resultCache, int requestId, const peg::ast& ast,
+		CachePlan&& cachePlan, size_t streamChunkSize, bool deliver, response::Value&& document);
+	static response::Value convertFetchedPayload(std::future<response::Value>&& payload);
+	static std::chrono::milliseconds untilDeadline(double deadline) noexcept;
+	static bool pastDeadline(double deadline) noexcept;
+	static void sendTimeout(const com_ptr<ResponseBatcher>& batcher, TimeoutStats& stats, int requestId, std::wstring_view stage);
+	static WorkerPool::Priority parsePriority(std::wstring_view name);
+	void scheduleDeadline(int requestId, const std::shared_ptr<FetchCancellation>& fetch, double deadline);
+	fire_and_forget expireDeadlinesAsync();
+	static std::string canonicalVariables(const response::Value& variables);
+	static response::Value sortedCopy(const response::Value& value);
+	static int salvageRequestId(std::wstring_view request);
 	static std::string ConvertToUTF8(std::wstring_view value);
 	static std::wstring ConvertToUTF16(std::string_view value);
 
 	std::shared_ptr<service::Request> serviceSingleton;
+	std::optional<bool> serviceProfile;
+	StartupTimeline startup;
+
+	// Durations of each stage a request goes through, and of resolving each operation by name.
+	std::shared_ptr<LatencyRegistry> latency { std::make_shared<LatencyRegistry>() };
+	LatencyRegistry operationLatency;
+
+	std::shared_ptr<SubscriptionStats> subscriptionStats { std::make_shared<SubscriptionStats>() };
+	CancellationStats cancellationStats;
+	std::shared_ptr<TimeoutStats> timeoutStats { std::make_shared<TimeoutStats>() };
+
+	// Indexed by WorkerPool::Priority. The time each class waits for a worker is its own latency stage.
+	static constexpr std::array c_priorityNames { L"interactive"sv, L"normal"sv, L"background"sv };
+	static constexpr std::array c_priorityQueueStages { L"workerQueue.interactive"sv, L"workerQueue.normal"sv, L"workerQueue.background"sv };
+
+	// Deadlines of the queries and mutations on the worker pool, ticked while any are pending.
+	struct PendingDeadline
+	{
+		std::weak_ptr<FetchCancellation> fetch;
+		int requestId;
+	};
+
+	std::mutex deadlineMutex;
+	TimerWheel<PendingDeadline> deadlines;
+	bool expiringDeadlines = false;
 
 	DispatcherQueue dispatcherQueue;
 	handle shutdownEvent;
 	AppServiceConnection serviceConnection;
+	std::shared_ptr<AppServiceTransport> transport;
+	com_ptr<ResponseBatcher> responseBatcher;
+	DocumentCache documentCache;
+	std::shared_ptr<ResultCache> resultCache { std::make_shared<ResultCache>() };
+	PersistedQueryStore persistedQueries;
+	std::unique_ptr<WorkerPool> workerPool;
+
+	SlotMap<QueryEntry> queryMap;
 
-	std::map<int, peg::ast> queryMap;
-	std::map<int, com_ptr<SubscriptionPayloadQueue>> subscriptionMap;
+	// Keyed by the cached document's root node, which stays put for as long as a group holds a
+	// copy of its ast, the operation name and the canonical JSON for the variables.
+	using SubscriptionGroupKey = std::tuple<const void*, std::string, std::string>;
+
+	std::map<SubscriptionGroupKey, std::weak_ptr<SubscriptionGroup>> subscriptionGroups;
 };
 
 Service::Service(const DispatcherQueueController& controller)
 	: dispatcherQueue { controller.DispatcherQueue() }
+	, persistedQueries { std::filesystem::path { std::wstring_view { ApplicationData::Current().LocalCacheFolder().Path() } } / L"persistedQueries.json" }
 {
 	serviceConnection.AppServiceName(L"gqlmapi.bridge");
 	serviceConnection.PackageFamilyName(L"a7012456-f540-4a9d-8203-e902b637742f_rs2j33705jmqp");
+	transport = std::make_shared<AppServiceTransport>(serviceConnection);
+	responseBatcher = make_self<ResponseBatcher>(transport, latency);
+	startup.mark(L"processStarted"sv);
 }
 
-IAsyncAction Service::sendResponse(int requestId, const JsonObject& response)
+void Service::sendResponse(int requestId, const JsonObject& response)
 {
 	response.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
 
-	ValueSet responseMessage;
+	responseBatcher->enqueue(response);
+}
+
+void Service::completeFetch(const com_ptr<ResponseBatcher>& batcher, ResultCache& resultCache, int requestId, const peg::ast& ast,
+	CachePlan&& cachePlan, size_t streamChunkSize, bool deliver, response::Value&& document)
+{
+	// Results with errors are not worth keeping, the next fetch might succeed.
+	const bool cacheable = (cachePlan.key
+		&& document.find("errors"sv) == document.end());
 
-	responseMessage.Insert(L"responses", PropertyValue::CreateStringArray({
-		response.ToString(),
-		}));
+	// A fetch which was cancelled while it resolved is not sent, but its result can still be cached.
+	if (deliver
+		&& streamChunkSize > 0)
+	{
+		// Streaming takes the document apart, so the cache gets its own copy.
+		ResultStream::send(batcher, requestId, cacheable ? response::Value { document } : std::move(document), streamChunkSize, cachePlan.status);
+	}
+	else if (deliver)
+	{
+		batcher->enqueueFetched(L"complete"sv, requestId, document, {}, cachePlan.status);
+	}
 
-	co_await serviceConnection.SendMessageAsync(responseMessage);
+	if (cacheable)
+	{
+		resultCache.insert(std::move(*cachePlan.key), ast, std::move(document), cachePlan.generation);
+	}
+	else if (cachePlan.invalidate)
+	{
+		// A mutation can change anything a cached query returned.
+		resultCache.clear();
+	}
 }
 
-JsonObject Service::convertFetchedPayload(std::wstring_view type, std::future<response::Value>&& payload)
+response::Value Service::convertFetchedPayload(std::future<response::Value>&& payload)
 {
 	response::Value document { response::Type::Map };
 
@@ -161,56 +619,208 @@ JsonObject Service::convertFetchedPayload(std::wstring_view type, std::future<re
 		document.emplace_back(std::string { service::strErrors }, response::Value { oss.str() });
 	}
 
-	JsonObject fetched;
+	return document;
+}
 
-	fetched.SetNamedValue(L"type", JsonValue::CreateStringValue(type));
-	fetched.SetNamedValue(L"fetched", JsonObject::Parse(ConvertToUTF16(response::toJSON(std::move(document)))));
+// Deadlines are in milliseconds since the Unix epoch, the client and the bridge share the system clock.
+std::chrono::milliseconds Service::untilDeadline(double deadline) noexcept
+{
+	const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
 
-	return fetched;
+	return std::chrono::milliseconds { static_cast<std::int64_t>(deadline) } - now;
 }
 
-std::string Service::ConvertToUTF8(std::wstring_view value)
+bool Service::pastDeadline(double deadline) noexcept
 {
-	std::string result;
+	return deadline > 0
+		&& untilDeadline(deadline).count() <= 0;
+}
 
-	if (!value.empty())
+void Service::sendTimeout(const com_ptr<ResponseBatcher>& batcher, TimeoutStats& stats, int requestId, std::wstring_view stage)
+{
+	if (stage == L"expired"sv)
+	{
+		++stats.expired;
+	}
+	else if (stage == L"queued"sv)
+	{
+		++stats.queued;
+	}
+	else
 	{
-		const auto cch = WideCharToMultiByte(CP_UTF8, 0, value.data(), static_cast<int>(value.size()), nullptr, 0, nullptr, nullptr);
+		++stats.resolving;
+	}
+
+	JsonObject response;
 
-		if (cch != 0)
+	response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"timeout"));
+	response.SetNamedValue(L"stage", JsonValue::CreateStringValue(stage));
+	response.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+
+	batcher->enqueue(response);
+}
+
+WorkerPool::Priority Service::parsePriority(std::wstring_view name)
+{
+	for (size_t index = 0; index < c_priorityNames.size(); ++index)
+	{
+		if (name == c_priorityNames[index])
 		{
-			result.resize(static_cast<size_t>(cch));
+			return static_cast<WorkerPool::Priority>(index);
+		}
+	}
 
-			if (cch != WideCharToMultiByte(CP_UTF8, 0, value.data(), static_cast<int>(value.size()), result.data(), cch, nullptr, nullptr))
+	throw std::invalid_argument { "Unknown priority" };
+}
+
+void Service::scheduleDeadline(int requestId, const std::shared_ptr<FetchCancellation>& fetch, double deadline)
+{
+	std::unique_lock lock { deadlineMutex };
+
+	deadlines.schedule(TimerWheel<PendingDeadline>::Clock::now() + untilDeadline(deadline), { fetch, requestId });
+
+	if (!expiringDeadlines)
+	{
+		expiringDeadlines = true;
+		lock.unlock();
+
+		expireDeadlinesAsync();
+	}
+}
+
+// Runs off the dispatcher thread, so a resolver which holds up the dispatcher cannot hold up its timeout.
+fire_and_forget Service::expireDeadlinesAsync()
+{
+	const auto strong_this { get_strong() };
+
+	for (bool expiring = true; expiring;)
+	{
+		co_await resume_after(TimerWheel<PendingDeadline>::c_tick);
+
+		std::vector<PendingDeadline> expired;
+
+		{
+			std::lock_guard lock { deadlineMutex };
+
+			expired = deadlines.advance(TimerWheel<PendingDeadline>::Clock::now());
+			expiring = expiringDeadlines = (deadlines.size() > 0);
+		}
+
+		for (const auto& entry : expired)
+		{
+			const auto fetch = entry.fetch.lock();
+
+			if (!fetch)
 			{
-				result.clear();
+				continue;
+			}
+
+			switch (fetch->timeOut())
+			{
+				case FetchCancellation::State::Queued:
+					sendTimeout(responseBatcher, *timeoutStats, entry.requestId, L"queued"sv);
+					break;
+
+				case FetchCancellation::State::Resolving:
+					sendTimeout(responseBatcher, *timeoutStats, entry.requestId, L"resolving"sv);
+					break;
+
+				default:
+					break;
 			}
 		}
 	}
-
-	return result;
 }
 
-std::wstring Service::ConvertToUTF16(std::string_view value)
+std::string Service::canonicalVariables(const response::Value& variables)
 {
-	std::wstring result;
+	return response::toJSON(sortedCopy(variables));
+}
 
-	if (!value.empty())
+// Deep copy with every map's members sorted by name, so equivalent variables compare equal no
+// matter which order the client wrote them in.
+response::Value Service::sortedCopy(const response::Value& value)
+{
+	switch (value.type())
 	{
-		const auto cch = MultiByteToWideChar(CP_UTF8, 0, value.data(), static_cast<int>(value.size()), nullptr, 0);
+		case response::Type::Map:
+		{
+			std::vector<const std::pair<std::string, response::Value>*> members;
+
+			members.reserve(value.size());
+
+			for (const auto& member : value)
+			{
+				members.push_back(&member);
+			}
+
+			std::sort(members.begin(), members.end(), [](const auto* lhs, const auto* rhs) noexcept {
+				return lhs->first < rhs->first;
+			});
+
+			response::Value sorted { response::Type::Map };
+
+			sorted.reserve(members.size());
 
-		if (cch != 0)
+			for (const auto* member : members)
+			{
+				sorted.emplace_back(std::string { member->first }, sortedCopy(member->second));
+			}
+
+			return sorted;
+		}
+
+		case response::Type::List:
 		{
-			result.resize(static_cast<size_t>(cch));
+			const auto& elements = value.get<response::ListType>();
+			response::Value sorted { response::Type::List };
+
+			sorted.reserve(elements.size());
 
-			if (cch != MultiByteToWideChar(CP_UTF8, 0, value.data(), static_cast<int>(value.size()), result.data(), cch))
+			for (const auto& element : elements)
 			{
-				result.clear();
+				sorted.emplace_back(sortedCopy(element));
 			}
+
+			return sorted;
 		}
+
+		default:
+			return response::Value { value };
 	}
+}
+
+// Best effort at finding the requestId of a request the envelope could not read, or -1 if there is none.
+int Service::salvageRequestId(std::wstring_view request)
+{
+	JsonObject parsed { nullptr };
+
+	if (!JsonObject::TryParse(request, parsed)
+		|| !parsed.HasKey(L"requestId"sv)
+		|| parsed.GetNamedValue(L"requestId"sv).ValueType() != JsonValueType::Number)
+	{
+		return -1;
+	}
+
+	return static_cast<int>(parsed.GetNamedNumber(L"requestId"sv));
+}
 
-	return result;
+// Both conversions go through a per-thread buffer which is sized for the worst case, so each string
+// is transcoded in one pass and the result is copied out at its exact size.
+std::string Service::ConvertToUTF8(std::wstring_view value)
+{
+	thread_local std::string buffer;
+	const auto length = utf::encodeUtf8(value, buffer, 0);
+
+	return std::string { buffer.data(), length };
+}
+
+std::wstring Service::ConvertToUTF16(std::string_view value)
+{
+	thread_local std::wstring buffer;
+	const auto length = utf::decodeUtf8(value, buffer, 0);
+
+	return std::wstring { buffer.data(), length };
 }
 
 fire_and_forget Service::run()
@@ -227,9 +837,20 @@ fire_and_forget Service::run()
 		throw std::runtime_error(oss.str());
 	}
 
+	startup.mark(L"connectionOpened"sv);
 	shutdownEvent.attach(CreateEventW(nullptr, true, false, nullptr));
+	persistedQueries.load();
 
-	serviceConnection.RequestReceived({ get_weak(), &Service::onRequestReceived });
+	transport->receive([weak = get_weak()](TransportMessage&& message, MessageTransport::Completion done) {
+		if (const auto strong = weak.get())
+		{
+			strong->onMessageReceived(std::move(message), std::move(done));
+		}
+		else
+		{
+			done(nullptr);
+		}
+	});
 	serviceConnection.ServiceClosed({ get_weak(), &Service::onServiceClosed });
 
 	co_await resume_on_signal(shutdownEvent.get());
@@ -238,152 +859,781 @@ fire_and_forget Service::run()
 
 	co_await resume_foreground(dispatcherQueue);
 
+	persistedQueries.save();
+	trace::Tracer::instance().stop();
+
 	PostQuitMessage(0);
 }
 
-void Service::startService(const JsonObject& request)
+// The relay may have already opened the session with a warmStart request, in which case
+// startService only needs to apply the client's options.
+void Service::openService(bool useDefaultProfile)
 {
-	serviceSingleton = mapi::GetService(request.GetNamedBoolean(L"useDefaultProfile"));
+	if (serviceSingleton
+		&& serviceProfile == useDefaultProfile)
+	{
+		return;
+	}
+
+	serviceSingleton = mapi::GetService(useDefaultProfile);
+	serviceProfile = useDefaultProfile;
+	startup.mark(L"mapiSessionOpened"sv);
 }
 
-void Service::stopService(JsonObject& response)
+void Service::startService(int requestId, const JsonObject& request)
 {
-	if (serviceSingleton)
+	startup.mark(L"startService"sv);
+	openService(request.GetNamedBoolean(L"useDefaultProfile"));
+
+	constexpr auto batchWindowKey = L"batchWindow"sv;
+	constexpr auto batchSizeKey = L"batchSize"sv;
+
+	if (request.HasKey(batchWindowKey)
+		|| request.HasKey(batchSizeKey))
+	{
+		responseBatcher->configure(std::chrono::milliseconds { static_cast<int>(request.GetNamedNumber(batchWindowKey, 0)) },
+			static_cast<size_t>(request.GetNamedNumber(batchSizeKey, 64)));
+	}
+
+	// Newer clients can read CBOR responses, older ones never ask for them and keep getting JSON.
+	constexpr auto encodingsKey = L"encodings"sv;
+	bool binaryEncoding = false;
+
+	if (request.HasKey(encodingsKey))
 	{
-		for (const auto& entry : subscriptionMap)
+		for (const auto& encoding : request.GetNamedArray(encodingsKey))
 		{
-			entry.second->Unsubscribe();
+			if (encoding.ValueType() == JsonValueType::String
+				&& encoding.GetString() == L"cbor")
+			{
+				binaryEncoding = true;
+				break;
+			}
 		}
+	}
+
+	responseBatcher->useBinaryEncoding(binaryEncoding);
+
+	// Tracing clients tag each request with a trace id, the spans go next to the persisted queries.
+	if (request.HasKey(L"trace"sv))
+	{
+		std::wostringstream oss;
+
+		oss << L"bridge-" << GetCurrentProcessId() << L".trace.json";
+		trace::Tracer::instance().start(std::filesystem::path { std::wstring_view { ApplicationData::Current().LocalCacheFolder().Path() } } / oss.str(), "bridge");
+	}
+
+	constexpr auto documentCacheEntriesKey = L"documentCacheEntries"sv;
+	constexpr auto documentCacheBytesKey = L"documentCacheBytes"sv;
+
+	if (request.HasKey(documentCacheEntriesKey)
+		|| request.HasKey(documentCacheBytesKey))
+	{
+		documentCache.configure(static_cast<size_t>(request.GetNamedNumber(documentCacheEntriesKey, DocumentCache::c_defaultMaxEntries)),
+			static_cast<size_t>(request.GetNamedNumber(documentCacheBytesKey, DocumentCache::c_defaultMaxBytes)));
+	}
+
+	constexpr auto persistedQueryEntriesKey = L"persistedQueryEntries"sv;
+	constexpr auto persistedQueryBytesKey = L"persistedQueryBytes"sv;
+
+	if (request.HasKey(persistedQueryEntriesKey)
+		|| request.HasKey(persistedQueryBytesKey))
+	{
+		persistedQueries.configure(static_cast<size_t>(request.GetNamedNumber(persistedQueryEntriesKey, PersistedQueryStore::c_defaultMaxEntries)),
+			static_cast<size_t>(request.GetNamedNumber(persistedQueryBytesKey, PersistedQueryStore::c_defaultMaxBytes)));
+	}
+
+	// Query results are only cached for operations with a TTL, either resultCacheTtl or the ttl in
+	// their resultCacheOperations entry, which can also name the subscriptions that invalidate them.
+	constexpr auto resultCacheTtlKey = L"resultCacheTtl"sv;
+	constexpr auto resultCacheBytesKey = L"resultCacheBytes"sv;
+	constexpr auto resultCacheOperationsKey = L"resultCacheOperations"sv;
+
+	if (request.HasKey(resultCacheTtlKey)
+		|| request.HasKey(resultCacheBytesKey))
+	{
+		resultCache->configure(std::chrono::milliseconds { static_cast<std::int64_t>(request.GetNamedNumber(resultCacheTtlKey, 0)) },
+			static_cast<size_t>(request.GetNamedNumber(resultCacheBytesKey, ResultCache::c_defaultMaxBytes)));
+	}
+
+	if (request.HasKey(resultCacheOperationsKey))
+	{
+		const auto operations = request.GetNamedObject(resultCacheOperationsKey);
+
+		for (const auto& operation : operations)
+		{
+			const auto settings = operations.GetNamedObject(operation.Key());
+			std::vector<std::string> invalidatedBy;
+
+			if (settings.HasKey(L"invalidatedBy"sv))
+			{
+				for (const auto& subscriptionName : settings.GetNamedArray(L"invalidatedBy"sv))
+				{
+					invalidatedBy.push_back(ConvertToUTF8(subscriptionName.GetString()));
+				}
+			}
+
+			resultCache->configureOperation(ConvertToUTF8(operation.Key()),
+				std::chrono::milliseconds { static_cast<std::int64_t>(settings.GetNamedNumber(L"ttl"sv, 0)) },
+				invalidatedBy);
+		}
+	}
+
+	// Queries resolve inline on the dispatcher thread unless the client asks for worker threads.
+	constexpr auto workerThreadsKey = L"workerThreads"sv;
+	constexpr auto workerQueueLimitKey = L"workerQueueLimit"sv;
+	const auto workerThreads = static_cast<size_t>(request.GetNamedNumber(workerThreadsKey, 0));
+
+	if (workerThreads > 0
+		&& !workerPool)
+	{
+		workerPool = std::make_unique<WorkerPool>(workerThreads,
+			static_cast<size_t>(request.GetNamedNumber(workerQueueLimitKey, 256)),
+			[]() {
+				init_apartment(apartment_type::multi_threaded);
+			},
+			[]() {
+				uninit_apartment();
+			});
+	}
+
+	// Payloads at least sharedMemoryThreshold bytes long can go through a shared memory ring
+	// instead of the relay, once the client opens it and sends attachSharedMemory.
+	constexpr auto sharedMemoryBytesKey = L"sharedMemoryBytes"sv;
+	constexpr auto sharedMemoryThresholdKey = L"sharedMemoryThreshold"sv;
+	const auto sharedMemoryBytes = static_cast<size_t>(request.GetNamedNumber(sharedMemoryBytesKey, 0));
+
+	if (sharedMemoryBytes > 0)
+	{
+		const auto name = responseBatcher->createSharedRing(sharedMemoryBytes,
+			static_cast<size_t>(request.GetNamedNumber(sharedMemoryThresholdKey, 16 * 1024)),
+			ConvertToUTF8(request.GetNamedString(L"appContainerSid"sv, {})));
+		JsonObject response;
+
+		response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"sharedMemory"));
+		response.SetNamedValue(L"name", JsonValue::CreateStringValue(ConvertToUTF16(name)));
+		sendResponse(requestId, response);
+	}
+}
+
+void Service::stopService(JsonObject& response)
+{
+	// Let queries which are already running or queued finish before the service goes away.
+	workerPool.reset();
+	persistedQueries.save();
+
+	if (serviceSingleton)
+	{
+		queryMap.forEach([](QueryEntry& entry) {
+			if (entry.subscription)
+			{
+				entry.subscription->Unsubscribe();
+			}
+		});
 
-		subscriptionMap.clear();
 		queryMap.clear();
+		subscriptionGroups.clear();
+		resultCache->clear();
 		serviceSingleton.reset();
+		serviceProfile.reset();
 	}
 
 	response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"stopped"));
 }
 
-void Service::parseQuery(const JsonObject& request, JsonObject& response)
+void Service::parseQuery(const RequestEnvelope& request, JsonObject& response)
 {
-	const int queryId = (queryMap.empty() ? 1 : queryMap.crbegin()->first + 1);
-	auto ast = peg::parseString(ConvertToUTF8(request.GetNamedString(L"query")));
-	auto validationErrors = serviceSingleton->validate(ast);
+	constexpr auto queryKey = L"query"sv;
+	constexpr auto queryHashKey = L"queryHash"sv;
+	std::string query;
 
-	if (!validationErrors.empty())
+	// Clients which know the document's SHA-256 hash only send the full text when we ask for it.
+	if (request.hasKey(queryHashKey))
 	{
-		throw service::schema_exception { std::move(validationErrors) };
+		const auto queryHash = ConvertToUTF8(request.getString(queryHashKey));
+
+		if (request.hasKey(queryKey))
+		{
+			query = ConvertToUTF8(request.getString(queryKey));
+			persistedQueries.insert(queryHash, query);
+			persistedQueries.saveIfDue();
+		}
+		else if (const auto persisted = persistedQueries.find(queryHash))
+		{
+			query = *persisted;
+		}
+		else
+		{
+			response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"persistedQueryNotFound"));
+			response.SetNamedValue(queryHashKey, JsonValue::CreateStringValue(request.getString(queryHashKey)));
+			return;
+		}
+	}
+	else
+	{
+		query = ConvertToUTF8(request.getString(queryKey));
 	}
 
-	queryMap[queryId] = std::move(ast);
+	auto document = documentCache.get(query, *serviceSingleton);
+	const int queryId = queryMap.insert({ std::move(document.ast), nullptr, document.hash });
 
 	response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"parsed"));
 	response.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
 }
 
-void Service::discardQuery(const JsonObject& request)
+void Service::discardQuery(const RequestEnvelope& request)
 {
-	queryMap.erase(static_cast<int>(request.GetNamedNumber(L"queryId")));
+	queryMap.erase(static_cast<int>(request.getNumber(L"queryId")));
 }
 
-IAsyncAction Service::fetchQuery(int requestId, const JsonObject& request)
+IAsyncAction Service::fetchQuery(int requestId, RequestEnvelope& request)
 {
 	const auto strong_this { get_strong() };
-	const auto queryId { static_cast<int>(request.GetNamedNumber(L"queryId")) };
-	const auto itrQuery { queryMap.find(queryId) };
+	const auto queryId { static_cast<int>(request.getNumber(L"queryId")) };
+	const auto query { queryMap.find(queryId) };
 
-	if (itrQuery == queryMap.cend())
+	if (!query)
 	{
 		throw std::runtime_error("Unknown queryId");
 	}
 
-	auto& ast = itrQuery->second;
+	startup.mark(L"firstFetchQuery"sv);
+
+	auto& ast = query->ast;
 	constexpr auto operationNameKey = L"operationName"sv;
-	auto operationName = request.HasKey(operationNameKey)
-		? ConvertToUTF8(request.GetNamedString(operationNameKey))
+	auto operationName = request.hasKey(operationNameKey)
+		? ConvertToUTF8(request.getString(operationNameKey))
 		: ""s;
-	constexpr auto variablesKey = L"variables"sv;
-	auto parsedVariables = (request.HasKey(variablesKey)
-		? response::parseJSON(ConvertToUTF8(request.GetNamedObject(variablesKey).ToString()))
-		: response::Value(response::Type::Map));
-	auto payloadQueue = make_self<SubscriptionPayloadQueue>(serviceConnection, requestId);
+	auto parsedVariables = request.takeVariables();
+	const auto traceId = ConvertToUTF8(request.getString(L"trace"sv, {}));
+	auto payloadQueue = make_self<SubscriptionPayloadQueue>(responseBatcher, requestId);
+	const auto operationType = serviceSingleton->findOperationDefinition(ast, operationName).first;
+	std::shared_ptr<FetchCancellation> cancellation;
 
-	if (serviceSingleton->findOperationDefinition(ast, operationName).first == service::strSubscription)
+	if (operationType == service::strSubscription)
 	{
-		if (subscriptionMap.find(queryId) != subscriptionMap.end())
+		if (query->subscription)
 		{
 			throw std::runtime_error("Duplicate subscription");
 		}
 
-		payloadQueue->registered = true;
-		payloadQueue->key = std::make_optional(serviceSingleton->subscribe(std::launch::deferred,
-			service::SubscriptionParams { nullptr,
-				peg::ast { ast },
-				std::move(operationName),
-				std::move(parsedVariables) },
-			[weak_queue { payloadQueue->get_weak() }](std::future<response::Value> payload) noexcept -> void
-		{
-			const auto subscriptionQueue { weak_queue.get() };
+		constexpr auto deltaPayloadsKey = L"deltaPayloads"sv;
+		constexpr auto resyncIntervalKey = L"resyncInterval"sv;
 
-			if (!subscriptionQueue)
+		payloadQueue->deltaPayloads = request.getBoolean(deltaPayloadsKey, false);
+		payloadQueue->resyncInterval = static_cast<size_t>(request.getNumber(resyncIntervalKey, 32));
+		payloadQueue->maxPending = static_cast<size_t>(request.getNumber(L"maxPendingPayloads"sv, 0));
+		payloadQueue->stats = subscriptionStats;
+
+		SubscriptionGroupKey groupKey { ast.root.get(), operationName, canonicalVariables(parsedVariables) };
+		auto group = subscriptionGroups[groupKey].lock();
+
+		if (group
+			&& group->add(payloadQueue))
+		{
+			++subscriptionStats->shared;
+		}
+		else
+		{
+			for (auto itr = subscriptionGroups.begin(); itr != subscriptionGroups.end();)
 			{
-				return;
+				itr = (itr->second.expired() ? subscriptionGroups.erase(itr) : std::next(itr));
 			}
 
-			subscriptionQueue->sendResponse(convertFetchedPayload(L"next"sv, std::move(payload)));
-		}).get());
+			group = std::make_shared<SubscriptionGroup>(responseBatcher, resultCache, operationName);
+			group->subscribe(serviceSingleton, serviceSingleton->subscribe(std::launch::deferred,
+				service::SubscriptionParams { nullptr,
+					peg::ast { ast },
+					std::move(operationName),
+					std::move(parsedVariables) },
+				[weak_group = std::weak_ptr<SubscriptionGroup> { group }](std::future<response::Value> payload) noexcept -> void
+			{
+				const auto subscriptionGroup { weak_group.lock() };
+
+				if (!subscriptionGroup)
+				{
+					return;
+				}
+
+				subscriptionGroup->deliver(convertFetchedPayload(std::move(payload)));
+			}).get());
+			group->add(payloadQueue);
+			subscriptionGroups[std::move(groupKey)] = group;
+		}
+
+		payloadQueue->group = std::move(group);
 	}
 	else
 	{
-		auto payload = serviceSingleton->resolve(std::launch::deferred,
-			nullptr,
-			ast,
-			operationName,
-			std::move(parsedVariables));
+		CachePlan cachePlan { std::nullopt, {}, resultCache->generation(), operationType == service::strMutation };
+		const auto streamChunkSize = static_cast<size_t>(request.getNumber(L"streamChunkSize"sv, 0));
+		const auto deadline = request.getNumber(L"deadline"sv, 0);
+		const auto priority = parsePriority(request.getString(L"priority"sv, L"normal"sv));
+		ResultCache::Result cached;
+
+		if (resultCache->enabled())
+		{
+			if (operationType == service::strQuery
+				&& resultCache->ttl(operationName).count() > 0)
+			{
+				cachePlan.key = std::make_optional<ResultCache::Key>(query->documentHash, operationName, canonicalVariables(parsedVariables));
+				cached = resultCache->find(*cachePlan.key, ast);
+				cachePlan.status = (cached ? L"hit"sv : L"miss"sv);
+			}
+			else
+			{
+				cachePlan.status = L"bypass"sv;
+			}
+		}
+
+		if (cached)
+		{
+			// Nothing is waiting on a resolver, so a cached result is never streamed.
+			responseBatcher->enqueueFetched(L"complete"sv, requestId, *cached, {}, cachePlan.status);
+		}
+		else if (workerPool)
+		{
+			auto& operationHistogram = operationLatency.get(request.getString(operationNameKey, {}));
+
+			cancellation = std::make_shared<FetchCancellation>(operationHistogram);
+
+			// The worker owns its own copy of the ast and shares the parsed nodes with the query entry.
+			// The histograms outlive the worker pool, which finishes every task before it goes away.
+			WorkerPool::Task task { [serviceSingleton = serviceSingleton,
+				batcher = responseBatcher,
+				resultCache = resultCache,
+				ast = peg::ast { ast },
+				operationName = std::move(operationName),
+				parsedVariables = std::make_shared<response::Value>(std::move(parsedVariables)),
+				cachePlan = std::move(cachePlan),
+				streamChunkSize,
+				queueLatency = &latency->get(L"workerQueue"sv),
+				priorityQueueLatency = &latency->get(c_priorityQueueStages[static_cast<size_t>(priority)]),
+				resolveLatency = &latency->get(L"resolve"sv),
+				operationResolveLatency = &operationHistogram,
+				cancellation,
+				deadline,
+				timeoutStats = timeoutStats,
+				posted = LatencyHistogram::Clock::now(),
+				tracePosted = trace::now(),
+				traceId,
+				requestId]() mutable {
+				const auto start = LatencyHistogram::Clock::now();
+
+				queueLatency->recordSince(posted);
+				priorityQueueLatency->recordSince(posted);
+				trace::Tracer::instance().record("workerQueue", traceId, requestId, tracePosted, trace::now());
+
+				if (pastDeadline(deadline)
+					&& cancellation->timeOut() == FetchCancellation::State::Queued)
+				{
+					sendTimeout(batcher, *timeoutStats, requestId, L"queued"sv);
+				}
+
+				if (!cancellation->start())
+				{
+					return;
+				}
+
+				trace::Span resolveSpan { "resolve", traceId, requestId };
+
+				auto payload = serviceSingleton->resolve(std::launch::deferred,
+					nullptr,
+					ast,
+					operationName,
+					std::move(*parsedVariables));
+				auto document = convertFetchedPayload(std::move(payload));
+
+				resolveLatency->recordSince(start);
+				operationResolveLatency->recordSince(start);
+				completeFetch(batcher, *resultCache, requestId, ast, std::move(cachePlan), streamChunkSize, cancellation->finish(), std::move(document));
+			} };
+
+			if (!workerPool->post(std::move(task), priority))
+			{
+				throw std::runtime_error("Worker queue is full");
+			}
+
+			if (deadline > 0)
+			{
+				scheduleDeadline(requestId, cancellation, deadline);
+			}
+		}
+		else
+		{
+			auto& operationHistogram = operationLatency.get(request.getString(operationNameKey, {}));
+
+			// The deadline timer runs on the thread pool, so a resolver which holds up the dispatcher
+			// still gets its timeout on time, and its result is dropped once it does finish.
+			if (deadline > 0)
+			{
+				cancellation = std::make_shared<FetchCancellation>(operationHistogram);
+				cancellation->start();
+				scheduleDeadline(requestId, cancellation, deadline);
+			}
+
+			const auto start = LatencyHistogram::Clock::now();
+			trace::Span resolveSpan { "resolve", traceId, requestId };
+			response::Value document;
+
+			try
+			{
+				auto payload = serviceSingleton->resolve(std::launch::deferred,
+					nullptr,
+					ast,
+					operationName,
+					std::move(parsedVariables));
 
-		payloadQueue->sendResponse(convertFetchedPayload(L"complete"sv, std::move(payload)));
+				document = convertFetchedPayload(std::move(payload));
+			}
+			catch (...)
+			{
+				// The error response is all the client gets, the deadline must not answer it as well.
+				if (cancellation)
+				{
+					cancellation->finish();
+				}
+
+				throw;
+			}
+
+			latency->get(L"resolve"sv).recordSince(start);
+			operationHistogram.recordSince(start);
+			completeFetch(responseBatcher, *resultCache, requestId, ast, std::move(cachePlan), streamChunkSize,
+				!cancellation || cancellation->finish(), std::move(document));
+		}
 	}
 
-	subscriptionMap[queryId] = std::move(payloadQueue);
+	query->subscription = std::move(payloadQueue);
+
+	if (cancellation)
+	{
+		auto& fetches = query->fetches;
+
+		fetches.erase(std::remove_if(fetches.begin(), fetches.end(), [](const auto& fetch) noexcept {
+			return fetch->done();
+		}), fetches.end());
+		fetches.push_back(std::move(cancellation));
+	}
 
 	co_return;
 }
 
-void Service::unsubscribe(const JsonObject& request)
+void Service::unsubscribe(const RequestEnvelope& request)
+{
+	const auto query { queryMap.find(static_cast<int>(request.getNumber(L"queryId"))) };
+
+	if (query
+		&& query->subscription)
+	{
+		query->subscription->Unsubscribe();
+		query->subscription = nullptr;
+	}
+}
+
+void Service::cancel(const RequestEnvelope& request, JsonObject& response)
 {
-	auto itr = subscriptionMap.find(static_cast<int>(request.GetNamedNumber(L"queryId")));
+	const auto queryId { static_cast<int>(request.getNumber(L"queryId")) };
+	const auto query { queryMap.find(queryId) };
+	auto stage = L"none"sv;
+	std::uint64_t estimatedSaved = 0;
+	size_t stopped = 0;
+
+	if (query)
+	{
+		// Fetches for the same query can overlap, and the client has dropped all of them.
+		const auto fetches { std::move(query->fetches) };
+
+		query->fetches.clear();
+
+		for (const auto& fetch : fetches)
+		{
+			switch (fetch->cancel())
+			{
+				case FetchCancellation::State::Queued:
+					stage = L"queued"sv;
+					estimatedSaved += fetch->operationLatency.summary().p50;
+					++cancellationStats.queued;
+					++stopped;
+					break;
+
+				case FetchCancellation::State::Resolving:
+					if (stage == L"none"sv)
+					{
+						stage = L"resolving"sv;
+					}
+
+					++cancellationStats.resolving;
+					++stopped;
+					break;
+
+				default:
+					break;
+			}
+		}
+	}
+
+	if (query
+		&& query->subscription)
+	{
+		if (query->subscription->group)
+		{
+			stage = L"subscribed"sv;
+			++cancellationStats.subscriptions;
+		}
+
+		query->subscription->Unsubscribe();
+		query->subscription = nullptr;
+	}
+
+	if (stage == L"none"sv)
+	{
+		++cancellationStats.late;
+	}
+
+	// "queued" skipped the resolvers entirely for at least one fetch, "resolving" dropped results
+	// nobody was waiting for, "subscribed" stopped future payloads and "none" found nothing left to stop.
+	response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"cancelled"));
+	response.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
+	response.SetNamedValue(L"stage", JsonValue::CreateStringValue(stage));
+	response.SetNamedValue(L"fetches", JsonValue::CreateNumberValue(static_cast<double>(stopped)));
 
-	if (itr != subscriptionMap.end())
+	if (estimatedSaved > 0)
 	{
-		itr->second->Unsubscribe();
-		subscriptionMap.erase(itr);
+		// The median time the skipped operations' resolvers have taken, added up, in microseconds.
+		response.SetNamedValue(L"estimatedSaved", JsonValue::CreateNumberValue(static_cast<double>(estimatedSaved)));
 	}
 }
 
-IAsyncAction Service::onRequestReceived(const AppServiceConnection& /* sender */, const AppServiceRequestReceivedEventArgs& args)
+void Service::getStats(const RequestEnvelope& request, JsonObject& response)
+{
+	const auto documentStats = documentCache.stats();
+	JsonObject documents;
+
+	documents.SetNamedValue(L"entries", JsonValue::CreateNumberValue(static_cast<double>(documentStats.entries)));
+	documents.SetNamedValue(L"bytes", JsonValue::CreateNumberValue(static_cast<double>(documentStats.bytes)));
+	documents.SetNamedValue(L"hits", JsonValue::CreateNumberValue(static_cast<double>(documentStats.hits)));
+	documents.SetNamedValue(L"misses", JsonValue::CreateNumberValue(static_cast<double>(documentStats.misses)));
+	documents.SetNamedValue(L"evictions", JsonValue::CreateNumberValue(static_cast<double>(documentStats.evictions)));
+
+	response.SetNamedValue(L"type", JsonValue::CreateStringValue(L"stats"));
+	response.SetNamedValue(L"documentCache", documents);
+
+	const auto persistedStats = persistedQueries.stats();
+	JsonObject persisted;
+
+	persisted.SetNamedValue(L"entries", JsonValue::CreateNumberValue(static_cast<double>(persistedStats.entries)));
+	persisted.SetNamedValue(L"bytes", JsonValue::CreateNumberValue(static_cast<double>(persistedStats.bytes)));
+	persisted.SetNamedValue(L"evictions", JsonValue::CreateNumberValue(static_cast<double>(persistedStats.evictions)));
+	response.SetNamedValue(L"persistedQueries", persisted);
+
+	const auto resultStats = resultCache->stats();
+	JsonObject results;
+
+	results.SetNamedValue(L"entries", JsonValue::CreateNumberValue(static_cast<double>(resultStats.entries)));
+	results.SetNamedValue(L"bytes", JsonValue::CreateNumberValue(static_cast<double>(resultStats.bytes)));
+	results.SetNamedValue(L"hits", JsonValue::CreateNumberValue(static_cast<double>(resultStats.hits)));
+	results.SetNamedValue(L"misses", JsonValue::CreateNumberValue(static_cast<double>(resultStats.misses)));
+	results.SetNamedValue(L"expirations", JsonValue::CreateNumberValue(static_cast<double>(resultStats.expirations)));
+	results.SetNamedValue(L"evictions", JsonValue::CreateNumberValue(static_cast<double>(resultStats.evictions)));
+	results.SetNamedValue(L"invalidations", JsonValue::CreateNumberValue(static_cast<double>(resultStats.invalidations)));
+	response.SetNamedValue(L"resultCache", results);
+
+	if (workerPool)
+	{
+		const auto workerStats = workerPool->stats();
+		JsonObject workers;
+
+		workers.SetNamedValue(L"threads", JsonValue::CreateNumberValue(static_cast<double>(workerStats.threads)));
+		workers.SetNamedValue(L"queued", JsonValue::CreateNumberValue(static_cast<double>(workerStats.queued)));
+		workers.SetNamedValue(L"maxQueued", JsonValue::CreateNumberValue(static_cast<double>(workerStats.maxQueued)));
+		workers.SetNamedValue(L"running", JsonValue::CreateNumberValue(static_cast<double>(workerStats.running)));
+		workers.SetNamedValue(L"completed", JsonValue::CreateNumberValue(static_cast<double>(workerStats.completed)));
+		workers.SetNamedValue(L"rejected", JsonValue::CreateNumberValue(static_cast<double>(workerStats.rejected)));
+
+		JsonObject priorities;
+
+		for (size_t index = 0; index < workerStats.classes.size(); ++index)
+		{
+			const auto& classStats = workerStats.classes[index];
+			JsonObject priorityClass;
+
+			priorityClass.SetNamedValue(L"queued", JsonValue::CreateNumberValue(static_cast<double>(classStats.queued)));
+			priorityClass.SetNamedValue(L"completed", JsonValue::CreateNumberValue(static_cast<double>(classStats.completed)));
+			priorityClass.SetNamedValue(L"promoted", JsonValue::CreateNumberValue(static_cast<double>(classStats.promoted)));
+			priorities.SetNamedValue(c_priorityNames[index], priorityClass);
+		}
+
+		workers.SetNamedValue(L"priorities", priorities);
+
+		response.SetNamedValue(L"workers", workers);
+	}
+
+	const auto sharedStats = responseBatcher->sharedRingStats();
+
+	if (sharedStats.capacity > 0)
+	{
+		JsonObject sharedMemory;
+
+		sharedMemory.SetNamedValue(L"capacity", JsonValue::CreateNumberValue(static_cast<double>(sharedStats.capacity)));
+		sharedMemory.SetNamedValue(L"used", JsonValue::CreateNumberValue(static_cast<double>(sharedStats.used)));
+		sharedMemory.SetNamedValue(L"records", JsonValue::CreateNumberValue(static_cast<double>(sharedStats.records)));
+		sharedMemory.SetNamedValue(L"bytes", JsonValue::CreateNumberValue(static_cast<double>(sharedStats.bytes)));
+		sharedMemory.SetNamedValue(L"fallbacks", JsonValue::CreateNumberValue(static_cast<double>(sharedStats.fallbacks)));
+
+		if (!sharedStats.attachError.empty())
+		{
+			sharedMemory.SetNamedValue(L"attachError", JsonValue::CreateStringValue(ConvertToUTF16(sharedStats.attachError)));
+		}
+
+		response.SetNamedValue(L"sharedMemory", sharedMemory);
+	}
+
+	const auto batchStats = responseBatcher->batchStats();
+	JsonObject batches;
+
+	batches.SetNamedValue(L"sent", JsonValue::CreateNumberValue(static_cast<double>(batchStats.sent)));
+	batches.SetNamedValue(L"failed", JsonValue::CreateNumberValue(static_cast<double>(batchStats.failed)));
+	batches.SetNamedValue(L"droppedResponses", JsonValue::CreateNumberValue(static_cast<double>(batchStats.droppedResponses)));
+	response.SetNamedValue(L"responseBatches", batches);
+
+	JsonObject subscriptions;
+
+	subscriptions.SetNamedValue(L"conflated", JsonValue::CreateNumberValue(static_cast<double>(subscriptionStats->conflated.load())));
+	subscriptions.SetNamedValue(L"dropped", JsonValue::CreateNumberValue(static_cast<double>(subscriptionStats->dropped.load())));
+	subscriptions.SetNamedValue(L"shared", JsonValue::CreateNumberValue(static_cast<double>(subscriptionStats->shared.load())));
+	subscriptions.SetNamedValue(L"groups", JsonValue::CreateNumberValue(static_cast<double>(std::count_if(subscriptionGroups.begin(), subscriptionGroups.end(), [](const auto& entry) noexcept {
+		return !entry.second.expired();
+	}))));
+	response.SetNamedValue(L"subscriptions", subscriptions);
+
+	JsonObject cancellations;
+
+	cancellations.SetNamedValue(L"queued", JsonValue::CreateNumberValue(static_cast<double>(cancellationStats.queued)));
+	cancellations.SetNamedValue(L"resolving", JsonValue::CreateNumberValue(static_cast<double>(cancellationStats.resolving)));
+	cancellations.SetNamedValue(L"subscriptions", JsonValue::CreateNumberValue(static_cast<double>(cancellationStats.subscriptions)));
+	cancellations.SetNamedValue(L"late", JsonValue::CreateNumberValue(static_cast<double>(cancellationStats.late)));
+	response.SetNamedValue(L"cancellations", cancellations);
+
+	JsonObject timeouts;
+
+	timeouts.SetNamedValue(L"expired", JsonValue::CreateNumberValue(static_cast<double>(timeoutStats->expired.load())));
+	timeouts.SetNamedValue(L"queued", JsonValue::CreateNumberValue(static_cast<double>(timeoutStats->queued.load())));
+	timeouts.SetNamedValue(L"resolving", JsonValue::CreateNumberValue(static_cast<double>(timeoutStats->resolving.load())));
+	response.SetNamedValue(L"timeouts", timeouts);
+
+	JsonObject startupStages;
+
+	for (const auto& stage : startup.stages())
+	{
+		startupStages.SetNamedValue(stage.first, JsonValue::CreateNumberValue(static_cast<double>(stage.second)));
+	}
+
+	response.SetNamedValue(L"startup", startupStages);
+
+	// Every duration is in microseconds. Operations are keyed by the operationName the client sent.
+	JsonObject latencies;
+
+	latencies.SetNamedValue(L"stages", latencyToJson(*latency));
+	latencies.SetNamedValue(L"operations", latencyToJson(operationLatency));
+	response.SetNamedValue(L"latency", latencies);
+
+	if (request.getBoolean(L"reset"sv, false))
+	{
+		latency->reset();
+		operationLatency.reset();
+	}
+}
+
+IAsyncAction Service::onMessageReceived(TransportMessage message, MessageTransport::Completion done)
 {
 	const auto strong_this { get_strong() };
-	const auto messageDeferral { args.GetDeferral() };
-	const auto messageRequest { args.Request() };
-	const auto message { messageRequest.Message() };
-	com_array<hstring> requests;
-	bool stopped = false;
+	const bool stopped = co_await processRequestsAsync(std::move(message.requests));
+
+	done(nullptr);
+
+	if (stopped)
+	{
+		SetEvent(shutdownEvent.get());
+	}
+}
 
-	message.Lookup(L"requests").as<IPropertyValue>().GetStringArray(requests);
+// Handles one batch of requests in order, independent of how they reached the bridge. Returns true
+// once stopService has run and every response has been sent.
+IAsyncOperation<bool> Service::processRequestsAsync(std::vector<utf::WideString> requests)
+{
+	const auto strong_this { get_strong() };
+	bool stopped = false;
+	const auto received = LatencyHistogram::Clock::now();
+	const auto traceReceived = trace::now();
 
 	co_await resume_foreground(dispatcherQueue);
+	startup.mark(L"firstRequest"sv);
+	latency->get(L"dispatch"sv).recordSince(received);
+	trace::Tracer::instance().record("dispatch", {}, 0, traceReceived, trace::now(), static_cast<std::int32_t>(requests.size()));
 
 	for (const auto& request : requests)
 	{
-		const auto requestObject = JsonObject::Parse(request);
-		const auto requestId = static_cast<int>(requestObject.GetNamedNumber(L"requestId"));
-		const auto type = requestObject.GetNamedString(L"type");
+		const auto parseStart = LatencyHistogram::Clock::now();
+		std::optional<RequestEnvelope> envelope;
+		int requestId = -1;
+		std::wstring_view type;
+		std::string malformed;
+
+		try
+		{
+			envelope.emplace(request);
+			requestId = envelope->requestId();
+			type = envelope->type();
+		}
+		catch (const std::exception& ex)
+		{
+			// Answered with an error below, under whichever requestId can still be found in it.
+			envelope.reset();
+			malformed = ex.what();
+			requestId = salvageRequestId(request);
+		}
+
+		latency->get(L"requestParse"sv).recordSince(parseStart);
+
 		std::optional<JsonObject> response;
+		std::string traceName;
+		std::string traceId;
+
+		if (envelope
+			&& trace::Tracer::instance().enabled())
+		{
+			traceName = ConvertToUTF8(type);
+			traceId = ConvertToUTF8(envelope->getString(L"trace"sv, {}));
+		}
+
+		trace::Span requestSpan { traceName, traceId, requestId };
 
 		try
 		{
-			if (type == L"startService")
+			if (!envelope)
+			{
+				throw std::invalid_argument { malformed };
+			}
+			else if (stopped)
+			{
+				// stopService released the service, whatever followed it in the same batch has nothing to run on.
+				throw std::logic_error { "The service was stopped earlier in this batch" };
+			}
+			else if (pastDeadline(envelope->getNumber(L"deadline"sv, 0)))
 			{
-				startService(requestObject);
+				// Whoever sent it has already given up on it.
+				sendTimeout(responseBatcher, *timeoutStats, requestId, L"expired"sv);
+			}
+			else if (type == L"startService")
+			{
+				// The only request with nested settings, which the envelope does not keep.
+				startService(requestId, JsonObject::Parse(request));
+			}
+			else if (type == L"warmStart")
+			{
+				startup.mark(L"warmStart"sv);
+				openService(envelope->getBoolean(L"useDefaultProfile"sv, true));
 			}
 			else if (type == L"stopService")
 			{
@@ -394,19 +1644,40 @@ IAsyncAction Service::onRequestReceived(const AppServiceConnection& /* sender */
 			else if (type == L"parseQuery")
 			{
 				response = std::make_optional<JsonObject>();
-				parseQuery(requestObject, *response);
+				parseQuery(*envelope, *response);
 			}
 			else if (type == L"discardQuery")
 			{
-				discardQuery(requestObject);
+				discardQuery(*envelope);
 			}
 			else if (type == L"fetchQuery")
 			{
-				co_await fetchQuery(requestId, requestObject);
+				co_await fetchQuery(requestId, *envelope);
 			}
 			else if (type == L"unsubscribe")
 			{
-				unsubscribe(requestObject);
+				unsubscribe(*envelope);
+			}
+			else if (type == L"cancel")
+			{
+				response = std::make_optional<JsonObject>();
+				cancel(*envelope, *response);
+			}
+			else if (type == L"attachSharedMemory")
+			{
+				if (envelope->hasKey(L"error"sv))
+				{
+					responseBatcher->releaseSharedRing(ConvertToUTF8(envelope->getString(L"error"sv)));
+				}
+				else
+				{
+					responseBatcher->attachSharedRing();
+				}
+			}
+			else if (type == L"stats")
+			{
+				response = std::make_optional<JsonObject>();
+				getStats(*envelope, *response);
 			}
 			else
 			{
@@ -431,18 +1702,18 @@ IAsyncAction Service::onRequestReceived(const AppServiceConnection& /* sender */
 
 		if (response)
 		{
-			co_await sendResponse(requestId, *response);
+			sendResponse(requestId, *response);
 		}
 	}
 
 	co_await resume_background();
 
-	messageDeferral.Complete();
-
 	if (stopped)
 	{
-		SetEvent(shutdownEvent.get());
+		co_await responseBatcher->flushAsync();
 	}
+
+	co_return stopped;
 }
 
 void Service::onServiceClosed(const AppServiceConnection& /* sender */, const AppServiceClosedEventArgs& /* reason */)
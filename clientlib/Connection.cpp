@@ -2,8 +2,18 @@
 #include "Connection.h"
 #include "Connection.g.cpp"
 
+#include "Cbor.h"
+#include "LatencyJson.h"
+#include "SharedMemory.h"
+#include "SharedRing.h"
+
+#include <algorithm>
+#include <chrono>
 #include <stdexcept>
 #include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 using namespace winrt;
 using namespace Windows::ApplicationModel;
@@ -11,384 +21,928 @@ using namespace Windows::ApplicationModel::AppService;
 using namespace Windows::Data::Json;
 using namespace Windows::Foundation;
 using namespace Windows::Foundation::Collections;
+using namespace Windows::Security::Cryptography;
+using namespace Windows::Security::Cryptography::Core;
 
 namespace winrt::clientlib::implementation {
 
-Connection::Connection(bool useDefaultProfile)
-	: m_useDefaultProfile { useDefaultProfile }
+struct Connection::SharedRegion
 {
-	m_serviceConnection.AppServiceName(L"gqlmapi.client");
-	m_serviceConnection.PackageFamilyName(L"a7012456-f540-4a9d-8203-e902b637742f_rs2j33705jmqp");
-}
+	explicit SharedRegion(const std::string& name)
+		: memory { shm::SharedMemory::open(name) }
+		, reader { memory.data(), memory.size() }
+	{
+	}
 
-IAsyncOperation<bool> Connection::OpenAsync(const ErrorHandler& onError) const
+	shm::SharedMemory memory;
+	shm::RingReader reader;
+	shm::Record record;
+};
+
+namespace {
+
+// What onError receives when a request's deadline passes, whether the bridge or the client noticed.
+constexpr std::wstring_view c_timedOut = L"Request timed out";
+
+std::string MakeTracePrefix()
 {
-	const auto onErrorCopy { onError };
+	static std::atomic<std::uint32_t> s_connections { 0 };
+	std::ostringstream oss;
 
-	if (!m_opened)
-	{
-		const auto status = co_await m_serviceConnection.OpenAsync();
+	oss << GetCurrentProcessId() << '.' << ++s_connections << '.';
 
-		if (status != AppServiceConnectionStatus::Success)
-		{
-			if (onErrorCopy)
-			{
-				std::wostringstream oss;
+	return oss.str();
+}
 
-				oss << L"AppServiceConnection::OpenAsync failed: " << static_cast<int>(status);
-				onErrorCopy(oss.str());
-			}
+hstring ComputeQueryHash(const hstring& query)
+{
+	const auto provider = HashAlgorithmProvider::OpenAlgorithm(HashAlgorithmNames::Sha256());
 
-			co_return false;
-		}
+	return CryptographicBuffer::EncodeToHexString(provider.HashData(CryptographicBuffer::ConvertStringToBinary(query, BinaryStringEncoding::Utf8)));
+}
 
-		m_serviceConnection.RequestReceived({ this, &Connection::OnRequestReceived });
+// Deeper than any response the bridge writes, and shallow enough that a hostile payload cannot
+// exhaust the stack.
+constexpr size_t c_maxCborDepth = 256;
 
-		m_opened = true;
+IJsonValue ReadCborValue(cbor::Reader& reader, size_t depth = 0)
+{
+	if (depth > c_maxCborDepth)
+	{
+		throw std::runtime_error("CBOR response is nested too deeply");
 	}
 
-	if (!m_started)
+	const auto item = reader.next();
+
+	switch (item.type)
 	{
-		JsonObject startService;
+		case cbor::ItemType::Null:
+			return JsonValue::CreateNullValue();
 
-		startService.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(m_nextRequestId++));
-		startService.SetNamedValue(L"type", JsonValue::CreateStringValue(L"startService"));
-		startService.SetNamedValue(L"useDefaultProfile", JsonValue::CreateBooleanValue(true));
+		case cbor::ItemType::Boolean:
+			return JsonValue::CreateBooleanValue(item.boolean);
 
-		ValueSet requests;
+		case cbor::ItemType::Integer:
+			return JsonValue::CreateNumberValue(static_cast<double>(item.integer));
 
-		requests.Insert(L"requests", PropertyValue::CreateStringArray({
-			startService.ToString(),
-			}));
+		case cbor::ItemType::Float:
+			return JsonValue::CreateNumberValue(item.number);
 
-		const auto messageResult = co_await m_serviceConnection.SendMessageAsync(requests);
-		const auto messageStatus = messageResult.Status();
+		case cbor::ItemType::Text:
+			return JsonValue::CreateStringValue(to_hstring(item.text));
 
-		if (messageStatus != AppServiceResponseStatus::Success)
+		case cbor::ItemType::Array:
 		{
-			if (onErrorCopy)
+			JsonArray elements;
+
+			for (size_t i = 0; i < item.count; ++i)
 			{
-				std::wostringstream oss;
+				elements.Append(ReadCborValue(reader, depth + 1));
+			}
 
-				oss << L"AppServiceConnection::SendMessageAsync(startService) failed: " << static_cast<int>(messageStatus);
-				onErrorCopy(oss.str());
+			return elements;
+		}
+
+		case cbor::ItemType::Map:
+		{
+			JsonObject members;
+
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				const auto key = reader.next();
+
+				if (key.type != cbor::ItemType::Text)
+				{
+					throw std::runtime_error("CBOR map keys must be text");
+				}
+
+				members.SetNamedValue(to_hstring(key.text), ReadCborValue(reader, depth + 1));
 			}
 
-			co_return false;
+			return members;
 		}
 
-		m_started = true;
+		default:
+			throw std::runtime_error("Unexpected CBOR byte string");
 	}
-
-	co_return true;
 }
 
-void Connection::Close() const
+std::vector<std::wstring> ParseJsonPointer(std::wstring_view path)
 {
-	if (m_opened)
+	std::vector<std::wstring> tokens;
+
+	if (path.empty())
 	{
-		m_serviceConnection.Close();
-		m_opened = false;
+		return tokens;
 	}
-}
 
-IAsyncAction Connection::OnRequestReceived(const AppServiceConnection& /* sender */, const AppServiceRequestReceivedEventArgs& args) const
-{
-	const auto strong_this { const_cast<Connection*>(this)->get_strong() };
-	const auto messageDeferral { args.GetDeferral() };
-	const auto messageRequest { args.Request() };
-	const auto message { messageRequest.Message() };
-	com_array<hstring> responses;
-	bool stopped = false;
+	if (path.front() != L'/')
+	{
+		throw std::invalid_argument("Invalid JSON Pointer");
+	}
 
-	message.Lookup(L"responses").as<IPropertyValue>().GetStringArray(responses);
+	tokens.emplace_back();
 
-	for (const auto& response : responses)
+	for (size_t i = 1; i < path.size(); ++i)
 	{
-		const auto responseObject = JsonObject::Parse(response);
-		const auto requestId = static_cast<std::int32_t>(responseObject.GetNamedNumber(L"requestId"));
-		const auto type = responseObject.GetNamedString(L"type");
+		const auto ch = path[i];
 
-		if (type == L"parsed")
+		if (ch == L'/')
 		{
-			const auto itr = m_onParsed.find(requestId);
-
-			if (itr != m_onParsed.end())
-			{
-				co_await itr->second(static_cast<std::int32_t>(responseObject.GetNamedNumber(L"queryId")));
-				m_onParsed.erase(itr);
-			}
-
-			m_onError.erase(requestId);
+			tokens.emplace_back();
 		}
-		else if (type == L"next")
+		else if (ch == L'~'
+			&& i + 1 < path.size()
+			&& (path[i + 1] == L'0' || path[i + 1] == L'1'))
 		{
-			const auto itr = m_onNext.find(requestId);
-
-			if (itr != m_onNext.end())
-			{
-				co_await itr->second(responseObject.GetNamedObject(L"fetched"));
-			}
+			tokens.back().push_back(path[++i] == L'0' ? L'~' : L'/');
 		}
-		else if (type == L"complete")
+		else
 		{
-			const auto itr = m_onComplete.find(requestId);
+			tokens.back().push_back(ch);
+		}
+	}
 
-			if (itr != m_onComplete.end())
-			{
-				co_await itr->second(responseObject.GetNamedObject(L"fetched"));
-				m_onComplete.erase(itr);
-			}
+	return tokens;
+}
 
-			m_onNext.erase(requestId);
-			m_onError.erase(requestId);
-		}
-		else if (type == L"error")
+// Applies the "add", "remove" and "replace" operations the bridge sends in a "nextPatch" response,
+// and returns the patched document in case the whole thing was replaced.
+IJsonValue ApplyJsonPatch(IJsonValue document, const JsonArray& operations)
+{
+	for (const auto& entry : operations)
+	{
+		const auto operation = entry.as<JsonObject>();
+		const auto op = operation.GetNamedString(L"op");
+		const auto tokens = ParseJsonPointer(operation.GetNamedString(L"path"));
+
+		if (tokens.empty())
 		{
-			const auto itr = m_onError.find(requestId);
+			document = (op == L"remove" ? JsonValue::CreateNullValue() : operation.GetNamedValue(L"value"));
+			continue;
+		}
 
-			if (itr != m_onError.end())
-			{
-				co_await itr->second(responseObject.GetNamedString(L"message"));
-				m_onError.erase(itr);
-			}
+		auto parent = document;
 
-			m_onParsed.erase(requestId);
-			m_onNext.erase(requestId);
-			m_onComplete.erase(requestId);
-			m_onStopped.erase(requestId);
+		for (size_t i = 0; i + 1 < tokens.size(); ++i)
+		{
+			parent = (parent.ValueType() == JsonValueType::Array
+				? parent.as<JsonArray>().GetAt(static_cast<std::uint32_t>(std::stoul(tokens[i])))
+				: parent.as<JsonObject>().GetNamedValue(tokens[i]));
 		}
-		else if (type == L"stopped")
+
+		const auto& token = tokens.back();
+
+		if (parent.ValueType() == JsonValueType::Array)
 		{
-			const auto itr = m_onStopped.find(requestId);
+			const auto elements = parent.as<JsonArray>();
+			const auto index = (token == L"-" ? elements.Size() : static_cast<std::uint32_t>(std::stoul(token)));
 
-			if (itr != m_onStopped.end())
+			if (op == L"add")
 			{
-				co_await itr->second();
-				m_onStopped.erase(itr);
+				elements.InsertAt(index, operation.GetNamedValue(L"value"));
+			}
+			else if (op == L"replace")
+			{
+				elements.SetAt(index, operation.GetNamedValue(L"value"));
+			}
+			else if (op == L"remove")
+			{
+				elements.RemoveAt(index);
 			}
-
-			m_onError.erase(requestId);
-			stopped = true;
-			break;
 		}
 		else
 		{
-			const auto itr = m_onError.find(requestId);
+			const auto members = parent.as<JsonObject>();
 
-			if (itr != m_onError.end())
+			if (op == L"remove")
 			{
-				std::wostringstream oss;
-
-				oss << L"Unexpected response type: " << std::wstring_view { type };
-				co_await itr->second(oss.str());
+				members.Remove(token);
+			}
+			else
+			{
+				members.SetNamedValue(token, operation.GetNamedValue(L"value"));
 			}
 		}
 	}
 
-	messageDeferral.Complete();
-
-	if (stopped)
-	{
-		Close();
-	}
-
-	co_return;
-}
-
-Connection::~Connection()
-{
-	Close();
+	return document;
 }
 
-IAsyncAction Connection::Shutdown(const StoppedHandler& onStopped, const ErrorHandler& onError) const
+// Adds the items from a "nextItems" response to the end of the list at tokens[depth...], and returns
+// the result as a copy of document. Only the objects and arrays along the path are copied, everything
+// else is shared with document, which onNext may still be holding on to.
+IJsonValue AppendJsonItems(const IJsonValue& document, const std::vector<std::wstring>& tokens, size_t depth, const JsonArray& items)
 {
-	const auto onStoppedCopy { onStopped };
-	const auto onErrorCopy { onError };
-
-	if (m_started)
+	if (depth == tokens.size())
 	{
-		const auto requestId = m_nextRequestId++;
+		JsonArray list;
 
-		m_onStopped[requestId] = onStoppedCopy;
-
-		if (onErrorCopy)
+		for (const auto& element : document.as<JsonArray>())
 		{
-			m_onError[requestId] = onErrorCopy;
+			list.Append(element);
 		}
 
-		JsonObject stopService;
-
-		stopService.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
-		stopService.SetNamedValue(L"type", JsonValue::CreateStringValue(L"stopService"));
+		for (const auto& item : items)
+		{
+			list.Append(item);
+		}
 
-		ValueSet requests;
+		return list;
+	}
 
-		requests.Insert(L"requests", PropertyValue::CreateStringArray({
-			stopService.ToString(),
-			}));
+	const auto& token = tokens[depth];
 
-		const auto messageResult = co_await m_serviceConnection.SendMessageAsync(requests);
+	if (document.ValueType() == JsonValueType::Array)
+	{
+		const auto elements = document.as<JsonArray>();
+		const auto index = static_cast<std::uint32_t>(std::stoul(token));
+		JsonArray copy;
 
-		if (onErrorCopy)
+		for (std::uint32_t i = 0; i < elements.Size(); ++i)
 		{
-			const auto messageStatus = messageResult.Status();
-
-			if (messageStatus != AppServiceResponseStatus::Success)
-			{
-				std::wostringstream oss;
-
-				oss << L"AppServiceConnection::SendMessageAsync(stopService) failed: " << static_cast<int>(messageStatus);
-				onErrorCopy(oss.str());
-			}
-
-			co_return;
+			copy.Append(i == index ? AppendJsonItems(elements.GetAt(i), tokens, depth + 1, items) : elements.GetAt(i));
 		}
 
-		m_started = false;
+		return copy;
 	}
-	else if (onStoppedCopy)
+
+	JsonObject copy;
+
+	for (const auto& member : document.as<JsonObject>())
 	{
-		onStoppedCopy();
+		copy.SetNamedValue(member.Key(), member.Key() == token ? AppendJsonItems(member.Value(), tokens, depth + 1, items) : member.Value());
 	}
+
+	return copy;
 }
 
-IAsyncAction Connection::ParseQuery(const hstring& query,
-	const ParsedHandler& onParsed, const ErrorHandler& onError) const
+// The bridge sends JSON text in "responses", or a single CBOR array in "cborResponses" once we
+// have offered to read CBOR in startService.
+std::vector<JsonObject> ReadResponses(const TransportMessage& message)
 {
-	const auto queryCopy { query };
-	const auto onParsedCopy { onParsed };
-	const auto onErrorCopy { onError };
+	std::vector<JsonObject> responseObjects;
 
-	if (!co_await OpenAsync(onError))
+	if (!message.cborResponses.empty())
 	{
-		co_return;
-	}
+		cbor::Reader reader { message.cborResponses.data(), message.cborResponses.size() };
+		const auto responses = reader.next();
 
-	const auto requestId = m_nextRequestId++;
+		if (responses.type != cbor::ItemType::Array)
+		{
+			throw std::runtime_error("Expected a CBOR array of responses");
+		}
 
-	m_onParsed[requestId] = onParsedCopy;
+		responseObjects.reserve(responses.count);
 
-	if (onErrorCopy)
-	{
-		m_onError[requestId] = onErrorCopy;
+		for (size_t i = 0; i < responses.count; ++i)
+		{
+			responseObjects.push_back(ReadCborValue(reader).as<JsonObject>());
+		}
 	}
+	else
+	{
+		responseObjects.reserve(message.responses.size());
 
-	JsonObject parseQuery;
+		for (const auto& response : message.responses)
+		{
+			responseObjects.push_back(JsonObject::Parse(response));
+		}
+	}
 
-	parseQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
-	parseQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"parseQuery"));
-	parseQuery.SetNamedValue(L"query", JsonValue::CreateStringValue(queryCopy));
+	return responseObjects;
+}
 
-	ValueSet requests;
+} // namespace
 
-	requests.Insert(L"requests", PropertyValue::CreateStringArray({
-		parseQuery.ToString(),
-		}));
+Connection::Connection(bool useDefaultProfile)
+	: m_useDefaultProfile { useDefaultProfile }
+	, m_tracePrefix { MakeTracePrefix() }
+	, m_transport { std::make_shared<AppServiceTransport>(m_serviceConnection) }
+{
+	m_serviceConnection.AppServiceName(L"gqlmapi.client");
+	m_serviceConnection.PackageFamilyName(L"a7012456-f540-4a9d-8203-e902b637742f_rs2j33705jmqp");
+}
 
-	const auto messageResult = co_await m_serviceConnection.SendMessageAsync(requests);
+IAsyncOperation<bool> Connection::OpenAsync(const ErrorHandler& onError) const
+{
+	const auto onErrorCopy { onError };
 
-	if (onErrorCopy)
+	if (!m_opened)
 	{
-		const auto messageStatus = messageResult.Status();
+		const auto status = co_await m_serviceConnection.OpenAsync();
 
-		if (messageStatus != AppServiceResponseStatus::Success)
+		if (status != AppServiceConnectionStatus::Success)
 		{
-			std::wostringstream oss;
+			if (onErrorCopy)
+			{
+				std::wostringstream oss;
+
+				oss << L"AppServiceConnection::OpenAsync failed: " << static_cast<int>(status);
+				onErrorCopy(oss.str());
+			}
 
-			oss << L"AppServiceConnection::SendMessageAsync(parseQuery) failed: " << static_cast<int>(messageStatus);
-			onErrorCopy(oss.str());
+			co_return false;
 		}
+
+		m_transport->receive([this](TransportMessage&& message, MessageTransport::Completion done) {
+			OnMessageReceived(std::move(message), std::move(done));
+		});
+
+		m_opened = true;
 	}
-}
 
-IAsyncAction Connection::DiscardQuery(std::int32_t queryId) const
-{
 	if (!m_started)
 	{
-		co_return;
-	}
+		JsonObject startService;
 
-	const auto requestId = m_nextRequestId++;
-	JsonObject discardQuery;
+		startService.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(m_nextRequestId++));
+		startService.SetNamedValue(L"type", JsonValue::CreateStringValue(L"startService"));
+		startService.SetNamedValue(L"useDefaultProfile", JsonValue::CreateBooleanValue(true));
 
-	discardQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
-	discardQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"discardQuery"));
-	discardQuery.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
+		JsonArray encodings;
+
+		encodings.Append(JsonValue::CreateStringValue(L"cbor"));
+		startService.SetNamedValue(L"encodings", encodings);
 
-	ValueSet queueRequests;
+		if (m_sharedMemoryBytes > 0)
+		{
+			startService.SetNamedValue(L"sharedMemoryBytes", JsonValue::CreateNumberValue(m_sharedMemoryBytes));
+
+			// The bridge has to create the region where this app container can open it.
+			if (const auto appContainerSid = shm::currentAppContainerSid(); !appContainerSid.empty())
+			{
+				startService.SetNamedValue(L"appContainerSid", JsonValue::CreateStringValue(to_hstring(appContainerSid)));
+			}
+		}
+
+		// Queue it like any other request, so it cannot overtake a stopService which is still waiting to be sent.
+		QueueRequest(L"startService", startService, onErrorCopy);
 
-	queueRequests.Insert(L"requests", PropertyValue::CreateStringArray({
-		discardQuery.ToString(),
-		}));
+		m_started = true;
+	}
 
-	co_await m_serviceConnection.SendMessageAsync(queueRequests);
+	co_return true;
 }
 
-IAsyncAction Connection::FetchQuery(std::int32_t queryId, const hstring& operationName, const JsonObject& variables,
-	const FetchedHandler& onNext, const FetchedHandler& onComplete, const ErrorHandler& onError) const
+void Connection::Close() const
 {
-	const auto operationNameCopy { operationName };
-	const auto variablesCopy { variables };
-	const auto onNextCopy { onNext };
-	const auto onCompleteCopy { onComplete };
-	const auto onErrorCopy { onError };
-
-	if (!co_await OpenAsync(onError))
+	if (m_opened)
 	{
-		co_return;
+		m_serviceConnection.Close();
+		m_opened = false;
 	}
+}
 
-	const auto requestId = m_nextRequestId++;
+IAsyncAction Connection::OnMessageReceived(TransportMessage message, MessageTransport::Completion done) const
+{
+	const auto strong_this { const_cast<Connection*>(this)->get_strong() };
+	const auto parseStart = LatencyHistogram::Clock::now();
+	const auto traceStart = trace::now();
+	std::vector<JsonObject> responses;
+	bool stopped = false;
 
-	if (onNextCopy)
+	try
 	{
-		m_onNext[requestId] = onNextCopy;
+		responses = ReadResponses(message);
 	}
-
-	if (onCompleteCopy)
+	catch (const std::exception&)
 	{
-		m_onComplete[requestId] = onCompleteCopy;
+		// There is no request to report a message we cannot read to.
 	}
-
-	if (onErrorCopy)
+	catch (const hresult_error&)
 	{
-		m_onError[requestId] = onErrorCopy;
 	}
 
-	JsonObject fetchQuery;
-
-	fetchQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
-	fetchQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"fetchQuery"));
-	fetchQuery.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
-	fetchQuery.SetNamedValue(L"operationName", JsonValue::CreateStringValue(operationNameCopy));
-	fetchQuery.SetNamedValue(L"variables", variablesCopy);
+	m_latency.get(L"responseParse").recordSince(parseStart);
+	trace::Tracer::instance().record("responseParse", {}, 0, traceStart, trace::now(), static_cast<std::int32_t>(responses.size()));
 
-	ValueSet queueRequests;
+	// A response which fails only fails its own request, the rest of the message is still delivered
+	// and done is always called.
+	for (const auto& responseObject : responses)
+	{
+		hstring failure;
 
-	queueRequests.Insert(L"requests", PropertyValue::CreateStringArray({
-		fetchQuery.ToString(),
-		}));
+		try
+		{
+			stopped = co_await HandleResponseAsync(responseObject);
+		}
+		catch (const std::exception& ex)
+		{
+			failure = to_hstring(ex.what());
+		}
+		catch (const hresult_error& hr)
+		{
+			failure = hr.message();
+		}
 
-	const auto messageResult = co_await m_serviceConnection.SendMessageAsync(queueRequests);
+		if (!failure.empty()
+			&& responseObject.HasKey(L"requestId"))
+		{
+			const auto record = m_requests.take(static_cast<std::int32_t>(responseObject.GetNamedNumber(L"requestId")));
 
-	if (onErrorCopy)
-	{
-		const auto messageStatus = messageResult.Status();
+			if (record
+				&& record->onError)
+			{
+				co_await record->onError(failure);
+			}
+		}
 
-		if (messageStatus != AppServiceResponseStatus::Success)
+		if (stopped)
 		{
-			std::wostringstream oss;
-
-			oss << L"AppServiceConnection::SendMessageAsync(fetchQuery) failed: " << static_cast<int>(messageStatus);
-			onErrorCopy(oss.str());
+			break;
 		}
 	}
-}
 
-IAsyncAction Connection::Unsubscribe(std::int32_t queryId) const
-{
-	if (!m_started)
+	done(nullptr);
+
+	if (stopped)
+	{
+		Close();
+	}
+
+	co_return;
+}
+
+// Handles one response, returns true once the bridge has stopped.
+IAsyncOperation<bool> Connection::HandleResponseAsync(JsonObject responseObject) const
+{
+	if (responseObject.GetNamedString(L"type") == L"shared")
+	{
+		responseObject = ReadSharedResponse(static_cast<std::uint64_t>(responseObject.GetNamedNumber(L"sequence")));
+	}
+
+	if (responseObject.HasKey(L"requestIds"))
+	{
+		// One "next" payload for every subscription that shares the same upstream subscription.
+		const auto fetched = responseObject.GetNamedObject(L"fetched");
+
+		for (const auto& id : responseObject.GetNamedArray(L"requestIds"))
+		{
+			const auto sharedRequestId = static_cast<std::int32_t>(id.GetNumber());
+			FetchedHandler onNext;
+			std::optional<FetchTiming> timing;
+
+			m_requests.update(sharedRequestId, [&](RequestRecord& record) {
+				onNext = record.onNext;
+				timing = std::exchange(record.timing, std::nullopt);
+				record.deadline.reset();
+			});
+			RecordRoundTrip(sharedRequestId, timing);
+
+			if (onNext)
+			{
+				const auto callbackStart = LatencyHistogram::Clock::now();
+
+				co_await onNext(fetched);
+				m_latency.get(L"callback").recordSince(callbackStart);
+			}
+		}
+
+		co_return false;
+	}
+
+	const auto requestId = static_cast<std::int32_t>(responseObject.GetNamedNumber(L"requestId"));
+	const auto type = responseObject.GetNamedString(L"type");
+
+	if (type == L"parsed")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record
+			&& record->onParsed)
+		{
+			co_await record->onParsed(static_cast<std::int32_t>(responseObject.GetNamedNumber(L"queryId")));
+		}
+	}
+	else if (type == L"persistedQueryNotFound")
+	{
+		hstring query;
+
+		m_requests.update(requestId, [&](RequestRecord& record) {
+			query = std::exchange(record.persistedQuery, {});
+		});
+
+		if (!query.empty())
+		{
+			// The bridge has not seen this document yet, send it once along with its hash.
+			JsonObject parseQuery;
+
+			parseQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+			parseQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"parseQuery"));
+			parseQuery.SetNamedValue(L"queryHash", JsonValue::CreateStringValue(responseObject.GetNamedString(L"queryHash")));
+			parseQuery.SetNamedValue(L"query", JsonValue::CreateStringValue(query));
+
+			QueueRequest(L"parseQuery", parseQuery, nullptr);
+		}
+	}
+	else if (type == L"sharedMemory")
+	{
+		AttachSharedMemory(responseObject.GetNamedString(L"name"));
+	}
+	else if (type == L"next")
+	{
+		const auto fetched = responseObject.GetNamedObject(L"fetched");
+		FetchedHandler onNext;
+		std::optional<FetchTiming> timing;
+
+		m_requests.update(requestId, [&](RequestRecord& record) {
+			if (record.keepSnapshot)
+			{
+				record.snapshot = fetched;
+			}
+
+			onNext = record.onNext;
+			timing = std::exchange(record.timing, std::nullopt);
+			record.deadline.reset();
+		});
+		RecordRoundTrip(requestId, timing);
+
+		if (onNext)
+		{
+			const auto callbackStart = LatencyHistogram::Clock::now();
+
+			co_await onNext(fetched);
+			m_latency.get(L"callback").recordSince(callbackStart);
+		}
+	}
+	else if (type == L"nextPatch")
+	{
+		JsonObject snapshot { nullptr };
+		FetchedHandler onNext;
+		ErrorHandler onError;
+
+		// Cancel drops the records of every fetch for the query, while patches may still be on their way.
+		if (!m_requests.update(requestId, [&](RequestRecord& record) {
+				snapshot = record.snapshot;
+				onNext = record.onNext;
+				onError = record.onError;
+			}))
+		{
+			co_return false;
+		}
+
+		if (!snapshot)
+		{
+			if (onError)
+			{
+				co_await onError(L"Received a patch without a snapshot");
+			}
+
+			co_return false;
+		}
+
+		// The previous snapshot was handed to onNext, so patch a copy of it.
+		const auto fetched = ApplyJsonPatch(JsonObject::Parse(snapshot.ToString()), responseObject.GetNamedArray(L"fetched")).as<JsonObject>();
+
+		m_requests.update(requestId, [&](RequestRecord& record) {
+			record.snapshot = fetched;
+		});
+
+		if (onNext)
+		{
+			co_await onNext(fetched);
+		}
+	}
+	else if (type == L"nextItems")
+	{
+		JsonObject snapshot { nullptr };
+		FetchedHandler onNext;
+		ErrorHandler onError;
+
+		if (!m_requests.update(requestId, [&](RequestRecord& record) {
+				snapshot = record.snapshot;
+				onNext = record.onNext;
+				onError = record.onError;
+			}))
+		{
+			co_return false;
+		}
+
+		if (!snapshot)
+		{
+			if (onError)
+			{
+				co_await onError(L"Received list items without a snapshot");
+			}
+
+			co_return false;
+		}
+
+		const auto chunk = responseObject.GetNamedObject(L"fetched");
+		const auto fetched = AppendJsonItems(snapshot, ParseJsonPointer(chunk.GetNamedString(L"path")), 0, chunk.GetNamedArray(L"items")).as<JsonObject>();
+
+		m_requests.update(requestId, [&](RequestRecord& record) {
+			record.snapshot = fetched;
+		});
+
+		if (onNext)
+		{
+			co_await onNext(fetched);
+		}
+	}
+	else if (type == L"complete")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record)
+		{
+			RecordRoundTrip(requestId, record->timing);
+
+			if (record->onComplete)
+			{
+				const auto callbackStart = LatencyHistogram::Clock::now();
+				const auto fetched = responseObject.GetNamedValue(L"fetched");
+
+				// A streamed result ends with an empty "complete", the snapshot holds all of it.
+				co_await record->onComplete(fetched.ValueType() == JsonValueType::Null ? record->snapshot : fetched.as<JsonObject>());
+				m_latency.get(L"callback").recordSince(callbackStart);
+			}
+		}
+	}
+	else if (type == L"stats"
+		|| type == L"relayStats")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record
+			&& record->onStats)
+		{
+			if (type == L"stats")
+			{
+				auto latency = responseObject.HasKey(L"latency") ? responseObject.GetNamedObject(L"latency") : JsonObject {};
+				JsonObject client;
+
+				client.SetNamedValue(L"stages", latencyToJson(m_latency));
+				client.SetNamedValue(L"operations", latencyToJson(m_operationLatency));
+				latency.SetNamedValue(L"client", client);
+				responseObject.SetNamedValue(L"latency", latency);
+
+				if (record->resetStats)
+				{
+					m_latency.reset();
+					m_operationLatency.reset();
+				}
+			}
+
+			co_await record->onStats(responseObject);
+		}
+	}
+	else if (type == L"cancelled")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record
+			&& record->onCancelled)
+		{
+			co_await record->onCancelled(responseObject);
+		}
+	}
+	else if (type == L"timeout")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record
+			&& record->onError)
+		{
+			co_await record->onError(hstring { c_timedOut });
+		}
+	}
+	else if (type == L"error")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record)
+		{
+			RecordRoundTrip(requestId, record->timing);
+
+			if (record->onError)
+			{
+				co_await record->onError(responseObject.GetNamedString(L"message"));
+			}
+		}
+	}
+	else if (type == L"stopped")
+	{
+		const auto record = m_requests.take(requestId);
+
+		if (record
+			&& record->onStopped)
+		{
+			co_await record->onStopped();
+		}
+
+		co_return true;
+	}
+	else
+	{
+		ErrorHandler onError;
+
+		m_requests.update(requestId, [&](RequestRecord& record) {
+			onError = record.onError;
+		});
+
+		if (onError)
+		{
+			std::wostringstream oss;
+
+			oss << L"Unexpected response type: " << std::wstring_view { type };
+			co_await onError(oss.str());
+		}
+	}
+
+	co_return false;
+}
+
+Connection::~Connection()
+{
+	Close();
+}
+
+IAsyncAction Connection::Shutdown(const StoppedHandler& onStopped, const ErrorHandler& onError) const
+{
+	const auto onStoppedCopy { onStopped };
+	const auto onErrorCopy { onError };
+
+	if (m_started)
+	{
+		const auto requestId = m_nextRequestId++;
+		RequestRecord record;
+
+		record.onStopped = onStoppedCopy;
+		record.onError = onErrorCopy;
+		m_requests.insert(requestId, std::move(record));
+
+		JsonObject stopService;
+
+		stopService.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+		stopService.SetNamedValue(L"type", JsonValue::CreateStringValue(L"stopService"));
+
+		QueueRequest(L"stopService", stopService, nullptr);
+
+		m_started = false;
+	}
+	else if (onStoppedCopy)
+	{
+		co_await onStoppedCopy();
+	}
+}
+
+IAsyncAction Connection::ParseQuery(const hstring& query,
+	const ParsedHandler& onParsed, const ErrorHandler& onError) const
+{
+	const auto queryCopy { query };
+	const auto onParsedCopy { onParsed };
+	const auto onErrorCopy { onError };
+
+	if (!co_await OpenAsync(onError))
+	{
+		co_return;
+	}
+
+	const auto requestId = m_nextRequestId++;
+	RequestRecord record;
+
+	record.onParsed = onParsedCopy;
+	record.onError = onErrorCopy;
+	record.persistedQuery = queryCopy;
+	m_requests.insert(requestId, std::move(record));
+
+	// Try the hash first, the bridge will ask for the full text if it does not recognize it.
+	JsonObject parseQuery;
+
+	parseQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+	parseQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"parseQuery"));
+	parseQuery.SetNamedValue(L"queryHash", JsonValue::CreateStringValue(ComputeQueryHash(queryCopy)));
+
+	QueueRequest(L"parseQuery", parseQuery, nullptr);
+}
+
+IAsyncAction Connection::DiscardQuery(std::int32_t queryId) const
+{
+	if (!m_started)
+	{
+		co_return;
+	}
+
+	const auto requestId = m_nextRequestId++;
+	JsonObject discardQuery;
+
+	discardQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+	discardQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"discardQuery"));
+	discardQuery.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
+
+	QueueRequest(L"discardQuery", discardQuery, nullptr);
+}
+
+IAsyncAction Connection::FetchQuery(std::int32_t queryId, const hstring& operationName, const JsonObject& variables,
+	const FetchedHandler& onNext, const FetchedHandler& onComplete, const ErrorHandler& onError) const
+{
+	return FetchQueryWithOptions(queryId, operationName, variables, nullptr, onNext, onComplete, onError);
+}
+
+IAsyncAction Connection::FetchQueryWithOptions(std::int32_t queryId, const hstring& operationName, const JsonObject& variables,
+	const clientlib::FetchOptions& options, const FetchedHandler& onNext, const FetchedHandler& onComplete, const ErrorHandler& onError) const
+{
+	const auto operationNameCopy { operationName };
+	const auto variablesCopy { variables };
+	const auto optionsCopy { options };
+	const auto onNextCopy { onNext };
+	const auto onCompleteCopy { onComplete };
+	const auto onErrorCopy { onError };
+
+	if (!co_await OpenAsync(onError))
+	{
+		co_return;
+	}
+
+	const auto requestId = m_nextRequestId++;
+	RequestRecord record;
+
+	record.onNext = onNextCopy;
+	record.onComplete = onCompleteCopy;
+	record.onError = onErrorCopy;
+	record.timing = FetchTiming { LatencyHistogram::Clock::now(), operationNameCopy, trace::now() };
+	record.queryId = queryId;
+
+	JsonObject fetchQuery;
+
+	fetchQuery.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+	fetchQuery.SetNamedValue(L"type", JsonValue::CreateStringValue(L"fetchQuery"));
+	fetchQuery.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
+	fetchQuery.SetNamedValue(L"operationName", JsonValue::CreateStringValue(operationNameCopy));
+	fetchQuery.SetNamedValue(L"variables", variablesCopy);
+
+	if (optionsCopy
+		&& optionsCopy.MaxPendingPayloads() > 0)
+	{
+		fetchQuery.SetNamedValue(L"maxPendingPayloads", JsonValue::CreateNumberValue(optionsCopy.MaxPendingPayloads()));
+	}
+
+	if (optionsCopy
+		&& optionsCopy.DeltaPayloads())
+	{
+		// The snapshot is filled in by the first full "next" payload, every "nextPatch" after that
+		// applies to it.
+		record.keepSnapshot = true;
+		fetchQuery.SetNamedValue(L"deltaPayloads", JsonValue::CreateBooleanValue(true));
+
+		if (optionsCopy.ResyncInterval() > 0)
+		{
+			fetchQuery.SetNamedValue(L"resyncInterval", JsonValue::CreateNumberValue(optionsCopy.ResyncInterval()));
+		}
+	}
+
+	if (optionsCopy
+		&& optionsCopy.StreamChunkSize() > 0)
+	{
+		record.keepSnapshot = true;
+		fetchQuery.SetNamedValue(L"streamChunkSize", JsonValue::CreateNumberValue(optionsCopy.StreamChunkSize()));
+	}
+
+	if (optionsCopy
+		&& optionsCopy.Timeout() > 0)
+	{
+		const std::chrono::milliseconds timeout { optionsCopy.Timeout() };
+		const auto deadline = std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() + timeout).time_since_epoch());
+
+		// The bridge checks the deadline against its own clock, so it travels as wall clock time.
+		record.deadline = TimerWheel<std::int32_t>::Clock::now() + timeout;
+		fetchQuery.SetNamedValue(L"deadline", JsonValue::CreateNumberValue(static_cast<double>(deadline.count())));
+	}
+
+	if (optionsCopy)
+	{
+		switch (optionsCopy.Priority())
+		{
+			case clientlib::FetchPriority::Interactive:
+				fetchQuery.SetNamedValue(L"priority", JsonValue::CreateStringValue(L"interactive"));
+				break;
+
+			case clientlib::FetchPriority::Background:
+				fetchQuery.SetNamedValue(L"priority", JsonValue::CreateStringValue(L"background"));
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	const auto deadline = record.deadline;
+
+	m_requests.insert(requestId, std::move(record));
+
+	if (deadline)
+	{
+		ScheduleDeadline(requestId, *deadline);
+	}
+
+	QueueRequest(L"fetchQuery", fetchQuery, nullptr);
+}
+
+IAsyncAction Connection::Unsubscribe(std::int32_t queryId) const
+{
+	if (!m_started)
 	{
 		co_return;
 	}
@@ -400,13 +954,424 @@ IAsyncAction Connection::Unsubscribe(std::int32_t queryId) const
 	unsubscribe.SetNamedValue(L"type", JsonValue::CreateStringValue(L"unsubscribe"));
 	unsubscribe.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
 
-	ValueSet queueRequests;
+	QueueRequest(L"unsubscribe", unsubscribe, nullptr);
+}
+
+IAsyncAction Connection::Cancel(std::int32_t queryId, const CancelledHandler& onCancelled) const
+{
+	const auto onCancelledCopy { onCancelled };
+
+	if (!m_started)
+	{
+		co_return;
+	}
+
+	// Payloads which are already on their way find no handlers once the fetch's records are gone.
+	m_requests.eraseIf([queryId](const RequestRecord& record) noexcept {
+		return record.queryId == queryId;
+	});
+
+	const auto requestId = m_nextRequestId++;
+
+	if (onCancelledCopy)
+	{
+		RequestRecord record;
+
+		record.onCancelled = onCancelledCopy;
+		m_requests.insert(requestId, std::move(record));
+	}
+
+	JsonObject cancel;
+
+	cancel.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+	cancel.SetNamedValue(L"type", JsonValue::CreateStringValue(L"cancel"));
+	cancel.SetNamedValue(L"queryId", JsonValue::CreateNumberValue(queryId));
+
+	QueueRequest(L"cancel", cancel, nullptr);
+}
+
+IAsyncAction Connection::GetStats(bool reset, const StatsHandler& onStats, const ErrorHandler& onError) const
+{
+	const auto onStatsCopy { onStats };
+	const auto onErrorCopy { onError };
+
+	if (!co_await OpenAsync(onError))
+	{
+		co_return;
+	}
+
+	const auto requestId = m_nextRequestId++;
+	RequestRecord record;
+
+	record.onStats = onStatsCopy;
+	record.resetStats = reset;
+	record.onError = onErrorCopy;
+	m_requests.insert(requestId, std::move(record));
+
+	JsonObject stats;
+
+	stats.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(requestId));
+	stats.SetNamedValue(L"type", JsonValue::CreateStringValue(L"stats"));
+	stats.SetNamedValue(L"reset", JsonValue::CreateBooleanValue(reset));
+
+	QueueRequest(L"stats", stats, nullptr);
+}
+
+IAsyncAction Connection::GetRelayStats(bool reset, const StatsHandler& onStats, const ErrorHandler& onError) const
+{
+	const auto onStatsCopy { onStats };
+	const auto onErrorCopy { onError };
+
+	if (!co_await OpenAsync(onError))
+	{
+		co_return;
+	}
+
+	const auto requestId = m_nextRequestId++;
+	RequestRecord record;
+
+	record.onStats = onStatsCopy;
+	record.resetStats = reset;
+	m_requests.insert(requestId, std::move(record));
+
+	// The relay answers this itself instead of forwarding it to the bridge.
+	TransportMessage relayStats;
+
+	relayStats.relayStats = requestId;
+	relayStats.resetStats = reset;
+
+	std::wstring failure;
+
+	try
+	{
+		co_await sendMessageAsync(*m_transport, std::move(relayStats));
+	}
+	catch (const hresult_error& hr)
+	{
+		failure = hr.message();
+	}
+	catch (const std::exception& ex)
+	{
+		failure = to_hstring(ex.what());
+	}
+
+	if (!failure.empty())
+	{
+		m_requests.erase(requestId);
+
+		if (onErrorCopy)
+		{
+			std::wostringstream oss;
+
+			oss << L"Sending relayStats failed: " << failure;
+			co_await onErrorCopy(oss.str());
+		}
+	}
+}
+
+std::int32_t Connection::BatchWindow() const
+{
+	return m_batchWindow;
+}
+
+void Connection::BatchWindow(std::int32_t value) const
+{
+	m_batchWindow = std::max(value, 0);
+}
+
+std::int64_t Connection::BatchesSent() const
+{
+	return m_batchesSent;
+}
+
+std::int64_t Connection::RequestsSent() const
+{
+	return m_requestsSent;
+}
+
+std::int32_t Connection::LargestBatch() const
+{
+	return m_largestBatch;
+}
+
+std::int32_t Connection::SharedMemoryBytes() const
+{
+	return m_sharedMemoryBytes;
+}
+
+void Connection::SharedMemoryBytes(std::int32_t value) const
+{
+	m_sharedMemoryBytes = std::max(value, 0);
+}
+
+hstring Connection::TracePath() const
+{
+	return m_tracePath;
+}
+
+void Connection::TracePath(const hstring& value) const
+{
+	// The tracer is shared by every connection in the process, the first path set wins.
+	if (value.empty())
+	{
+		trace::Tracer::instance().stop();
+	}
+	else
+	{
+		trace::Tracer::instance().start(std::wstring_view { value }, "client");
+	}
+
+	m_tracePath = value;
+}
+
+void Connection::AttachSharedMemory(const hstring& name) const
+{
+	JsonObject attachSharedMemory;
+
+	attachSharedMemory.SetNamedValue(L"requestId", JsonValue::CreateNumberValue(m_nextRequestId++));
+	attachSharedMemory.SetNamedValue(L"type", JsonValue::CreateStringValue(L"attachSharedMemory"));
+
+	try
+	{
+		m_sharedRegion = std::make_unique<SharedRegion>(to_string(name));
+	}
+	catch (const std::exception& ex)
+	{
+		// The bridge releases the region, keeps sending everything through the relay, and reports
+		// why in its stats.
+		m_sharedRegion.reset();
+		attachSharedMemory.SetNamedValue(L"error", JsonValue::CreateStringValue(to_hstring(ex.what())));
+	}
+
+	QueueRequest(L"attachSharedMemory", attachSharedMemory, nullptr);
+}
+
+JsonObject Connection::ReadSharedResponse(std::uint64_t sequence) const
+{
+	if (!m_sharedRegion)
+	{
+		throw std::runtime_error("Missing shared memory response");
+	}
+
+	auto& record = m_sharedRegion->record;
+
+	// Skips the records whose placeholders never got here, because the relay dropped them or
+	// reading them failed.
+	if (!m_sharedRegion->reader.tryReadSequence(sequence, record))
+	{
+		throw std::runtime_error("Missing shared memory response");
+	}
+
+	const auto& data = record.data;
+
+	// The tag is the encoding the bridge used: 0 for UTF-16 JSON text, 1 for CBOR.
+	if (record.tag == 0)
+	{
+		return JsonObject::Parse(std::wstring_view { reinterpret_cast<const wchar_t*>(data.data()), data.size() / sizeof(wchar_t) });
+	}
+
+	cbor::Reader reader { data.data(), data.size() };
+
+	return ReadCborValue(reader).as<JsonObject>();
+}
+
+void Connection::RecordRoundTrip(std::int32_t requestId, const std::optional<FetchTiming>& timing) const
+{
+	if (!timing)
+	{
+		return;
+	}
+
+	// Subscriptions only count the time to their first payload.
+	m_latency.get(L"roundTrip").recordSince(timing->started);
+	m_operationLatency.get(timing->operationName).recordSince(timing->started);
+	trace::Tracer::instance().record("fetchQuery", TraceId(requestId), requestId, timing->traceStart, trace::now());
+}
+
+std::string Connection::TraceId(std::int32_t requestId) const
+{
+	return m_tracePrefix + std::to_string(requestId);
+}
+
+void Connection::ScheduleDeadline(std::int32_t requestId, TimerWheel<std::int32_t>::Clock::time_point deadline) const
+{
+	std::unique_lock lock { m_deadlineMutex };
+
+	m_deadlines.schedule(deadline, std::int32_t { requestId });
+
+	if (!m_expiring)
+	{
+		m_expiring = true;
+		lock.unlock();
+
+		ExpireDeadlinesAsync();
+	}
+}
+
+fire_and_forget Connection::ExpireDeadlinesAsync() const
+{
+	const auto strong_this { const_cast<Connection*>(this)->get_strong() };
+
+	for (bool expiring = true; expiring;)
+	{
+		co_await resume_after(TimerWheel<std::int32_t>::c_tick);
 
-	queueRequests.Insert(L"requests", PropertyValue::CreateStringArray({
-		unsubscribe.ToString(),
-		}));
+		const auto now = TimerWheel<std::int32_t>::Clock::now();
+		std::vector<std::int32_t> expired;
+
+		{
+			std::lock_guard lock { m_deadlineMutex };
+
+			expired = m_deadlines.advance(now);
+			expiring = m_expiring = (m_deadlines.size() > 0);
+		}
+
+		for (const auto requestId : expired)
+		{
+			// Requests which finished or got their first payload in time no longer have a deadline.
+			const auto record = m_requests.takeIf(requestId, [now](const RequestRecord& record) noexcept {
+				return record.deadline
+					&& *record.deadline <= now;
+			});
+
+			if (record
+				&& record->onError)
+			{
+				co_await record->onError(hstring { c_timedOut });
+			}
+		}
+	}
+}
 
-	co_await m_serviceConnection.SendMessageAsync(queueRequests);
+// onError is only for requests without a RequestRecord, a failed send fails the others through
+// their record.
+void Connection::QueueRequest(std::wstring_view type, const JsonObject& request, const ErrorHandler& onError) const
+{
+	const auto requestId = static_cast<std::int32_t>(request.GetNamedNumber(L"requestId"));
+	std::string traceId;
+
+	if (trace::Tracer::instance().enabled())
+	{
+		traceId = TraceId(requestId);
+		request.SetNamedValue(L"trace", JsonValue::CreateStringValue(to_hstring(traceId)));
+	}
+
+	std::unique_lock lock { m_pendingMutex };
+
+	m_pendingRequests.push_back({ type, requestId, request.ToString(), onError, LatencyHistogram::Clock::now(), std::move(traceId) });
+
+	if (!m_flushing)
+	{
+		m_flushing = true;
+		lock.unlock();
+
+		FlushRequestsAsync();
+	}
+}
+
+fire_and_forget Connection::FlushRequestsAsync() const
+{
+	const auto strong_this { const_cast<Connection*>(this)->get_strong() };
+	const std::chrono::milliseconds window { m_batchWindow.load() };
+
+	// Let every request made in the same tick (or within the batch window) join this message.
+	if (window.count() > 0)
+	{
+		co_await resume_after(window);
+	}
+	else
+	{
+		co_await resume_background();
+	}
+
+	// Only one flush loop runs at a time, so the bridge sees requests in the order they were queued.
+	for (;;)
+	{
+		std::vector<PendingRequest> batch;
+
+		{
+			std::lock_guard lock { m_pendingMutex };
+
+			if (m_pendingRequests.empty())
+			{
+				m_flushing = false;
+				break;
+			}
+
+			batch = std::move(m_pendingRequests);
+			m_pendingRequests.clear();
+		}
+
+		TransportMessage queueRequests;
+		auto& queueLatency = m_latency.get(L"queue");
+
+		queueRequests.requests.reserve(batch.size());
+
+		for (const auto& pending : batch)
+		{
+			queueRequests.requests.emplace_back(pending.request);
+			queueLatency.recordSince(pending.queued);
+
+			if (!pending.trace.empty())
+			{
+				queueRequests.traces.emplace_back(to_hstring(pending.trace));
+			}
+		}
+
+		const auto batchSize = static_cast<std::int32_t>(queueRequests.requests.size());
+
+		++m_batchesSent;
+		m_requestsSent += batchSize;
+
+		for (auto largest = m_largestBatch.load(); largest < batchSize && !m_largestBatch.compare_exchange_weak(largest, batchSize);)
+		{
+		}
+
+		const auto sendStart = LatencyHistogram::Clock::now();
+		const auto traceStart = trace::now();
+		std::wstring failure;
+
+		// This loop is the only thing which clears m_flushing, so a failed send must not escape it.
+		// The transport also fails it when the relay's queue was full or the bridge went away before
+		// the requests reached it.
+		try
+		{
+			co_await sendMessageAsync(*m_transport, std::move(queueRequests));
+		}
+		catch (const hresult_error& hr)
+		{
+			failure = hr.message();
+		}
+		catch (const std::exception& ex)
+		{
+			failure = to_hstring(ex.what());
+		}
+
+		m_latency.get(L"send").recordSince(sendStart);
+		trace::Tracer::instance().record("send", batch.front().trace, 0, traceStart, trace::now(), batchSize);
+
+		if (!failure.empty())
+		{
+			for (const auto& pending : batch)
+			{
+				auto onError = pending.onError;
+
+				// Taking the record means a response or the request's deadline cannot fail it again.
+				if (const auto record = m_requests.take(pending.requestId))
+				{
+					onError = record->onError;
+				}
+
+				if (onError)
+				{
+					std::wostringstream oss;
+
+					oss << L"Sending " << pending.type << L" failed: " << failure;
+					co_await onError(oss.str());
+				}
+			}
+		}
+	}
 }
 
 }
@@ -2,9 +2,21 @@
 
 #include "Connection.g.h"
 
+#include "AppServiceTransport.h"
+#include "LatencyHistogram.h"
+#include "RequestTable.h"
+#include "TimerWheel.h"
+#include "TraceWriter.h"
+
 #include <atomic>
-#include <map>
+#include <chrono>
 #include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace winrt::clientlib::implementation {
 
@@ -20,26 +32,121 @@ struct Connection : ConnectionT<Connection>
 
 	Windows::Foundation::IAsyncAction FetchQuery(std::int32_t queryId, const hstring& operationName, const Windows::Data::Json::JsonObject& variables,
 		const FetchedHandler& onNext, const FetchedHandler& onComplete, const ErrorHandler& onError) const;
+	Windows::Foundation::IAsyncAction FetchQueryWithOptions(std::int32_t queryId, const hstring& operationName, const Windows::Data::Json::JsonObject& variables,
+		const clientlib::FetchOptions& options, const FetchedHandler& onNext, const FetchedHandler& onComplete, const ErrorHandler& onError) const;
 	Windows::Foundation::IAsyncAction Unsubscribe(std::int32_t queryId) const;
+	Windows::Foundation::IAsyncAction Cancel(std::int32_t queryId, const CancelledHandler& onCancelled) const;
+
+	Windows::Foundation::IAsyncAction GetStats(bool reset, const StatsHandler& onStats, const ErrorHandler& onError) const;
+	Windows::Foundation::IAsyncAction GetRelayStats(bool reset, const StatsHandler& onStats, const ErrorHandler& onError) const;
+
+	std::int32_t BatchWindow() const;
+	void BatchWindow(std::int32_t value) const;
+	std::int64_t BatchesSent() const;
+	std::int64_t RequestsSent() const;
+	std::int32_t LargestBatch() const;
+	std::int32_t SharedMemoryBytes() const;
+	void SharedMemoryBytes(std::int32_t value) const;
+	hstring TracePath() const;
+	void TracePath(const hstring& value) const;
 
 private:
+	struct SharedRegion;
+
+	struct PendingRequest
+	{
+		std::wstring_view type;
+		std::int32_t requestId;
+		hstring request;
+		// Only for requests without a RequestRecord, the others are failed through their record.
+		ErrorHandler onError;
+		LatencyHistogram::Clock::time_point queued;
+		std::string trace;
+	};
+
+	struct FetchTiming
+	{
+		LatencyHistogram::Clock::time_point started;
+		hstring operationName;
+		std::int64_t traceStart;
+	};
+
+	// Everything the responses to one request need, only the members for its type are set.
+	struct RequestRecord
+	{
+		StoppedHandler onStopped;
+		ParsedHandler onParsed;
+		FetchedHandler onNext;
+		FetchedHandler onComplete;
+		ErrorHandler onError;
+		StatsHandler onStats;
+		CancelledHandler onCancelled;
+		bool resetStats = false;
+
+		// parseQuery: the query text, until the bridge has recognized its hash or asked for it.
+		hstring persistedQuery;
+
+		// fetchQuery with DeltaPayloads or StreamChunkSize: the last full payload, which the next
+		// patch or chunk of list items applies to.
+		bool keepSnapshot = false;
+		Windows::Data::Json::JsonObject snapshot { nullptr };
+
+		// fetchQuery: cleared by the first payload.
+		std::optional<FetchTiming> timing;
+
+		// fetchQuery: the query it fetches, so Cancel can find it.
+		std::optional<std::int32_t> queryId;
+
+		// fetchQuery with Timeout: cleared by the first payload, the request expires if it is still set.
+		std::optional<TimerWheel<std::int32_t>::Clock::time_point> deadline;
+	};
+
 	Windows::Foundation::IAsyncOperation<bool> OpenAsync(const ErrorHandler& onError) const;
 	void Close() const;
-	Windows::Foundation::IAsyncAction OnRequestReceived(const Windows::ApplicationModel::AppService::AppServiceConnection& sender, const Windows::ApplicationModel::AppService::AppServiceRequestReceivedEventArgs& args) const;
+	Windows::Foundation::IAsyncAction OnMessageReceived(TransportMessage message, MessageTransport::Completion done) const;
+	Windows::Foundation::IAsyncOperation<bool> HandleResponseAsync(Windows::Data::Json::JsonObject responseObject) const;
+	void QueueRequest(std::wstring_view type, const Windows::Data::Json::JsonObject& request, const ErrorHandler& onError) const;
+	fire_and_forget FlushRequestsAsync() const;
+	void AttachSharedMemory(const hstring& name) const;
+	Windows::Data::Json::JsonObject ReadSharedResponse(std::uint64_t sequence) const;
+	void RecordRoundTrip(std::int32_t requestId, const std::optional<FetchTiming>& timing) const;
+	std::string TraceId(std::int32_t requestId) const;
+	void ScheduleDeadline(std::int32_t requestId, TimerWheel<std::int32_t>::Clock::time_point deadline) const;
+	fire_and_forget ExpireDeadlinesAsync() const;
 
 	const bool m_useDefaultProfile;
+	// Trace ids are this prefix and the request id, unique across processes and connections.
+	const std::string m_tracePrefix;
 
 	mutable bool m_opened = false;
 	mutable bool m_started = false;
 	mutable std::atomic<std::int32_t> m_nextRequestId;
 
-	mutable std::map<std::int32_t, StoppedHandler> m_onStopped;
-	mutable std::map<std::int32_t, ParsedHandler> m_onParsed;
-	mutable std::map<std::int32_t, FetchedHandler> m_onNext;
-	mutable std::map<std::int32_t, FetchedHandler> m_onComplete;
-	mutable std::map<std::int32_t, ErrorHandler> m_onError;
+	// Requests are made from any thread, and responses are handled on the AppService thread.
+	mutable RequestTable<RequestRecord> m_requests;
+
+	// Stage durations on this side of the relay, and the round trip for each fetch by operation name.
+	mutable LatencyRegistry m_latency;
+	mutable LatencyRegistry m_operationLatency;
+
+	mutable std::mutex m_pendingMutex;
+	mutable std::vector<PendingRequest> m_pendingRequests;
+	mutable bool m_flushing = false;
+	mutable std::atomic<std::int32_t> m_batchWindow { 0 };
+	mutable std::atomic<std::int64_t> m_batchesSent { 0 };
+	mutable std::atomic<std::int64_t> m_requestsSent { 0 };
+	mutable std::atomic<std::int32_t> m_largestBatch { 0 };
+	mutable std::atomic<std::int32_t> m_sharedMemoryBytes { 0 };
+	mutable std::unique_ptr<SharedRegion> m_sharedRegion;
+	mutable hstring m_tracePath;
+
+	// One wheel for every request with a deadline, ticked while any are pending.
+	mutable std::mutex m_deadlineMutex;
+	mutable TimerWheel<std::int32_t> m_deadlines;
+	mutable bool m_expiring = false;
 
 	Windows::ApplicationModel::AppService::AppServiceConnection m_serviceConnection;
+	const std::shared_ptr<AppServiceTransport> m_transport;
 };
 
 }
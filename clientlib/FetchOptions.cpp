@@ -0,0 +1,69 @@
+﻿#include "pch.h"
+#include "FetchOptions.h"
+#include "FetchOptions.g.cpp"
+
+#include <algorithm>
+
+namespace winrt::clientlib::implementation {
+
+bool FetchOptions::DeltaPayloads() const
+{
+	return m_deltaPayloads;
+}
+
+void FetchOptions::DeltaPayloads(bool value)
+{
+	m_deltaPayloads = value;
+}
+
+std::int32_t FetchOptions::ResyncInterval() const
+{
+	return m_resyncInterval;
+}
+
+void FetchOptions::ResyncInterval(std::int32_t value)
+{
+	m_resyncInterval = std::max(value, 0);
+}
+
+std::int32_t FetchOptions::MaxPendingPayloads() const
+{
+	return m_maxPendingPayloads;
+}
+
+void FetchOptions::MaxPendingPayloads(std::int32_t value)
+{
+	m_maxPendingPayloads = std::max(value, 0);
+}
+
+std::int32_t FetchOptions::StreamChunkSize() const
+{
+	return m_streamChunkSize;
+}
+
+void FetchOptions::StreamChunkSize(std::int32_t value)
+{
+	m_streamChunkSize = std::max(value, 0);
+}
+
+std::int32_t FetchOptions::Timeout() const
+{
+	return m_timeout;
+}
+
+void FetchOptions::Timeout(std::int32_t value)
+{
+	m_timeout = std::max(value, 0);
+}
+
+clientlib::FetchPriority FetchOptions::Priority() const
+{
+	return m_priority;
+}
+
+void FetchOptions::Priority(clientlib::FetchPriority value)
+{
+	m_priority = value;
+}
+
+}
@@ -0,0 +1,41 @@
+﻿#pragma once
+
+#include "FetchOptions.g.h"
+
+namespace winrt::clientlib::implementation {
+
+struct FetchOptions : FetchOptionsT<FetchOptions>
+{
+	FetchOptions() = default;
+
+	bool DeltaPayloads() const;
+	void DeltaPayloads(bool value);
+	std::int32_t ResyncInterval() const;
+	void ResyncInterval(std::int32_t value);
+	std::int32_t MaxPendingPayloads() const;
+	void MaxPendingPayloads(std::int32_t value);
+	std::int32_t StreamChunkSize() const;
+	void StreamChunkSize(std::int32_t value);
+	std::int32_t Timeout() const;
+	void Timeout(std::int32_t value);
+	clientlib::FetchPriority Priority() const;
+	void Priority(clientlib::FetchPriority value);
+
+private:
+	bool m_deltaPayloads = false;
+	std::int32_t m_resyncInterval = 0;
+	std::int32_t m_maxPendingPayloads = 0;
+	std::int32_t m_streamChunkSize = 0;
+	std::int32_t m_timeout = 0;
+	clientlib::FetchPriority m_priority = clientlib::FetchPriority::Normal;
+};
+
+}
+
+namespace winrt::clientlib::factory_implementation {
+
+struct FetchOptions : FetchOptionsT<FetchOptions, implementation::FetchOptions>
+{
+};
+
+}
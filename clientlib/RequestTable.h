@@ -0,0 +1,149 @@
+﻿#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+// Per-request records keyed by requestId, split across c_shardCount shards by the low bits of the
+// id. Request ids are handed out in sequence, so requests made at the same time land on different
+// shards and callers on different threads rarely wait for the same lock. Every method holds the lock
+// only for the one lookup, callbacks should be copied out and invoked after it returns.
+template <typename T>
+class RequestTable
+{
+public:
+	static constexpr size_t c_shardCount = 16;
+
+	void insert(std::int32_t requestId, T&& record)
+	{
+		auto& shard = shardFor(requestId);
+		std::lock_guard lock { shard.mutex };
+
+		shard.records.insert_or_assign(requestId, std::move(record));
+	}
+
+	// Calls fn with the record while its shard is locked, returns false if there is no record.
+	template <typename Fn>
+	bool update(std::int32_t requestId, Fn&& fn)
+	{
+		auto& shard = shardFor(requestId);
+		std::lock_guard lock { shard.mutex };
+		const auto itr = shard.records.find(requestId);
+
+		if (itr == shard.records.end())
+		{
+			return false;
+		}
+
+		fn(itr->second);
+
+		return true;
+	}
+
+	// Removes the record and hands it back, for responses which finish a request.
+	std::optional<T> take(std::int32_t requestId)
+	{
+		auto& shard = shardFor(requestId);
+		std::lock_guard lock { shard.mutex };
+		const auto itr = shard.records.find(requestId);
+
+		if (itr == shard.records.end())
+		{
+			return std::nullopt;
+		}
+
+		std::optional<T> record { std::move(itr->second) };
+
+		shard.records.erase(itr);
+
+		return record;
+	}
+
+	// Removes the record only if pred accepts it, checked under the same lock.
+	template <typename Pred>
+	std::optional<T> takeIf(std::int32_t requestId, Pred&& pred)
+	{
+		auto& shard = shardFor(requestId);
+		std::lock_guard lock { shard.mutex };
+		const auto itr = shard.records.find(requestId);
+
+		if (itr == shard.records.end()
+			|| !pred(itr->second))
+		{
+			return std::nullopt;
+		}
+
+		std::optional<T> record { std::move(itr->second) };
+
+		shard.records.erase(itr);
+
+		return record;
+	}
+
+	void erase(std::int32_t requestId)
+	{
+		auto& shard = shardFor(requestId);
+		std::lock_guard lock { shard.mutex };
+
+		shard.records.erase(requestId);
+	}
+
+	// Removes every record pred accepts, for the rare lookups which are not by requestId.
+	template <typename Pred>
+	size_t eraseIf(Pred&& pred)
+	{
+		size_t erased = 0;
+
+		for (auto& shard : m_shards)
+		{
+			std::lock_guard lock { shard.mutex };
+
+			for (auto itr = shard.records.begin(); itr != shard.records.end();)
+			{
+				if (pred(itr->second))
+				{
+					itr = shard.records.erase(itr);
+					++erased;
+				}
+				else
+				{
+					++itr;
+				}
+			}
+		}
+
+		return erased;
+	}
+
+	size_t size() const
+	{
+		size_t size = 0;
+
+		for (auto& shard : m_shards)
+		{
+			std::lock_guard lock { shard.mutex };
+
+			size += shard.records.size();
+		}
+
+		return size;
+	}
+
+private:
+	struct Shard
+	{
+		mutable std::mutex mutex;
+		std::unordered_map<std::int32_t, T> records;
+	};
+
+	Shard& shardFor(std::int32_t requestId) noexcept
+	{
+		return m_shards[static_cast<std::uint32_t>(requestId) % c_shardCount];
+	}
+
+	std::array<Shard, c_shardCount> m_shards;
+};
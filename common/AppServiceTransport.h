@@ -0,0 +1,211 @@
+﻿#pragma once
+
+#include "MessageTransport.h"
+
+#include <winrt/Windows.ApplicationModel.AppService.h>
+#include <winrt/Windows.Foundation.h>
+#include <winrt/Windows.Foundation.Collections.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+// Carries each TransportMessage as a ValueSet over an AppServiceConnection, which is how clientlib,
+// the relay and the bridge talk to each other. Whoever owns the connection still opens and closes it.
+class AppServiceTransport : public MessageTransport
+{
+public:
+	explicit AppServiceTransport(const winrt::Windows::ApplicationModel::AppService::AppServiceConnection& serviceConnection)
+		: m_serviceConnection { serviceConnection }
+	{
+	}
+
+	void send(TransportMessage&& message, Completion onSent) override
+	{
+		sendAsync(m_serviceConnection, toValueSet(message), std::move(onSent));
+	}
+
+	// Holds the message's deferral until the receiver calls done.
+	void receive(Receiver receiver) override
+	{
+		using namespace winrt::Windows::ApplicationModel::AppService;
+
+		m_requestReceived = m_serviceConnection.RequestReceived(winrt::auto_revoke,
+			[receiver = std::move(receiver)](const AppServiceConnection& /* sender */, const AppServiceRequestReceivedEventArgs& args) {
+				const auto messageDeferral { args.GetDeferral() };
+				TransportMessage message;
+
+				try
+				{
+					message = fromValueSet(args.Request().Message());
+				}
+				catch (const winrt::hresult_error&)
+				{
+					// Nothing in it can be handed on, and there is no request to report it to.
+					messageDeferral.Complete();
+					return;
+				}
+
+				receiver(std::move(message), [messageDeferral](std::exception_ptr /* error */) {
+					messageDeferral.Complete();
+				});
+			});
+	}
+
+private:
+	// Only takes copies, so a send which is still in flight does not depend on this transport.
+	static winrt::fire_and_forget sendAsync(winrt::Windows::ApplicationModel::AppService::AppServiceConnection serviceConnection,
+		winrt::Windows::Foundation::Collections::ValueSet message, Completion onSent)
+	{
+		std::exception_ptr error;
+
+		try
+		{
+			checkResult(co_await serviceConnection.SendMessageAsync(message));
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		if (onSent)
+		{
+			onSent(error);
+		}
+	}
+
+	// The relay answers with "dropped" when it could not pass the message on.
+	static void checkResult(const winrt::Windows::ApplicationModel::AppService::AppServiceResponse& result)
+	{
+		const auto status = result.Status();
+
+		if (status != winrt::Windows::ApplicationModel::AppService::AppServiceResponseStatus::Success)
+		{
+			std::ostringstream oss;
+
+			oss << "AppServiceConnection::SendMessageAsync failed: " << static_cast<int>(status);
+			throw std::runtime_error { oss.str() };
+		}
+
+		if (result.Message().HasKey(L"dropped"))
+		{
+			throw std::runtime_error { "The relay dropped the message" };
+		}
+	}
+
+	static winrt::Windows::Foundation::Collections::ValueSet toValueSet(const TransportMessage& message)
+	{
+		using winrt::Windows::Foundation::PropertyValue;
+
+		winrt::Windows::Foundation::Collections::ValueSet result;
+
+		if (!message.requests.empty())
+		{
+			result.Insert(L"requests", PropertyValue::CreateStringArray(toStrings(message.requests)));
+		}
+
+		if (!message.traces.empty())
+		{
+			result.Insert(L"traces", PropertyValue::CreateStringArray(toStrings(message.traces)));
+		}
+
+		if (!message.responses.empty())
+		{
+			result.Insert(L"responses", PropertyValue::CreateStringArray(toStrings(message.responses)));
+		}
+
+		if (!message.cborResponses.empty())
+		{
+			result.Insert(L"cborResponses", PropertyValue::CreateUInt8Array(message.cborResponses));
+		}
+
+		if (message.relayStats)
+		{
+			result.Insert(L"relayStats", PropertyValue::CreateInt32(*message.relayStats));
+			result.Insert(L"reset", PropertyValue::CreateBoolean(message.resetStats));
+		}
+
+		return result;
+	}
+
+	static TransportMessage fromValueSet(const winrt::Windows::Foundation::Collections::ValueSet& message)
+	{
+		using winrt::Windows::Foundation::IPropertyValue;
+
+		TransportMessage result;
+
+		readStrings(message, L"requests", result.requests);
+		readStrings(message, L"traces", result.traces);
+		readStrings(message, L"responses", result.responses);
+
+		if (message.HasKey(L"cborResponses"))
+		{
+			winrt::com_array<std::uint8_t> encoded;
+
+			message.Lookup(L"cborResponses").as<IPropertyValue>().GetUInt8Array(encoded);
+			result.cborResponses.assign(encoded.begin(), encoded.end());
+		}
+
+		if (message.HasKey(L"relayStats"))
+		{
+			result.relayStats = winrt::unbox_value<std::int32_t>(message.Lookup(L"relayStats"));
+			result.resetStats = winrt::unbox_value_or<bool>(message.TryLookup(L"reset"), false);
+		}
+
+		return result;
+	}
+
+	static std::vector<winrt::hstring> toStrings(const std::vector<utf::WideString>& values)
+	{
+		std::vector<winrt::hstring> strings;
+
+		strings.reserve(values.size());
+
+		for (const auto& value : values)
+		{
+			strings.emplace_back(value);
+		}
+
+		return strings;
+	}
+
+	static void readStrings(const winrt::Windows::Foundation::Collections::ValueSet& message, const wchar_t* key, std::vector<utf::WideString>& values)
+	{
+		if (!message.HasKey(key))
+		{
+			return;
+		}
+
+		winrt::com_array<winrt::hstring> strings;
+
+		message.Lookup(key).as<winrt::Windows::Foundation::IPropertyValue>().GetStringArray(strings);
+		values.reserve(strings.size());
+
+		for (const auto& value : strings)
+		{
+			values.emplace_back(value);
+		}
+	}
+
+	winrt::Windows::ApplicationModel::AppService::AppServiceConnection m_serviceConnection;
+	winrt::Windows::ApplicationModel::AppService::AppServiceConnection::RequestReceived_revoker m_requestReceived;
+};
+
+// Resumes once the other end has finished with the message, and rethrows whatever stopped it.
+inline winrt::Windows::Foundation::IAsyncAction sendMessageAsync(MessageTransport& transport, TransportMessage message)
+{
+	winrt::handle sent { CreateEventW(nullptr, true, false, nullptr) };
+	std::exception_ptr error;
+
+	transport.send(std::move(message), [&sent, &error](std::exception_ptr result) {
+		error = result;
+		SetEvent(sent.get());
+	});
+
+	co_await winrt::resume_on_signal(sent.get());
+
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
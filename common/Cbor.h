@@ -0,0 +1,396 @@
+﻿#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include "Utf.h"
+
+// Minimal CBOR (RFC 8949) encoder and pull decoder for the binary response envelope. Only
+// definite-length items are written, which is all the bridge and clientlib ever need.
+namespace cbor {
+
+enum class MajorType : std::uint8_t
+{
+	UnsignedInt = 0,
+	NegativeInt = 1,
+	ByteString = 2,
+	TextString = 3,
+	Array = 4,
+	Map = 5,
+	Tag = 6,
+	Simple = 7,
+};
+
+constexpr std::uint8_t c_false = 0xF4;
+constexpr std::uint8_t c_true = 0xF5;
+constexpr std::uint8_t c_null = 0xF6;
+constexpr std::uint8_t c_undefined = 0xF7;
+constexpr std::uint8_t c_half = 0xF9;
+constexpr std::uint8_t c_single = 0xFA;
+constexpr std::uint8_t c_double = 0xFB;
+
+class Writer
+{
+public:
+	explicit Writer(std::vector<std::uint8_t>& buffer) noexcept
+		: m_buffer { buffer }
+	{
+	}
+
+	void writeNull()
+	{
+		m_buffer.push_back(c_null);
+	}
+
+	void writeBool(bool value)
+	{
+		m_buffer.push_back(value ? c_true : c_false);
+	}
+
+	void writeInt(std::int64_t value)
+	{
+		if (value < 0)
+		{
+			writeHead(MajorType::NegativeInt, static_cast<std::uint64_t>(-(value + 1)));
+		}
+		else
+		{
+			writeHead(MajorType::UnsignedInt, static_cast<std::uint64_t>(value));
+		}
+	}
+
+	void writeDouble(double value)
+	{
+		std::uint64_t bits;
+
+		std::memcpy(&bits, &value, sizeof(bits));
+		m_buffer.push_back(c_double);
+		writeBigEndian(bits, sizeof(bits));
+	}
+
+	// JSON numbers arrive as doubles, integral values take up less space as CBOR integers.
+	void writeNumber(double value)
+	{
+		constexpr double c_maxExact = 9007199254740992.0;
+
+		if (std::isfinite(value)
+			&& std::trunc(value) == value
+			&& std::fabs(value) <= c_maxExact)
+		{
+			writeInt(static_cast<std::int64_t>(value));
+		}
+		else
+		{
+			writeDouble(value);
+		}
+	}
+
+	void writeText(std::string_view utf8)
+	{
+		writeHead(MajorType::TextString, utf8.size());
+		m_buffer.insert(m_buffer.end(), utf8.begin(), utf8.end());
+	}
+
+	// Transcodes UTF-16 text (wchar_t on Windows) to the UTF-8 which CBOR text strings require.
+	template <typename CharT>
+	void writeUtf16Text(std::basic_string_view<CharT> utf16)
+	{
+		writeHead(MajorType::TextString, utf::utf8Length(utf16));
+		utf::appendUtf8(utf16, m_buffer);
+	}
+
+	void beginArray(size_t count)
+	{
+		writeHead(MajorType::Array, count);
+	}
+
+	void beginMap(size_t count)
+	{
+		writeHead(MajorType::Map, count);
+	}
+
+	// Splice an item which was already encoded somewhere else.
+	void writeEncoded(const std::vector<std::uint8_t>& item)
+	{
+		m_buffer.insert(m_buffer.end(), item.begin(), item.end());
+	}
+
+private:
+	void writeHead(MajorType type, std::uint64_t argument)
+	{
+		const auto major = static_cast<std::uint8_t>(static_cast<std::uint8_t>(type) << 5);
+
+		if (argument < 24)
+		{
+			m_buffer.push_back(static_cast<std::uint8_t>(major | argument));
+		}
+		else if (argument <= std::numeric_limits<std::uint8_t>::max())
+		{
+			m_buffer.push_back(major | 24);
+			writeBigEndian(argument, 1);
+		}
+		else if (argument <= std::numeric_limits<std::uint16_t>::max())
+		{
+			m_buffer.push_back(major | 25);
+			writeBigEndian(argument, 2);
+		}
+		else if (argument <= std::numeric_limits<std::uint32_t>::max())
+		{
+			m_buffer.push_back(major | 26);
+			writeBigEndian(argument, 4);
+		}
+		else
+		{
+			m_buffer.push_back(major | 27);
+			writeBigEndian(argument, 8);
+		}
+	}
+
+	void writeBigEndian(std::uint64_t value, size_t bytes)
+	{
+		for (size_t shift = bytes * 8; shift > 0; shift -= 8)
+		{
+			m_buffer.push_back(static_cast<std::uint8_t>(value >> (shift - 8)));
+		}
+	}
+
+	std::vector<std::uint8_t>& m_buffer;
+};
+
+enum class ItemType
+{
+	Null,
+	Boolean,
+	Integer,
+	Float,
+	Text,
+	Bytes,
+	Array,
+	Map,
+};
+
+struct Item
+{
+	ItemType type = ItemType::Null;
+	bool boolean = false;
+	std::int64_t integer = 0;
+	double number = 0.0;
+	std::string_view text;
+	size_t count = 0;
+};
+
+// Reads one item at a time. Arrays and maps report their element count, and the caller reads that
+// many items (or key/value pairs) next.
+class Reader
+{
+public:
+	Reader(const std::uint8_t* data, size_t size) noexcept
+		: m_data { data }
+		, m_size { size }
+	{
+	}
+
+	bool atEnd() const noexcept
+	{
+		return m_offset >= m_size;
+	}
+
+	Item next()
+	{
+		auto initial = readByte();
+
+		// Tags only annotate the next item. Skip any number of them without recursing.
+		while (static_cast<MajorType>(initial >> 5) == MajorType::Tag)
+		{
+			readArgument(static_cast<std::uint8_t>(initial & 0x1F));
+			initial = readByte();
+		}
+
+		const auto major = static_cast<MajorType>(initial >> 5);
+		const auto additional = static_cast<std::uint8_t>(initial & 0x1F);
+		Item item;
+
+		if (major == MajorType::Simple)
+		{
+			switch (initial)
+			{
+				case c_false:
+				case c_true:
+					item.type = ItemType::Boolean;
+					item.boolean = (initial == c_true);
+					break;
+
+				case c_null:
+				case c_undefined:
+					item.type = ItemType::Null;
+					break;
+
+				case c_half:
+					item.type = ItemType::Float;
+					item.number = decodeHalf(static_cast<std::uint16_t>(readBigEndian(2)));
+					break;
+
+				case c_single:
+				{
+					const auto bits = static_cast<std::uint32_t>(readBigEndian(4));
+					float value;
+
+					std::memcpy(&value, &bits, sizeof(value));
+					item.type = ItemType::Float;
+					item.number = value;
+					break;
+				}
+
+				case c_double:
+				{
+					const auto bits = readBigEndian(8);
+
+					item.type = ItemType::Float;
+					std::memcpy(&item.number, &bits, sizeof(item.number));
+					break;
+				}
+
+				default:
+					throw std::runtime_error("Unsupported CBOR simple value");
+			}
+
+			return item;
+		}
+
+		const auto argument = readArgument(additional);
+
+		switch (major)
+		{
+			case MajorType::UnsignedInt:
+				if (argument > static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()))
+				{
+					throw std::runtime_error("CBOR integer out of range");
+				}
+
+				item.type = ItemType::Integer;
+				item.integer = static_cast<std::int64_t>(argument);
+				break;
+
+			case MajorType::NegativeInt:
+				if (argument > static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()))
+				{
+					throw std::runtime_error("CBOR integer out of range");
+				}
+
+				item.type = ItemType::Integer;
+				item.integer = -1 - static_cast<std::int64_t>(argument);
+				break;
+
+			case MajorType::ByteString:
+			case MajorType::TextString:
+				if (argument > m_size - m_offset)
+				{
+					throw std::runtime_error("Truncated CBOR string");
+				}
+
+				item.type = (major == MajorType::TextString ? ItemType::Text : ItemType::Bytes);
+				item.text = std::string_view { reinterpret_cast<const char*>(m_data + m_offset), static_cast<size_t>(argument) };
+				m_offset += static_cast<size_t>(argument);
+				break;
+
+			case MajorType::Array:
+			case MajorType::Map:
+				// Every element takes at least one byte, which bounds the count of a well-formed item.
+				if (argument > m_size - m_offset)
+				{
+					throw std::runtime_error("Truncated CBOR container");
+				}
+
+				item.type = (major == MajorType::Array ? ItemType::Array : ItemType::Map);
+				item.count = static_cast<size_t>(argument);
+				break;
+
+			default:
+				throw std::runtime_error("Unsupported CBOR major type");
+		}
+
+		return item;
+	}
+
+private:
+	std::uint8_t readByte()
+	{
+		if (m_offset >= m_size)
+		{
+			throw std::runtime_error("Truncated CBOR item");
+		}
+
+		return m_data[m_offset++];
+	}
+
+	std::uint64_t readBigEndian(size_t bytes)
+	{
+		std::uint64_t value = 0;
+
+		for (size_t i = 0; i < bytes; ++i)
+		{
+			value = (value << 8) | readByte();
+		}
+
+		return value;
+	}
+
+	std::uint64_t readArgument(std::uint8_t additional)
+	{
+		if (additional < 24)
+		{
+			return additional;
+		}
+
+		switch (additional)
+		{
+			case 24:
+				return readBigEndian(1);
+
+			case 25:
+				return readBigEndian(2);
+
+			case 26:
+				return readBigEndian(4);
+
+			case 27:
+				return readBigEndian(8);
+
+			default:
+				throw std::runtime_error("Indefinite-length CBOR items are not supported");
+		}
+	}
+
+	static double decodeHalf(std::uint16_t half) noexcept
+	{
+		const int exponent = (half >> 10) & 0x1F;
+		const int mantissa = half & 0x3FF;
+		double value;
+
+		if (exponent == 0)
+		{
+			value = std::ldexp(mantissa, -24);
+		}
+		else if (exponent != 31)
+		{
+			value = std::ldexp(mantissa + 1024, exponent - 25);
+		}
+		else
+		{
+			value = (mantissa == 0 ? std::numeric_limits<double>::infinity() : std::numeric_limits<double>::quiet_NaN());
+		}
+
+		return (half & 0x8000) ? -value : value;
+	}
+
+	const std::uint8_t* m_data;
+	const size_t m_size;
+	size_t m_offset = 0;
+};
+
+} // namespace cbor
@@ -0,0 +1,207 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Log-linear histogram of durations in microseconds. Every power of two range is split into
+// c_subBuckets linear buckets, so a percentile read back is within about 3% of the recorded value.
+// Recording is a handful of relaxed atomic increments, any number of threads can record at once
+// and readers never block them.
+class LatencyHistogram
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Summary
+	{
+		std::uint64_t count;
+		std::uint64_t p50;
+		std::uint64_t p99;
+		std::uint64_t max;
+	};
+
+	void record(std::uint64_t micros) noexcept
+	{
+		m_buckets[bucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+
+		for (auto max = m_max.load(std::memory_order_relaxed); max < micros && !m_max.compare_exchange_weak(max, micros, std::memory_order_relaxed);)
+		{
+		}
+	}
+
+	void recordSince(Clock::time_point start) noexcept
+	{
+		record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count()));
+	}
+
+	// Counts recorded while this runs may or may not be included, which is fine for monitoring.
+	Summary summary() const noexcept
+	{
+		const auto count = m_count.load(std::memory_order_relaxed);
+		const auto max = m_max.load(std::memory_order_relaxed);
+
+		return { count, percentile(count, 0.50, max), percentile(count, 0.99, max), max };
+	}
+
+	void reset() noexcept
+	{
+		for (auto& bucket : m_buckets)
+		{
+			bucket.store(0, std::memory_order_relaxed);
+		}
+
+		m_count.store(0, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr unsigned c_subBucketBits = 5;
+	static constexpr std::uint64_t c_subBuckets = 1 << c_subBucketBits;
+
+	// Anything past 2^36 microseconds (about 19 hours) lands in the last bucket.
+	static constexpr unsigned c_maxExponent = 36;
+	static constexpr size_t c_bucketCount = c_subBuckets * (c_maxExponent - c_subBucketBits + 2);
+
+	static unsigned floorLog2(std::uint64_t value) noexcept
+	{
+		unsigned exponent = 0;
+
+		for (unsigned shift = 32; shift > 0; shift >>= 1)
+		{
+			if (value >> shift)
+			{
+				value >>= shift;
+				exponent += shift;
+			}
+		}
+
+		return exponent;
+	}
+
+	static size_t bucketIndex(std::uint64_t value) noexcept
+	{
+		if (value < c_subBuckets)
+		{
+			return static_cast<size_t>(value);
+		}
+
+		const auto exponent = floorLog2(value);
+
+		if (exponent > c_maxExponent)
+		{
+			return c_bucketCount - 1;
+		}
+
+		const auto shift = exponent - c_subBucketBits;
+		const auto subBucket = (value >> shift) - c_subBuckets;
+
+		return static_cast<size_t>(c_subBuckets * (shift + 1) + subBucket);
+	}
+
+	// The largest value which falls in the bucket.
+	static std::uint64_t bucketLimit(size_t index) noexcept
+	{
+		if (index < c_subBuckets)
+		{
+			return index;
+		}
+
+		const auto shift = static_cast<unsigned>(index / c_subBuckets - 1);
+		const auto subBucket = index % c_subBuckets;
+
+		return ((c_subBuckets + subBucket + 1) << shift) - 1;
+	}
+
+	std::uint64_t percentile(std::uint64_t count, double fraction, std::uint64_t max) const noexcept
+	{
+		if (count == 0)
+		{
+			return 0;
+		}
+
+		const auto rank = static_cast<std::uint64_t>(fraction * static_cast<double>(count - 1)) + 1;
+		std::uint64_t seen = 0;
+
+		for (size_t index = 0; index < c_bucketCount; ++index)
+		{
+			seen += m_buckets[index].load(std::memory_order_relaxed);
+
+			if (seen >= rank)
+			{
+				const auto limit = bucketLimit(index);
+
+				return (limit < max ? limit : max);
+			}
+		}
+
+		return max;
+	}
+
+	std::array<std::atomic<std::uint64_t>, c_bucketCount> m_buckets {};
+	std::atomic<std::uint64_t> m_count { 0 };
+	std::atomic<std::uint64_t> m_max { 0 };
+};
+
+// Named histograms which are created on first use and live as long as the registry, so callers can
+// hold on to the reference. Looking a name up takes a lock, recording into it does not.
+class LatencyRegistry
+{
+public:
+	LatencyHistogram& get(std::wstring_view name)
+	{
+		std::lock_guard lock { m_mutex };
+		auto itr = m_histograms.find(name);
+
+		if (itr == m_histograms.end())
+		{
+			itr = m_histograms.emplace(std::wstring { name }, std::make_unique<LatencyHistogram>()).first;
+		}
+
+		return *itr->second;
+	}
+
+	std::vector<std::pair<std::wstring, LatencyHistogram::Summary>> summaries() const
+	{
+		std::lock_guard lock { m_mutex };
+		std::vector<std::pair<std::wstring, LatencyHistogram::Summary>> result;
+
+		result.reserve(m_histograms.size());
+
+		for (const auto& entry : m_histograms)
+		{
+			const auto summary = entry.second->summary();
+
+			if (summary.count > 0)
+			{
+				result.emplace_back(entry.first, summary);
+			}
+		}
+
+		return result;
+	}
+
+	void reset()
+	{
+		std::lock_guard lock { m_mutex };
+
+		for (auto& entry : m_histograms)
+		{
+			entry.second->reset();
+		}
+	}
+
+private:
+	mutable std::mutex m_mutex;
+	std::map<std::wstring, std::unique_ptr<LatencyHistogram>, std::less<>> m_histograms;
+};
@@ -0,0 +1,28 @@
+﻿#pragma once
+
+#include "LatencyHistogram.h"
+
+#include <winrt/Windows.Data.Json.h>
+
+// Reports every histogram in the registry which has recorded anything as
+// { name: { count, p50, p99, max } }, with the durations in microseconds.
+inline winrt::Windows::Data::Json::JsonObject latencyToJson(const LatencyRegistry& registry)
+{
+	using winrt::Windows::Data::Json::JsonObject;
+	using winrt::Windows::Data::Json::JsonValue;
+
+	JsonObject result;
+
+	for (const auto& entry : registry.summaries())
+	{
+		JsonObject summary;
+
+		summary.SetNamedValue(L"count", JsonValue::CreateNumberValue(static_cast<double>(entry.second.count)));
+		summary.SetNamedValue(L"p50", JsonValue::CreateNumberValue(static_cast<double>(entry.second.p50)));
+		summary.SetNamedValue(L"p99", JsonValue::CreateNumberValue(static_cast<double>(entry.second.p99)));
+		summary.SetNamedValue(L"max", JsonValue::CreateNumberValue(static_cast<double>(entry.second.max)));
+		result.SetNamedValue(entry.first, summary);
+	}
+
+	return result;
+}
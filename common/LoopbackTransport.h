@@ -0,0 +1,213 @@
+﻿#pragma once
+
+#include "MessageTransport.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+// Both ends of an in-process connection. Each end has its own delivery thread, which hands one
+// message at a time to that end's receiver and waits for it to call done before delivering the next,
+// the same as the relay does with an in-flight window of 1.
+class LoopbackTransport : public MessageTransport
+{
+public:
+	// Returns the two connected ends.
+	static std::pair<std::shared_ptr<LoopbackTransport>, std::shared_ptr<LoopbackTransport>> createPair()
+	{
+		std::shared_ptr<LoopbackTransport> first { new LoopbackTransport };
+		std::shared_ptr<LoopbackTransport> second { new LoopbackTransport };
+
+		first->m_peer = second->m_inbox;
+		second->m_peer = first->m_inbox;
+
+		return { std::move(first), std::move(second) };
+	}
+
+	~LoopbackTransport() override
+	{
+		m_inbox->stop();
+	}
+
+	void send(TransportMessage&& message, Completion onSent) override
+	{
+		const auto peer = m_peer.lock();
+
+		if (!peer
+			|| !peer->post(std::move(message), std::move(onSent)))
+		{
+			if (onSent)
+			{
+				onSent(std::make_exception_ptr(std::runtime_error { "The other end of the loopback is closed" }));
+			}
+		}
+	}
+
+	void receive(Receiver receiver) override
+	{
+		m_inbox->setReceiver(std::move(receiver));
+	}
+
+private:
+	class Inbox
+	{
+	public:
+		Inbox()
+			: m_thread { &Inbox::run, this }
+		{
+		}
+
+		~Inbox()
+		{
+			stop();
+		}
+
+		bool post(TransportMessage&& message, Completion onSent)
+		{
+			{
+				std::lock_guard lock { m_mutex };
+
+				if (m_stopping)
+				{
+					return false;
+				}
+
+				m_queue.push_back({ std::move(message), std::move(onSent) });
+			}
+
+			m_wake.notify_one();
+
+			return true;
+		}
+
+		void setReceiver(Receiver receiver)
+		{
+			{
+				std::lock_guard lock { m_mutex };
+
+				m_receiver = std::move(receiver);
+			}
+
+			m_wake.notify_one();
+		}
+
+		// Messages which were not delivered yet fail. Waits for the message being delivered, so an end
+		// must not be destroyed from inside its own receiver.
+		void stop()
+		{
+			{
+				std::lock_guard lock { m_mutex };
+
+				if (m_stopping)
+				{
+					return;
+				}
+
+				m_stopping = true;
+			}
+
+			m_wake.notify_one();
+			m_thread.join();
+		}
+
+	private:
+		struct Pending
+		{
+			TransportMessage message;
+			Completion onSent;
+		};
+
+		// Only the first completion counts, including the one for a receiver which threw.
+		struct Delivery
+		{
+			void complete(std::exception_ptr error)
+			{
+				if (!m_completed.test_and_set())
+				{
+					finished.set_value(error);
+				}
+			}
+
+			std::promise<std::exception_ptr> finished;
+
+		private:
+			std::atomic_flag m_completed = ATOMIC_FLAG_INIT;
+		};
+
+		void run()
+		{
+			std::unique_lock lock { m_mutex };
+
+			for (;;)
+			{
+				m_wake.wait(lock, [this]() noexcept {
+					return m_stopping || (m_receiver && !m_queue.empty());
+				});
+
+				if (m_stopping)
+				{
+					break;
+				}
+
+				auto pending = std::move(m_queue.front());
+				const auto receiver = m_receiver;
+
+				m_queue.pop_front();
+				lock.unlock();
+
+				const auto delivery = std::make_shared<Delivery>();
+				auto result = delivery->finished.get_future();
+
+				try
+				{
+					receiver(std::move(pending.message), [delivery](std::exception_ptr error) {
+						delivery->complete(error);
+					});
+				}
+				catch (...)
+				{
+					delivery->complete(std::current_exception());
+				}
+
+				const auto error = result.get();
+
+				if (pending.onSent)
+				{
+					pending.onSent(error);
+				}
+
+				lock.lock();
+			}
+
+			auto abandoned = std::move(m_queue);
+
+			lock.unlock();
+
+			for (auto& pending : abandoned)
+			{
+				if (pending.onSent)
+				{
+					pending.onSent(std::make_exception_ptr(std::runtime_error { "The loopback was closed" }));
+				}
+			}
+		}
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::deque<Pending> m_queue;
+		Receiver m_receiver;
+		bool m_stopping = false;
+		std::thread m_thread;
+	};
+
+	LoopbackTransport() = default;
+
+	const std::shared_ptr<Inbox> m_inbox { std::make_shared<Inbox>() };
+	std::weak_ptr<Inbox> m_peer;
+};
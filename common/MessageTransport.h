@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include "Utf.h"
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <vector>
+
+// One message between clientlib, the relay and the bridge, in plain C++ types so the protocol code
+// on either end does not depend on how the message travels.
+struct TransportMessage
+{
+	// Client to bridge: JSON requests, and the trace id of each traced request.
+	std::vector<utf::WideString> requests;
+	std::vector<utf::WideString> traces;
+
+	// Bridge to client: JSON responses, one string each, or a single CBOR array of every response.
+	std::vector<utf::WideString> responses;
+	std::vector<std::uint8_t> cborResponses;
+
+	// Client to relay: the relay answers with its own stats under this requestId.
+	std::optional<std::int32_t> relayStats;
+	bool resetStats = false;
+};
+
+// Delivers messages to the other end, in the order they were sent, and hands the ones coming back
+// to a receiver. The AppService connection is the real one, a loopback can stand in for it.
+class MessageTransport
+{
+public:
+	// Called exactly once, with nullptr once the other end has finished with the message, or with
+	// the reason it could not be delivered.
+	using Completion = std::function<void(std::exception_ptr error)>;
+
+	// The receiver calls done once it has finished with the message, which is what completes the
+	// sender's Completion.
+	using Receiver = std::function<void(TransportMessage&& message, Completion done)>;
+
+	virtual ~MessageTransport() = default;
+
+	virtual void send(TransportMessage&& message, Completion onSent) = 0;
+
+	// Replaces any earlier receiver.
+	virtual void receive(Receiver receiver) = 0;
+};
@@ -0,0 +1,323 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sddl.h>
+#include <securityappcontainer.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A named shared memory region, backed by a pagefile section on Windows and by shm_open on POSIX.
+// The process which creates the region owns the name, the other side opens it by that name.
+namespace shm {
+
+// The SID of the app container this process runs in, or an empty string if it does not run in one.
+// An app container can only open names in its own namespace, so the creating side needs it.
+inline std::string currentAppContainerSid()
+{
+#ifdef _WIN32
+	DWORD isAppContainer = 0;
+	DWORD length = 0;
+
+	if (!GetTokenInformation(GetCurrentProcessToken(), TokenIsAppContainer, &isAppContainer, sizeof(isAppContainer), &length)
+		|| !isAppContainer)
+	{
+		return {};
+	}
+
+	length = 0;
+	GetTokenInformation(GetCurrentProcessToken(), TokenAppContainerSid, nullptr, 0, &length);
+
+	std::string buffer(length, '\0');
+	LPWSTR sidString = nullptr;
+
+	if (!GetTokenInformation(GetCurrentProcessToken(), TokenAppContainerSid, buffer.data(), length, &length)
+		|| !ConvertSidToStringSidW(reinterpret_cast<const TOKEN_APPCONTAINER_INFORMATION*>(buffer.data())->TokenAppContainer, &sidString))
+	{
+		return {};
+	}
+
+	// SIDs are plain ASCII.
+	const std::wstring_view wide { sidString };
+	std::string result(wide.size(), '\0');
+
+	std::transform(wide.begin(), wide.end(), result.begin(), [](wchar_t ch) noexcept {
+		return static_cast<char>(ch);
+	});
+	LocalFree(sidString);
+
+	return result;
+#else
+	return {};
+#endif
+}
+
+class SharedMemory
+{
+public:
+	// With an appContainerSid from currentAppContainerSid() in the opening process, the region is
+	// placed in that app container's namespace, and only the creator and the app container are
+	// granted access to it. Otherwise it goes in the creator's session namespace with the default
+	// security. POSIX regions are only ever readable by the same user.
+	static SharedMemory create(const std::string& name, std::size_t size, [[maybe_unused]] const std::string& appContainerSid = {})
+	{
+		SharedMemory region;
+
+#ifdef _WIN32
+		std::wstring wideName;
+		SECURITY_ATTRIBUTES attributes { sizeof(attributes), nullptr, false };
+
+		if (appContainerSid.empty())
+		{
+			wideName = L"Local\\" + widen(name);
+		}
+		else
+		{
+			// Owner and SYSTEM get full access, the app container may only map it. The low mandatory
+			// label lets the app container, which runs at low integrity, write the ring's tail.
+			const auto sddl = L"D:P(A;;GA;;;OW)(A;;GA;;;SY)(A;;0x6;;;" + widen(appContainerSid) + L")S:(ML;;NW;;;LW)";
+
+			if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &attributes.lpSecurityDescriptor, nullptr))
+			{
+				throw std::runtime_error("ConvertStringSecurityDescriptorToSecurityDescriptorW failed for " + appContainerSid);
+			}
+
+			region.m_securityDescriptor = attributes.lpSecurityDescriptor;
+			wideName = appContainerPath(appContainerSid) + L"\\" + widen(name);
+		}
+
+		region.m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE,
+			static_cast<DWORD>(static_cast<std::uint64_t>(size) >> 32), static_cast<DWORD>(size), wideName.c_str());
+
+		if (!region.m_mapping
+			|| GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			throw std::runtime_error("CreateFileMappingW failed for " + name);
+		}
+
+		region.map(size);
+#else
+		region.m_name = posixName(name);
+		region.m_fd = shm_open(region.m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+
+		if (region.m_fd < 0)
+		{
+			region.m_name.clear();
+			throw std::runtime_error("shm_open failed for " + name);
+		}
+
+		region.m_owner = true;
+
+		if (ftruncate(region.m_fd, static_cast<off_t>(size)) != 0)
+		{
+			throw std::runtime_error("ftruncate failed for " + name);
+		}
+
+		region.map(size);
+#endif
+
+		return region;
+	}
+
+	static SharedMemory open(const std::string& name)
+	{
+		SharedMemory region;
+
+#ifdef _WIN32
+		// Inside an app container this resolves to the container's own namespace.
+		const auto wideName = L"Local\\" + widen(name);
+
+		region.m_mapping = OpenFileMappingFromApp(FILE_MAP_READ | FILE_MAP_WRITE, false, wideName.c_str());
+
+		if (!region.m_mapping)
+		{
+			throw std::runtime_error("OpenFileMappingFromApp failed for " + name + ": " + std::to_string(GetLastError()));
+		}
+
+		region.map(0);
+#else
+		const auto fullName = posixName(name);
+		struct stat status {};
+
+		region.m_fd = shm_open(fullName.c_str(), O_RDWR, 0);
+
+		if (region.m_fd < 0
+			|| fstat(region.m_fd, &status) != 0)
+		{
+			throw std::runtime_error("shm_open failed for " + name);
+		}
+
+		region.map(static_cast<std::size_t>(status.st_size));
+#endif
+
+		return region;
+	}
+
+	SharedMemory(SharedMemory&& other) noexcept
+	{
+		swap(other);
+	}
+
+	SharedMemory& operator=(SharedMemory&& other) noexcept
+	{
+		SharedMemory { std::move(other) }.swap(*this);
+		return *this;
+	}
+
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	~SharedMemory()
+	{
+#ifdef _WIN32
+		if (m_view)
+		{
+			UnmapViewOfFile(m_view);
+		}
+
+		if (m_mapping)
+		{
+			CloseHandle(m_mapping);
+		}
+
+		if (m_securityDescriptor)
+		{
+			LocalFree(m_securityDescriptor);
+		}
+#else
+		if (m_view)
+		{
+			munmap(m_view, m_size);
+		}
+
+		if (m_fd >= 0)
+		{
+			close(m_fd);
+		}
+
+		if (m_owner)
+		{
+			shm_unlink(m_name.c_str());
+		}
+#endif
+	}
+
+	void* data() const noexcept
+	{
+		return m_view;
+	}
+
+	std::size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+private:
+	SharedMemory() = default;
+
+	void swap(SharedMemory& other) noexcept
+	{
+		std::swap(m_view, other.m_view);
+		std::swap(m_size, other.m_size);
+#ifdef _WIN32
+		std::swap(m_mapping, other.m_mapping);
+		std::swap(m_securityDescriptor, other.m_securityDescriptor);
+#else
+		std::swap(m_fd, other.m_fd);
+		std::swap(m_owner, other.m_owner);
+		std::swap(m_name, other.m_name);
+#endif
+	}
+
+#ifdef _WIN32
+	static std::wstring widen(const std::string& name)
+	{
+		// Region names are generated from ASCII, there is nothing to transcode.
+		return { name.begin(), name.end() };
+	}
+
+	// Where a process outside the app container names objects which the app container can open.
+	static std::wstring appContainerPath(const std::string& appContainerSid)
+	{
+		PSID sid = nullptr;
+
+		if (!ConvertStringSidToSidW(widen(appContainerSid).c_str(), &sid))
+		{
+			throw std::runtime_error("ConvertStringSidToSidW failed for " + appContainerSid);
+		}
+
+		std::wstring path(MAX_PATH, L'\0');
+		ULONG length = 0;
+		const bool found = GetAppContainerNamedObjectPath(nullptr, sid, static_cast<ULONG>(path.size()), path.data(), &length);
+
+		LocalFree(sid);
+
+		if (!found)
+		{
+			throw std::runtime_error("GetAppContainerNamedObjectPath failed for " + appContainerSid);
+		}
+
+		path.resize(std::wstring_view { path.c_str() }.size());
+
+		return path;
+	}
+
+	void map(std::size_t size)
+	{
+		m_view = MapViewOfFileFromApp(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, size);
+
+		if (!m_view)
+		{
+			throw std::runtime_error("MapViewOfFileFromApp failed");
+		}
+
+		// The opening side does not know the size up front, the view covers the whole section.
+		MEMORY_BASIC_INFORMATION info {};
+
+		VirtualQuery(m_view, &info, sizeof(info));
+		m_size = (size == 0 ? info.RegionSize : size);
+	}
+
+	HANDLE m_mapping = nullptr;
+	PSECURITY_DESCRIPTOR m_securityDescriptor = nullptr;
+#else
+	static std::string posixName(const std::string& name)
+	{
+		return name.empty() || name.front() != '/' ? "/" + name : name;
+	}
+
+	void map(std::size_t size)
+	{
+		void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+		if (view == MAP_FAILED)
+		{
+			throw std::runtime_error("mmap failed");
+		}
+
+		m_view = view;
+		m_size = size;
+	}
+
+	int m_fd = -1;
+	bool m_owner = false;
+	std::string m_name;
+#endif
+
+	void* m_view = nullptr;
+	std::size_t m_size = 0;
+};
+
+} // namespace shm
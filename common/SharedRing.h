@@ -0,0 +1,244 @@
+﻿#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// Single-producer/single-consumer ring of length-prefixed records in a caller supplied region,
+// which is normally a shared memory mapping. The producer and consumer only share the head and
+// tail byte counters, so neither side ever takes a lock. Each record is identified by the byte
+// position it was written at, which the producer hands to the consumer out of band as a sequence
+// number so the consumer can tell it is reading the record it was told about.
+namespace shm {
+
+constexpr std::uint32_t c_ringMagic = 0x474E5251; // "QRNG"
+constexpr std::uint32_t c_ringVersion = 1;
+constexpr std::size_t c_cacheLine = 64;
+
+struct RingHeader
+{
+	std::uint32_t magic;
+	std::uint32_t version;
+	std::uint64_t capacity;
+
+	// Total bytes the producer has published.
+	alignas(c_cacheLine) std::atomic<std::uint64_t> head;
+
+	// Total bytes the consumer has released.
+	alignas(c_cacheLine) std::atomic<std::uint64_t> tail;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "The ring counters must be address-free");
+
+struct RecordHeader
+{
+	std::uint32_t size;
+	std::uint32_t tag;
+};
+
+// Marks the unused space at the end of the buffer when a record did not fit in front of it.
+constexpr std::uint32_t c_wrapMarker = 0xFFFFFFFF;
+
+constexpr std::uint64_t alignRecord(std::uint64_t size) noexcept
+{
+	return (size + alignof(std::uint64_t) - 1) & ~static_cast<std::uint64_t>(alignof(std::uint64_t) - 1);
+}
+
+constexpr std::size_t ringCapacity(std::size_t regionSize) noexcept
+{
+	return regionSize > sizeof(RingHeader)
+		? static_cast<std::size_t>((regionSize - sizeof(RingHeader)) & ~static_cast<std::uint64_t>(alignof(std::uint64_t) - 1))
+		: 0;
+}
+
+class RingWriter
+{
+public:
+	// Formats the region, anything which was there before is discarded.
+	RingWriter(void* region, std::size_t regionSize)
+		: m_header { static_cast<RingHeader*>(region) }
+		, m_data { static_cast<std::uint8_t*>(region) + sizeof(RingHeader) }
+		, m_capacity { ringCapacity(regionSize) }
+	{
+		if (m_capacity < sizeof(RecordHeader))
+		{
+			throw std::invalid_argument("Shared ring region is too small");
+		}
+
+		new (m_header) RingHeader {};
+		m_header->magic = c_ringMagic;
+		m_header->version = c_ringVersion;
+		m_header->capacity = m_capacity;
+		m_header->head.store(0, std::memory_order_relaxed);
+		m_header->tail.store(0, std::memory_order_release);
+	}
+
+	std::uint64_t capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	// Returns the sequence number of the new record, or nothing if the consumer has not released
+	// enough space yet. The producer never waits, the caller decides what to do with records which
+	// do not fit.
+	std::optional<std::uint64_t> tryWrite(std::uint32_t tag, const void* data, std::size_t size)
+	{
+		const auto required = alignRecord(sizeof(RecordHeader) + size);
+
+		if (size >= c_wrapMarker
+			|| required > m_capacity)
+		{
+			return std::nullopt;
+		}
+
+		auto head = m_header->head.load(std::memory_order_relaxed);
+		const auto tail = m_header->tail.load(std::memory_order_acquire);
+		const auto offset = head % m_capacity;
+		const auto contiguous = m_capacity - offset;
+		const auto padding = (required > contiguous ? contiguous : 0);
+
+		if (head + padding + required - tail > m_capacity)
+		{
+			return std::nullopt;
+		}
+
+		if (padding > 0)
+		{
+			writeRecordHeader(offset, c_wrapMarker, 0);
+			head += padding;
+		}
+
+		const auto sequence = head;
+		const auto recordOffset = head % m_capacity;
+
+		writeRecordHeader(recordOffset, static_cast<std::uint32_t>(size), tag);
+
+		// An empty record may come with a null data pointer, which memcpy must not be given.
+		if (size > 0)
+		{
+			std::memcpy(m_data + recordOffset + sizeof(RecordHeader), data, size);
+		}
+
+		m_header->head.store(head + required, std::memory_order_release);
+
+		return sequence;
+	}
+
+	// Bytes the consumer has not released yet.
+	std::uint64_t used() const noexcept
+	{
+		return m_header->head.load(std::memory_order_relaxed) - m_header->tail.load(std::memory_order_acquire);
+	}
+
+private:
+	void writeRecordHeader(std::uint64_t offset, std::uint32_t size, std::uint32_t tag) noexcept
+	{
+		const RecordHeader record { size, tag };
+
+		std::memcpy(m_data + offset, &record, sizeof(record));
+	}
+
+	RingHeader* const m_header;
+	std::uint8_t* const m_data;
+	const std::uint64_t m_capacity;
+};
+
+struct Record
+{
+	std::uint64_t sequence = 0;
+	std::uint32_t tag = 0;
+	std::vector<std::uint8_t> data;
+};
+
+class RingReader
+{
+public:
+	// Attaches to a region which a RingWriter already formatted.
+	RingReader(void* region, std::size_t regionSize)
+		: m_header { static_cast<RingHeader*>(region) }
+		, m_data { static_cast<std::uint8_t*>(region) + sizeof(RingHeader) }
+		, m_capacity { regionSize >= sizeof(RingHeader) ? m_header->capacity : 0 }
+	{
+		if (regionSize < sizeof(RingHeader)
+			|| m_header->magic != c_ringMagic
+			|| m_header->version != c_ringVersion
+			|| m_capacity > ringCapacity(regionSize)
+			|| m_capacity < sizeof(RecordHeader))
+		{
+			throw std::invalid_argument("Shared ring region is not formatted");
+		}
+	}
+
+	// Copies the next record out of the ring and releases its space to the producer. Returns false
+	// if the producer has not published anything new.
+	bool tryRead(Record& record)
+	{
+		auto tail = m_header->tail.load(std::memory_order_relaxed);
+		const auto head = m_header->head.load(std::memory_order_acquire);
+
+		while (tail != head)
+		{
+			const auto offset = tail % m_capacity;
+			RecordHeader header;
+
+			std::memcpy(&header, m_data + offset, sizeof(header));
+
+			if (header.size == c_wrapMarker)
+			{
+				tail += m_capacity - offset;
+				continue;
+			}
+
+			const auto recordSize = alignRecord(sizeof(RecordHeader) + header.size);
+
+			if (recordSize > m_capacity - offset
+				|| tail + recordSize > head)
+			{
+				throw std::runtime_error("Shared ring record is corrupt");
+			}
+
+			const auto payload = m_data + offset + sizeof(RecordHeader);
+
+			record.sequence = tail;
+			record.tag = header.tag;
+			record.data.assign(payload, payload + header.size);
+			m_header->tail.store(tail + recordSize, std::memory_order_release);
+
+			return true;
+		}
+
+		m_header->tail.store(tail, std::memory_order_release);
+
+		return false;
+	}
+
+	// Reads up to the record written at sequence. Records come out in the order they were written, so
+	// one whose sequence number never reached the consumer is older than the one it is after. Those
+	// are released and skipped, which keeps every later read in step. Returns false if the ring runs
+	// out or the next record is newer than sequence.
+	bool tryReadSequence(std::uint64_t sequence, Record& record)
+	{
+		do
+		{
+			if (!tryRead(record)
+				|| record.sequence > sequence)
+			{
+				return false;
+			}
+		} while (record.sequence < sequence);
+
+		return true;
+	}
+
+private:
+	RingHeader* const m_header;
+	const std::uint8_t* const m_data;
+	const std::uint64_t m_capacity;
+};
+
+} // namespace shm
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Wall clock timestamps for the first time each start-up stage is reached. The relay and the bridge
+// run in different processes, so stages are recorded in milliseconds since the Unix epoch to line
+// them up against each other.
+class StartupTimeline
+{
+public:
+	using Stage = std::pair<std::wstring, std::int64_t>;
+
+	void mark(std::wstring_view stage)
+	{
+		const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		std::lock_guard lock { m_mutex };
+
+		for (const auto& entry : m_stages)
+		{
+			if (entry.first == stage)
+			{
+				return;
+			}
+		}
+
+		m_stages.emplace_back(std::wstring { stage }, static_cast<std::int64_t>(now));
+	}
+
+	std::vector<Stage> stages() const
+	{
+		std::lock_guard lock { m_mutex };
+
+		return m_stages;
+	}
+
+private:
+	mutable std::mutex m_mutex;
+	std::vector<Stage> m_stages;
+};
@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Hashed timing wheel for request deadlines. Each deadline lands in the slot for its tick, so
+// scheduling costs the same however many are pending, and advancing only visits the slots whose ticks
+// have passed. A slot holds deadlines from every rotation, the ones for a later rotation stay put.
+// Entries are never removed early: whoever handles an expired one checks whether it still applies.
+// Not thread safe, callers hold their own lock.
+template <typename T>
+class TimerWheel
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr std::chrono::milliseconds c_tick { 50 };
+	static constexpr size_t c_slotCount = 256;
+
+	explicit TimerWheel(Clock::time_point start = Clock::now()) noexcept
+		: m_start { start }
+	{
+	}
+
+	void schedule(Clock::time_point deadline, T&& value)
+	{
+		// Round up, so nothing expires before its deadline.
+		auto tick = static_cast<std::uint64_t>((std::max(deadline, m_start) - m_start + c_tick - Clock::duration { 1 }) / c_tick);
+
+		if (tick < m_nextTick)
+		{
+			tick = m_nextTick;
+		}
+
+		m_slots[tick % c_slotCount].push_back({ tick, std::move(value) });
+		++m_size;
+	}
+
+	// Removes and returns every entry whose deadline is at or before now.
+	std::vector<T> advance(Clock::time_point now)
+	{
+		std::vector<T> expired;
+
+		if (now < m_start)
+		{
+			return expired;
+		}
+
+		const auto nowTick = static_cast<std::uint64_t>((now - m_start) / c_tick);
+
+		if (nowTick < m_nextTick)
+		{
+			return expired;
+		}
+
+		// After a long gap every slot is due at most once.
+		const auto slots = std::min<std::uint64_t>(nowTick - m_nextTick + 1, c_slotCount);
+
+		for (std::uint64_t i = 0; i < slots; ++i)
+		{
+			auto& slot = m_slots[(m_nextTick + i) % c_slotCount];
+
+			for (size_t index = 0; index < slot.size();)
+			{
+				if (slot[index].tick <= nowTick)
+				{
+					expired.push_back(std::move(slot[index].value));
+					slot[index] = std::move(slot.back());
+					slot.pop_back();
+				}
+				else
+				{
+					++index;
+				}
+			}
+		}
+
+		m_nextTick = nowTick + 1;
+		m_size -= expired.size();
+
+		return expired;
+	}
+
+	size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+private:
+	struct Entry
+	{
+		std::uint64_t tick;
+		T value;
+	};
+
+	const Clock::time_point m_start;
+	std::uint64_t m_nextTick = 0;
+	size_t m_size = 0;
+	std::array<std::vector<Entry>, c_slotCount> m_slots;
+};
@@ -0,0 +1,392 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Opt-in spans written to a Chrome trace-event file (chrome://tracing, Perfetto). Every thread
+// records into its own single-producer ring without taking a lock, and a background thread drains
+// the rings to the file every c_flushInterval. A full ring drops spans instead of blocking the
+// thread which records them. Timestamps are microseconds since the Unix epoch, so files from the
+// client, the relay and the bridge line up on one timeline, and the trace id carried in each request
+// ties their spans together.
+namespace trace {
+
+constexpr size_t c_ringSize = 4096;
+constexpr std::chrono::milliseconds c_flushInterval { 250 };
+
+inline std::int64_t now() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct Event
+{
+	std::array<char, 32> name;
+	std::array<char, 48> trace;
+	std::int32_t requestId;
+	std::int32_t count;
+	std::int64_t start;
+	std::int64_t duration;
+};
+
+class ThreadRing
+{
+public:
+	explicit ThreadRing(std::uint32_t threadId) noexcept
+		: m_threadId { threadId }
+	{
+	}
+
+	void push(const Event& event) noexcept
+	{
+		const auto head = m_head.load(std::memory_order_relaxed);
+
+		if (head - m_tail.load(std::memory_order_acquire) >= c_ringSize)
+		{
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		m_events[head % c_ringSize] = event;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+
+	template <typename Fn>
+	void drain(Fn&& fn)
+	{
+		auto tail = m_tail.load(std::memory_order_relaxed);
+		const auto head = m_head.load(std::memory_order_acquire);
+
+		for (; tail != head; ++tail)
+		{
+			fn(m_events[tail % c_ringSize]);
+		}
+
+		m_tail.store(tail, std::memory_order_release);
+	}
+
+	std::uint32_t threadId() const noexcept
+	{
+		return m_threadId;
+	}
+
+	std::uint64_t dropped() const noexcept
+	{
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	const std::uint32_t m_threadId;
+	std::array<Event, c_ringSize> m_events {};
+	std::atomic<std::uint64_t> m_head { 0 };
+	std::atomic<std::uint64_t> m_tail { 0 };
+	std::atomic<std::uint64_t> m_dropped { 0 };
+};
+
+// One per process. Rings belong to the tracer once a thread registers, so spans recorded just before
+// a thread exits still make it to the file. The ring is then handed on to the next thread which
+// registers, so there are only ever as many rings as threads recording at the same time.
+class Tracer
+{
+public:
+	static Tracer& instance()
+	{
+		static Tracer tracer;
+
+		return tracer;
+	}
+
+	~Tracer()
+	{
+		stop();
+	}
+
+	// Does nothing if the tracer is already writing a file.
+	void start(const std::filesystem::path& path, std::string_view processName)
+	{
+		std::lock_guard lock { m_mutex };
+
+		if (m_enabled.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		m_file.open(path, std::ios::out | std::ios::trunc);
+
+		if (!m_file)
+		{
+			return;
+		}
+
+		// The JSON array format may be left unterminated, so the file stays readable if the process
+		// never gets to stop.
+		m_file << "[\n";
+		m_file << R"({"name":"process_name","ph":"M","pid":)" << processId() << R"(,"args":{"name":")";
+		writeEscaped(processName);
+		m_file << "\"}},\n";
+
+		m_stopping = false;
+		m_enabled.store(true, std::memory_order_release);
+		m_flusher = std::thread { [this]() {
+			flushLoop();
+		} };
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard lock { m_mutex };
+
+			if (!m_enabled.load(std::memory_order_relaxed))
+			{
+				return;
+			}
+
+			m_enabled.store(false, std::memory_order_release);
+			m_stopping = true;
+		}
+
+		m_wake.notify_all();
+		m_flusher.join();
+
+		std::lock_guard lock { m_mutex };
+
+		flush();
+		m_file.close();
+	}
+
+	bool enabled() const noexcept
+	{
+		return m_enabled.load(std::memory_order_relaxed);
+	}
+
+	// Start and end are from trace::now().
+	void record(std::string_view name, std::string_view trace, std::int32_t requestId, std::int64_t start, std::int64_t end, std::int32_t count = 0) noexcept
+	{
+		if (!enabled())
+		{
+			return;
+		}
+
+		Event event {};
+
+		copyTruncated(event.name, name);
+		copyTruncated(event.trace, trace);
+		event.requestId = requestId;
+		event.count = count;
+		event.start = start;
+		event.duration = std::max<std::int64_t>(end - start, 0);
+
+		if (const auto ring = threadRing())
+		{
+			ring->push(event);
+		}
+	}
+
+private:
+	Tracer() = default;
+
+	// Held by each thread which records, and gives the ring back to the tracer when the thread exits.
+	struct RingLease
+	{
+		~RingLease()
+		{
+			if (ring)
+			{
+				tracer->release(std::move(ring));
+			}
+		}
+
+		Tracer* tracer = nullptr;
+		std::shared_ptr<ThreadRing> ring;
+	};
+
+	template <size_t Size>
+	static void copyTruncated(std::array<char, Size>& target, std::string_view value) noexcept
+	{
+		const auto length = std::min(value.size(), Size - 1);
+
+		std::copy_n(value.data(), length, target.data());
+		target[length] = '\0';
+	}
+
+	static std::uint64_t processId() noexcept
+	{
+#ifdef _WIN32
+		return GetCurrentProcessId();
+#else
+		return static_cast<std::uint64_t>(getpid());
+#endif
+	}
+
+	// Returns nullptr if there is no ring and no memory for a new one, the span is dropped then.
+	ThreadRing* threadRing() noexcept
+	{
+		thread_local RingLease lease;
+
+		if (!lease.ring)
+		{
+			try
+			{
+				std::lock_guard lock { m_mutex };
+
+				if (m_freeRings.empty())
+				{
+					auto ring = std::make_shared<ThreadRing>(static_cast<std::uint32_t>(m_rings.size() + 1));
+
+					m_rings.push_back(ring);
+					lease.ring = std::move(ring);
+				}
+				else
+				{
+					lease.ring = std::move(m_freeRings.back());
+					m_freeRings.pop_back();
+				}
+
+				lease.tracer = this;
+			}
+			catch (const std::exception&)
+			{
+				return nullptr;
+			}
+		}
+
+		return lease.ring.get();
+	}
+
+	// The ring keeps its thread id, so a thread which picks it up shows up on the same track. Its
+	// spans are still drained from m_rings, the free list only decides who writes to it next.
+	void release(std::shared_ptr<ThreadRing>&& ring) noexcept
+	{
+		try
+		{
+			std::lock_guard lock { m_mutex };
+
+			m_freeRings.push_back(std::move(ring));
+		}
+		catch (const std::exception&)
+		{
+			// It is still drained, it just is not reused.
+		}
+	}
+
+	void flushLoop()
+	{
+		std::unique_lock lock { m_mutex };
+
+		while (!m_stopping)
+		{
+			m_wake.wait_for(lock, c_flushInterval, [this]() noexcept {
+				return m_stopping;
+			});
+			flush();
+		}
+	}
+
+	// Called with the mutex held.
+	void flush()
+	{
+		const auto pid = processId();
+
+		for (const auto& ring : m_rings)
+		{
+			ring->drain([this, pid, threadId = ring->threadId()](const Event& event) {
+				m_file << R"({"name":")";
+				writeEscaped(event.name.data());
+				m_file << R"(","ph":"X","pid":)" << pid
+					   << R"(,"tid":)" << threadId
+					   << R"(,"ts":)" << event.start
+					   << R"(,"dur":)" << event.duration
+					   << R"(,"args":{"trace":")";
+				writeEscaped(event.trace.data());
+				m_file << R"(","requestId":)" << event.requestId
+					   << R"(,"count":)" << event.count
+					   << "}},\n";
+			});
+		}
+
+		m_file.flush();
+	}
+
+	// Span names and trace ids are plain ASCII, anything else is dropped rather than escaped.
+	void writeEscaped(std::string_view value)
+	{
+		for (const auto ch : value)
+		{
+			if (ch == '"' || ch == '\\')
+			{
+				m_file.put('\\');
+				m_file.put(ch);
+			}
+			else if (ch >= 0x20 && ch < 0x7F)
+			{
+				m_file.put(ch);
+			}
+		}
+	}
+
+	std::atomic_bool m_enabled { false };
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	bool m_stopping = false;
+	std::vector<std::shared_ptr<ThreadRing>> m_rings;
+	std::vector<std::shared_ptr<ThreadRing>> m_freeRings;
+	std::ofstream m_file;
+	std::thread m_flusher;
+};
+
+// Records a span from construction to destruction. The name and trace id must outlive the span.
+class Span
+{
+public:
+	explicit Span(std::string_view name, std::string_view trace = {}, std::int32_t requestId = 0) noexcept
+		: m_name { name }
+		, m_trace { trace }
+		, m_requestId { requestId }
+		, m_start { Tracer::instance().enabled() ? now() : 0 }
+	{
+	}
+
+	Span(const Span&) = delete;
+	Span& operator=(const Span&) = delete;
+
+	~Span()
+	{
+		if (m_start != 0)
+		{
+			Tracer::instance().record(m_name, m_trace, m_requestId, m_start, now(), m_count);
+		}
+	}
+
+	void count(std::int32_t value) noexcept
+	{
+		m_count = value;
+	}
+
+private:
+	const std::string_view m_name;
+	const std::string_view m_trace;
+	const std::int32_t m_requestId;
+	const std::int64_t m_start;
+	std::int32_t m_count = 0;
+};
+
+} // namespace trace
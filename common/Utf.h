@@ -0,0 +1,371 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cwchar>
+#include <string>
+#include <string_view>
+
+// Define GQLMAPI_UTF_NO_SIMD to build only the scalar path, e.g. to test it on x64.
+#if !defined(GQLMAPI_UTF_NO_SIMD) && (defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__))
+#include <emmintrin.h>
+#define GQLMAPI_UTF_SSE2
+#endif
+
+// UTF-16 <-> UTF-8 transcoding in one pass over the input. The output buffer is grown to the worst
+// case up front (3 bytes for every UTF-16 code unit, 1 code unit for every UTF-8 byte) and the
+// position after the last unit written is returned, so a buffer which is reused never shrinks and
+// is only filled once it has grown. Runs of ASCII go 16 at a time with SSE2, which every x64 CPU has,
+// and one code point at a time everywhere else. Malformed input does not fail: unpaired surrogates
+// and invalid UTF-8 become U+FFFD, the same as WideCharToMultiByte and MultiByteToWideChar without
+// WC_ERR_INVALID_CHARS or MB_ERR_INVALID_CHARS.
+namespace utf {
+
+// UTF-16 text as the platform hands it over: wchar_t where it is 16 bits wide (Windows, so hstring
+// and std::wstring fit without a copy), and char16_t everywhere else.
+#if WCHAR_MAX == 0xFFFF
+using WideChar = wchar_t;
+#else
+using WideChar = char16_t;
+#endif
+
+using WideString = std::basic_string<WideChar>;
+using WideStringView = std::basic_string_view<WideChar>;
+
+constexpr char32_t c_replacementCharacter = 0xFFFD;
+
+// Decodes the sequence starting at data[i] and advances i past it. A truncated or invalid sequence
+// consumes its lead byte and any continuation bytes which follow it, and decodes as U+FFFD.
+inline char32_t decodeCodePoint(const unsigned char* data, size_t length, size_t& i) noexcept
+{
+	const unsigned char lead = data[i];
+
+	if (lead < 0x80)
+	{
+		++i;
+		return lead;
+	}
+
+	size_t extra = 0;
+	char32_t codePoint = 0;
+	char32_t minimum = 0;
+
+	if ((lead & 0xE0) == 0xC0)
+	{
+		extra = 1;
+		codePoint = lead & 0x1F;
+		minimum = 0x80;
+	}
+	else if ((lead & 0xF0) == 0xE0)
+	{
+		extra = 2;
+		codePoint = lead & 0x0F;
+		minimum = 0x800;
+	}
+	else if ((lead & 0xF8) == 0xF0)
+	{
+		extra = 3;
+		codePoint = lead & 0x07;
+		minimum = 0x10000;
+	}
+	else
+	{
+		++i;
+		return c_replacementCharacter;
+	}
+
+	size_t consumed = 1;
+
+	while (consumed <= extra
+		&& i + consumed < length
+		&& (data[i + consumed] & 0xC0) == 0x80)
+	{
+		codePoint = (codePoint << 6) | (data[i + consumed] & 0x3F);
+		++consumed;
+	}
+
+	i += consumed;
+
+	if (consumed <= extra
+		|| codePoint < minimum
+		|| codePoint > 0x10FFFF
+		|| (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+	{
+		return c_replacementCharacter;
+	}
+
+	return codePoint;
+}
+
+// Writes ch as UTF-16 at dest and returns the position after it.
+template <typename CharT>
+CharT* encodeCodePoint(char32_t ch, CharT* dest) noexcept
+{
+	if (ch >= 0x10000)
+	{
+		ch -= 0x10000;
+		*dest++ = static_cast<CharT>(0xD800 + (ch >> 10));
+		*dest++ = static_cast<CharT>(0xDC00 + (ch & 0x3FF));
+	}
+	else
+	{
+		*dest++ = static_cast<CharT>(ch);
+	}
+
+	return dest;
+}
+
+// Widens length ASCII bytes to UTF-16 at dest.
+template <typename CharT>
+void widenAscii(const char* data, size_t length, CharT* dest) noexcept
+{
+	static_assert(sizeof(CharT) == sizeof(char16_t), "UTF-16 code units only");
+
+	size_t i = 0;
+
+#ifdef GQLMAPI_UTF_SSE2
+	const auto zero = _mm_setzero_si128();
+
+	for (; i + 16 <= length; i += 16)
+	{
+		const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_unpacklo_epi8(bytes, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 8), _mm_unpackhi_epi8(bytes, zero));
+	}
+#endif
+
+	for (; i < length; ++i)
+	{
+		dest[i] = static_cast<CharT>(static_cast<unsigned char>(data[i]));
+	}
+}
+
+namespace detail {
+
+template <typename CharT>
+bool isSurrogatePair(const CharT* data, size_t length, size_t i) noexcept
+{
+	return data[i] >= 0xD800 && data[i] <= 0xDBFF
+		&& i + 1 < length
+		&& data[i + 1] >= 0xDC00 && data[i + 1] <= 0xDFFF;
+}
+
+#ifdef GQLMAPI_UTF_SSE2
+// True if all 16 UTF-16 code units in low and high are below 0x80.
+inline bool isAscii16(const __m128i& low, const __m128i& high) noexcept
+{
+	const auto nonAscii = _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi16(static_cast<short>(0xFF80)));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) == 0xFFFF;
+}
+#endif
+
+} // namespace detail
+
+// The number of UTF-8 bytes encodeUtf8 writes for utf16.
+template <typename CharT>
+size_t utf8Length(std::basic_string_view<CharT> utf16) noexcept
+{
+	static_assert(sizeof(CharT) == sizeof(char16_t), "UTF-16 code units only");
+
+	const auto data = utf16.data();
+	const auto length = utf16.size();
+	size_t result = 0;
+	size_t i = 0;
+
+	while (i < length)
+	{
+#ifdef GQLMAPI_UTF_SSE2
+		if (i + 16 <= length)
+		{
+			const auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			const auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 8));
+
+			if (detail::isAscii16(low, high))
+			{
+				result += 16;
+				i += 16;
+				continue;
+			}
+		}
+#endif
+
+		const auto ch = static_cast<char16_t>(data[i]);
+
+		if (ch < 0x80)
+		{
+			result += 1;
+		}
+		else if (ch < 0x800)
+		{
+			result += 2;
+		}
+		else if (detail::isSurrogatePair(data, length, i))
+		{
+			result += 4;
+			++i;
+		}
+		else
+		{
+			result += 3;
+		}
+
+		++i;
+	}
+
+	return result;
+}
+
+// Transcodes utf16 into out starting at offset, growing out if it might not fit, and returns the
+// offset after the last byte written. Out is a contiguous container of 8-bit units, std::string or
+// std::vector<std::uint8_t>.
+template <typename CharT, typename Out>
+size_t encodeUtf8(std::basic_string_view<CharT> utf16, Out& out, size_t offset)
+{
+	static_assert(sizeof(CharT) == sizeof(char16_t), "UTF-16 code units only");
+	static_assert(sizeof(typename Out::value_type) == 1, "UTF-8 code units only");
+
+	const auto data = utf16.data();
+	const auto length = utf16.size();
+
+	if (length == 0)
+	{
+		return offset;
+	}
+
+	if (out.size() < offset + length * 3)
+	{
+		out.resize(offset + length * 3);
+	}
+
+	const auto begin = reinterpret_cast<std::uint8_t*>(&out[0]);
+	auto dest = begin + offset;
+	size_t i = 0;
+
+	while (i < length)
+	{
+#ifdef GQLMAPI_UTF_SSE2
+		if (i + 16 <= length)
+		{
+			const auto low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			const auto high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 8));
+
+			if (detail::isAscii16(low, high))
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_packus_epi16(low, high));
+				dest += 16;
+				i += 16;
+				continue;
+			}
+		}
+#endif
+
+		char32_t ch = static_cast<char16_t>(data[i]);
+
+		if (detail::isSurrogatePair(data, length, i))
+		{
+			ch = 0x10000 + ((ch - 0xD800) << 10) + (static_cast<char16_t>(data[++i]) - 0xDC00);
+		}
+		else if (ch >= 0xD800 && ch <= 0xDFFF)
+		{
+			ch = c_replacementCharacter;
+		}
+
+		++i;
+
+		if (ch < 0x80)
+		{
+			*dest++ = static_cast<std::uint8_t>(ch);
+		}
+		else if (ch < 0x800)
+		{
+			*dest++ = static_cast<std::uint8_t>(0xC0 | (ch >> 6));
+			*dest++ = static_cast<std::uint8_t>(0x80 | (ch & 0x3F));
+		}
+		else if (ch < 0x10000)
+		{
+			*dest++ = static_cast<std::uint8_t>(0xE0 | (ch >> 12));
+			*dest++ = static_cast<std::uint8_t>(0x80 | ((ch >> 6) & 0x3F));
+			*dest++ = static_cast<std::uint8_t>(0x80 | (ch & 0x3F));
+		}
+		else
+		{
+			*dest++ = static_cast<std::uint8_t>(0xF0 | (ch >> 18));
+			*dest++ = static_cast<std::uint8_t>(0x80 | ((ch >> 12) & 0x3F));
+			*dest++ = static_cast<std::uint8_t>(0x80 | ((ch >> 6) & 0x3F));
+			*dest++ = static_cast<std::uint8_t>(0x80 | (ch & 0x3F));
+		}
+	}
+
+	return static_cast<size_t>(dest - begin);
+}
+
+// Transcodes utf8 into out starting at offset, growing out if it might not fit, and returns the
+// offset after the last code unit written. Out is a contiguous container of 16-bit units,
+// std::wstring on Windows or std::u16string.
+template <typename Out>
+size_t decodeUtf8(std::string_view utf8, Out& out, size_t offset)
+{
+	using CharT = typename Out::value_type;
+
+	static_assert(sizeof(CharT) == sizeof(char16_t), "UTF-16 code units only");
+
+	const auto data = reinterpret_cast<const unsigned char*>(utf8.data());
+	const auto length = utf8.size();
+
+	if (length == 0)
+	{
+		return offset;
+	}
+
+	if (out.size() < offset + length)
+	{
+		out.resize(offset + length);
+	}
+
+	const auto begin = &out[0];
+	auto dest = begin + offset;
+	size_t i = 0;
+
+	while (i < length)
+	{
+#ifdef GQLMAPI_UTF_SSE2
+		if (i + 16 <= length)
+		{
+			const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+
+			if (_mm_movemask_epi8(bytes) == 0)
+			{
+				const auto zero = _mm_setzero_si128();
+
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_unpacklo_epi8(bytes, zero));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 8), _mm_unpackhi_epi8(bytes, zero));
+				dest += 16;
+				i += 16;
+				continue;
+			}
+		}
+#endif
+
+		dest = encodeCodePoint(decodeCodePoint(data, length, i), dest);
+	}
+
+	return static_cast<size_t>(dest - begin);
+}
+
+// Appends utf16 to out as UTF-8.
+template <typename CharT, typename Out>
+void appendUtf8(std::basic_string_view<CharT> utf16, Out& out)
+{
+	out.resize(encodeUtf8(utf16, out, out.size()));
+}
+
+// Appends utf8 to out as UTF-16.
+template <typename Out>
+void appendUtf16(std::string_view utf8, Out& out)
+{
+	out.resize(decodeUtf8(utf8, out, out.size()));
+}
+
+} // namespace utf
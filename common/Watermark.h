@@ -0,0 +1,44 @@
+﻿#pragma once
+
+#include <cstddef>
+
+// Hysteresis on a queue's depth: throttles once the depth reaches the high watermark and releases
+// once it drains back to the low one, so a sender held at the high watermark is not released and
+// held again with every message. Not thread safe, callers hold their own lock.
+class Watermark
+{
+public:
+	// low must be below high.
+	Watermark(size_t high, size_t low) noexcept
+		: m_high { high }
+		, m_low { low }
+	{
+	}
+
+	// Returns whether the queue is throttled at this depth.
+	bool update(size_t depth) noexcept
+	{
+		if (!m_throttling
+			&& depth >= m_high)
+		{
+			m_throttling = true;
+		}
+		else if (m_throttling
+			&& depth <= m_low)
+		{
+			m_throttling = false;
+		}
+
+		return m_throttling;
+	}
+
+	bool throttling() const noexcept
+	{
+		return m_throttling;
+	}
+
+private:
+	const size_t m_high;
+	const size_t m_low;
+	bool m_throttling = false;
+};
@@ -0,0 +1,113 @@
+﻿#include "Cbor.h"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+// A contents table page shaped like the bridge's "next" envelope, written as UTF-16 the way the
+// WinRT side hands strings over.
+void writeEnvelope(cbor::Writer& writer, int items)
+{
+	writer.beginMap(3);
+	writer.writeText("type"sv);
+	writer.writeText("next"sv);
+	writer.writeText("fetched"sv);
+	writer.beginMap(1);
+	writer.writeText("items"sv);
+	writer.beginArray(static_cast<size_t>(items));
+
+	for (int i = 0; i < items; ++i)
+	{
+		const auto id = u"AAMkAGI2TG93AAA="s + std::u16string(1, static_cast<char16_t>(u'0' + i % 10));
+
+		writer.beginMap(5);
+		writer.writeText("id"sv);
+		writer.writeUtf16Text(std::u16string_view { id });
+		writer.writeText("subject"sv);
+		writer.writeUtf16Text(u"Quarterly report – draft"sv);
+		writer.writeText("unread"sv);
+		writer.writeBool(i % 2 == 0);
+		writer.writeText("size"sv);
+		writer.writeNumber(1024.0 * i);
+		writer.writeText("score"sv);
+		writer.writeNumber(i + 0.5);
+	}
+
+	writer.writeText("requestId"sv);
+	writer.writeInt(42);
+}
+
+// Walks every item the way clientlib's ReadCborValue does, without building a JsonValue.
+size_t skipValue(cbor::Reader& reader)
+{
+	const auto item = reader.next();
+	size_t count = 1;
+
+	switch (item.type)
+	{
+		case cbor::ItemType::Array:
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				count += skipValue(reader);
+			}
+			break;
+
+		case cbor::ItemType::Map:
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				reader.next();
+				count += skipValue(reader);
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return count;
+}
+
+void BM_Encode(benchmark::State& state)
+{
+	std::vector<std::uint8_t> buffer;
+
+	for (auto _ : state)
+	{
+		buffer.clear();
+
+		cbor::Writer writer { buffer };
+
+		writeEnvelope(writer, static_cast<int>(state.range(0)));
+		benchmark::DoNotOptimize(buffer.data());
+	}
+
+	state.counters["bytes"] = static_cast<double>(buffer.size());
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * buffer.size()));
+}
+
+void BM_Decode(benchmark::State& state)
+{
+	std::vector<std::uint8_t> buffer;
+	cbor::Writer writer { buffer };
+
+	writeEnvelope(writer, static_cast<int>(state.range(0)));
+
+	for (auto _ : state)
+	{
+		cbor::Reader reader { buffer.data(), buffer.size() };
+
+		benchmark::DoNotOptimize(skipValue(reader));
+	}
+
+	state.counters["bytes"] = static_cast<double>(buffer.size());
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * buffer.size()));
+}
+
+} // namespace
+
+BENCHMARK(BM_Encode)->Arg(10)->Arg(1000)->Arg(10000);
+BENCHMARK(BM_Decode)->Arg(10)->Arg(1000)->Arg(10000);
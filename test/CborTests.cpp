@@ -0,0 +1,239 @@
+﻿#include "Cbor.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+
+using namespace std::literals;
+
+namespace {
+
+using Bytes = std::vector<std::uint8_t>;
+
+template <typename Write>
+Bytes encode(Write&& write)
+{
+	Bytes buffer;
+	cbor::Writer writer { buffer };
+
+	write(writer);
+
+	return buffer;
+}
+
+cbor::Item decodeOne(const Bytes& bytes)
+{
+	cbor::Reader reader { bytes.data(), bytes.size() };
+	const auto item = reader.next();
+
+	EXPECT_TRUE(reader.atEnd());
+
+	return item;
+}
+
+} // namespace
+
+// Encodings from RFC 8949 appendix A.
+TEST(CborTests, IntegersUseTheShortestHead)
+{
+	const std::pair<std::int64_t, Bytes> cases[] = {
+		{ 0, { 0x00 } },
+		{ 23, { 0x17 } },
+		{ 24, { 0x18, 0x18 } },
+		{ 1000, { 0x19, 0x03, 0xE8 } },
+		{ 1000000, { 0x1A, 0x00, 0x0F, 0x42, 0x40 } },
+		{ 1000000000000, { 0x1B, 0x00, 0x00, 0x00, 0xE8, 0xD4, 0xA5, 0x10, 0x00 } },
+		{ -1, { 0x20 } },
+		{ -100, { 0x38, 0x63 } },
+		{ -1000, { 0x39, 0x03, 0xE7 } },
+	};
+
+	for (const auto& [value, expected] : cases)
+	{
+		const auto bytes = encode([value = value](cbor::Writer& writer) {
+			writer.writeInt(value);
+		});
+
+		EXPECT_EQ(expected, bytes) << value;
+
+		const auto item = decodeOne(bytes);
+
+		EXPECT_EQ(cbor::ItemType::Integer, item.type);
+		EXPECT_EQ(value, item.integer);
+	}
+}
+
+TEST(CborTests, Int64LimitsRoundTrip)
+{
+	for (const auto value : { std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max() })
+	{
+		const auto item = decodeOne(encode([value](cbor::Writer& writer) {
+			writer.writeInt(value);
+		}));
+
+		EXPECT_EQ(value, item.integer);
+	}
+}
+
+TEST(CborTests, IntegersPastInt64AreRejected)
+{
+	const Bytes bytes { 0x1B, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+	cbor::Reader reader { bytes.data(), bytes.size() };
+
+	EXPECT_THROW(reader.next(), std::runtime_error);
+}
+
+TEST(CborTests, IntegralNumbersBecomeIntegers)
+{
+	EXPECT_EQ((Bytes { 0x18, 0x2A }), encode([](cbor::Writer& writer) {
+		writer.writeNumber(42.0);
+	}));
+	EXPECT_EQ(cbor::ItemType::Float, decodeOne(encode([](cbor::Writer& writer) {
+		writer.writeNumber(1.5);
+	})).type);
+	EXPECT_EQ(cbor::ItemType::Float, decodeOne(encode([](cbor::Writer& writer) {
+		writer.writeNumber(1e300);
+	})).type);
+}
+
+TEST(CborTests, FloatsOfEveryWidthDecode)
+{
+	EXPECT_EQ(1.1, decodeOne(encode([](cbor::Writer& writer) {
+		writer.writeDouble(1.1);
+	})).number);
+
+	// Half precision: 1.5, 65504, -4 and the smallest subnormal.
+	EXPECT_EQ(1.5, decodeOne(Bytes { 0xF9, 0x3E, 0x00 }).number);
+	EXPECT_EQ(65504.0, decodeOne(Bytes { 0xF9, 0x7B, 0xFF }).number);
+	EXPECT_EQ(-4.0, decodeOne(Bytes { 0xF9, 0xC4, 0x00 }).number);
+	EXPECT_EQ(5.960464477539063e-8, decodeOne(Bytes { 0xF9, 0x00, 0x01 }).number);
+	EXPECT_TRUE(std::isinf(decodeOne(Bytes { 0xF9, 0x7C, 0x00 }).number));
+	EXPECT_TRUE(std::isnan(decodeOne(Bytes { 0xF9, 0x7E, 0x00 }).number));
+
+	// Single precision: 100000.
+	EXPECT_EQ(100000.0, decodeOne(Bytes { 0xFA, 0x47, 0xC3, 0x50, 0x00 }).number);
+}
+
+TEST(CborTests, SimpleValues)
+{
+	const auto bytes = encode([](cbor::Writer& writer) {
+		writer.beginArray(3);
+		writer.writeBool(false);
+		writer.writeBool(true);
+		writer.writeNull();
+	});
+
+	EXPECT_EQ((Bytes { 0x83, 0xF4, 0xF5, 0xF6 }), bytes);
+
+	cbor::Reader reader { bytes.data(), bytes.size() };
+
+	EXPECT_EQ(3u, reader.next().count);
+	EXPECT_FALSE(reader.next().boolean);
+	EXPECT_TRUE(reader.next().boolean);
+	EXPECT_EQ(cbor::ItemType::Null, reader.next().type);
+	EXPECT_TRUE(reader.atEnd());
+}
+
+TEST(CborTests, Utf16TextIsWrittenAsUtf8)
+{
+	const auto bytes = encode([](cbor::Writer& writer) {
+		writer.writeUtf16Text(u"ü水\U00010151"sv);
+	});
+
+	EXPECT_EQ((Bytes { 0x69, 0xC3, 0xBC, 0xE6, 0xB0, 0xB4, 0xF0, 0x90, 0x85, 0x91 }), bytes);
+	EXPECT_EQ(u8"ü水\U00010151"sv, decodeOne(bytes).text);
+}
+
+TEST(CborTests, LongTextUsesAWiderHead)
+{
+	const std::string text(300, 'x');
+	const auto bytes = encode([&text](cbor::Writer& writer) {
+		writer.writeText(text);
+	});
+
+	EXPECT_EQ(3u + text.size(), bytes.size());
+	EXPECT_EQ(text, decodeOne(bytes).text);
+}
+
+TEST(CborTests, NestedMapsAndArrays)
+{
+	const auto bytes = encode([](cbor::Writer& writer) {
+		writer.beginMap(2);
+		writer.writeText("a"sv);
+		writer.writeInt(1);
+		writer.writeText("b"sv);
+		writer.beginArray(2);
+		writer.writeInt(2);
+		writer.writeInt(3);
+	});
+
+	EXPECT_EQ((Bytes { 0xA2, 0x61, 0x61, 0x01, 0x61, 0x62, 0x82, 0x02, 0x03 }), bytes);
+}
+
+TEST(CborTests, TagsAreSkipped)
+{
+	// 1(1363896240), an epoch date.
+	EXPECT_EQ(1363896240, decodeOne(Bytes { 0xC1, 0x1A, 0x51, 0x4B, 0x67, 0xB0 }).integer);
+}
+
+TEST(CborTests, LongTagChainsDoNotRecurse)
+{
+	Bytes bytes(1'000'000, 0xC1);
+
+	bytes.push_back(0x07);
+
+	EXPECT_EQ(7, decodeOne(bytes).integer);
+}
+
+TEST(CborTests, TagWithoutItemIsTruncated)
+{
+	const Bytes bytes { 0xC1, 0xC1 };
+	cbor::Reader reader { bytes.data(), bytes.size() };
+
+	EXPECT_THROW(reader.next(), std::runtime_error);
+}
+
+TEST(CborTests, MalformedInputThrows)
+{
+	const Bytes cases[] = {
+		{},
+		// Text claims 5 bytes, has 1.
+		{ 0x65, 0x61 },
+		// Array claims 1000 elements in 0 bytes.
+		{ 0x99, 0x03, 0xE8 },
+		// Head promises a 4-byte argument.
+		{ 0x1A, 0x00, 0x01 },
+		// Indefinite-length array.
+		{ 0x9F, 0x01, 0xFF },
+		// Reserved additional information.
+		{ 0x1C },
+		// Unassigned simple value.
+		{ 0xF0 },
+	};
+
+	for (const auto& bytes : cases)
+	{
+		cbor::Reader reader { bytes.data(), bytes.size() };
+
+		EXPECT_THROW(reader.next(), std::runtime_error) << bytes.size();
+	}
+}
+
+TEST(CborTests, WriteEncodedSplicesItems)
+{
+	const auto inner = encode([](cbor::Writer& writer) {
+		writer.writeText("cached"sv);
+	});
+	const auto bytes = encode([&inner](cbor::Writer& writer) {
+		writer.beginArray(2);
+		writer.writeEncoded(inner);
+		writer.writeEncoded(inner);
+	});
+	cbor::Reader reader { bytes.data(), bytes.size() };
+
+	EXPECT_EQ(2u, reader.next().count);
+	EXPECT_EQ("cached"sv, reader.next().text);
+	EXPECT_EQ("cached"sv, reader.next().text);
+	EXPECT_TRUE(reader.atEnd());
+}
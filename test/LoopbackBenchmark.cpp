@@ -0,0 +1,583 @@
+﻿#include "Cbor.h"
+#include "LatencyHistogram.h"
+#include "LoopbackTransport.h"
+#include "PayloadWriter.h"
+#include "RequestEnvelope.h"
+#include "RequestTable.h"
+
+#include "graphqlservice/JSONResponse.h"
+
+#include <benchmark/benchmark.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+// Both ends of the protocol in one process: the client side of clientlib and the bridge side of
+// Service, talking through a LoopbackTransport instead of the AppService relay. Each workload
+// reports its round trips per second and the p50/p99 latency of each one in microseconds.
+
+namespace {
+
+utf::WideString widen(std::string_view text)
+{
+	utf::WideString result;
+
+	utf::appendUtf16(text, result);
+
+	return result;
+}
+
+const utf::WideString c_parseQuery { widen("parseQuery"sv) };
+const utf::WideString c_fetchQuery { widen("fetchQuery"sv) };
+const utf::WideString c_operationName { widen("operationName"sv) };
+const utf::WideString c_subscription { widen("ItemAdded"sv) };
+const utf::WideString c_complete { widen("complete"sv) };
+const utf::WideString c_next { widen("next"sv) };
+
+// Stands in for the MAPI schema. GetItems resolves as many items as its "first" variable asks for,
+// so each request sets the size of its own result, the same as paging through a folder.
+response::Value resolveItems(int count)
+{
+	response::Value list { response::Type::List };
+
+	for (int i = 0; i < count; ++i)
+	{
+		response::Value item { response::Type::Map };
+
+		item.emplace_back("id"s, response::Value { "AAMkAGI2TG93AAA="s + std::to_string(i) });
+		item.emplace_back("subject"s, response::Value { u8"Quarterly report – draft "s + std::to_string(i) });
+		item.emplace_back("preview"s, response::Value { "Hi all,\nplease find the \"final\" numbers attached."s });
+		item.emplace_back("unread"s, response::Value { i % 2 == 0 });
+		item.emplace_back("size"s, response::Value { 1024 * i });
+		list.emplace_back(std::move(item));
+	}
+
+	response::Value items { response::Type::Map };
+
+	items.emplace_back("items"s, std::move(list));
+
+	return items;
+}
+
+response::Value resolve(response::Value&& variables)
+{
+	const auto itr = variables.find("first"sv);
+
+	return resolveItems(itr == variables.end() ? 0 : static_cast<int>(itr->second.get<response::IntType>()));
+}
+
+// One message's worth of responses, JSON in "responses" or a single CBOR array, the same as the
+// ResponseBatcher sends them.
+class ResponseBatch
+{
+public:
+	explicit ResponseBatch(bool binary) noexcept
+		: m_binary { binary }
+	{
+	}
+
+	bool empty() const noexcept
+	{
+		return m_text.empty() && m_items.empty();
+	}
+
+	void add(utf::WideStringView json)
+	{
+		m_text.emplace_back(json);
+	}
+
+	void add(const std::vector<std::uint8_t>& cbor)
+	{
+		m_items.push_back(cbor);
+	}
+
+	TransportMessage take()
+	{
+		TransportMessage message;
+
+		if (m_binary)
+		{
+			cbor::Writer writer { message.cborResponses };
+
+			writer.beginArray(m_items.size());
+
+			for (const auto& item : m_items)
+			{
+				writer.writeEncoded(item);
+			}
+		}
+		else
+		{
+			message.responses = std::move(m_text);
+		}
+
+		m_text.clear();
+		m_items.clear();
+
+		return message;
+	}
+
+private:
+	const bool m_binary;
+	std::vector<utf::WideString> m_text;
+	std::vector<std::vector<std::uint8_t>> m_items;
+};
+
+// The bridge's half: reads each request with RequestEnvelope, resolves it against the stub schema
+// and writes the result with PayloadWriter. A message is finished once its responses have been
+// delivered, so the client has at most one batch in flight, the same as with the relay.
+class StubBridge
+{
+public:
+	StubBridge(std::shared_ptr<MessageTransport> transport, bool binary)
+		: m_transport { std::move(transport) }
+		, m_binary { binary }
+	{
+		m_transport->receive([this](TransportMessage&& message, MessageTransport::Completion done) {
+			handle(std::move(message), std::move(done));
+		});
+	}
+
+	~StubBridge()
+	{
+		// Stops the delivery thread before the rest of this goes away.
+		m_transport.reset();
+	}
+
+	// Sends one payload to every subscriber at once, the way a SubscriptionGroup does.
+	void publish(const response::Value& payload)
+	{
+		ResponseBatch batch { m_binary };
+
+		if (m_binary)
+		{
+			batch.add(m_publishWriter.writeFetchedCbor(c_next, m_subscribers, payload));
+		}
+		else
+		{
+			batch.add(m_publishWriter.writeFetched(c_next, m_subscribers, payload));
+		}
+
+		m_transport->send(batch.take(), {});
+	}
+
+private:
+	void handle(TransportMessage&& message, MessageTransport::Completion done)
+	{
+		ResponseBatch batch { m_binary };
+
+		for (const auto& request : message.requests)
+		{
+			RequestEnvelope envelope { request };
+			const auto requestId = envelope.requestId();
+			const auto type = envelope.type();
+
+			if (type == c_parseQuery)
+			{
+				// The GraphQL parse is not part of the stub, the bridge only answers with a queryId.
+				writeParsed(batch, requestId);
+			}
+			else if (type == c_fetchQuery
+				&& envelope.getString(c_operationName) == c_subscription)
+			{
+				// Subscriptions only answer when something is published.
+				m_subscribers.push_back(requestId);
+			}
+			else if (type == c_fetchQuery)
+			{
+				const auto result = resolve(envelope.takeVariables());
+
+				if (m_binary)
+				{
+					batch.add(m_writer.writeFetchedCbor(c_complete, requestId, result));
+				}
+				else
+				{
+					batch.add(m_writer.writeFetched(c_complete, requestId, result));
+				}
+			}
+		}
+
+		if (batch.empty())
+		{
+			done(nullptr);
+			return;
+		}
+
+		m_transport->send(batch.take(), std::move(done));
+	}
+
+	void writeParsed(ResponseBatch& batch, int requestId)
+	{
+		if (m_binary)
+		{
+			std::vector<std::uint8_t> encoded;
+			cbor::Writer writer { encoded };
+
+			writer.beginMap(3);
+			writer.writeText("type"sv);
+			writer.writeText("parsed"sv);
+			writer.writeText("queryId"sv);
+			writer.writeInt(requestId);
+			writer.writeText("requestId"sv);
+			writer.writeInt(requestId);
+			batch.add(encoded);
+		}
+		else
+		{
+			const auto id = std::to_string(requestId);
+
+			batch.add(widen(R"({"type":"parsed","queryId":)" + id + R"(,"requestId":)" + id + "}"));
+		}
+	}
+
+	std::shared_ptr<MessageTransport> m_transport;
+	const bool m_binary;
+	PayloadWriter m_writer;
+	PayloadWriter m_publishWriter;
+	std::vector<int> m_subscribers;
+};
+
+// The response side of clientlib's ReadCborValue, building a response::Value instead of a JsonValue.
+response::Value readCborValue(cbor::Reader& reader)
+{
+	const auto item = reader.next();
+
+	switch (item.type)
+	{
+		case cbor::ItemType::Boolean:
+			return response::Value { item.boolean };
+
+		case cbor::ItemType::Integer:
+			return response::Value { static_cast<response::IntType>(item.integer) };
+
+		case cbor::ItemType::Float:
+			return response::Value { item.number };
+
+		case cbor::ItemType::Text:
+		case cbor::ItemType::Bytes:
+			return response::Value { std::string { item.text } };
+
+		case cbor::ItemType::Array:
+		{
+			response::Value list { response::Type::List };
+
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				list.emplace_back(readCborValue(reader));
+			}
+
+			return list;
+		}
+
+		case cbor::ItemType::Map:
+		{
+			response::Value map { response::Type::Map };
+
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				auto key = readCborValue(reader).release<response::StringType>();
+
+				map.emplace_back(std::move(key), readCborValue(reader));
+			}
+
+			return map;
+		}
+
+		default:
+			return response::Value {};
+	}
+}
+
+// clientlib's half: every request has a record in a RequestTable, and each response message is
+// decoded and dispatched to the records it names, the same as Connection::OnMessageReceived.
+class StubClient
+{
+public:
+	explicit StubClient(std::shared_ptr<MessageTransport> transport)
+		: m_transport { std::move(transport) }
+	{
+		m_transport->receive([this](TransportMessage&& message, MessageTransport::Completion done) {
+			handle(std::move(message));
+			done(nullptr);
+		});
+	}
+
+	~StubClient()
+	{
+		m_transport.reset();
+	}
+
+	// Sends a batch of requests and waits until every one of them has been answered.
+	void roundTrip(TransportMessage&& message, const std::vector<int>& requestIds)
+	{
+		const auto sent = LatencyHistogram::Clock::now();
+
+		for (const auto requestId : requestIds)
+		{
+			m_requests.insert(requestId, Record { sent, false });
+		}
+
+		expect(requestIds.size());
+		m_transport->send(std::move(message), {});
+		wait();
+	}
+
+	// Registers the subscriptions, which only answer once something is published.
+	void subscribe(TransportMessage&& message, const std::vector<int>& requestIds)
+	{
+		for (const auto requestId : requestIds)
+		{
+			m_requests.insert(requestId, Record { {}, true });
+		}
+
+		std::promise<std::exception_ptr> sent;
+
+		m_transport->send(std::move(message), [&sent](std::exception_ptr error) {
+			sent.set_value(error);
+		});
+
+		if (const auto error = sent.get_future().get())
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+	// Waits for a payload the bridge publishes to reach every subscriber.
+	template <typename Fn>
+	void fanOut(size_t subscribers, Fn&& publish)
+	{
+		m_published = LatencyHistogram::Clock::now();
+		expect(subscribers);
+		publish();
+		wait();
+	}
+
+	void report(benchmark::State& state, size_t perIteration)
+	{
+		const auto summary = m_latency.summary();
+
+		state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * perIteration));
+		state.counters["p50_us"] = static_cast<double>(summary.p50);
+		state.counters["p99_us"] = static_cast<double>(summary.p99);
+	}
+
+private:
+	struct Record
+	{
+		LatencyHistogram::Clock::time_point sent;
+		bool subscription;
+	};
+
+	void handle(TransportMessage&& message)
+	{
+		if (!message.cborResponses.empty())
+		{
+			cbor::Reader reader { message.cborResponses.data(), message.cborResponses.size() };
+			const auto responses = reader.next();
+
+			for (size_t i = 0; i < responses.count; ++i)
+			{
+				dispatch(readCborValue(reader));
+			}
+		}
+		else
+		{
+			for (const auto& response : message.responses)
+			{
+				m_utf8.clear();
+				utf::appendUtf8(utf::WideStringView { response }, m_utf8);
+				dispatch(response::parseJSON(m_utf8));
+			}
+		}
+	}
+
+	void dispatch(const response::Value& response)
+	{
+		size_t handled = 0;
+
+		if (const auto itr = response.find("requestId"sv); itr != response.end())
+		{
+			handled += deliver(static_cast<std::int32_t>(itr->second.get<response::IntType>()));
+		}
+		else if (const auto itrIds = response.find("requestIds"sv); itrIds != response.end())
+		{
+			for (const auto& requestId : itrIds->second.get<response::ListType>())
+			{
+				handled += deliver(static_cast<std::int32_t>(requestId.get<response::IntType>()));
+			}
+		}
+
+		std::lock_guard lock { m_mutex };
+
+		m_outstanding -= handled;
+
+		if (m_outstanding == 0)
+		{
+			m_finished.notify_one();
+		}
+	}
+
+	// Subscriptions stay in the table, anything else is finished by its one response.
+	size_t deliver(std::int32_t requestId)
+	{
+		if (const auto record = m_requests.takeIf(requestId, [](const Record& record) noexcept {
+				return !record.subscription;
+			}))
+		{
+			m_latency.recordSince(record->sent);
+			return 1;
+		}
+
+		if (m_requests.update(requestId, [this](Record& /* record */) {
+				m_latency.recordSince(m_published);
+			}))
+		{
+			return 1;
+		}
+
+		return 0;
+	}
+
+	void expect(size_t responses)
+	{
+		std::lock_guard lock { m_mutex };
+
+		m_outstanding = responses;
+	}
+
+	void wait()
+	{
+		std::unique_lock lock { m_mutex };
+
+		m_finished.wait(lock, [this]() noexcept {
+			return m_outstanding == 0;
+		});
+	}
+
+	std::shared_ptr<MessageTransport> m_transport;
+	RequestTable<Record> m_requests;
+	LatencyHistogram m_latency;
+	LatencyHistogram::Clock::time_point m_published;
+	std::string m_utf8;
+
+	std::mutex m_mutex;
+	std::condition_variable m_finished;
+	size_t m_outstanding = 0;
+};
+
+// The bridge end is declared last so it shuts down first, while the client can still take its
+// responses.
+struct Loopback
+{
+	explicit Loopback(bool binary)
+		: Loopback { LoopbackTransport::createPair(), binary }
+	{
+	}
+
+	StubClient client;
+	StubBridge bridge;
+
+private:
+	Loopback(std::pair<std::shared_ptr<LoopbackTransport>, std::shared_ptr<LoopbackTransport>>&& ends, bool binary)
+		: client { std::move(ends.first) }
+		, bridge { std::move(ends.second), binary }
+	{
+	}
+};
+
+TransportMessage makeRequests(std::string_view type, const std::vector<int>& requestIds, std::string_view members)
+{
+	TransportMessage message;
+
+	for (const auto requestId : requestIds)
+	{
+		message.requests.push_back(widen(R"({"type":")" + std::string { type } + R"(","requestId":)" + std::to_string(requestId)
+			+ std::string { members } + "}"));
+	}
+
+	return message;
+}
+
+std::vector<int> makeRequestIds(int count)
+{
+	std::vector<int> requestIds(static_cast<size_t>(count));
+
+	for (int i = 0; i < count; ++i)
+	{
+		requestIds[static_cast<size_t>(i)] = i + 1;
+	}
+
+	return requestIds;
+}
+
+// A batch of parseQuery requests and their answers, which is mostly the cost of the envelopes.
+void BM_LoopbackParse(benchmark::State& state)
+{
+	Loopback loopback { state.range(1) != 0 };
+	const auto requestIds = makeRequestIds(static_cast<int>(state.range(0)));
+	const auto requests = makeRequests("parseQuery"sv, requestIds, R"(,"query":"query GetItems($first: Int) { items(first: $first) { id subject } }")"sv);
+
+	for (auto _ : state)
+	{
+		auto message = requests;
+
+		loopback.client.roundTrip(std::move(message), requestIds);
+	}
+
+	loopback.client.report(state, requestIds.size());
+}
+
+// One fetchQuery whose result has range(0) items.
+void BM_LoopbackFetch(benchmark::State& state)
+{
+	Loopback loopback { state.range(1) != 0 };
+	const std::vector<int> requestIds { 1 };
+	const auto requests = makeRequests("fetchQuery"sv, requestIds,
+		R"(,"queryId":1,"operationName":"GetItems","variables":{"first":)" + std::to_string(state.range(0)) + "}");
+
+	for (auto _ : state)
+	{
+		auto message = requests;
+
+		loopback.client.roundTrip(std::move(message), requestIds);
+	}
+
+	loopback.client.report(state, requestIds.size());
+}
+
+// A 16 item payload published once to range(0) subscriptions.
+void BM_LoopbackFanOut(benchmark::State& state)
+{
+	Loopback loopback { state.range(1) != 0 };
+	const auto requestIds = makeRequestIds(static_cast<int>(state.range(0)));
+	const auto payload = resolveItems(16);
+
+	loopback.client.subscribe(makeRequests("fetchQuery"sv, requestIds, R"(,"queryId":1,"operationName":"ItemAdded")"sv), requestIds);
+
+	for (auto _ : state)
+	{
+		loopback.client.fanOut(requestIds.size(), [&]() {
+			loopback.bridge.publish(payload);
+		});
+	}
+
+	loopback.client.report(state, requestIds.size());
+}
+
+} // namespace
+
+// The second argument is 0 for JSON responses and 1 for CBOR.
+BENCHMARK(BM_LoopbackParse)->ArgsProduct({ { 1, 16, 64 }, { 0, 1 } })->UseRealTime();
+BENCHMARK(BM_LoopbackFetch)->ArgsProduct({ { 1, 64, 1024 }, { 0, 1 } })->UseRealTime();
+BENCHMARK(BM_LoopbackFanOut)->ArgsProduct({ { 1, 16, 256 }, { 0, 1 } })->UseRealTime();
@@ -0,0 +1,259 @@
+﻿#include "LoopbackTransport.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+utf::WideString widen(std::string_view text)
+{
+	utf::WideString result;
+
+	utf::appendUtf16(text, result);
+
+	return result;
+}
+
+TransportMessage makeMessage(int index)
+{
+	TransportMessage message;
+
+	message.requests.push_back(widen(std::to_string(index)));
+
+	return message;
+}
+
+int readIndex(const TransportMessage& message)
+{
+	std::string text;
+
+	utf::appendUtf8(utf::WideStringView { message.requests.front() }, text);
+
+	return std::stoi(text);
+}
+
+// Resolves with whatever error the sender's completion reports.
+class SentFuture
+{
+public:
+	MessageTransport::Completion completion()
+	{
+		return [promise = m_promise](std::exception_ptr error) {
+			promise->set_value(error);
+		};
+	}
+
+	bool ready(std::chrono::milliseconds timeout = 0ms)
+	{
+		return m_future.wait_for(timeout) == std::future_status::ready;
+	}
+
+	std::exception_ptr get()
+	{
+		return m_future.get();
+	}
+
+private:
+	std::shared_ptr<std::promise<std::exception_ptr>> m_promise { std::make_shared<std::promise<std::exception_ptr>>() };
+	std::future<std::exception_ptr> m_future { m_promise->get_future() };
+};
+
+std::string errorMessage(std::exception_ptr error)
+{
+	try
+	{
+		std::rethrow_exception(error);
+	}
+	catch (const std::exception& ex)
+	{
+		return ex.what();
+	}
+}
+
+} // namespace
+
+TEST(LoopbackTransportTests, DeliversInOrder)
+{
+	constexpr int c_messages = 1000;
+	auto [client, bridge] = LoopbackTransport::createPair();
+	std::mutex mutex;
+	std::vector<int> received;
+
+	bridge->receive([&](TransportMessage&& message, MessageTransport::Completion done) {
+		{
+			std::lock_guard lock { mutex };
+
+			received.push_back(readIndex(message));
+		}
+
+		done(nullptr);
+	});
+
+	std::vector<SentFuture> sent(c_messages);
+
+	for (int i = 0; i < c_messages; ++i)
+	{
+		client->send(makeMessage(i), sent[i].completion());
+	}
+
+	for (auto& future : sent)
+	{
+		EXPECT_EQ(future.get(), nullptr);
+	}
+
+	std::lock_guard lock { mutex };
+
+	ASSERT_EQ(received.size(), static_cast<size_t>(c_messages));
+
+	for (int i = 0; i < c_messages; ++i)
+	{
+		EXPECT_EQ(received[i], i);
+	}
+}
+
+TEST(LoopbackTransportTests, CarriesEveryMember)
+{
+	auto [client, bridge] = LoopbackTransport::createPair();
+	std::promise<TransportMessage> received;
+
+	client->receive([&](TransportMessage&& message, MessageTransport::Completion done) {
+		received.set_value(std::move(message));
+		done(nullptr);
+	});
+
+	TransportMessage message;
+
+	message.responses.push_back(widen(R"({"type":"next"})"sv));
+	message.cborResponses = { 0x80 };
+	message.relayStats = 7;
+	message.resetStats = true;
+	bridge->send(std::move(message), {});
+
+	const auto result = received.get_future().get();
+
+	ASSERT_EQ(result.responses.size(), 1u);
+	EXPECT_TRUE(result.responses.front() == widen(R"({"type":"next"})"sv));
+	EXPECT_EQ(result.cborResponses, std::vector<std::uint8_t> { 0x80 });
+	EXPECT_EQ(result.relayStats.value_or(0), 7);
+	EXPECT_TRUE(result.resetStats);
+}
+
+TEST(LoopbackTransportTests, SentOnceDone)
+{
+	auto [client, bridge] = LoopbackTransport::createPair();
+	std::mutex mutex;
+	std::condition_variable delivered;
+	std::vector<MessageTransport::Completion> held;
+
+	bridge->receive([&](TransportMessage&&, MessageTransport::Completion done) {
+		std::lock_guard lock { mutex };
+
+		held.push_back(std::move(done));
+		delivered.notify_one();
+	});
+
+	const auto nextDone = [&](size_t count) {
+		std::unique_lock lock { mutex };
+
+		delivered.wait(lock, [&]() {
+			return held.size() >= count;
+		});
+
+		return held[count - 1];
+	};
+
+	SentFuture first;
+	SentFuture second;
+
+	client->send(makeMessage(1), first.completion());
+	client->send(makeMessage(2), second.completion());
+
+	const auto firstDone = nextDone(1);
+
+	// The second message waits behind the first until the receiver is finished with it.
+	EXPECT_FALSE(first.ready(50ms));
+	EXPECT_FALSE(second.ready());
+
+	{
+		std::lock_guard lock { mutex };
+
+		EXPECT_EQ(held.size(), 1u);
+	}
+
+	firstDone(std::make_exception_ptr(std::runtime_error { "rejected" }));
+
+	EXPECT_EQ(errorMessage(first.get()), "rejected");
+
+	const auto secondDone = nextDone(2);
+
+	EXPECT_FALSE(second.ready(50ms));
+
+	secondDone(nullptr);
+
+	EXPECT_EQ(second.get(), nullptr);
+}
+
+TEST(LoopbackTransportTests, HoldsMessagesUntilReceiver)
+{
+	auto [client, bridge] = LoopbackTransport::createPair();
+	SentFuture sent;
+
+	client->send(makeMessage(3), sent.completion());
+
+	EXPECT_FALSE(sent.ready(50ms));
+
+	std::promise<int> received;
+
+	bridge->receive([&](TransportMessage&& message, MessageTransport::Completion done) {
+		received.set_value(readIndex(message));
+		done(nullptr);
+	});
+
+	EXPECT_EQ(received.get_future().get(), 3);
+	EXPECT_EQ(sent.get(), nullptr);
+}
+
+TEST(LoopbackTransportTests, ReceiverThrows)
+{
+	auto [client, bridge] = LoopbackTransport::createPair();
+
+	bridge->receive([](TransportMessage&&, MessageTransport::Completion) {
+		throw std::runtime_error { "bad message" };
+	});
+
+	SentFuture sent;
+
+	client->send(makeMessage(4), sent.completion());
+
+	EXPECT_EQ(errorMessage(sent.get()), "bad message");
+}
+
+TEST(LoopbackTransportTests, FailsOnceClosed)
+{
+	auto [client, bridge] = LoopbackTransport::createPair();
+	SentFuture abandoned;
+
+	// Nothing receives on the bridge end, so this is still queued when it closes.
+	client->send(makeMessage(5), abandoned.completion());
+	bridge.reset();
+
+	EXPECT_EQ(errorMessage(abandoned.get()), "The loopback was closed");
+
+	SentFuture closed;
+
+	client->send(makeMessage(6), closed.completion());
+
+	ASSERT_TRUE(closed.ready());
+	EXPECT_EQ(errorMessage(closed.get()), "The other end of the loopback is closed");
+}
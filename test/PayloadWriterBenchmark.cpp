@@ -0,0 +1,105 @@
+﻿#include "PayloadWriter.h"
+
+#include "graphqlservice/JSONResponse.h"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+namespace {
+
+const utf::WideString c_type { u8"next"sv.begin(), u8"next"sv.end() };
+
+response::Value makeFolder(int items)
+{
+	response::Value list { response::Type::List };
+
+	for (int i = 0; i < items; ++i)
+	{
+		response::Value item { response::Type::Map };
+
+		item.emplace_back("id"s, response::Value { "AAMkAGI2TG93AAA="s + std::to_string(i) });
+		item.emplace_back("subject"s, response::Value { u8"Quarterly report – draft "s + std::to_string(i) });
+		item.emplace_back("preview"s, response::Value { "Hi all,\nplease find the \"final\" numbers attached."s });
+		item.emplace_back("unread"s, response::Value { i % 2 == 0 });
+		item.emplace_back("size"s, response::Value { 1024 * i });
+		list.emplace_back(std::move(item));
+	}
+
+	response::Value fetched { response::Type::Map };
+
+	fetched.emplace_back("items"s, std::move(list));
+
+	return fetched;
+}
+
+// The path PayloadWriter replaced: response::toJSON, widen the whole document to UTF-16, and build
+// the envelope around it in another string. The JsonObject parse and ToString the bridge also did
+// on Windows are not counted, so this is the lower bound of what it cost.
+void BM_CurrentPath(benchmark::State& state)
+{
+	const auto fetched = makeFolder(static_cast<int>(state.range(0)));
+	size_t bytes = 0;
+
+	for (auto _ : state)
+	{
+		utf::WideString fetchedText;
+		utf::WideString envelope;
+
+		utf::appendUtf16(response::toJSON(response::Value { fetched }), fetchedText);
+		utf::appendUtf16(R"({"type":"next","fetched":)"sv, envelope);
+		envelope.append(fetchedText);
+		utf::appendUtf16(R"(,"requestId":42})"sv, envelope);
+		bytes = envelope.size() * sizeof(utf::WideChar);
+		benchmark::DoNotOptimize(envelope.data());
+	}
+
+	state.counters["bytes"] = static_cast<double>(bytes);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+}
+
+void BM_PayloadWriterJson(benchmark::State& state)
+{
+	const auto fetched = makeFolder(static_cast<int>(state.range(0)));
+	PayloadWriter writer;
+	size_t bytes = 0;
+
+	for (auto _ : state)
+	{
+		const auto envelope = writer.writeFetched(c_type, 42, fetched);
+
+		bytes = envelope.size() * sizeof(utf::WideChar);
+		benchmark::DoNotOptimize(envelope.data());
+	}
+
+	state.counters["bytes"] = static_cast<double>(bytes);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+}
+
+void BM_PayloadWriterCbor(benchmark::State& state)
+{
+	const auto fetched = makeFolder(static_cast<int>(state.range(0)));
+	PayloadWriter writer;
+	size_t bytes = 0;
+
+	for (auto _ : state)
+	{
+		const auto& envelope = writer.writeFetchedCbor(c_type, 42, fetched);
+
+		bytes = envelope.size();
+		benchmark::DoNotOptimize(envelope.data());
+	}
+
+	state.counters["bytes"] = static_cast<double>(bytes);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+}
+
+} // namespace
+
+BENCHMARK(BM_CurrentPath)->Arg(10)->Arg(1000)->Arg(10000);
+BENCHMARK(BM_PayloadWriterJson)->Arg(10)->Arg(1000)->Arg(10000);
+BENCHMARK(BM_PayloadWriterCbor)->Arg(10)->Arg(1000)->Arg(10000);
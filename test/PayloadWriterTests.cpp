@@ -0,0 +1,216 @@
+﻿#include "PayloadWriter.h"
+
+#include "graphqlservice/JSONResponse.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+#include <string>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+namespace {
+
+const utf::WideString c_type { u8"next"sv.begin(), u8"next"sv.end() };
+
+response::Value makeFolder(int items)
+{
+	response::Value list { response::Type::List };
+
+	for (int i = 0; i < items; ++i)
+	{
+		response::Value item { response::Type::Map };
+
+		item.emplace_back("id"s, response::Value { "AAMkAGI2TG93AAA="s + std::to_string(i) });
+		item.emplace_back("subject"s, response::Value { "Quarterly report "s + std::to_string(i) });
+		item.emplace_back("unread"s, response::Value { i % 2 == 0 });
+		item.emplace_back("size"s, response::Value { 1024 * i });
+		list.emplace_back(std::move(item));
+	}
+
+	response::Value folder { response::Type::Map };
+
+	folder.emplace_back("items"s, std::move(list));
+
+	response::Value fetched { response::Type::Map };
+
+	fetched.emplace_back("data"s, std::move(folder));
+
+	return fetched;
+}
+
+std::string toUtf8(utf::WideStringView text)
+{
+	std::string result;
+
+	utf::appendUtf8(text, result);
+
+	return result;
+}
+
+// What the bridge sent before PayloadWriter: the payload serialized by response::toJSON and wrapped
+// in the envelope.
+std::string currentPath(std::string_view type, int requestId, const response::Value& fetched)
+{
+	std::string result { R"({"type":")" };
+
+	result.append(type);
+	result.append(R"(","fetched":)");
+	result.append(response::toJSON(response::Value { fetched }));
+	result.append(R"(,"requestId":)");
+	result.append(std::to_string(requestId));
+	result.push_back('}');
+
+	return result;
+}
+
+response::Value readCbor(cbor::Reader& reader)
+{
+	const auto item = reader.next();
+
+	switch (item.type)
+	{
+		case cbor::ItemType::Null:
+			return {};
+
+		case cbor::ItemType::Boolean:
+			return response::Value { item.boolean };
+
+		case cbor::ItemType::Integer:
+			return response::Value { static_cast<int>(item.integer) };
+
+		case cbor::ItemType::Float:
+			return response::Value { item.number };
+
+		case cbor::ItemType::Text:
+			return response::Value { std::string { item.text } };
+
+		case cbor::ItemType::Array:
+		{
+			response::Value list { response::Type::List };
+
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				list.emplace_back(readCbor(reader));
+			}
+
+			return list;
+		}
+
+		case cbor::ItemType::Map:
+		{
+			response::Value map { response::Type::Map };
+
+			for (size_t i = 0; i < item.count; ++i)
+			{
+				auto key = readCbor(reader);
+
+				map.emplace_back(key.release<response::StringType>(), readCbor(reader));
+			}
+
+			return map;
+		}
+
+		default:
+			throw std::runtime_error("Unexpected CBOR item");
+	}
+}
+
+} // namespace
+
+TEST(PayloadWriterTests, MatchesCurrentPathByteForByte)
+{
+	PayloadWriter writer;
+	const auto fetched = makeFolder(20);
+
+	EXPECT_EQ(currentPath("next"sv, 42, fetched), toUtf8(writer.writeFetched(c_type, 42, fetched)));
+}
+
+TEST(PayloadWriterTests, EscapesStringsTheSameWayTheyParse)
+{
+	PayloadWriter writer;
+	response::Value fetched { response::Type::Map };
+
+	fetched.emplace_back("quote"s, response::Value { R"(say "hi" \ bye)"s });
+	fetched.emplace_back("controls"s, response::Value { "tab\tline\nreturn\rbell\x07"s });
+	fetched.emplace_back("accented"s, response::Value { u8"café naïve"s });
+	fetched.emplace_back("astral"s, response::Value { u8"emoji \U0001F600 end"s });
+	fetched.emplace_back("long"s, response::Value { std::string(100, 'x') + "\"" + std::string(100, 'y') });
+
+	const auto envelope = response::parseJSON(toUtf8(writer.writeFetched(c_type, 7, fetched)));
+
+	EXPECT_TRUE(envelope["fetched"sv] == fetched);
+	EXPECT_EQ(7, envelope["requestId"sv].get<response::IntType>());
+}
+
+TEST(PayloadWriterTests, MalformedUtf8BecomesReplacementCharacter)
+{
+	PayloadWriter writer;
+	response::Value fetched { response::Type::Map };
+
+	fetched.emplace_back("bad"s, response::Value { "a\xC3("s });
+
+	const auto envelope = response::parseJSON(toUtf8(writer.writeFetched(c_type, 1, fetched)));
+
+	EXPECT_EQ(u8"a�("s, envelope["fetched"sv]["bad"sv].get<response::StringType>());
+}
+
+TEST(PayloadWriterTests, NonFiniteFloatsAreNull)
+{
+	PayloadWriter writer;
+	response::Value fetched { response::Type::List };
+
+	fetched.emplace_back(response::Value { std::numeric_limits<double>::quiet_NaN() });
+	fetched.emplace_back(response::Value { std::numeric_limits<double>::infinity() });
+	fetched.emplace_back(response::Value { 0.5 });
+
+	EXPECT_EQ(R"({"type":"next","fetched":[null,null,0.5],"requestId":3})", toUtf8(writer.writeFetched(c_type, 3, fetched)));
+}
+
+TEST(PayloadWriterTests, SharedPayloadListsEveryRequestId)
+{
+	PayloadWriter writer;
+	response::Value fetched { response::Type::Map };
+
+	fetched.emplace_back("count"s, response::Value { 5 });
+
+	EXPECT_EQ(R"({"type":"next","fetched":{"count":5},"requestIds":[1,2,3]})",
+		toUtf8(writer.writeFetched(c_type, std::vector<int> { 1, 2, 3 }, fetched)));
+}
+
+TEST(PayloadWriterTests, CacheStatusIsWrittenBeforeRequestId)
+{
+	PayloadWriter writer;
+	const utf::WideString hit { u8"hit"sv.begin(), u8"hit"sv.end() };
+
+	EXPECT_EQ(R"({"type":"next","fetched":null,"cache":"hit","requestId":9})",
+		toUtf8(writer.writeFetched(c_type, 9, response::Value {}, hit)));
+}
+
+TEST(PayloadWriterTests, BufferIsReusedBetweenPayloads)
+{
+	PayloadWriter writer;
+	const auto first = toUtf8(writer.writeFetched(c_type, 1, makeFolder(50)));
+	const auto second = toUtf8(writer.writeFetched(c_type, 2, makeFolder(1)));
+
+	EXPECT_EQ(currentPath("next"sv, 2, makeFolder(1)), second);
+	EXPECT_GT(first.size(), second.size());
+}
+
+TEST(PayloadWriterTests, CborDecodesToTheSameEnvelope)
+{
+	PayloadWriter writer;
+	const auto fetched = makeFolder(20);
+	const auto& bytes = writer.writeFetchedCbor(c_type, 42, fetched);
+	cbor::Reader reader { bytes.data(), bytes.size() };
+	const auto envelope = readCbor(reader);
+
+	EXPECT_TRUE(reader.atEnd());
+	EXPECT_EQ("next"s, envelope["type"sv].get<response::StringType>());
+	EXPECT_TRUE(envelope["fetched"sv] == fetched);
+	EXPECT_EQ(42, envelope["requestId"sv].get<response::IntType>());
+	EXPECT_LT(bytes.size(), currentPath("next"sv, 42, fetched).size());
+}
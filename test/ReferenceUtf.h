@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include <string>
+#include <string_view>
+
+// A code point at a time transcoder with the same replacement rules as utf::, written as plainly as
+// possible. The tests check utf:: against it, and the benchmarks use it as the baseline.
+namespace reference {
+
+inline std::string toUtf8(std::u16string_view utf16)
+{
+	std::string result;
+
+	for (size_t i = 0; i < utf16.size(); ++i)
+	{
+		char32_t ch = utf16[i];
+
+		if (ch >= 0xD800 && ch <= 0xDBFF && i + 1 < utf16.size() && utf16[i + 1] >= 0xDC00 && utf16[i + 1] <= 0xDFFF)
+		{
+			ch = 0x10000 + ((ch - 0xD800) << 10) + (utf16[++i] - 0xDC00);
+		}
+		else if (ch >= 0xD800 && ch <= 0xDFFF)
+		{
+			ch = 0xFFFD;
+		}
+
+		if (ch < 0x80)
+		{
+			result += static_cast<char>(ch);
+		}
+		else if (ch < 0x800)
+		{
+			result += static_cast<char>(0xC0 | (ch >> 6));
+			result += static_cast<char>(0x80 | (ch & 0x3F));
+		}
+		else if (ch < 0x10000)
+		{
+			result += static_cast<char>(0xE0 | (ch >> 12));
+			result += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+			result += static_cast<char>(0x80 | (ch & 0x3F));
+		}
+		else
+		{
+			result += static_cast<char>(0xF0 | (ch >> 18));
+			result += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
+			result += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+			result += static_cast<char>(0x80 | (ch & 0x3F));
+		}
+	}
+
+	return result;
+}
+
+inline std::u16string toUtf16(std::string_view utf8)
+{
+	std::u16string result;
+	size_t i = 0;
+
+	while (i < utf8.size())
+	{
+		const auto lead = static_cast<unsigned char>(utf8[i]);
+		size_t length = 0;
+
+		if (lead < 0x80)
+		{
+			result += static_cast<char16_t>(lead);
+			++i;
+			continue;
+		}
+		else if (lead >= 0xC0 && lead < 0xE0)
+		{
+			length = 2;
+		}
+		else if (lead >= 0xE0 && lead < 0xF0)
+		{
+			length = 3;
+		}
+		else if (lead >= 0xF0 && lead < 0xF8)
+		{
+			length = 4;
+		}
+		else
+		{
+			result += u'\xFFFD';
+			++i;
+			continue;
+		}
+
+		size_t continuation = 0;
+
+		while (continuation + 1 < length
+			&& i + 1 + continuation < utf8.size()
+			&& (static_cast<unsigned char>(utf8[i + 1 + continuation]) & 0xC0) == 0x80)
+		{
+			++continuation;
+		}
+
+		if (continuation + 1 < length)
+		{
+			result += u'\xFFFD';
+			i += 1 + continuation;
+			continue;
+		}
+
+		char32_t ch = lead & (0x7F >> length);
+
+		for (size_t j = 1; j < length; ++j)
+		{
+			ch = (ch << 6) | (static_cast<unsigned char>(utf8[i + j]) & 0x3F);
+		}
+
+		i += length;
+
+		const char32_t minimum[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+		if (ch < minimum[length]
+			|| ch > 0x10FFFF
+			|| (ch >= 0xD800 && ch <= 0xDFFF))
+		{
+			result += u'\xFFFD';
+		}
+		else if (ch >= 0x10000)
+		{
+			result += static_cast<char16_t>(0xD800 + ((ch - 0x10000) >> 10));
+			result += static_cast<char16_t>(0xDC00 + ((ch - 0x10000) & 0x3FF));
+		}
+		else
+		{
+			result += static_cast<char16_t>(ch);
+		}
+	}
+
+	return result;
+}
+
+} // namespace reference
@@ -0,0 +1,81 @@
+﻿#include "RequestEnvelope.h"
+
+#include "graphqlservice/JSONResponse.h"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+namespace {
+
+// A fetchQuery request with a variables object of roughly the requested number of members.
+utf::WideString makeRequest(int members)
+{
+	std::string json { R"({"type":"fetchQuery","requestId":42,"queryId":7,"operationName":"GetItems","variables":{)" };
+
+	for (int i = 0; i < members; ++i)
+	{
+		if (i > 0)
+		{
+			json += ',';
+		}
+
+		json += R"("filter)" + std::to_string(i) + R"(":{"subject":"Quarterly \"report\" – draft","ids":["AAMk=",)"
+			+ std::to_string(i) + R"(],"unread":true,"ratio":0.25})";
+	}
+
+	json += "}}";
+
+	utf::WideString result;
+
+	utf::appendUtf16(json, result);
+
+	return result;
+}
+
+// The work the bridge did before RequestEnvelope, without the WinRT parts: every request was parsed
+// into a JsonObject, the variables were serialized again and converted to UTF-8, and
+// response::parseJSON parsed them a second time. Converting the whole request and parsing it once
+// with parseJSON is a lower bound for that.
+void BM_ParseJson(benchmark::State& state)
+{
+	const auto request = makeRequest(static_cast<int>(state.range(0)));
+	std::string utf8;
+
+	for (auto _ : state)
+	{
+		utf8.clear();
+		utf::appendUtf8(utf::WideStringView { request }, utf8);
+
+		auto parsed = response::parseJSON(utf8);
+
+		benchmark::DoNotOptimize(parsed);
+	}
+
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * request.size() * sizeof(utf::WideChar)));
+}
+
+void BM_RequestEnvelope(benchmark::State& state)
+{
+	const auto request = makeRequest(static_cast<int>(state.range(0)));
+
+	for (auto _ : state)
+	{
+		RequestEnvelope envelope { request };
+		auto variables = envelope.takeVariables();
+
+		benchmark::DoNotOptimize(envelope.requestId());
+		benchmark::DoNotOptimize(variables);
+	}
+
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * request.size() * sizeof(utf::WideChar)));
+}
+
+} // namespace
+
+BENCHMARK(BM_ParseJson)->Arg(0)->Arg(10)->Arg(1000);
+BENCHMARK(BM_RequestEnvelope)->Arg(0)->Arg(10)->Arg(1000);
@@ -0,0 +1,140 @@
+﻿#include "RequestEnvelope.h"
+
+#include "graphqlservice/JSONResponse.h"
+
+#include <gtest/gtest.h>
+
+using namespace graphql;
+
+using namespace std::literals;
+
+namespace {
+
+utf::WideString toWide(std::string_view utf8)
+{
+	utf::WideString result;
+
+	utf::appendUtf16(utf8, result);
+
+	return result;
+}
+
+RequestEnvelope parse(std::string_view utf8)
+{
+	return RequestEnvelope { toWide(utf8) };
+}
+
+} // namespace
+
+TEST(RequestEnvelopeTests, ReadsScalarMembers)
+{
+	auto envelope = parse(R"({ "type": "fetchQuery", "requestId": 17, "queryId": 3.0, "operationName": "",
+		"trace": true, "cache": null, "timeoutMs": 2.5e3 })"sv);
+
+	EXPECT_EQ(17, envelope.requestId());
+	EXPECT_EQ(toWide("fetchQuery"sv), envelope.type());
+	EXPECT_EQ(3.0, envelope.getNumber(toWide("queryId"sv)));
+	EXPECT_EQ(2500.0, envelope.getNumber(toWide("timeoutMs"sv), 0.0));
+	EXPECT_EQ(toWide(""sv), envelope.getString(toWide("operationName"sv)));
+	EXPECT_TRUE(envelope.getBoolean(toWide("trace"sv), false));
+	EXPECT_TRUE(envelope.hasKey(toWide("cache"sv)));
+	EXPECT_FALSE(envelope.hasKey(toWide("variables"sv)));
+	EXPECT_EQ(5.0, envelope.getNumber(toWide("missing"sv), 5.0));
+}
+
+TEST(RequestEnvelopeTests, WrongOrMissingMembersThrow)
+{
+	auto envelope = parse(R"({"type":7})"sv);
+
+	EXPECT_THROW(envelope.type(), std::invalid_argument);
+	EXPECT_THROW(envelope.requestId(), std::invalid_argument);
+	EXPECT_THROW(envelope.getBoolean(toWide("type"sv), false), std::invalid_argument);
+}
+
+TEST(RequestEnvelopeTests, LaterDuplicateMemberWins)
+{
+	auto envelope = parse(R"({"requestId":1,"requestId":2})"sv);
+
+	EXPECT_EQ(2, envelope.requestId());
+}
+
+TEST(RequestEnvelopeTests, UnescapesStrings)
+{
+	auto envelope = parse(R"({"query":"a\"b\\c\/d\b\f\n\r\t \u00e9 \ud83d\ude00 \ud83d!"})"sv);
+
+	// The lone high surrogate at the end stays as it is in UTF-16, the same as JsonObject leaves it.
+	auto expected = toWide(u8"a\"b\\c/d\b\f\n\r\t é \U0001F600 "sv);
+
+	expected += static_cast<utf::WideChar>(0xD83D);
+	expected += '!';
+
+	EXPECT_EQ(expected, envelope.getString(toWide("query"sv)));
+}
+
+TEST(RequestEnvelopeTests, VariablesMatchParseJson)
+{
+	const auto variables = R"({"id":"AAMk=","count":25,"ratio":0.5,"big":1e300,"flags":[true,false,null],
+		"nested":{"name":"café 😀","empty":{},"list":[]}})"sv;
+	auto envelope = parse(R"({"type":"fetchQuery","requestId":1,"variables":)"s + std::string { variables } + "}");
+	const auto expected = response::parseJSON(std::string { variables });
+
+	EXPECT_TRUE(envelope.takeVariables() == expected);
+
+	// Moved out by the first call.
+	EXPECT_EQ(0u, envelope.takeVariables().size());
+}
+
+TEST(RequestEnvelopeTests, MissingVariablesAreAnEmptyMap)
+{
+	auto envelope = parse(R"({"type":"fetchQuery","requestId":1})"sv);
+	const auto variables = envelope.takeVariables();
+
+	EXPECT_EQ(response::Type::Map, variables.type());
+	EXPECT_EQ(0u, variables.size());
+}
+
+TEST(RequestEnvelopeTests, VariablesMustBeAnObject)
+{
+	auto envelope = parse(R"({"variables":[1,2]})"sv);
+
+	EXPECT_THROW(envelope.takeVariables(), std::invalid_argument);
+}
+
+TEST(RequestEnvelopeTests, OtherNestedMembersAreSkipped)
+{
+	auto envelope = parse(R"({"options":{"a":[1,{"b":"}"}]},"requestId":4})"sv);
+
+	EXPECT_FALSE(envelope.hasKey(toWide("options"sv)));
+	EXPECT_EQ(4, envelope.requestId());
+}
+
+TEST(RequestEnvelopeTests, MalformedJsonThrows)
+{
+	const std::string_view cases[] = {
+		""sv,
+		"{"sv,
+		R"({"type")"sv,
+		R"({"type":})"sv,
+		R"({"type":"x",})"sv,
+		R"({"type":"x"} trailing)"sv,
+		R"({"type":"unterminated})"sv,
+		R"({"type":"bad \q escape"})"sv,
+		R"({"type":"bad \u12G4"})"sv,
+		"{\"type\":\"raw\ncontrol\"}"sv,
+		R"({"n":1.2.3})"sv,
+		R"({"n":tru})"sv,
+		R"({"variables":{"a":1,}})"sv,
+	};
+
+	for (const auto json : cases)
+	{
+		EXPECT_THROW(parse(json), std::invalid_argument) << json;
+	}
+}
+
+TEST(RequestEnvelopeTests, DeepNestingIsRejected)
+{
+	const auto json = R"({"variables":{"a":)"s + std::string(1000, '[') + std::string(1000, ']') + "}}";
+
+	EXPECT_THROW(parse(json), std::invalid_argument);
+}
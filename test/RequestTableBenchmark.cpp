@@ -0,0 +1,103 @@
+﻿#include "RequestTable.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace {
+
+// Roughly the shape of clientlib's RequestRecord: a few handlers and some request state.
+struct Record
+{
+	std::function<void()> onNext;
+	std::function<void()> onComplete;
+	std::function<void(const std::string&)> onError;
+	std::uint32_t payloads = 0;
+};
+
+// The least a thread-safe version of the old handler maps would have needed: one map behind one lock.
+class LockedMap
+{
+public:
+	void insert(std::int32_t requestId, Record&& record)
+	{
+		std::lock_guard lock { m_mutex };
+
+		m_records.insert_or_assign(requestId, std::move(record));
+	}
+
+	template <typename Fn>
+	bool update(std::int32_t requestId, Fn&& fn)
+	{
+		std::lock_guard lock { m_mutex };
+		const auto itr = m_records.find(requestId);
+
+		if (itr == m_records.end())
+		{
+			return false;
+		}
+
+		fn(itr->second);
+
+		return true;
+	}
+
+	std::optional<Record> take(std::int32_t requestId)
+	{
+		std::lock_guard lock { m_mutex };
+		const auto itr = m_records.find(requestId);
+
+		if (itr == m_records.end())
+		{
+			return std::nullopt;
+		}
+
+		std::optional<Record> record { std::move(itr->second) };
+
+		m_records.erase(itr);
+
+		return record;
+	}
+
+private:
+	std::mutex m_mutex;
+	std::map<std::int32_t, Record> m_records;
+};
+
+// Every thread makes requests the way callers on arbitrary threads do: register the handlers, apply
+// a few "next" payloads, then take the record when the request completes.
+template <typename Table>
+void BM_RequestLifetime(benchmark::State& state)
+{
+	static Table table;
+	static std::atomic<std::int32_t> nextRequestId { 1 };
+	constexpr int c_payloads = 4;
+
+	for (auto _ : state)
+	{
+		const auto requestId = nextRequestId.fetch_add(1, std::memory_order_relaxed);
+
+		table.insert(requestId, Record { [] {}, [] {}, [](const std::string&) {} });
+
+		for (int i = 0; i < c_payloads; ++i)
+		{
+			table.update(requestId, [](Record& record) {
+				++record.payloads;
+			});
+		}
+
+		benchmark::DoNotOptimize(table.take(requestId));
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_RequestLifetime, RequestTable<Record>)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_RequestLifetime, LockedMap)->ThreadRange(1, 8)->UseRealTime();
@@ -0,0 +1,104 @@
+﻿#include "RequestTable.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST(RequestTableTests, UpdateAndTake)
+{
+	RequestTable<std::string> table;
+
+	table.insert(1, "parsed");
+
+	EXPECT_TRUE(table.update(1, [](std::string& record) {
+		record += ", fetched";
+	}));
+	EXPECT_FALSE(table.update(2, [](std::string&) {
+		FAIL();
+	}));
+
+	const auto record = table.take(1);
+
+	ASSERT_TRUE(record);
+	EXPECT_EQ("parsed, fetched", *record);
+	EXPECT_FALSE(table.take(1));
+	EXPECT_EQ(0u, table.size());
+}
+
+TEST(RequestTableTests, TakeIfChecksUnderTheLock)
+{
+	RequestTable<int> table;
+
+	table.insert(5, 10);
+
+	EXPECT_FALSE(table.takeIf(5, [](int value) {
+		return value > 10;
+	}));
+	EXPECT_TRUE(table.takeIf(5, [](int value) {
+		return value == 10;
+	}));
+	EXPECT_FALSE(table.takeIf(5, [](int) {
+		return true;
+	}));
+}
+
+TEST(RequestTableTests, EraseIfVisitsEveryShard)
+{
+	RequestTable<int> table;
+
+	for (std::int32_t id = 1; id <= 100; ++id)
+	{
+		table.insert(id, id % 3);
+	}
+
+	EXPECT_EQ(33u, table.eraseIf([](int value) {
+		return value == 0;
+	}));
+	EXPECT_EQ(67u, table.size());
+}
+
+TEST(RequestTableTests, ConcurrentRequestsDoNotLoseRecords)
+{
+	constexpr int c_threads = 8;
+	constexpr int c_requests = 10'000;
+
+	RequestTable<int> table;
+	std::atomic<std::int32_t> nextRequestId { 1 };
+	std::atomic<int> completed { 0 };
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < c_threads; ++t)
+	{
+		threads.emplace_back([&]() {
+			for (int i = 0; i < c_requests; ++i)
+			{
+				const auto requestId = nextRequestId++;
+
+				table.insert(requestId, 0);
+
+				for (int payload = 0; payload < 3; ++payload)
+				{
+					EXPECT_TRUE(table.update(requestId, [](int& record) {
+						++record;
+					}));
+				}
+
+				if (table.take(requestId) == 3)
+				{
+					++completed;
+				}
+			}
+		});
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	EXPECT_EQ(c_threads * c_requests, completed);
+	EXPECT_EQ(0u, table.size());
+}
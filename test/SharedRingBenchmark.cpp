@@ -0,0 +1,78 @@
+﻿#include "SharedMemory.h"
+#include "SharedRing.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#endif
+
+namespace {
+
+constexpr size_t c_regionSize = 4 * 1024 * 1024;
+
+// One response written and read back on the same thread: the cost of the ring itself.
+void BM_WriteRead(benchmark::State& state)
+{
+	std::vector<std::uint8_t> region(c_regionSize);
+	shm::RingWriter writer { region.data(), region.size() };
+	shm::RingReader reader { region.data(), region.size() };
+	const std::vector<std::uint8_t> payload(static_cast<size_t>(state.range(0)), 'x');
+	shm::Record record;
+
+	for (auto _ : state)
+	{
+		const auto sequence = writer.tryWrite(0, payload.data(), payload.size());
+
+		benchmark::DoNotOptimize(reader.tryReadSequence(*sequence, record));
+	}
+
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * payload.size()));
+}
+
+// The bridge and clientlib side by side: a consumer thread drains a separate mapping of the same
+// region while the producer writes, spinning whenever the ring is full.
+void BM_Stream(benchmark::State& state)
+{
+	const auto name = "gqlmapi-bench-" + std::to_string(getpid());
+	auto created = shm::SharedMemory::create(name, c_regionSize);
+	auto opened = shm::SharedMemory::open(name);
+	shm::RingWriter writer { created.data(), created.size() };
+	shm::RingReader reader { opened.data(), opened.size() };
+	const std::vector<std::uint8_t> payload(static_cast<size_t>(state.range(0)), 'x');
+	std::atomic<bool> producing { true };
+	std::uint64_t full = 0;
+
+	std::thread consumer { [&reader, &producing]() {
+		shm::Record record;
+
+		while (reader.tryRead(record) || producing.load(std::memory_order_acquire))
+		{
+		}
+	} };
+
+	for (auto _ : state)
+	{
+		while (!writer.tryWrite(0, payload.data(), payload.size()))
+		{
+			++full;
+		}
+	}
+
+	producing.store(false, std::memory_order_release);
+	consumer.join();
+
+	state.counters["full"] = static_cast<double>(full);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * payload.size()));
+	state.SetItemsProcessed(state.iterations());
+}
+
+} // namespace
+
+BENCHMARK(BM_WriteRead)->Arg(64)->Arg(4 * 1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+BENCHMARK(BM_Stream)->Arg(64)->Arg(4 * 1024)->Arg(64 * 1024)->Arg(1024 * 1024)->UseRealTime();
@@ -0,0 +1,259 @@
+﻿#include "SharedMemory.h"
+#include "SharedRing.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#endif
+
+namespace {
+
+std::string uniqueName(const char* test)
+{
+	return "gqlmapi-test-" + std::to_string(getpid()) + "-" + test;
+}
+
+// Fills a payload which the reader can check without being told its contents.
+std::vector<std::uint8_t> makePayload(std::uint32_t index, size_t size)
+{
+	std::vector<std::uint8_t> payload(size);
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		payload[i] = static_cast<std::uint8_t>(index * 31 + i);
+	}
+
+	return payload;
+}
+
+std::vector<std::uint8_t> makeRegion(size_t size)
+{
+	// Keep the region 8-byte aligned like a mapping would be.
+	return std::vector<std::uint8_t>(size);
+}
+
+} // namespace
+
+TEST(SharedRingTests, ReaderRejectsUnformattedRegion)
+{
+	auto region = makeRegion(4096);
+
+	EXPECT_THROW((shm::RingReader { region.data(), region.size() }), std::invalid_argument);
+	EXPECT_THROW((shm::RingWriter { region.data(), sizeof(shm::RingHeader) }), std::invalid_argument);
+}
+
+TEST(SharedRingTests, RecordsComeOutInOrder)
+{
+	auto region = makeRegion(4096);
+	shm::RingWriter writer { region.data(), region.size() };
+	shm::RingReader reader { region.data(), region.size() };
+	std::vector<std::uint64_t> sequences;
+
+	for (std::uint32_t i = 0; i < 10; ++i)
+	{
+		const auto payload = makePayload(i, i * 10);
+		const auto sequence = writer.tryWrite(i, payload.data(), payload.size());
+
+		ASSERT_TRUE(sequence);
+		sequences.push_back(*sequence);
+	}
+
+	shm::Record record;
+
+	for (std::uint32_t i = 0; i < 10; ++i)
+	{
+		ASSERT_TRUE(reader.tryRead(record));
+		EXPECT_EQ(sequences[i], record.sequence);
+		EXPECT_EQ(i, record.tag);
+		EXPECT_EQ(makePayload(i, i * 10), record.data);
+	}
+
+	EXPECT_FALSE(reader.tryRead(record));
+	EXPECT_EQ(0u, writer.used());
+}
+
+TEST(SharedRingTests, FullRingRejectsUntilReaderReleases)
+{
+	auto region = makeRegion(sizeof(shm::RingHeader) + 256);
+	shm::RingWriter writer { region.data(), region.size() };
+	shm::RingReader reader { region.data(), region.size() };
+	const auto payload = makePayload(0, 56);
+
+	// Each record takes 64 bytes with its header.
+	for (int i = 0; i < 4; ++i)
+	{
+		ASSERT_TRUE(writer.tryWrite(0, payload.data(), payload.size()));
+	}
+
+	EXPECT_FALSE(writer.tryWrite(0, payload.data(), payload.size()));
+	EXPECT_FALSE(writer.tryWrite(0, nullptr, writer.capacity()));
+
+	shm::Record record;
+
+	ASSERT_TRUE(reader.tryRead(record));
+	EXPECT_TRUE(writer.tryWrite(0, payload.data(), payload.size()));
+}
+
+TEST(SharedRingTests, RecordsWrapAroundTheEnd)
+{
+	auto region = makeRegion(sizeof(shm::RingHeader) + 1024);
+	shm::RingWriter writer { region.data(), region.size() };
+	shm::RingReader reader { region.data(), region.size() };
+	shm::Record record;
+
+	// Sizes which do not divide the capacity, so records regularly have to skip the tail end.
+	for (std::uint32_t i = 0; i < 10'000; ++i)
+	{
+		const auto payload = makePayload(i, 100 + (i * 37) % 300);
+		const auto sequence = writer.tryWrite(i, payload.data(), payload.size());
+
+		ASSERT_TRUE(sequence);
+		ASSERT_TRUE(reader.tryRead(record));
+		ASSERT_EQ(*sequence, record.sequence);
+		ASSERT_EQ(payload, record.data);
+	}
+}
+
+TEST(SharedRingTests, ReadSequenceSkipsRecordsNobodyAskedFor)
+{
+	auto region = makeRegion(4096);
+	shm::RingWriter writer { region.data(), region.size() };
+	shm::RingReader reader { region.data(), region.size() };
+	std::vector<std::uint64_t> sequences;
+
+	for (std::uint32_t i = 0; i < 5; ++i)
+	{
+		const auto payload = makePayload(i, 16);
+
+		sequences.push_back(*writer.tryWrite(i, payload.data(), payload.size()));
+	}
+
+	shm::Record record;
+
+	// The placeholders for records 0 and 1 were lost.
+	ASSERT_TRUE(reader.tryReadSequence(sequences[2], record));
+	EXPECT_EQ(2u, record.tag);
+	ASSERT_TRUE(reader.tryReadSequence(sequences[3], record));
+	EXPECT_EQ(3u, record.tag);
+
+	// Record 3 was already read, so asking for it again finds a newer record.
+	EXPECT_FALSE(reader.tryReadSequence(sequences[3], record));
+
+	// Nothing is left to read.
+	EXPECT_FALSE(reader.tryReadSequence(sequences[4] + 1000, record));
+}
+
+// The producer and consumer share one region through two separate mappings, the way the bridge and
+// clientlib do, and hand sequence numbers over out of band. Every seventh hand-over is dropped, so
+// the consumer has to resynchronise on the next one.
+TEST(SharedRingTests, ProducerAndConsumerThreadsStayInStep)
+{
+	constexpr std::uint32_t c_records = 200'000;
+	constexpr std::uint32_t c_dropEvery = 7;
+
+	const auto name = uniqueName("stress");
+	auto created = shm::SharedMemory::create(name, 64 * 1024);
+	auto opened = shm::SharedMemory::open(name);
+	shm::RingWriter writer { created.data(), created.size() };
+	shm::RingReader reader { opened.data(), opened.size() };
+
+	std::mutex mutex;
+	std::deque<std::pair<std::uint32_t, std::uint64_t>> handedOver;
+	std::atomic<bool> producing { true };
+	std::uint64_t full = 0;
+
+	std::thread producer { [&]() {
+		std::mt19937 random { 42 };
+		std::uniform_int_distribution<size_t> size { 0, 2000 };
+
+		for (std::uint32_t i = 0; i < c_records; ++i)
+		{
+			const auto payload = makePayload(i, size(random));
+			std::optional<std::uint64_t> sequence;
+
+			while (!(sequence = writer.tryWrite(i, payload.data(), payload.size())))
+			{
+				++full;
+				std::this_thread::yield();
+			}
+
+			if (i % c_dropEvery != 0)
+			{
+				std::lock_guard lock { mutex };
+
+				handedOver.emplace_back(i, *sequence);
+			}
+		}
+
+		producing = false;
+	} };
+
+	std::mt19937 random { 42 };
+	std::uniform_int_distribution<size_t> size { 0, 2000 };
+	std::uint32_t expected = 0;
+	std::uint32_t received = 0;
+	shm::Record record;
+
+	for (;;)
+	{
+		std::optional<std::pair<std::uint32_t, std::uint64_t>> next;
+
+		{
+			std::lock_guard lock { mutex };
+
+			if (!handedOver.empty())
+			{
+				next = handedOver.front();
+				handedOver.pop_front();
+			}
+		}
+
+		if (!next)
+		{
+			if (!producing)
+			{
+				std::lock_guard lock { mutex };
+
+				if (handedOver.empty())
+				{
+					break;
+				}
+			}
+
+			std::this_thread::yield();
+			continue;
+		}
+
+		// Replay the producer's sizes up to this record to know what it should contain.
+		size_t payloadSize = 0;
+
+		for (; expected <= next->first; ++expected)
+		{
+			payloadSize = size(random);
+		}
+
+		ASSERT_TRUE(reader.tryReadSequence(next->second, record)) << next->first;
+		ASSERT_EQ(next->first, record.tag);
+		ASSERT_EQ(makePayload(next->first, payloadSize), record.data);
+		++received;
+	}
+
+	producer.join();
+
+	EXPECT_EQ(c_records - (c_records + c_dropEvery - 1) / c_dropEvery, received);
+	EXPECT_GT(full, 0u);
+}
+
+TEST(SharedRingTests, OpenFailsForUnknownName)
+{
+	EXPECT_THROW(shm::SharedMemory::open(uniqueName("missing")), std::runtime_error);
+}
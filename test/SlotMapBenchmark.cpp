@@ -0,0 +1,135 @@
+﻿#include "SlotMap.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Roughly the shape of the bridge's QueryEntry: a parsed document, a subscription and a hash.
+struct Entry
+{
+	std::shared_ptr<int> ast;
+	std::shared_ptr<int> subscription;
+	size_t hash = 0;
+};
+
+constexpr int c_liveEntries = 100'000;
+
+// The container the bridge used before SlotMap, with the same next-ID rule.
+struct OrderedMap
+{
+	int insert(Entry&& entry)
+	{
+		const int key = m_entries.empty() ? 1 : m_entries.crbegin()->first + 1;
+
+		m_entries.emplace(key, std::move(entry));
+
+		return key;
+	}
+
+	Entry* find(int key)
+	{
+		const auto itr = m_entries.find(key);
+
+		return itr == m_entries.end() ? nullptr : &itr->second;
+	}
+
+	bool erase(int key)
+	{
+		return m_entries.erase(key) != 0;
+	}
+
+	void clear()
+	{
+		m_entries.clear();
+	}
+
+	std::map<int, Entry> m_entries;
+};
+
+template <typename Map>
+std::vector<int> fill(Map& map, int count)
+{
+	std::vector<int> keys;
+
+	keys.reserve(static_cast<size_t>(count));
+
+	for (int i = 0; i < count; ++i)
+	{
+		keys.push_back(map.insert(Entry { std::make_shared<int>(i), nullptr, static_cast<size_t>(i) }));
+	}
+
+	return keys;
+}
+
+template <typename Map>
+void BM_Find(benchmark::State& state)
+{
+	Map map;
+	auto keys = fill(map, c_liveEntries);
+
+	std::shuffle(keys.begin(), keys.end(), std::mt19937 { 42 });
+
+	size_t next = 0;
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(map.find(keys[next]));
+		next = (next + 1) % keys.size();
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+// Discard a random live entry and parse a new one, keeping 100k entries live.
+template <typename Map>
+void BM_Churn(benchmark::State& state)
+{
+	Map map;
+	auto keys = fill(map, c_liveEntries);
+	std::mt19937 random { 42 };
+	std::uniform_int_distribution<size_t> pick { 0, keys.size() - 1 };
+
+	for (auto _ : state)
+	{
+		auto& key = keys[pick(random)];
+
+		map.erase(key);
+		key = map.insert(Entry { nullptr, nullptr, 0 });
+	}
+
+	state.SetItemsProcessed(state.iterations());
+}
+
+// stopService tearing down every live entry.
+template <typename Map>
+void BM_Clear(benchmark::State& state)
+{
+	for (auto _ : state)
+	{
+		state.PauseTiming();
+
+		Map map;
+
+		fill(map, c_liveEntries);
+		state.ResumeTiming();
+
+		map.clear();
+	}
+
+	state.SetItemsProcessed(state.iterations() * c_liveEntries);
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_Find, SlotMap<Entry>);
+BENCHMARK_TEMPLATE(BM_Find, OrderedMap);
+BENCHMARK_TEMPLATE(BM_Churn, SlotMap<Entry>);
+BENCHMARK_TEMPLATE(BM_Churn, OrderedMap);
+BENCHMARK_TEMPLATE(BM_Clear, SlotMap<Entry>);
+BENCHMARK_TEMPLATE(BM_Clear, OrderedMap);
@@ -0,0 +1,100 @@
+﻿#include "SlotMap.h"
+
+#include <gtest/gtest.h>
+
+#include <set>
+#include <string>
+
+TEST(SlotMapTests, FindsWhatWasInserted)
+{
+	SlotMap<std::string> map;
+	const auto first = map.insert("first");
+	const auto second = map.insert("second");
+
+	ASSERT_NE(nullptr, map.find(first));
+	ASSERT_NE(nullptr, map.find(second));
+	EXPECT_EQ("first", *map.find(first));
+	EXPECT_EQ("second", *map.find(second));
+	EXPECT_EQ(2u, map.size());
+}
+
+TEST(SlotMapTests, KeysArePositive)
+{
+	SlotMap<int> map;
+
+	for (int i = 0; i < 1000; ++i)
+	{
+		EXPECT_GT(map.insert(int { i }), 0);
+	}
+
+	EXPECT_EQ(nullptr, map.find(0));
+	EXPECT_EQ(nullptr, map.find(-1));
+}
+
+TEST(SlotMapTests, ErasedKeyIsNeverFoundOrReused)
+{
+	SlotMap<int> map;
+	std::set<SlotMap<int>::Key> seen;
+	const auto stale = map.insert(1);
+
+	seen.insert(stale);
+	ASSERT_TRUE(map.erase(stale));
+
+	for (int i = 0; i < 100; ++i)
+	{
+		const auto key = map.insert(int { i });
+
+		EXPECT_TRUE(seen.insert(key).second);
+		EXPECT_EQ(nullptr, map.find(stale));
+		ASSERT_TRUE(map.erase(key));
+	}
+
+	EXPECT_FALSE(map.erase(stale));
+	EXPECT_TRUE(map.empty());
+}
+
+TEST(SlotMapTests, ExhaustedSlotIsRetired)
+{
+	SlotMap<int> map;
+	std::set<SlotMap<int>::Key> seen;
+
+	for (std::uint32_t i = 0; i < SlotMap<int>::c_maxGeneration; ++i)
+	{
+		const auto key = map.insert(0);
+
+		EXPECT_TRUE(seen.insert(key).second);
+		ASSERT_TRUE(map.erase(key));
+	}
+
+	// The first slot has used every generation, so the next insert has to start a new slot.
+	const auto key = map.insert(0);
+
+	EXPECT_TRUE(seen.insert(key).second);
+	EXPECT_EQ(1u, static_cast<std::uint32_t>(key) & (SlotMap<int>::c_maxSlots - 1));
+}
+
+TEST(SlotMapTests, ClearReleasesEverySlot)
+{
+	SlotMap<int> map;
+	std::vector<SlotMap<int>::Key> keys;
+
+	for (int i = 0; i < 100; ++i)
+	{
+		keys.push_back(map.insert(int { i }));
+	}
+
+	int visited = 0;
+
+	map.forEach([&visited](int&) {
+		++visited;
+	});
+	map.clear();
+
+	EXPECT_EQ(100, visited);
+	EXPECT_TRUE(map.empty());
+
+	for (const auto key : keys)
+	{
+		EXPECT_EQ(nullptr, map.find(key));
+	}
+}
@@ -0,0 +1,155 @@
+﻿#include "TimerWheel.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+using Wheel = TimerWheel<int>;
+
+const auto c_start = Wheel::Clock::now();
+
+Wheel::Clock::time_point at(std::int64_t ticks, Wheel::Clock::duration offset = {})
+{
+	return c_start + ticks * Wheel::c_tick + offset;
+}
+
+std::vector<int> sorted(std::vector<int> values)
+{
+	std::sort(values.begin(), values.end());
+
+	return values;
+}
+
+} // namespace
+
+TEST(TimerWheelTests, NothingExpiresBeforeItsDeadline)
+{
+	Wheel wheel { c_start };
+
+	// Rounds up to the end of tick 3.
+	wheel.schedule(at(2, 10ms), 1);
+
+	EXPECT_TRUE(wheel.advance(at(2)).empty());
+	EXPECT_TRUE(wheel.advance(at(3) - 1ms).empty());
+	EXPECT_EQ(wheel.advance(at(3)), std::vector<int> { 1 });
+	EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimerWheelTests, PastDeadlineExpiresOnTheNextAdvance)
+{
+	Wheel wheel { c_start };
+
+	wheel.schedule(c_start - 1s, 1);
+
+	EXPECT_EQ(wheel.advance(at(10)), std::vector<int> { 1 });
+
+	// The cursor has moved on, so a deadline behind it lands on the next tick instead.
+	wheel.schedule(at(3), 2);
+
+	EXPECT_TRUE(wheel.advance(at(10)).empty());
+	EXPECT_EQ(wheel.advance(at(11)), std::vector<int> { 2 });
+}
+
+TEST(TimerWheelTests, SlotWraparound)
+{
+	Wheel wheel { c_start };
+	const auto rotation = static_cast<std::int64_t>(Wheel::c_slotCount);
+
+	// All three share a slot, one rotation apart.
+	wheel.schedule(at(5), 1);
+	wheel.schedule(at(5 + rotation), 2);
+	wheel.schedule(at(5 + 2 * rotation), 3);
+
+	EXPECT_EQ(wheel.advance(at(5)), std::vector<int> { 1 });
+	EXPECT_EQ(wheel.size(), 2u);
+	EXPECT_TRUE(wheel.advance(at(4 + rotation)).empty());
+	EXPECT_EQ(wheel.advance(at(5 + rotation)), std::vector<int> { 2 });
+	EXPECT_EQ(wheel.advance(at(5 + 2 * rotation)), std::vector<int> { 3 });
+	EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimerWheelTests, AdvanceJumpsSeveralTicks)
+{
+	Wheel wheel { c_start };
+
+	for (int tick = 1; tick <= 10; ++tick)
+	{
+		wheel.schedule(at(tick), int { tick });
+	}
+
+	EXPECT_EQ(sorted(wheel.advance(at(7))), (std::vector<int> { 1, 2, 3, 4, 5, 6, 7 }));
+	EXPECT_EQ(sorted(wheel.advance(at(20))), (std::vector<int> { 8, 9, 10 }));
+	EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimerWheelTests, LongGapVisitsEverySlotOnce)
+{
+	Wheel wheel { c_start };
+	const auto rotation = static_cast<std::int64_t>(Wheel::c_slotCount);
+	std::vector<int> due;
+
+	for (int tick = 0; tick < rotation; ++tick)
+	{
+		wheel.schedule(at(tick), int { tick });
+		due.push_back(tick);
+	}
+
+	// Further than a whole rotation: due in the same slots, but not yet.
+	wheel.schedule(at(3 * rotation), -1);
+	wheel.schedule(at(3 * rotation + 7), -2);
+
+	EXPECT_EQ(sorted(wheel.advance(at(2 * rotation + 10))), due);
+	EXPECT_EQ(wheel.size(), 2u);
+	EXPECT_EQ(sorted(wheel.advance(at(4 * rotation))), (std::vector<int> { -2, -1 }));
+}
+
+// The wheel never removes an entry early, so rescheduling adds a second one and the caller drops
+// whichever no longer matches, the way Connection checks a record's deadline.
+TEST(TimerWheelTests, CancelAndReschedule)
+{
+	Wheel wheel { c_start };
+	std::map<int, Wheel::Clock::time_point> deadlines;
+
+	const auto schedule = [&](int id, Wheel::Clock::time_point deadline) {
+		deadlines[id] = deadline;
+		wheel.schedule(deadline, int { id });
+	};
+
+	const auto expire = [&](Wheel::Clock::time_point now) {
+		std::vector<int> expired;
+
+		for (const auto id : wheel.advance(now))
+		{
+			const auto itr = deadlines.find(id);
+
+			if (itr != deadlines.end()
+				&& itr->second <= now)
+			{
+				deadlines.erase(itr);
+				expired.push_back(id);
+			}
+		}
+
+		return sorted(expired);
+	};
+
+	schedule(1, at(2));
+	schedule(2, at(2));
+	schedule(3, at(4));
+
+	// 1 is pushed back, 2 is cancelled.
+	schedule(1, at(6));
+	deadlines.erase(2);
+
+	EXPECT_TRUE(expire(at(2)).empty());
+	EXPECT_EQ(expire(at(4)), std::vector<int> { 3 });
+	EXPECT_EQ(expire(at(6)), std::vector<int> { 1 });
+	EXPECT_TRUE(deadlines.empty());
+	EXPECT_EQ(wheel.size(), 0u);
+}
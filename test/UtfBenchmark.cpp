@@ -0,0 +1,104 @@
+﻿#include "Utf.h"
+
+#include "ReferenceUtf.h"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+enum Text
+{
+	Ascii,
+	Latin,
+	Cjk,
+};
+
+// A response-sized document: JSON punctuation and field names around text in one script.
+std::u16string makeText(Text text, size_t length)
+{
+	const std::u16string_view value = (text == Ascii ? u"Quarterly report for the team"sv
+			: text == Latin                          ? u"Rapport trimestriel de l'équipe"sv
+													 : u"チームの四半期報告書です"sv);
+	std::u16string result;
+
+	while (result.size() < length)
+	{
+		result += u"{\"subject\":\""sv;
+		result += value;
+		result += u"\"},"sv;
+	}
+
+	return result;
+}
+
+void setLabel(benchmark::State& state)
+{
+	state.SetLabel(state.range(0) == Ascii ? "ascii" : state.range(0) == Latin ? "latin" : "cjk");
+}
+
+void BM_Utf16ToUtf8(benchmark::State& state)
+{
+	const auto utf16 = makeText(static_cast<Text>(state.range(0)), static_cast<size_t>(state.range(1)));
+	std::string buffer;
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(utf::encodeUtf8(std::u16string_view { utf16 }, buffer, 0));
+	}
+
+	setLabel(state);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * utf16.size() * sizeof(char16_t)));
+}
+
+void BM_Utf8ToUtf16(benchmark::State& state)
+{
+	const auto utf8 = reference::toUtf8(makeText(static_cast<Text>(state.range(0)), static_cast<size_t>(state.range(1))));
+	std::u16string buffer;
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(utf::decodeUtf8(utf8, buffer, 0));
+	}
+
+	setLabel(state);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * utf8.size()));
+}
+
+// The baseline: a code point at a time into a new string, the same work the two-pass Win32 calls
+// did per pass.
+void BM_ReferenceUtf16ToUtf8(benchmark::State& state)
+{
+	const auto utf16 = makeText(static_cast<Text>(state.range(0)), static_cast<size_t>(state.range(1)));
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(reference::toUtf8(utf16));
+	}
+
+	setLabel(state);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * utf16.size() * sizeof(char16_t)));
+}
+
+void BM_ReferenceUtf8ToUtf16(benchmark::State& state)
+{
+	const auto utf8 = reference::toUtf8(makeText(static_cast<Text>(state.range(0)), static_cast<size_t>(state.range(1))));
+
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(reference::toUtf16(utf8));
+	}
+
+	setLabel(state);
+	state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * utf8.size()));
+}
+
+} // namespace
+
+BENCHMARK(BM_Utf16ToUtf8)->ArgsProduct({ { Ascii, Latin, Cjk }, { 1 << 10, 1 << 20 } });
+BENCHMARK(BM_Utf8ToUtf16)->ArgsProduct({ { Ascii, Latin, Cjk }, { 1 << 10, 1 << 20 } });
+BENCHMARK(BM_ReferenceUtf16ToUtf8)->ArgsProduct({ { Ascii, Latin, Cjk }, { 1 << 10, 1 << 20 } });
+BENCHMARK(BM_ReferenceUtf8ToUtf16)->ArgsProduct({ { Ascii, Latin, Cjk }, { 1 << 10, 1 << 20 } });
@@ -0,0 +1,232 @@
+﻿#include "Utf.h"
+
+#include "ReferenceUtf.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+std::string toUtf8(std::u16string_view utf16)
+{
+	std::string result;
+
+	utf::appendUtf8(utf16, result);
+
+	return result;
+}
+
+std::u16string toUtf16(std::string_view utf8)
+{
+	std::u16string result;
+
+	utf::appendUtf16(utf8, result);
+
+	return result;
+}
+
+// Mostly ASCII runs long enough for the 16 at a time path, mixed with everything else.
+std::u16string randomUtf16(std::mt19937& random, size_t length)
+{
+	std::uniform_int_distribution<int> kind { 0, 9 };
+	std::uniform_int_distribution<int> ascii { 0x20, 0x7E };
+	std::uniform_int_distribution<int> bmp { 0x80, 0xFFFF };
+	std::uniform_int_distribution<int> surrogate { 0xD800, 0xDFFF };
+	std::u16string result;
+
+	while (result.size() < length)
+	{
+		switch (kind(random))
+		{
+			case 0:
+				result += static_cast<char16_t>(bmp(random));
+				break;
+
+			case 1:
+				result += static_cast<char16_t>(surrogate(random));
+				break;
+
+			case 2:
+				result += u"\U0001F600"sv;
+				break;
+
+			default:
+				for (int i = ascii(random) % 20; i > 0; --i)
+				{
+					result += static_cast<char16_t>(ascii(random));
+				}
+				break;
+		}
+	}
+
+	return result;
+}
+
+// Valid UTF-8 with random bytes flipped, dropped and inserted.
+std::string randomUtf8(std::mt19937& random, size_t length)
+{
+	auto result = reference::toUtf8(randomUtf16(random, length));
+	std::uniform_int_distribution<size_t> position { 0, result.size() - 1 };
+	std::uniform_int_distribution<int> byte { 0, 0xFF };
+
+	for (size_t i = result.size() / 50; i > 0; --i)
+	{
+		switch (byte(random) % 3)
+		{
+			case 0:
+				result[position(random)] = static_cast<char>(byte(random));
+				break;
+
+			case 1:
+				result.erase(position(random) % result.size(), 1);
+				break;
+
+			case 2:
+				result.insert(position(random) % result.size(), 1, static_cast<char>(byte(random)));
+				break;
+		}
+	}
+
+	return result;
+}
+
+} // namespace
+
+TEST(UtfTests, RoundTripsEveryPlane)
+{
+	const auto utf8 = u8"ASCII, é, 水, \U0001F600 and \U0010FFFF"s;
+	const auto utf16 = u"ASCII, é, 水, \U0001F600 and \U0010FFFF"s;
+
+	EXPECT_EQ(utf16, toUtf16(utf8));
+	EXPECT_EQ(utf8, toUtf8(utf16));
+	EXPECT_EQ(utf8.size(), utf::utf8Length(std::u16string_view { utf16 }));
+}
+
+TEST(UtfTests, UnpairedSurrogatesBecomeReplacementCharacters)
+{
+	const std::pair<std::u16string, std::string> cases[] = {
+		// Lone high surrogate, in the middle and at the end.
+		{ u"a\xD83D" u"b", u8"a�b" },
+		{ u"a\xD83D", u8"a�" },
+		// Lone low surrogate.
+		{ u"\xDE00" u"a", u8"�a" },
+		// Low before high is two unpaired surrogates.
+		{ u"\xDE00\xD83D", u8"��" },
+		// Two highs in a row, then a pair.
+		{ u"\xD83D\xD83D\xDE00", u8"�\U0001F600" },
+	};
+
+	for (const auto& [utf16, utf8] : cases)
+	{
+		EXPECT_EQ(utf8, toUtf8(utf16));
+		EXPECT_EQ(utf8.size(), utf::utf8Length(std::u16string_view { utf16 }));
+	}
+}
+
+TEST(UtfTests, MalformedUtf8BecomesReplacementCharacters)
+{
+	const std::pair<std::string, std::u16string> cases[] = {
+		// Stray continuation bytes.
+		{ "a\x80\xBF" "b", u"a��b" },
+		// Bytes which never start a sequence.
+		{ "\xF8\xFF\xFE", u"���" },
+		// Truncated sequences, followed by ASCII and at the end.
+		{ "\xE6\xB0" "a", u"�a" },
+		{ "a\xF0\x9F\x98", u"a�" },
+		// Overlong encodings of '/' and NUL.
+		{ "\xC0\xAF", u"�" },
+		{ "\xE0\x80\x80", u"�" },
+		{ "\xF0\x80\x80\xAF", u"�" },
+		// An encoded surrogate.
+		{ "\xED\xA0\x80", u"�" },
+		// Past U+10FFFF.
+		{ "\xF4\x90\x80\x80", u"�" },
+		// A lead byte interrupting a sequence.
+		{ "\xE6\xC3\xA9", u"�é" },
+	};
+
+	for (const auto& [utf8, utf16] : cases)
+	{
+		EXPECT_EQ(utf16, toUtf16(utf8)) << utf8.size();
+	}
+}
+
+TEST(UtfTests, AsciiRunsAroundOtherText)
+{
+	// Every split of a non-ASCII character around the 16 code unit boundary.
+	for (size_t prefix = 0; prefix < 40; ++prefix)
+	{
+		const auto utf16 = std::u16string(prefix, u'x') + u"é水\U0001F600" + std::u16string(prefix, u'y');
+		const auto utf8 = std::string(prefix, 'x') + u8"é水\U0001F600" + std::string(prefix, 'y');
+
+		EXPECT_EQ(utf8, toUtf8(utf16));
+		EXPECT_EQ(utf16, toUtf16(utf8));
+		EXPECT_EQ(utf8.size(), utf::utf8Length(std::u16string_view { utf16 }));
+	}
+}
+
+TEST(UtfTests, AppendKeepsWhatIsAlreadyThere)
+{
+	std::string utf8 { "prefix:" };
+	std::u16string utf16 { u"prefix:" };
+
+	utf::appendUtf8(u"é"sv, utf8);
+	utf::appendUtf16(u8"é"sv, utf16);
+
+	EXPECT_EQ(u8"prefix:é"s, utf8);
+	EXPECT_EQ(u"prefix:é"s, utf16);
+}
+
+TEST(UtfTests, ReusedBufferOnlyGrows)
+{
+	std::vector<std::uint8_t> buffer;
+	const auto longText = std::u16string(1000, u'水');
+	const auto length = utf::encodeUtf8(std::u16string_view { longText }, buffer, 0);
+	const auto capacity = buffer.size();
+
+	EXPECT_EQ(3000u, length);
+	EXPECT_EQ(2u, utf::encodeUtf8(u"ok"sv, buffer, 0));
+	EXPECT_EQ(capacity, buffer.size());
+	EXPECT_EQ('o', buffer[0]);
+	EXPECT_EQ('k', buffer[1]);
+}
+
+TEST(UtfTests, WidenAscii)
+{
+	const std::string ascii { "The quick brown fox jumps over the lazy dog" };
+	std::u16string wide(ascii.size(), u'\0');
+
+	utf::widenAscii(ascii.data(), ascii.size(), wide.data());
+
+	EXPECT_EQ(u"The quick brown fox jumps over the lazy dog"s, wide);
+}
+
+TEST(UtfTests, MatchesReferenceOnRandomUtf16)
+{
+	std::mt19937 random { 42 };
+
+	for (int i = 0; i < 2000; ++i)
+	{
+		const auto utf16 = randomUtf16(random, i % 200);
+		const auto expected = reference::toUtf8(utf16);
+
+		ASSERT_EQ(expected, toUtf8(utf16));
+		ASSERT_EQ(expected.size(), utf::utf8Length(std::u16string_view { utf16 }));
+	}
+}
+
+TEST(UtfTests, MatchesReferenceOnRandomMalformedUtf8)
+{
+	std::mt19937 random { 42 };
+
+	for (int i = 0; i < 2000; ++i)
+	{
+		const auto utf8 = randomUtf8(random, 1 + i % 200);
+
+		ASSERT_EQ(reference::toUtf16(utf8), toUtf16(utf8));
+	}
+}
@@ -0,0 +1,144 @@
+﻿#include "Watermark.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+namespace {
+
+constexpr size_t c_high = 8;
+constexpr size_t c_low = 2;
+
+// The relay's ForwardingQueue without the AppService parts: senders only queue a message while the
+// queue is not throttled, the rest are held until it drains.
+class HeldQueue
+{
+public:
+	// A sender arrives with a message.
+	void arrive()
+	{
+		++m_waiting;
+		admit();
+	}
+
+	// The other end takes the oldest message.
+	void drain()
+	{
+		ASSERT_FALSE(m_queue.empty());
+		m_queue.pop_front();
+		m_watermark.update(m_queue.size());
+		admit();
+	}
+
+	size_t depth() const noexcept
+	{
+		return m_queue.size();
+	}
+
+	size_t waiting() const noexcept
+	{
+		return m_waiting;
+	}
+
+	bool throttling() const noexcept
+	{
+		return m_watermark.throttling();
+	}
+
+private:
+	// Held senders go in as soon as the queue is released.
+	void admit()
+	{
+		while (m_waiting > 0
+			&& !m_watermark.throttling())
+		{
+			--m_waiting;
+			m_queue.push_back(0);
+			m_watermark.update(m_queue.size());
+		}
+	}
+
+	Watermark m_watermark { c_high, c_low };
+	std::deque<int> m_queue;
+	size_t m_waiting = 0;
+};
+
+} // namespace
+
+TEST(WatermarkTests, ThrottlesAtHighAndReleasesAtLow)
+{
+	Watermark watermark { c_high, c_low };
+
+	for (size_t depth = 0; depth < c_high; ++depth)
+	{
+		EXPECT_FALSE(watermark.update(depth)) << depth;
+	}
+
+	EXPECT_TRUE(watermark.update(c_high));
+
+	// Still throttled on the way down until the low watermark.
+	for (size_t depth = c_high - 1; depth > c_low; --depth)
+	{
+		EXPECT_TRUE(watermark.update(depth)) << depth;
+	}
+
+	EXPECT_FALSE(watermark.update(c_low));
+
+	// And not throttled again on the way up until the high watermark.
+	for (size_t depth = c_low + 1; depth < c_high; ++depth)
+	{
+		EXPECT_FALSE(watermark.update(depth)) << depth;
+	}
+
+	EXPECT_TRUE(watermark.update(c_high + 1));
+	EXPECT_TRUE(watermark.throttling());
+}
+
+TEST(WatermarkTests, QueueRefillsAndDrains)
+{
+	HeldQueue queue;
+
+	// A burst larger than the high watermark: the queue fills to it and the rest are held.
+	for (size_t i = 0; i < 3 * c_high; ++i)
+	{
+		queue.arrive();
+	}
+
+	EXPECT_TRUE(queue.throttling());
+	EXPECT_EQ(queue.depth(), c_high);
+	EXPECT_EQ(queue.waiting(), 2 * c_high);
+
+	// Draining only lets held senders in once the low watermark is reached, and then the queue
+	// refills to the high watermark, once per cycle until nobody is left waiting.
+	std::vector<size_t> releases;
+	size_t maxDepth = 0;
+
+	while (queue.depth() > 0)
+	{
+		const auto waiting = queue.waiting();
+
+		queue.drain();
+		maxDepth = std::max(maxDepth, queue.depth());
+
+		if (queue.waiting() < waiting)
+		{
+			releases.push_back(waiting - queue.waiting());
+		}
+		else if (queue.waiting() > 0)
+		{
+			EXPECT_TRUE(queue.throttling());
+			EXPECT_GT(queue.depth(), c_low);
+		}
+	}
+
+	EXPECT_EQ(maxDepth, c_high);
+	EXPECT_EQ(queue.waiting(), 0u);
+	ASSERT_EQ(releases.size(), 3u);
+	EXPECT_EQ(releases[0], c_high - c_low);
+	EXPECT_EQ(releases[1], c_high - c_low);
+	EXPECT_EQ(releases[2], 2 * c_high - releases[0] - releases[1]);
+	EXPECT_FALSE(queue.throttling());
+}
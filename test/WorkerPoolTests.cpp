@@ -0,0 +1,199 @@
+﻿#include "WorkerPool.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+using namespace std::literals;
+
+namespace {
+
+// Occupies the only worker until release() is called, so the test can fill the queues first.
+class Gate
+{
+public:
+	explicit Gate(WorkerPool& pool)
+	{
+		std::promise<void> started;
+		auto startedFuture = started.get_future();
+
+		EXPECT_TRUE(pool.post(WorkerPool::Task { [this, started = std::move(started)]() mutable {
+			started.set_value();
+			m_released.get_future().wait();
+		} }));
+		startedFuture.wait();
+	}
+
+	void release()
+	{
+		m_released.set_value();
+	}
+
+private:
+	std::promise<void> m_released;
+};
+
+class Recorder
+{
+public:
+	WorkerPool::Task task(char name)
+	{
+		return WorkerPool::Task { [this, name]() {
+			std::lock_guard lock { m_mutex };
+
+			m_order.push_back(name);
+		} };
+	}
+
+	std::string order() const
+	{
+		std::lock_guard lock { m_mutex };
+
+		return m_order;
+	}
+
+private:
+	mutable std::mutex m_mutex;
+	std::string m_order;
+};
+
+} // namespace
+
+TEST(WorkerPoolTests, HigherClassGoesFirst)
+{
+	Recorder recorder;
+
+	{
+		WorkerPool pool { 1, 16 };
+		Gate gate { pool };
+
+		pool.post(recorder.task('b'), WorkerPool::Priority::Background);
+		pool.post(recorder.task('n'), WorkerPool::Priority::Normal);
+		pool.post(recorder.task('i'), WorkerPool::Priority::Interactive);
+		pool.post(recorder.task('j'), WorkerPool::Priority::Interactive);
+		gate.release();
+	}
+
+	EXPECT_EQ("ijnb", recorder.order());
+}
+
+TEST(WorkerPoolTests, OldBackgroundTaskOvertakesNewInteractiveTask)
+{
+	Recorder recorder;
+	WorkerPool::Stats stats {};
+
+	{
+		WorkerPool pool { 1, 16 };
+		Gate gate { pool };
+
+		pool.post(recorder.task('b'), WorkerPool::Priority::Background);
+		std::this_thread::sleep_for(WorkerPool::c_agingStep * 2 + 50ms);
+		pool.post(recorder.task('i'), WorkerPool::Priority::Interactive);
+		gate.release();
+
+		while (pool.stats().completed < 3)
+		{
+			std::this_thread::yield();
+		}
+
+		stats = pool.stats();
+	}
+
+	EXPECT_EQ("bi", recorder.order());
+
+	const auto& background = stats.classes[static_cast<size_t>(WorkerPool::Priority::Background)];
+
+	EXPECT_EQ(1u, background.promoted);
+	EXPECT_EQ(1u, background.completed);
+}
+
+TEST(WorkerPoolTests, QueueLimitCoversEveryClass)
+{
+	WorkerPool pool { 1, 2 };
+	Gate gate { pool };
+
+	EXPECT_TRUE(pool.post(WorkerPool::Task { []() {
+	} },
+		WorkerPool::Priority::Interactive));
+	EXPECT_TRUE(pool.post(WorkerPool::Task { []() {
+	} },
+		WorkerPool::Priority::Background));
+	EXPECT_FALSE(pool.post(WorkerPool::Task { []() {
+	} },
+		WorkerPool::Priority::Normal));
+
+	const auto stats = pool.stats();
+
+	EXPECT_EQ(1u, stats.threads);
+	EXPECT_EQ(2u, stats.queued);
+	EXPECT_EQ(2u, stats.maxQueued);
+	EXPECT_EQ(1u, stats.running);
+	EXPECT_EQ(1u, stats.rejected);
+	EXPECT_EQ(1u, stats.classes[static_cast<size_t>(WorkerPool::Priority::Interactive)].queued);
+	EXPECT_EQ(0u, stats.classes[static_cast<size_t>(WorkerPool::Priority::Normal)].queued);
+	EXPECT_EQ(1u, stats.classes[static_cast<size_t>(WorkerPool::Priority::Background)].queued);
+
+	gate.release();
+}
+
+TEST(WorkerPoolTests, QueuedTasksRunBeforeDestruction)
+{
+	std::atomic<int> ran { 0 };
+
+	{
+		WorkerPool pool { 2, 100 };
+
+		for (int i = 0; i < 100; ++i)
+		{
+			pool.post(WorkerPool::Task { [&ran]() {
+				++ran;
+			} });
+		}
+	}
+
+	EXPECT_EQ(100, ran);
+}
+
+TEST(WorkerPoolTests, TaskExceptionReachesItsFuture)
+{
+	WorkerPool pool { 1, 4 };
+	WorkerPool::Task task { []() {
+		throw std::runtime_error("resolver failed");
+	} };
+	auto result = task.get_future();
+
+	ASSERT_TRUE(pool.post(std::move(task)));
+	EXPECT_THROW(result.get(), std::runtime_error);
+
+	// The worker survives and keeps taking tasks.
+	WorkerPool::Task next { []() {
+	} };
+	auto nextResult = next.get_future();
+
+	ASSERT_TRUE(pool.post(std::move(next)));
+	EXPECT_NO_THROW(nextResult.get());
+}
+
+TEST(WorkerPoolTests, ThreadHooksRunOnEveryWorker)
+{
+	std::atomic<int> started { 0 };
+	std::atomic<int> stopped { 0 };
+
+	{
+		WorkerPool pool {
+			3,
+			4,
+			[&started]() {
+				++started;
+			},
+			[&stopped]() {
+				++stopped;
+			},
+		};
+	}
+
+	EXPECT_EQ(3, started);
+	EXPECT_EQ(3, stopped);
+}